@@ -469,6 +469,7 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         else if (value == "mean") { params.pooling_type = LLAMA_POOLING_TYPE_MEAN; }
         else if (value == "cls") { params.pooling_type = LLAMA_POOLING_TYPE_CLS; }
         else if (value == "last") { params.pooling_type = LLAMA_POOLING_TYPE_LAST; }
+        else if (value == "rank") { params.pooling_type = LLAMA_POOLING_TYPE_RANK; }
         else { invalid_param = true; }
         return true;
     }
@@ -624,6 +625,11 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.p_split = std::stof(argv[i]);
         return true;
     }
+    if (arg == "--draft-seqs") {
+        CHECK_ARG
+        params.n_seq_draft = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-m" || arg == "--model") {
         CHECK_ARG
         params.model = argv[i];
@@ -657,7 +663,9 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
     if (arg == "--lora") {
         CHECK_ARG
         params.lora_adapter.emplace_back(argv[i], 1.0f);
-        params.use_mmap = false;
+        if (!llama_lora_adapter_is_gguf(argv[i])) {
+            params.use_mmap = false; // legacy adapters are merged into the weights
+        }
         return true;
     }
     if (arg == "--lora-scaled") {
@@ -665,7 +673,9 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         const char* lora_adapter = argv[i];
         CHECK_ARG
         params.lora_adapter.emplace_back(lora_adapter, std::stof(argv[i]));
-        params.use_mmap = false;
+        if (!llama_lora_adapter_is_gguf(lora_adapter)) {
+            params.use_mmap = false; // legacy adapters are merged into the weights
+        }
         return true;
     }
     if (arg == "--lora-base") {
@@ -714,6 +724,11 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.embedding = true;
         return true;
     }
+    if (arg == "--reranking" || arg == "--rerank") {
+        params.embedding    = true;
+        params.pooling_type = LLAMA_POOLING_TYPE_RANK;
+        return true;
+    }
     if (arg == "--embd-normalize") {
         CHECK_ARG
         params.embd_normalize = std::stoi(argv[i]);
@@ -827,9 +842,9 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
             invalid_param = true;
             return true;
         }
-#ifndef GGML_USE_CUDA_SYCL_VULKAN
-        fprintf(stderr, "warning: llama.cpp was compiled without CUDA/SYCL/Vulkan. Setting the split mode has no effect.\n");
-#endif // GGML_USE_CUDA_SYCL_VULKAN
+#if !defined(GGML_USE_CUDA_SYCL_VULKAN) && !defined(GGML_USE_RPC)
+        fprintf(stderr, "warning: llama.cpp was compiled without CUDA/SYCL/Vulkan/RPC. Setting the split mode has no effect.\n");
+#endif // !GGML_USE_CUDA_SYCL_VULKAN && !GGML_USE_RPC
         return true;
     }
     if (arg == "--tensor-split" || arg == "-ts") {
@@ -852,9 +867,9 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
                 params.tensor_split[i] = 0.0f;
             }
         }
-#ifndef GGML_USE_CUDA_SYCL_VULKAN
-        fprintf(stderr, "warning: llama.cpp was compiled without CUDA/SYCL/Vulkan. Setting a tensor split has no effect.\n");
-#endif // GGML_USE_CUDA_SYCL_VULKAN
+#if !defined(GGML_USE_CUDA_SYCL_VULKAN) && !defined(GGML_USE_RPC)
+        fprintf(stderr, "warning: llama.cpp was compiled without CUDA/SYCL/Vulkan/RPC. Setting a tensor split has no effect.\n");
+#endif // !GGML_USE_CUDA_SYCL_VULKAN && !GGML_USE_RPC
         return true;
     }
     if (arg == "--rpc") {
@@ -1125,6 +1140,28 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.n_threads_http = std::stoi(argv[i]);
         return true;
     }
+    if (arg == "--threads-stream") {
+        CHECK_ARG
+        params.n_threads_stream = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--serve-model") {
+        CHECK_ARG
+        const std::string value = argv[i];
+        const size_t pos = value.find('=');
+        if (pos == std::string::npos || pos == 0 || pos + 1 == value.size()) {
+            fprintf(stderr, "error: invalid --serve-model value, expected ALIAS=FNAME: %s\n", value.c_str());
+            invalid_param = true;
+            return true;
+        }
+        params.served_models.emplace_back(value.substr(0, pos), value.substr(pos + 1));
+        return true;
+    }
+    if (arg == "--models-mem-max") {
+        CHECK_ARG
+        params.models_mem_max = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-spf" || arg == "--system-prompt-file") {
         CHECK_ARG
         std::ifstream file(argv[i]);
@@ -1162,6 +1199,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.endpoint_metrics = true;
         return true;
     }
+    if (arg == "--lookup") {
+        params.lookup_decoding = true;
+        return true;
+    }
     if (arg == "--slot-save-path") {
         CHECK_ARG
         params.slot_save_path = argv[i];
@@ -1187,6 +1228,38 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.slot_prompt_similarity = std::stof(argv[i]);
         return true;
     }
+    if (arg == "--prefill-budget") {
+        CHECK_ARG
+        params.prefill_budget = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--prefill-chunk") {
+        CHECK_ARG
+        params.prefill_chunk = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--max-queue") {
+        CHECK_ARG
+        params.n_queue_max = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--kv-overcommit") {
+        CHECK_ARG
+        params.kv_overcommit = std::stof(argv[i]);
+        return true;
+    }
+    if (arg == "--kv-pool") {
+        params.kv_pool = true;
+        return true;
+    }
+    if (arg == "--kv-preempt") {
+        CHECK_ARG
+        std::string value(argv[i]);
+        /**/ if (value == "swap")      { params.kv_preempt_swap = true; }
+        else if (value == "recompute") { params.kv_preempt_swap = false; }
+        else { invalid_param = true; }
+        return true;
+    }
     if (arg == "-pps") {
         params.is_pp_shared = true;
         return true;
@@ -1382,6 +1455,8 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "number of threads to use during batch and prompt processing (default: same as --threads-draft)" });
     options.push_back({ "speculative", "       --draft N",              "number of tokens to draft for speculative decoding (default: %d)", params.n_draft });
     options.push_back({ "speculative", "-ps,   --p-split N",            "speculative decoding split probability (default: %.1f)", (double)params.p_split });
+    options.push_back({ "server",      "       --lookup",               "enable lookup decoding: draft tokens from n-grams of the slot context (default: %s)", params.lookup_decoding ? "enabled" : "disabled" });
+    options.push_back({ "server",      "       --draft-seqs N",         "max number of draft branches for tree-based speculative decoding (default: %d)", params.n_seq_draft });
     options.push_back({ "*",           "-lcs,  --lookup-cache-static FNAME",
                                                                         "path to static lookup cache to use for lookup decoding (not updated by generation)" });
     options.push_back({ "*",           "-lcd,  --lookup-cache-dynamic FNAME",
@@ -1463,7 +1538,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "For schemas w/ external $refs, use --grammar + example/json_schema_to_grammar.py instead" });
 
     options.push_back({ "embedding" });
-    options.push_back({ "embedding",   "       --pooling {none,mean,cls}",
+    options.push_back({ "embedding",   "       --pooling {none,mean,cls,last,rank}",
                                                                         "pooling type for embeddings, use model default if unspecified" });
 
     options.push_back({ "context hacking" });
@@ -1533,7 +1608,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "how to split the model across multiple GPUs, one of:\n"
                                                                         "  - none: use one GPU only\n"
                                                                         "  - layer (default): split layers and KV across GPUs\n"
-                                                                        "  - row: split rows across GPUs" });
+                                                                        "  - row: split rows across GPUs (or across the local device and the RPC servers)" });
         options.push_back({ "*",           "-ts,   --tensor-split SPLIT",
                                                                         "fraction of the model to offload to each GPU, comma-separated list of proportions, e.g. 3,1" });
         options.push_back({ "*",           "-mg,   --main-gpu i",       "the GPU to use for the model (with split-mode = none),\n"
@@ -1545,9 +1620,9 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "*",           "       --override-kv KEY=TYPE:VALUE",
                                                                         "advanced option to override model metadata by key. may be specified multiple times.\n"
                                                                         "types: int, float, bool, str. example: --override-kv tokenizer.ggml.add_bos_token=bool:false" });
-    options.push_back({ "*",           "       --lora FNAME",           "apply LoRA adapter (implies --no-mmap)" });
-    options.push_back({ "*",           "       --lora-scaled FNAME S",  "apply LoRA adapter with user defined scaling S (implies --no-mmap)" });
-    options.push_back({ "*",           "       --lora-base FNAME",      "optional model to use as a base for the layers modified by the LoRA adapter" });
+    options.push_back({ "*",           "       --lora FNAME",           "apply LoRA adapter (GGUF adapters are applied at runtime, legacy ones imply --no-mmap)" });
+    options.push_back({ "*",           "       --lora-scaled FNAME S",  "apply LoRA adapter with user defined scaling S (GGUF adapters are applied at runtime, legacy ones imply --no-mmap)" });
+    options.push_back({ "*",           "       --lora-base FNAME",      "optional model to use as a base for the layers modified by a legacy LoRA adapter" });
     options.push_back({ "*",           "       --control-vector FNAME", "add a control vector\n"
                                                                         "note: this argument can be repeated to add multiple control vectors" });
     options.push_back({ "*",           "       --control-vector-scaled FNAME SCALE",
@@ -1596,12 +1671,20 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "server",      "       --port PORT",            "port to listen (default: %d)", params.port });
     options.push_back({ "server",      "       --path PATH",            "path to serve static files from (default: %s)", params.public_path.c_str() });
     options.push_back({ "server",      "       --embedding(s)",         "enable embedding endpoint (default: %s)", params.embedding ? "enabled" : "disabled" });
+    options.push_back({ "server",      "       --reranking, --rerank",  "enable reranking endpoint, requires a reranker model (default: disabled)" });
     options.push_back({ "server",      "       --api-key KEY",          "API key to use for authentication (default: none)" });
     options.push_back({ "server",      "       --api-key-file FNAME",   "path to file containing API keys (default: none)" });
     options.push_back({ "server",      "       --ssl-key-file FNAME",   "path to file a PEM-encoded SSL private key" });
     options.push_back({ "server",      "       --ssl-cert-file FNAME",  "path to file a PEM-encoded SSL certificate" });
     options.push_back({ "server",      "       --timeout N",            "server read/write timeout in seconds (default: %d)", params.timeout_read });
     options.push_back({ "server",      "       --threads-http N",       "number of threads used to process HTTP requests (default: %d)", params.n_threads_http });
+    options.push_back({ "server",      "       --threads-stream N",     "number of event loop threads serving streamed responses, 0 to serve them from\n"
+                                                                        "the HTTP threads (default: %d)", params.n_threads_stream });
+    options.push_back({ "server",      "       --serve-model ALIAS=FNAME",
+                                                                        "serve an additional model to the requests with \"model\": \"ALIAS\", loaded on first use\n"
+                                                                        "(can be repeated to serve multiple models)" });
+    options.push_back({ "server",      "       --models-mem-max N",     "total size in MiB of the additional models kept loaded, the least recently used\n"
+                                                                        "idle models are unloaded to stay within it (default: %d, 0 = unlimited)", params.models_mem_max });
     options.push_back({ "server",      "       --system-prompt-file FNAME",
                                                                         "set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications" });
     options.push_back({ "server",      "       --log-format {text,json}",
@@ -1615,6 +1698,17 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "https://github.com/ggerganov/llama.cpp/wiki/Templates-supported-by-llama_chat_apply_template" });
     options.push_back({ "server",      "-sps,  --slot-prompt-similarity SIMILARITY",
                                                                         "how much the prompt of a request must match the prompt of a slot in order to use that slot (default: %.2f, 0.0 = disabled)\n", params.slot_prompt_similarity });
+    options.push_back({ "server",      "       --prefill-budget N",     "max tokens per decoding step while slots are generating, shared by their sampled tokens\n"
+                                                                        "and prompt chunks of the other slots (default: %d, -1 = ubatch size, 0 = batch size)", params.prefill_budget });
+    options.push_back({ "server",      "       --prefill-chunk N",      "max prompt tokens of a single slot per decoding step (default: %d, 0 = no limit)", params.prefill_chunk });
+    options.push_back({ "server",      "       --max-queue N",          "max completion requests waiting for a slot, more are rejected with 429 (default: %d, 0 = no limit)", params.n_queue_max });
+    options.push_back({ "server",      "       --kv-overcommit F",      "let the slots use up to F times their share of the KV cache, slots are preempted when it is full\n"
+                                                                        "(default: %.1f, 1.0 = disabled)", (double)params.kv_overcommit });
+    options.push_back({ "server",      "       --kv-preempt {swap,recompute}",
+                                                                        "what happens to the KV cache of a preempted slot: swapped to host memory or evaluated again on resume\n"
+                                                                        "(default: swap)" });
+    options.push_back({ "server",      "       --kv-pool",              "add slots on demand up to --parallel, each of them can use the whole KV cache and slots are preempted\n"
+                                                                        "when it is full (default: %s)", params.kv_pool ? "enabled" : "disabled" });
 
 #ifndef LOG_DISABLE_LOGS
     options.push_back({ "logging" });
@@ -1994,7 +2088,14 @@ std::string fs_get_cache_file(const std::string & filename) {
 // Model utils
 //
 
-std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_params(gpt_params & params) {
+bool llama_lora_adapter_is_gguf(const std::string & path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[4] = {};
+    file.read(magic, sizeof(magic));
+    return file && memcmp(magic, "GGUF", sizeof(magic)) == 0;
+}
+
+std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_params(gpt_params & params, std::vector<llama_lora_adapter_container> * lora_adapters) {
     auto mparams = llama_model_params_from_gpt_params(params);
 
     llama_model * model = nullptr;
@@ -2048,6 +2149,23 @@ std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_par
     for (unsigned int i = 0; i < params.lora_adapter.size(); ++i) {
         const std::string & lora_adapter = std::get<0>(params.lora_adapter[i]);
         float lora_scale = std::get<1>(params.lora_adapter[i]);
+
+        if (llama_lora_adapter_is_gguf(lora_adapter)) {
+            // applied at graph build time, the base weights are left untouched
+            llama_lora_adapter * adapter = llama_lora_adapter_init(model, lora_adapter.c_str());
+            if (adapter == nullptr) {
+                fprintf(stderr, "%s: error: failed to load lora adapter '%s'\n", __func__, lora_adapter.c_str());
+                llama_free(lctx);
+                llama_free_model(model);
+                return std::make_tuple(nullptr, nullptr);
+            }
+            llama_lora_adapter_set(lctx, adapter, lora_scale);
+            if (lora_adapters) {
+                lora_adapters->push_back({ lora_adapter, lora_scale, adapter });
+            }
+            continue;
+        }
+
         int err = llama_model_apply_lora_from_file(model,
                                              lora_adapter.c_str(),
                                              lora_scale,
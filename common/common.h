@@ -75,6 +75,7 @@ struct gpt_params {
     int32_t n_parallel            =     1; // number of parallel sequences to decode
     int32_t n_sequences           =     1; // number of sequences to decode
     float   p_split               =  0.1f; // speculative decoding split probability
+    int32_t n_seq_draft           =     1; // max number of draft branches for tree-based speculative decoding in the server
     int32_t n_gpu_layers          =    -1; // number of layers to store in VRAM (-1 - use default)
     int32_t n_gpu_layers_draft    =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
     int32_t main_gpu              =     0; // the GPU that is used for scratch and small tensors
@@ -195,6 +196,10 @@ struct gpt_params {
     int32_t timeout_read   = 600;          // http read timeout in seconds
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests
+    int32_t n_threads_stream = 1;          // number of event loop threads serving streamed responses (0 = HTTP threads)
+    int32_t models_mem_max = 0;            // total size in MiB of the resident additional models (0 = unlimited)
+
+    std::vector<std::pair<std::string, std::string>> served_models; // alias and path of the additional models to serve
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";
@@ -216,6 +221,15 @@ struct gpt_params {
 
     float slot_prompt_similarity = 0.5f;
 
+    bool lookup_decoding = false; // draft tokens from n-gram caches of the slot context (see lookup_cache_static/dynamic)
+
+    int32_t prefill_budget  = -1;    // max tokens per decoding step while slots are generating (-1 = n_ubatch, 0 = n_batch)
+    int32_t prefill_chunk   =  0;    // max prompt tokens of a single slot per decoding step (0 = no limit)
+    int32_t n_queue_max     =  0;    // max completion requests waiting for a slot, more are rejected (0 = no limit)
+    float   kv_overcommit   =  1.0f; // the slots may use this many times their share of the KV cache, preempted when it is full
+    bool    kv_preempt_swap = true;  // swap the KV cache of preempted slots to host memory instead of evaluating it again
+    bool    kv_pool         = false; // add slots on demand, each of them can use the whole KV cache
+
     // batched-bench params
     bool is_pp_shared = false;
 
@@ -304,8 +318,18 @@ std::string fs_get_cache_file(const std::string & filename);
 // Model utils
 //
 
+struct llama_lora_adapter_container {
+    std::string path;
+    float scale;
+    struct llama_lora_adapter * adapter;
+};
+
+// true if the adapter is a GGUF file that is applied at runtime instead of being merged into the model
+bool llama_lora_adapter_is_gguf(const std::string & path);
+
 // TODO: avoid tuplue, use struct
-std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_params(gpt_params & params);
+// the GGUF LoRA adapters that were loaded and set in the context are appended to lora_adapters if given
+std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_params(gpt_params & params, std::vector<llama_lora_adapter_container> * lora_adapters = nullptr);
 
 struct llama_model_params   llama_model_params_from_gpt_params  (const gpt_params & params);
 struct llama_context_params llama_context_params_from_gpt_params(const gpt_params & params);
@@ -2,8 +2,241 @@
 #include "common.h"
 #include "log.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <functional>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#   define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _POSIX_MAPPED_FILES
+#include <sys/mman.h>
+#endif
+#endif
+
+#define LLAMA_NGRAM_CACHE_MAGIC   0x636e676cu // 'lgnc'
+#define LLAMA_NGRAM_CACHE_VERSION 1
+
+// file format: header, n_buckets buckets, n_overflow token counts
+struct llama_ngram_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ngram_max; // LLAMA_NGRAM_MAX
+    uint32_t n_inline;  // LLAMA_NGRAM_CACHE_N_INLINE
+    uint64_t n_buckets;
+    uint64_t n_used;
+    uint64_t n_overflow;
+};
+
+static_assert(sizeof(llama_ngram_cache_bucket) == 48, "unexpected llama_ngram_cache_bucket size");
+static_assert(sizeof(llama_ngram_cache_header) % alignof(llama_ngram_cache_bucket) == 0, "misaligned buckets");
+
+// read-only view of a file, memory-mapped where supported
+struct llama_ngram_cache_mapping {
+    const void * addr = nullptr;
+    size_t       size = 0;
+
+#if defined(_WIN32)
+    ~llama_ngram_cache_mapping() {
+        if (addr) {
+            UnmapViewOfFile(addr);
+        }
+    }
+#elif defined(_POSIX_MAPPED_FILES)
+    ~llama_ngram_cache_mapping() {
+        if (addr) {
+            munmap(const_cast<void *>(addr), size);
+        }
+    }
+#else
+    std::vector<uint8_t> buf;
+#endif
+};
+
+static std::shared_ptr<llama_ngram_cache_mapping> llama_ngram_cache_map_file(const std::string & filename) {
+    std::shared_ptr<llama_ngram_cache_mapping> mapping = std::make_shared<llama_ngram_cache_mapping>();
+
+#if defined(_WIN32)
+    HANDLE hfile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hfile == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hfile, &size) || size.QuadPart == 0) {
+        CloseHandle(hfile);
+        return nullptr;
+    }
+    HANDLE hmapping = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hfile);
+    if (hmapping == NULL) {
+        return nullptr;
+    }
+    void * addr = MapViewOfFile(hmapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hmapping);
+    if (addr == NULL) {
+        return nullptr;
+    }
+    mapping->addr = addr;
+    mapping->size = size.QuadPart;
+#elif defined(_POSIX_MAPPED_FILES)
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return nullptr;
+    }
+    void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    mapping->addr = addr;
+    mapping->size = st.st_size;
+#else
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return nullptr;
+    }
+    mapping->buf.resize(file.tellg());
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(mapping->buf.data()), mapping->buf.size())) {
+        return nullptr;
+    }
+    mapping->addr = mapping->buf.data();
+    mapping->size = mapping->buf.size();
+#endif
+
+    return mapping;
+}
+
+int32_t llama_ngram_cache_part::count(llama_token token) const {
+    const llama_ngram_token_count * it = std::lower_bound(begin(), end(), token,
+        [](const llama_ngram_token_count & tc, llama_token t) { return tc.token < t; });
+    return it != end() && it->token == token ? it->count : 0;
+}
+
+void llama_ngram_cache::clear() {
+    buckets.clear();
+    overflow.clear();
+    n_used = 0;
+
+    mapping.reset();
+    mapped_buckets    = nullptr;
+    mapped_overflow   = nullptr;
+    n_mapped_buckets  = 0;
+    n_mapped_overflow = 0;
+}
+
+llama_ngram_cache_part llama_ngram_cache::find(const llama_ngram & ngram) const {
+    const size_t n = n_buckets();
+    if (n == 0) {
+        return llama_ngram_cache_part();
+    }
+    const llama_ngram_cache_bucket * b = buckets_data();
+
+    // there is always at least one empty bucket, so the probing terminates
+    for (size_t i = llama_ngram_hash_function{}(ngram) & (n - 1);; i = (i + 1) & (n - 1)) {
+        if (b[i].ngram.tokens[0] == -1) {
+            return llama_ngram_cache_part();
+        }
+        if (b[i].ngram == ngram) {
+            return part(b[i]);
+        }
+    }
+}
+
+void llama_ngram_cache::make_mutable() {
+    if (!mapping) {
+        return;
+    }
+    buckets.assign(mapped_buckets, mapped_buckets + n_mapped_buckets);
+    overflow.assign(mapped_overflow, mapped_overflow + n_mapped_overflow);
+
+    mapping.reset();
+    mapped_buckets    = nullptr;
+    mapped_overflow   = nullptr;
+    n_mapped_buckets  = 0;
+    n_mapped_overflow = 0;
+}
+
+void llama_ngram_cache::grow() {
+    std::vector<llama_ngram_cache_bucket> old = std::move(buckets);
+    buckets = std::vector<llama_ngram_cache_bucket>(std::max<size_t>(16, 2*old.size()));
+
+    const size_t mask = buckets.size() - 1;
+    for (const llama_ngram_cache_bucket & bucket : old) {
+        if (bucket.ngram.tokens[0] == -1) {
+            continue;
+        }
+        size_t i = llama_ngram_hash_function{}(bucket.ngram) & mask;
+        while (buckets[i].ngram.tokens[0] != -1) {
+            i = (i + 1) & mask;
+        }
+        buckets[i] = bucket;
+    }
+}
+
+void llama_ngram_cache::add(const llama_ngram & ngram, llama_token token, int32_t count) {
+    make_mutable();
+    if (2*(n_used + 1) > buckets.size()) {
+        grow();
+    }
+
+    const size_t mask = buckets.size() - 1;
+    size_t i = llama_ngram_hash_function{}(ngram) & mask;
+    while (buckets[i].ngram.tokens[0] != -1 && !(buckets[i].ngram == ngram)) {
+        i = (i + 1) & mask;
+    }
+
+    llama_ngram_cache_bucket & bucket = buckets[i];
+    if (bucket.ngram.tokens[0] == -1) {
+        bucket.ngram = ngram;
+        n_used++;
+    }
+
+    const int32_t n = bucket.n_counts;
+    llama_ngram_token_count * counts = n <= LLAMA_NGRAM_CACHE_N_INLINE ? bucket.counts : overflow.data() + bucket.ext.offset;
+
+    // the distribution is kept sorted by token
+    const int32_t pos = std::lower_bound(counts, counts + n, token,
+        [](const llama_ngram_token_count & tc, llama_token t) { return tc.token < t; }) - counts;
+    if (pos < n && counts[pos].token == token) {
+        counts[pos].count += count;
+        return;
+    }
+
+    if (n == LLAMA_NGRAM_CACHE_N_INLINE || (n > LLAMA_NGRAM_CACHE_N_INLINE && (uint64_t) n == bucket.ext.capacity)) {
+        // move the distribution to a block twice as large at the end of the overflow storage,
+        // the old block is left unused until the cache is saved
+        const uint64_t offset = overflow.size();
+        overflow.resize(offset + 2*n);
+
+        const llama_ngram_token_count * src = n == LLAMA_NGRAM_CACHE_N_INLINE ? bucket.counts : overflow.data() + bucket.ext.offset;
+        std::copy(src, src + n, overflow.data() + offset);
+
+        bucket.ext.offset   = offset;
+        bucket.ext.capacity = 2*n;
+        counts = overflow.data() + offset;
+    }
+
+    std::copy_backward(counts + pos, counts + n, counts + n + 1);
+    counts[pos].token = token;
+    counts[pos].count = count;
+    bucket.n_counts++;
+}
 
 void llama_ngram_cache_update(llama_ngram_cache & ngram_cache, int ngram_min, int ngram_max,
                               std::vector<llama_token> & inp, int nnew, bool print_progress) {
@@ -20,19 +253,7 @@ void llama_ngram_cache_update(llama_ngram_cache & ngram_cache, int ngram_min, in
             llama_ngram ngram(&inp[ngram_start], ngram_size);
             const llama_token token = inp[i];
 
-            llama_ngram_cache::iterator part_it = ngram_cache.find(ngram);
-            if (part_it == ngram_cache.end()) {
-                llama_ngram_cache_part part;
-                part.emplace(token, 1);
-                ngram_cache.emplace(ngram, part);
-            } else {
-                llama_ngram_cache_part::iterator token_count_it = part_it->second.find(token);
-                if (token_count_it == part_it->second.end()) {
-                    part_it->second.emplace(token, 1);
-                } else {
-                    token_count_it->second++;
-                }
-            }
+            ngram_cache.add(ngram, token, 1);
             ++n_done;
 
             if (print_progress && n_done % 10000000 == 0) {
@@ -59,20 +280,19 @@ constexpr int draft_min_sample_size_strict[LLAMA_NGRAM_MAX] = { 4,  3,  2,  2};
 constexpr int     draft_min_percent_strict[LLAMA_NGRAM_MAX] = {75, 66, 66, 66};
 
 // Helper function that tries to draft a token from only the static ngram cache:
-static llama_token try_draft(llama_ngram_cache & nc_static, const llama_ngram ngram_static) {
-    llama_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-    if (part_static_it == nc_static.end()) {
+static llama_token try_draft(const llama_ngram_cache & nc_static, const llama_ngram ngram_static) {
+    const llama_ngram_cache_part part_static = nc_static.find(ngram_static);
+    if (part_static.empty()) {
         return -1;
     }
-    const llama_ngram_cache_part part_static = part_static_it->second;
 
     int max_count_static  = 0;
     int sum_count_static  = 0;
     llama_token max_token = -1;
 
-    for (std::pair<llama_token, int> token_count_static : part_static) {
-        const llama_token token = token_count_static.first;
-        const int32_t count_static  = token_count_static.second;
+    for (const llama_ngram_token_count & token_count_static : part_static) {
+        const llama_token token = token_count_static.token;
+        const int32_t count_static  = token_count_static.count;
 
         if (count_static > max_count_static) {
             max_token        = token;
@@ -92,7 +312,7 @@ static llama_token try_draft(llama_ngram_cache & nc_static, const llama_ngram ng
 
 // Try to draft a token from primary cache (context/dynamic), validate with static cache:
 static llama_token try_draft(
-    llama_ngram_cache & nc_primary, const std::vector<llama_ngram> & ngrams_primary, llama_ngram_cache_part & part_static,
+    const llama_ngram_cache & nc_primary, const std::vector<llama_ngram> & ngrams_primary, const llama_ngram_cache_part & part_static,
     const int * min_sample_size, const int * min_percent) {
 
     llama_token drafted_token = -1;
@@ -100,24 +320,23 @@ static llama_token try_draft(
     for (int i = ngrams_primary.size()-1; i >= 0 && drafted_token == -1; --i) {
         const llama_ngram ngram_primary = ngrams_primary[i];
 
-        llama_ngram_cache::iterator part_primary_it = nc_primary.find(ngram_primary);
-        if (part_primary_it == nc_primary.end()) {
+        const llama_ngram_cache_part part_primary = nc_primary.find(ngram_primary);
+        if (part_primary.empty()) {
             continue;
         }
-        const llama_ngram_cache_part part_primary = part_primary_it->second;
 
         int max_count_primary = 0;
         int max_count_static  = 0;
         int sum_count_primary = 0;
         llama_token max_token = -1;
 
-        for (std::pair<llama_token, int> token_count_primary : part_primary) {
-            const llama_token token = token_count_primary.first;
+        for (const llama_ngram_token_count & token_count_primary : part_primary) {
+            const llama_token token = token_count_primary.token;
 
-            llama_ngram_cache_part::iterator token_count_static_it = part_static.find(token);
+            const int32_t count_static_raw = part_static.count(token);
 
-            const int32_t count_primary = token_count_primary.second;
-            const int32_t count_static  = token_count_static_it != part_static.end() ? 100*token_count_static_it->second : 1;
+            const int32_t count_primary = token_count_primary.count;
+            const int32_t count_static  = count_static_raw > 0 ? 100*count_static_raw : 1;
 
             if (count_primary*count_static > max_count_primary*max_count_static) {
                 max_token         = token;
@@ -158,11 +377,7 @@ void llama_ngram_cache_draft(
         for (int j = ngram_start_static; j < ngram_start_static + LLAMA_NGRAM_STATIC; ++j) {
             ngram_static.tokens[j-ngram_start_static] = get_token(inp, draft, j);
         }
-        llama_ngram_cache::iterator part_static_it = nc_static.find(ngram_static);
-        llama_ngram_cache_part part_static;
-        if (part_static_it != nc_static.end()) {
-            part_static = part_static_it->second;
-        }
+        const llama_ngram_cache_part part_static = nc_static.find(ngram_static);
 
         // cd = context + dynamic
         std::vector<llama_ngram> ngrams_cd;
@@ -194,33 +409,82 @@ void llama_ngram_cache_draft(
 }
 
 void llama_ngram_cache_save(llama_ngram_cache & ngram_cache, std::string & filename) {
-    std::ofstream file_out(filename, std::ios::binary);
-    for (std::pair<llama_ngram, llama_ngram_cache_part> item : ngram_cache) {
-        const llama_ngram      ngram        = item.first;
-        llama_ngram_cache_part token_counts = item.second;
-        GGML_ASSERT(!token_counts.empty());
-        const int32_t ntokens = token_counts.size();
-        GGML_ASSERT(ntokens > 0);
+    // the file may be the one that is mapped
+    ngram_cache.make_mutable();
 
-        file_out.write(reinterpret_cast<const char *>(&ngram),   sizeof(llama_ngram));
-        file_out.write(reinterpret_cast<const char *>(&ntokens), sizeof(int32_t));
-        for (std::pair<llama_token, int32_t> item2 : token_counts) {
-            const llama_token token = item2.first;
-            const int32_t     count = item2.second;
-            GGML_ASSERT(count > 0);
+    // rebuild the table with a compact overflow storage, distributions that outgrew their block leave gaps behind
+    size_t n_buckets = ngram_cache.empty() ? 0 : 1;
+    while (n_buckets < 2*ngram_cache.size()) {
+        n_buckets *= 2;
+    }
+
+    std::vector<llama_ngram_cache_bucket> buckets(n_buckets);
+    std::vector<llama_ngram_token_count>  overflow;
 
-            file_out.write(reinterpret_cast<const char *>(&token), sizeof(llama_token));
-            file_out.write(reinterpret_cast<const char *>(&count), sizeof(int32_t));
+    ngram_cache.for_each([&](const llama_ngram & ngram, const llama_ngram_cache_part & part) {
+        GGML_ASSERT(!part.empty());
+
+        size_t i = llama_ngram_hash_function{}(ngram) & (n_buckets - 1);
+        while (buckets[i].ngram.tokens[0] != -1) {
+            i = (i + 1) & (n_buckets - 1);
         }
-    }
 
+        llama_ngram_cache_bucket & bucket = buckets[i];
+        bucket.ngram    = ngram;
+        bucket.n_counts = part.size();
+        if (part.size() <= LLAMA_NGRAM_CACHE_N_INLINE) {
+            std::copy(part.begin(), part.end(), bucket.counts);
+        } else {
+            bucket.ext.offset   = overflow.size();
+            bucket.ext.capacity = part.size();
+            overflow.insert(overflow.end(), part.begin(), part.end());
+        }
+        for (const llama_ngram_token_count & token_count : part) {
+            GGML_ASSERT(token_count.count > 0);
+        }
+    });
+
+    llama_ngram_cache_header header;
+    header.magic      = LLAMA_NGRAM_CACHE_MAGIC;
+    header.version    = LLAMA_NGRAM_CACHE_VERSION;
+    header.ngram_max  = LLAMA_NGRAM_MAX;
+    header.n_inline   = LLAMA_NGRAM_CACHE_N_INLINE;
+    header.n_buckets  = n_buckets;
+    header.n_used     = ngram_cache.size();
+    header.n_overflow = overflow.size();
+
+    // the file is written under another name and renamed over the old one: other caches loaded from the old file
+    // (in this process or in another one) keep their mapping, rewriting it in place would change it under them
+#if defined(_WIN32)
+    const std::string tmp_filename = filename + "." + std::to_string(GetCurrentProcessId()) + ".tmp";
+#else
+    const std::string tmp_filename = filename + "." + std::to_string(getpid()) + ".tmp";
+#endif
+    {
+        std::ofstream file_out(tmp_filename, std::ios::binary);
+        file_out.write(reinterpret_cast<const char *>(&header),         sizeof(header));
+        file_out.write(reinterpret_cast<const char *>(buckets.data()),  buckets.size()*sizeof(llama_ngram_cache_bucket));
+        file_out.write(reinterpret_cast<const char *>(overflow.data()), overflow.size()*sizeof(llama_ngram_token_count));
+        file_out.close();
+        if (!file_out) {
+            fprintf(stderr, "%s: failed to write %s\n", __func__, tmp_filename.c_str());
+            std::remove(tmp_filename.c_str());
+            return;
+        }
+    }
+#if defined(_WIN32)
+    const bool renamed = MoveFileExA(tmp_filename.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    const bool renamed = std::rename(tmp_filename.c_str(), filename.c_str()) == 0;
+#endif
+    if (!renamed) {
+        fprintf(stderr, "%s: failed to replace %s\n", __func__, filename.c_str());
+        std::remove(tmp_filename.c_str());
+    }
 }
 
-llama_ngram_cache llama_ngram_cache_load(std::string & filename) {
-    std::ifstream hashmap_file(filename, std::ios::binary);
-    if (!hashmap_file) {
-        throw std::ifstream::failure("Unable to open file " + filename);
-    }
+// files written before the table format: a sequence of n-grams, each followed by its number of tokens and the (token, count) pairs
+static llama_ngram_cache llama_ngram_cache_load_legacy(std::ifstream & hashmap_file) {
     llama_ngram_cache ngram_cache;
 
     llama_ngram ngram;
@@ -236,7 +500,6 @@ llama_ngram_cache llama_ngram_cache_load(std::string & filename) {
         GGML_ASSERT(!hashmap_file.eof());
         GGML_ASSERT(hashmap_file.read(ntokensc, sizeof(int32_t)));
         GGML_ASSERT(ntokens > 0);
-        llama_ngram_cache_part token_counts;
 
         for (int i = 0; i < ntokens; ++i) {
             GGML_ASSERT(!hashmap_file.eof());
@@ -244,39 +507,141 @@ llama_ngram_cache llama_ngram_cache_load(std::string & filename) {
             GGML_ASSERT(!hashmap_file.eof());
             GGML_ASSERT(hashmap_file.read(countc, sizeof(int32_t)));
             GGML_ASSERT(count > 0);
-            token_counts.emplace(token, count);
+            ngram_cache.add(ngram, token, count);
         }
-
-        ngram_cache.emplace(ngram, token_counts);
     }
     GGML_ASSERT(hashmap_file.eof());
 
     return ngram_cache;
 }
 
-void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, llama_ngram_cache & ngram_cache_add) {
-    for (std::pair<llama_ngram, llama_ngram_cache_part> ngram_part : ngram_cache_add) {
-        const llama_ngram      ngram = ngram_part.first;
-        llama_ngram_cache_part  part = ngram_part.second;
+llama_ngram_cache llama_ngram_cache_load(std::string & filename) {
+    std::ifstream hashmap_file(filename, std::ios::binary);
+    if (!hashmap_file) {
+        throw std::ifstream::failure("Unable to open file " + filename);
+    }
 
-        llama_ngram_cache::iterator part_merged_it = ngram_cache_target.find(ngram);
-        if (part_merged_it == ngram_cache_target.end()) {
-            ngram_cache_target.emplace(ngram, part);
-            continue;
-        }
+    uint32_t magic = 0;
+    if (!hashmap_file.read(reinterpret_cast<char *>(&magic), sizeof(magic)) || magic != LLAMA_NGRAM_CACHE_MAGIC) {
+        hashmap_file.clear();
+        hashmap_file.seekg(0);
+        return llama_ngram_cache_load_legacy(hashmap_file);
+    }
+    hashmap_file.close();
 
-        for (std::pair<llama_token, int32_t> token_count : part) {
-            const llama_token token = token_count.first;
-            const int32_t     count = token_count.second;
-            GGML_ASSERT(count > 0);
+    std::shared_ptr<llama_ngram_cache_mapping> mapping = llama_ngram_cache_map_file(filename);
+    if (!mapping || mapping->size < sizeof(llama_ngram_cache_header)) {
+        throw std::ifstream::failure("Unable to map file " + filename);
+    }
+
+    llama_ngram_cache_header header;
+    memcpy(&header, mapping->addr, sizeof(header));
+
+    if (header.version != LLAMA_NGRAM_CACHE_VERSION || header.ngram_max != LLAMA_NGRAM_MAX || header.n_inline != LLAMA_NGRAM_CACHE_N_INLINE) {
+        throw std::ifstream::failure("Unsupported ngram cache format in " + filename);
+    }
+    const bool n_buckets_ok = (header.n_buckets & (header.n_buckets - 1)) == 0 && header.n_used < std::max<uint64_t>(header.n_buckets, 1);
+    // the counts are bounded by the file size first so that the expected size cannot overflow
+    const bool counts_ok = header.n_buckets  <= mapping->size/sizeof(llama_ngram_cache_bucket)
+                        && header.n_overflow <= mapping->size/sizeof(llama_ngram_token_count);
+    if (!n_buckets_ok || !counts_ok || mapping->size != sizeof(llama_ngram_cache_header)
+            + header.n_buckets*sizeof(llama_ngram_cache_bucket) + header.n_overflow*sizeof(llama_ngram_token_count)) {
+        throw std::ifstream::failure("Corrupted ngram cache file " + filename);
+    }
+
+    const char * data = reinterpret_cast<const char *>(mapping->addr);
 
-            llama_ngram_cache_part::iterator token_count_merged_it = part_merged_it->second.find(token);
-            if (token_count_merged_it == part_merged_it->second.end()) {
-                part_merged_it->second.emplace(token, count);
+    // every distribution must lie within the overflow storage, the buckets are queried in place without further checks
+    {
+        const llama_ngram_cache_bucket * buckets = reinterpret_cast<const llama_ngram_cache_bucket *>(data + sizeof(llama_ngram_cache_header));
+        uint64_t n_used = 0;
+        for (uint64_t i = 0; i < header.n_buckets; ++i) {
+            const llama_ngram_cache_bucket & b = buckets[i];
+            if (b.ngram.tokens[0] == -1) {
                 continue;
             }
+            ++n_used;
+            bool ok = b.n_counts > 0;
+            if (ok && b.n_counts > LLAMA_NGRAM_CACHE_N_INLINE) {
+                ok = b.ext.capacity >= (uint64_t) b.n_counts
+                  && b.ext.offset   <= header.n_overflow
+                  && b.ext.capacity <= header.n_overflow - b.ext.offset;
+            }
+            if (!ok) {
+                throw std::ifstream::failure("Corrupted ngram cache file " + filename);
+            }
+        }
+        if (n_used != header.n_used) {
+            throw std::ifstream::failure("Corrupted ngram cache file " + filename);
+        }
+    }
 
-            token_count_merged_it->second += count;
+    llama_ngram_cache ngram_cache;
+    ngram_cache.n_used            = header.n_used;
+    ngram_cache.mapped_buckets    = reinterpret_cast<const llama_ngram_cache_bucket *>(data + sizeof(llama_ngram_cache_header));
+    ngram_cache.mapped_overflow   = reinterpret_cast<const llama_ngram_token_count  *>(data + sizeof(llama_ngram_cache_header)
+                                                                                            + header.n_buckets*sizeof(llama_ngram_cache_bucket));
+    ngram_cache.n_mapped_buckets  = header.n_buckets;
+    ngram_cache.n_mapped_overflow = header.n_overflow;
+    ngram_cache.mapping           = mapping;
+
+    return ngram_cache;
+}
+
+void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, llama_ngram_cache & ngram_cache_add) {
+    ngram_cache_add.for_each([&](const llama_ngram & ngram, const llama_ngram_cache_part & part) {
+        for (const llama_ngram_token_count & token_count : part) {
+            GGML_ASSERT(token_count.count > 0);
+            ngram_cache_target.add(ngram, token_count.token, token_count.count);
         }
+    });
+}
+
+void llama_ngram_cache_prune(llama_ngram_cache & ngram_cache, size_t n_max) {
+    if (ngram_cache.size() <= n_max) {
+        return;
     }
+
+    // total number of times each n-gram has been seen
+    std::vector<int64_t> totals;
+    totals.reserve(ngram_cache.size());
+    ngram_cache.for_each([&](const llama_ngram & /*ngram*/, const llama_ngram_cache_part & part) {
+        int64_t total = 0;
+        for (const llama_ngram_token_count & token_count : part) {
+            total += token_count.count;
+        }
+        totals.push_back(total);
+    });
+
+    if (n_max == 0) {
+        ngram_cache.clear();
+        return;
+    }
+
+    // smallest total that is kept, only as many n-grams at the threshold are kept as fit in n_max
+    std::vector<int64_t> sorted = totals;
+    std::nth_element(sorted.begin(), sorted.begin() + (n_max - 1), sorted.end(), std::greater<int64_t>());
+    const int64_t threshold = sorted[n_max - 1];
+
+    size_t n_at_threshold = n_max - std::count_if(totals.begin(), totals.end(), [&](int64_t total) { return total > threshold; });
+
+    llama_ngram_cache pruned;
+    size_t i = 0;
+    ngram_cache.for_each([&](const llama_ngram & ngram, const llama_ngram_cache_part & part) {
+        const int64_t total = totals[i++];
+        if (total < threshold) {
+            return;
+        }
+        if (total == threshold) {
+            if (n_at_threshold == 0) {
+                return;
+            }
+            --n_at_threshold;
+        }
+        for (const llama_ngram_token_count & token_count : part) {
+            pruned.add(ngram, token_count.token, token_count.count);
+        }
+    });
+
+    ngram_cache = std::move(pruned);
 }
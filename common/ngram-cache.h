@@ -2,7 +2,8 @@
 
 #include "llama.h"
 
-#include <unordered_map>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -39,20 +40,117 @@ struct llama_ngram {
 
 struct llama_ngram_hash_function {
     size_t operator()(const llama_ngram & ngram) const {
-        size_t hash = 0;
+        // mix the tokens in order so that permutations of the same tokens do not collide
+        uint64_t hash = 0;
         for (int i = 0; i < LLAMA_NGRAM_MAX; ++i) {
-            hash ^= std::hash<llama_token>{}(ngram.tokens[i]);
+            hash = (hash ^ (uint32_t) ngram.tokens[i]) * 0x9E3779B97F4A7C15ull;
+            hash ^= hash >> 32;
         }
+        // splitmix64 finalizer
+        hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+        hash =  hash ^ (hash >> 31);
         return hash;
     }
 };
 
-// token -> number of times token has been seen
-typedef std::unordered_map<llama_token, int32_t> llama_ngram_cache_part;
+// number of times a token has been seen after an n-gram
+struct llama_ngram_token_count {
+    llama_token token;
+    int32_t     count;
+};
+
+// token -> number of times token has been seen, sorted by token
+// this is a view into the storage of a llama_ngram_cache and is invalidated when the cache is modified
+struct llama_ngram_cache_part {
+    const llama_ngram_token_count * data = nullptr;
+    size_t                          n    = 0;
+
+    llama_ngram_cache_part() {}
+    llama_ngram_cache_part(const llama_ngram_token_count * data, size_t n) : data(data), n(n) {}
+
+    const llama_ngram_token_count * begin() const { return data; }
+    const llama_ngram_token_count * end()   const { return data + n; }
+
+    size_t size()  const { return n; }
+    bool   empty() const { return n == 0; }
+
+    // number of times token has been seen, 0 if never
+    int32_t count(llama_token token) const;
+};
+
+// number of follow tokens stored directly in a table bucket, larger distributions go to the overflow storage
+#define LLAMA_NGRAM_CACHE_N_INLINE 3
+
+// bucket of the open-addressing table, the same layout is used in memory and in the file format
+struct llama_ngram_cache_bucket {
+    llama_ngram ngram;        // ngram.tokens[0] == -1 for an empty bucket
+    int32_t     n_counts = 0; // number of distinct tokens seen after ngram
+    uint32_t    padding  = 0; // keeps the file format free of uninitialized bytes
+    union {
+        llama_ngram_token_count counts[LLAMA_NGRAM_CACHE_N_INLINE] = {}; // n_counts <= LLAMA_NGRAM_CACHE_N_INLINE
+        struct {
+            uint64_t offset;   // index of the first token count in the overflow storage
+            uint64_t capacity; // number of token counts reserved at offset
+        } ext;                                                           // n_counts >  LLAMA_NGRAM_CACHE_N_INLINE
+    };
+};
+
+struct llama_ngram_cache_mapping;
 
 // n-gram -> empirical distribution of following tokens
-typedef std::unordered_map<llama_ngram, llama_ngram_cache_part, llama_ngram_hash_function> llama_ngram_cache;
+// flat open-addressing table with linear probing and a load factor of at most 1/2
+// a cache returned by llama_ngram_cache_load is memory-mapped and queried in place until it is first modified
+struct llama_ngram_cache {
+    size_t size()  const { return n_used; }
+    bool   empty() const { return n_used == 0; }
+    void   clear();
+
+    // distribution of the tokens seen after ngram, empty if ngram has not been seen
+    llama_ngram_cache_part find(const llama_ngram & ngram) const;
+
+    // add count occurrences of token after ngram
+    void add(const llama_ngram & ngram, llama_token token, int32_t count);
+
+    // copy a memory-mapped table into owned storage, called before the first modification
+    void make_mutable();
+
+    // call fn(ngram, part) for every n-gram in the cache
+    template <typename F>
+    void for_each(F && fn) const {
+        const llama_ngram_cache_bucket * b = buckets_data();
+        for (size_t i = 0; i < n_buckets(); ++i) {
+            if (b[i].ngram.tokens[0] != -1) {
+                fn(b[i].ngram, part(b[i]));
+            }
+        }
+    }
 
+    // table storage, either owned or pointing into mapping
+    std::vector<llama_ngram_cache_bucket> buckets;
+    std::vector<llama_ngram_token_count>  overflow;
+    size_t n_used = 0;
+
+    std::shared_ptr<llama_ngram_cache_mapping> mapping;
+    const llama_ngram_cache_bucket * mapped_buckets   = nullptr;
+    const llama_ngram_token_count  * mapped_overflow  = nullptr;
+    size_t                           n_mapped_buckets  = 0;
+    size_t                           n_mapped_overflow = 0;
+
+private:
+    const llama_ngram_cache_bucket * buckets_data()  const { return mapping ? mapped_buckets  : buckets.data(); }
+    const llama_ngram_token_count  * overflow_data() const { return mapping ? mapped_overflow : overflow.data(); }
+    size_t                           n_buckets()     const { return mapping ? n_mapped_buckets : buckets.size(); }
+
+    llama_ngram_cache_part part(const llama_ngram_cache_bucket & bucket) const {
+        if (bucket.n_counts <= LLAMA_NGRAM_CACHE_N_INLINE) {
+            return llama_ngram_cache_part(bucket.counts, bucket.n_counts);
+        }
+        return llama_ngram_cache_part(overflow_data() + bucket.ext.offset, bucket.n_counts);
+    }
+
+    void grow();
+};
 
 // Update an ngram cache with tokens.
 // ngram_cache:         the cache to modify.
@@ -79,11 +177,14 @@ void llama_ngram_cache_draft(
     llama_ngram_cache & nc_context, llama_ngram_cache & nc_dynamic, llama_ngram_cache & nc_static);
 
 // Save an ngram cache to a file.
+// The file contains the hash table itself so that llama_ngram_cache_load can memory-map it.
+// An existing file is replaced, not rewritten, so the caches loaded from it are not affected.
 // ngram_cache: the ngram cache to save.
 // filename:    the path under which to save the ngram cache.
 void llama_ngram_cache_save(llama_ngram_cache & ngram_cache, std::string & filename);
 
 // Load an ngram cache saved with llama_ngram_cache_save.
+// Files in the older format (a sequence of n-grams with their token counts) are read into memory.
 // filename: the path from which to load the ngram cache.
 // returns:  an ngram cache containing the information saved to filename.
 llama_ngram_cache llama_ngram_cache_load(std::string & filename);
@@ -92,3 +193,8 @@ llama_ngram_cache llama_ngram_cache_load(std::string & filename);
 // ngram_cache_target: the ngram cache to which to add the information from ngram_cache_add.
 // ngram_cache_add:    the ngram cache to add to ngram_cache_target.
 void llama_ngram_cache_merge(llama_ngram_cache & ngram_cache_target, llama_ngram_cache & ngram_cache_add);
+
+// Bound the size of an ngram cache.
+// ngram_cache: the ngram cache to prune.
+// n_max:       maximum number of n-grams to keep, the n-grams seen least often are dropped first.
+void llama_ngram_cache_prune(llama_ngram_cache & ngram_cache, size_t n_max);
@@ -1,6 +1,107 @@
 #define LLAMA_API_INTERNAL
 #include "sampling.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <random>
+#include <thread>
+
+void llama_token_ring::init(size_t capacity, size_t n_window) {
+    data.assign(capacity, 0);
+    this->n_window = std::min(n_window, capacity);
+
+    reset();
+}
+
+void llama_token_ring::reset() {
+    std::fill(data.begin(), data.end(), 0);
+    head = 0;
+
+    for (const llama_token id : distinct) {
+        distinct_pos[id] = -1;
+    }
+    distinct.clear();
+    distinct_count.clear();
+
+    for (size_t i = 0; i < n_window; ++i) {
+        count_add(0);
+    }
+}
+
+void llama_token_ring::resize(size_t capacity, size_t n_window) {
+    if (capacity == data.size() && std::min(n_window, capacity) == this->n_window) {
+        return;
+    }
+
+    const std::vector<llama_token> tokens = to_vector();
+
+    init(capacity, n_window);
+
+    for (size_t i = tokens.size() - std::min(tokens.size(), capacity); i < tokens.size(); ++i) {
+        push_back(tokens[i]);
+    }
+}
+
+void llama_token_ring::push_back(llama_token id) {
+    GGML_ASSERT(id >= 0);
+
+    if (data.empty()) {
+        return;
+    }
+
+    if (n_window > 0) {
+        // the token that leaves the window
+        count_sub((*this)[data.size() - n_window]);
+        count_add(id);
+    }
+
+    data[head] = id;
+    head = (head + 1) % data.size();
+}
+
+std::vector<llama_token> llama_token_ring::to_vector() const {
+    std::vector<llama_token> result(data.size());
+    for (size_t i = 0; i < data.size(); ++i) {
+        result[i] = (*this)[i];
+    }
+    return result;
+}
+
+void llama_token_ring::count_add(llama_token id) {
+    if ((size_t) id >= distinct_pos.size()) {
+        distinct_pos.resize(id + 1, -1);
+    }
+
+    const int32_t pos = distinct_pos[id];
+    if (pos < 0) {
+        distinct_pos[id] = distinct.size();
+        distinct.push_back(id);
+        distinct_count.push_back(1);
+    } else {
+        distinct_count[pos]++;
+    }
+}
+
+void llama_token_ring::count_sub(llama_token id) {
+    const int32_t pos = distinct_pos[id];
+    GGML_ASSERT(pos >= 0);
+
+    if (--distinct_count[pos] > 0) {
+        return;
+    }
+
+    // swap with the last distinct token
+    const llama_token last = distinct.back();
+
+    distinct[pos]       = last;
+    distinct_count[pos] = distinct_count.back();
+    distinct_pos[last]  = pos;
+
+    distinct.pop_back();
+    distinct_count.pop_back();
+    distinct_pos[id] = -1;
+}
 
 struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_params & params) {
     struct llama_sampling_context * result = new llama_sampling_context();
@@ -37,7 +138,12 @@ struct llama_sampling_context * llama_sampling_init(const struct llama_sampling_
         result->grammar = grammar;
     }
 
-    result->prev.resize(params.n_prev);
+    {
+        const int32_t n_prev         = std::max(0, params.n_prev);
+        const int32_t penalty_last_n = params.penalty_last_n < 0 ? n_prev : params.penalty_last_n;
+
+        result->prev.init(n_prev, penalty_last_n);
+    }
 
     result->n_valid = 0;
 
@@ -72,7 +178,7 @@ void llama_sampling_reset(llama_sampling_context * ctx) {
         ctx->grammar = grammar;
     }
 
-    std::fill(ctx->prev.begin(), ctx->prev.end(), 0);
+    ctx->prev.reset();
     ctx->cur.clear();
     ctx->n_valid = 0;
 }
@@ -368,7 +474,10 @@ static llama_token_data_array llama_sampling_prepare_impl(
 
     const bool    penalize_nl     = params.penalize_nl;
 
-    auto & prev = ctx_sampling->prev;
+    // the parameters can be changed after llama_sampling_init
+    ctx_sampling->prev.resize(std::max(0, params.n_prev), std::max(0, penalty_last_n));
+
+    const auto & prev = ctx_sampling->prev;
     auto & cur  = ctx_sampling->cur;
 
     // Get a pointer to the logits
@@ -399,14 +508,24 @@ static llama_token_data_array llama_sampling_prepare_impl(
     llama_token_data_array cur_p = { cur.data(), cur.size(), false };
 
     // apply penalties
-    const auto& penalty_tokens = params.use_penalty_prompt_tokens ? params.penalty_prompt_tokens : prev;
-    const int penalty_tokens_used_size = std::min((int)penalty_tokens.size(), penalty_last_n);
+    const int penalty_tokens_used_size = params.use_penalty_prompt_tokens
+        ? std::min((int) params.penalty_prompt_tokens.size(), penalty_last_n)
+        : (int) prev.n_window;
     if (penalty_tokens_used_size) {
         const float nl_logit = logits[llama_token_nl(llama_get_model(ctx_main))];
 
-        llama_sample_repetition_penalties(ctx_main, &cur_p,
-                penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
-                penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
+        if (params.use_penalty_prompt_tokens) {
+            const auto & penalty_tokens = params.penalty_prompt_tokens;
+
+            llama_sample_repetition_penalties(ctx_main, &cur_p,
+                    penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
+                    penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
+        } else {
+            // the token counts of the window are maintained by the ring buffer
+            llama_sample_repetition_penalties_counts(ctx_main, &cur_p,
+                    prev.window_tokens(), prev.window_counts(), prev.window_size(),
+                    penalty_repeat, penalty_freq, penalty_present);
+        }
 
         if (!penalize_nl) {
             for (size_t idx = 0; idx < cur_p.size; idx++) {
@@ -435,6 +554,141 @@ llama_token llama_sampling_sample(
     return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, /* is_resampling= */ false);
 }
 
+// worker threads of llama_sampling_sample_batch, kept alive between calls since the batch is sampled on every decode
+// the threads are started on first use and joined at exit
+struct llama_sampling_pool {
+    std::mutex mutex_run; // one batch at a time
+    std::mutex mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+
+    std::vector<std::thread> threads;
+
+    std::function<void()> job;
+    uint64_t generation = 0;
+    int      n_active   = 0; // threads that take part in the current job
+    int      n_running  = 0; // threads that have not finished the current job
+    bool     stop       = false;
+
+    ~llama_sampling_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_work.notify_all();
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+
+    void worker(int id, uint64_t seen) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv_work.wait(lock, [&]() { return stop || generation != seen; });
+            if (stop) {
+                return;
+            }
+            seen = generation;
+            if (id >= n_active) {
+                continue;
+            }
+
+            // job is not modified until all the active threads are done
+            lock.unlock();
+            job();
+            lock.lock();
+
+            if (--n_running == 0) {
+                cv_done.notify_one();
+            }
+        }
+    }
+
+    // runs fn on the calling thread and on n_workers threads of the pool, returns when all of them are done
+    void run(int n_workers, std::function<void()> fn) {
+        std::lock_guard<std::mutex> lock_run(mutex_run);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while ((int) threads.size() < n_workers) {
+                const int id = (int) threads.size();
+                threads.emplace_back(&llama_sampling_pool::worker, this, id, generation);
+            }
+            job       = std::move(fn);
+            n_active  = n_workers;
+            n_running = n_workers;
+            generation++;
+        }
+        cv_work.notify_all();
+
+        job();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [&]() { return n_running == 0; });
+        job = nullptr;
+    }
+};
+
+std::vector<llama_token> llama_sampling_sample_batch(
+        const std::vector<llama_sampling_context *> & ctxs_sampling,
+        struct llama_context * ctx_main,
+        const std::vector<int32_t> & idxs,
+        int n_threads) {
+    GGML_ASSERT(ctxs_sampling.size() == idxs.size());
+
+    const int n_rows = (int) idxs.size();
+
+    std::vector<llama_token> result(n_rows, -1);
+
+    // mirostat samples through llama_sample_token, which uses the shared RNG of ctx_main
+    // these rows are processed on the calling thread, after the parallel section
+    std::vector<int> rows_par;
+    std::vector<int> rows_seq;
+
+    rows_par.reserve(n_rows);
+
+    for (int i = 0; i < n_rows; ++i) {
+        const llama_sampling_params & params = ctxs_sampling[i]->params;
+
+        if (params.temp > 0.0f && params.mirostat != 0) {
+            rows_seq.push_back(i);
+        } else {
+            rows_par.push_back(i);
+        }
+    }
+
+    n_threads = std::max(1, std::min(n_threads, (int) rows_par.size()));
+
+    // rows are handed out one at a time, since the cost per row varies a lot (grammar, n_probs, ...)
+    std::atomic<int> i_next{0};
+
+    auto worker = [&]() {
+        while (true) {
+            const int i = i_next.fetch_add(1, std::memory_order_relaxed);
+            if (i >= (int) rows_par.size()) {
+                break;
+            }
+
+            const int ir = rows_par[i];
+
+            result[ir] = llama_sampling_sample(ctxs_sampling[ir], ctx_main, nullptr, idxs[ir]);
+        }
+    };
+
+    if (n_threads == 1) {
+        worker();
+    } else {
+        static llama_sampling_pool pool;
+        pool.run(n_threads - 1, worker);
+    }
+
+    for (const int ir : rows_seq) {
+        result[ir] = llama_sampling_sample(ctxs_sampling[ir], ctx_main, nullptr, idxs[ir]);
+    }
+
+    return result;
+}
+
 llama_token_data_array llama_sampling_prepare(
                   struct llama_sampling_context * ctx_sampling,
                   struct llama_context * ctx_main,
@@ -450,7 +704,6 @@ void llama_sampling_accept(
         struct llama_context * ctx_main,
         llama_token id,
         bool apply_grammar) {
-    ctx_sampling->prev.erase(ctx_sampling->prev.begin());
     ctx_sampling->prev.push_back(id);
 
     if (ctx_sampling->grammar != NULL && apply_grammar) {
@@ -64,6 +64,47 @@ typedef struct llama_sampling_params {
     bool                     use_penalty_prompt_tokens = false;
 } llama_sampling_params;
 
+// fixed-capacity ring buffer with the most recently accepted tokens
+// the number of occurrences of each token within the last n_window positions is maintained incrementally,
+// so the repetition penalties can be applied without rebuilding a frequency map on every sample
+struct llama_token_ring {
+    // the buffer starts (and is reset) filled with token 0
+    void init(size_t capacity, size_t n_window);
+    void reset();
+
+    // change the capacity and the window, keeping the most recent tokens
+    void resize(size_t capacity, size_t n_window);
+
+    // append a token, dropping the oldest one
+    void push_back(llama_token id);
+
+    size_t size() const { return data.size(); }
+
+    // i = 0 is the oldest token
+    llama_token operator[](size_t i) const { return data[(head + i) % data.size()]; }
+
+    llama_token back() const { return (*this)[data.size() - 1]; }
+
+    std::vector<llama_token> to_vector() const;
+
+    // distinct tokens within the window and their number of occurrences
+    size_t              n_window = 0;
+    const llama_token * window_tokens() const { return distinct.data(); }
+    const int32_t     * window_counts() const { return distinct_count.data(); }
+    size_t              window_size()   const { return distinct.size(); }
+
+private:
+    void count_add(llama_token id);
+    void count_sub(llama_token id);
+
+    std::vector<llama_token> data;
+    size_t head = 0; // position of the oldest token
+
+    std::vector<llama_token> distinct;
+    std::vector<int32_t>     distinct_count;
+    std::vector<int32_t>     distinct_pos;   // token -> index in distinct, -1 if not in the window (grown on demand)
+};
+
 // general sampler context
 // TODO: move to llama.h
 struct llama_sampling_context {
@@ -78,8 +119,7 @@ struct llama_sampling_context {
     // internal
     grammar_parser::parse_state parsed_grammar;
 
-    // TODO: replace with ring-buffer
-    std::vector<llama_token>      prev;
+    llama_token_ring              prev;
     std::vector<llama_token_data> cur;
     size_t n_valid; // Number of correct top tokens with correct probabilities.
 
@@ -144,6 +184,26 @@ llama_token llama_sampling_sample(
         struct llama_context * ctx_cfg,
         int idx = -1);
 
+// sample one token for each output row of the last decoded batch, processing the rows in parallel
+// this is equivalent to calling llama_sampling_sample for each row, but the vocabulary scans are
+// distributed across n_threads threads (the worker threads are reused between calls)
+//
+// required:
+//  - ctxs_sampling: sampling context for each row (must be distinct)
+//  - ctx_main:      context to use for sampling
+//  - idxs:          sample from llama_get_logits_ith(ctx, idxs[i]) using ctxs_sampling[i]
+//
+// note: rows that use mirostat draw from the RNG of ctx_main and are sampled on the calling thread
+//
+// returns:
+//  - the sampled token for each row
+//
+std::vector<llama_token> llama_sampling_sample_batch(
+        const std::vector<llama_sampling_context *> & ctxs_sampling,
+        struct llama_context * ctx_main,
+        const std::vector<int32_t> & idxs,
+        int n_threads);
+
 // Prepares and adjusts the set of token candidates for sampling based on penalties, biases, and sampling parameters.
 llama_token_data_array llama_sampling_prepare(
         struct llama_sampling_context * ctx_sampling,
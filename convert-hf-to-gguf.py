@@ -2281,7 +2281,7 @@ in chat mode so that the conversation can end normally.")
             return [(self.map_tensor_name(name), data_torch)]
 
 
-@Model.register("BertModel", "CamembertModel")
+@Model.register("BertModel", "CamembertModel", "BertForSequenceClassification")
 class BertModel(Model):
     model_arch = gguf.MODEL_ARCH.BERT
 
@@ -2289,10 +2289,19 @@ class BertModel(Model):
         super().__init__(*args, **kwargs)
         self.vocab_size = None
 
+        # cross-encoders (rerankers) keep their classification head and output a single score
+        self.is_reranker = any(arch.endswith("ForSequenceClassification") for arch in self.hparams.get("architectures", []))
+        if self.is_reranker and len(self.hparams.get("id2label", {"0": "LABEL_0"})) != 1:
+            raise NotImplementedError("Only classifiers with a single output label are supported")
+
     def set_gguf_parameters(self):
         super().set_gguf_parameters()
         self.gguf_writer.add_causal_attention(False)
 
+        if self.is_reranker:
+            self.gguf_writer.add_pooling_type(gguf.PoolingType.RANK)
+            return
+
         # get pooling path
         pooling_path = None
         module_path = self.dir_model / "modules.json"
@@ -2346,8 +2355,11 @@ class BertModel(Model):
     def modify_tensors(self, data_torch: Tensor, name: str, bid: int | None) -> Iterable[tuple[str, Tensor]]:
         del bid  # unused
 
-        # we are only using BERT for embeddings so we don't need the pooling layer
-        if name in ("embeddings.position_ids", "pooler.dense.weight", "pooler.dense.bias"):
+        if name.startswith("bert."):
+            name = name[5:]
+
+        # embedding models don't need the pooling layer, for rerankers it is part of the classification head
+        if name == "embeddings.position_ids" or (not self.is_reranker and name in ("pooler.dense.weight", "pooler.dense.bias")):
             return [] # we don't need these
 
         return [(self.map_tensor_name(name), data_torch)]
@@ -2692,7 +2704,7 @@ class OlmoModel(Model):
         return [(self.map_tensor_name(name), data_torch)]
 
 
-@Model.register("JinaBertModel", "JinaBertForMaskedLM")
+@Model.register("JinaBertModel", "JinaBertForMaskedLM", "JinaBertForSequenceClassification")
 class JinaBertV2Model(BertModel):
     model_arch = gguf.MODEL_ARCH.JINA_BERT_V2
 
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+# Convert a PEFT LoRA adapter (adapter_config.json + adapter_model.safetensors)
+# to a GGUF adapter that can be loaded at runtime with llama_lora_adapter_init.
+# The adapter is kept unmerged: every adapted weight W gets a pair of tensors
+# "<name>.lora_a" [n_in, rank] and "<name>.lora_b" [rank, n_out].
+
+from __future__ import annotations
+
+import argparse
+import json
+import logging
+import os
+import struct
+import sys
+from pathlib import Path
+from typing import Any, Callable
+
+import numpy as np
+
+if 'NO_LOCAL_GGUF' not in os.environ:
+    sys.path.insert(1, str(Path(__file__).parent / 'gguf-py'))
+import gguf
+
+logger = logging.getLogger("lora-to-gguf")
+
+
+def permute(weights: np.ndarray, n_head: int) -> np.ndarray:
+    # same row permutation as LlamaModel.permute in convert-hf-to-gguf.py
+    return (weights.reshape(n_head, 2, weights.shape[0] // n_head // 2, *weights.shape[1:])
+            .swapaxes(1, 2)
+            .reshape(weights.shape))
+
+
+def permute_llama(hparams: dict[str, Any]) -> Callable[[str, np.ndarray], np.ndarray]:
+    n_head    = hparams["num_attention_heads"]
+    n_head_kv = hparams.get("num_key_value_heads", n_head)
+
+    # W = B*A, so a permutation of the rows of W is a permutation of the rows of B
+    def modify(name: str, lora_b: np.ndarray) -> np.ndarray:
+        if name.endswith("q_proj"):
+            return permute(lora_b, n_head)
+        if name.endswith("k_proj"):
+            return permute(lora_b, n_head_kv)
+        return lora_b
+
+    return modify
+
+
+# HF architecture -> (gguf arch, optional modification of lora_b for a given HF module name)
+ARCHITECTURES: dict[str, tuple[gguf.MODEL_ARCH, Callable[[dict[str, Any]], Callable[[str, np.ndarray], np.ndarray]] | None]] = {
+    "LlamaForCausalLM":   (gguf.MODEL_ARCH.LLAMA, permute_llama),
+    "MistralForCausalLM": (gguf.MODEL_ARCH.LLAMA, permute_llama),
+    "Qwen2ForCausalLM":   (gguf.MODEL_ARCH.QWEN2, None),
+    "GemmaForCausalLM":   (gguf.MODEL_ARCH.GEMMA, None),
+}
+
+SAFETENSORS_DTYPES = {
+    "F32":  np.float32,
+    "F16":  np.float16,
+    "BF16": np.uint16,
+}
+
+
+def load_safetensors(path: Path) -> dict[str, np.ndarray]:
+    # minimal reader so that the conversion does not depend on torch
+    tensors: dict[str, np.ndarray] = {}
+    with open(path, "rb") as f:
+        n_header = struct.unpack("<Q", f.read(8))[0]
+        header = json.loads(f.read(n_header))
+        data = f.read()
+    for name, info in header.items():
+        if name == "__metadata__":
+            continue
+        dtype = info["dtype"]
+        if dtype not in SAFETENSORS_DTYPES:
+            raise ValueError(f"unsupported tensor type {dtype} for {name}")
+        begin, end = info["data_offsets"]
+        t = np.frombuffer(data[begin:end], dtype=SAFETENSORS_DTYPES[dtype]).reshape(info["shape"])
+        if dtype == "BF16":
+            t = (t.astype(np.uint32) << 16).view(np.float32)
+        tensors[name] = t.astype(np.float32)
+    return tensors
+
+
+def parse_args() -> argparse.Namespace:
+    parser = argparse.ArgumentParser(
+        description="Convert a huggingface PEFT LoRA adapter to a GGUF adapter")
+    parser.add_argument(
+        "--outfile", type=Path,
+        help="path to write to; default: ggml-lora-{outtype}.gguf in the adapter directory",
+    )
+    parser.add_argument(
+        "--outtype", type=str, choices=["f32", "f16"], default="f16",
+        help="output format - use f32 for float32, f16 for float16",
+    )
+    parser.add_argument(
+        "--base", type=Path, required=True,
+        help="directory containing the config.json of the base model",
+    )
+    parser.add_argument(
+        "lora_path", type=Path,
+        help="directory containing adapter_config.json and adapter_model.safetensors",
+    )
+    parser.add_argument(
+        "--verbose", action="store_true",
+        help="increase output verbosity",
+    )
+    return parser.parse_args()
+
+
+def main() -> None:
+    args = parse_args()
+
+    logging.basicConfig(level=logging.DEBUG if args.verbose else logging.INFO)
+
+    with open(args.base / "config.json", "r", encoding="utf-8") as f:
+        hparams = json.load(f)
+    with open(args.lora_path / "adapter_config.json", "r", encoding="utf-8") as f:
+        lparams = json.load(f)
+
+    arch_name = hparams["architectures"][0]
+    if arch_name not in ARCHITECTURES:
+        logger.error(f"Model {arch_name} is not supported")
+        sys.exit(1)
+    arch, make_modify = ARCHITECTURES[arch_name]
+    modify = make_modify(hparams) if make_modify is not None else None
+
+    n_layer = hparams["num_hidden_layers"]
+    tensor_map = gguf.get_tensor_name_map(arch, n_layer)
+
+    tensors = load_safetensors(args.lora_path / "adapter_model.safetensors")
+
+    dtype = np.float16 if args.outtype == "f16" else np.float32
+    fname_out = args.outfile if args.outfile is not None else args.lora_path / f"ggml-lora-{args.outtype}.gguf"
+
+    writer = gguf.GGUFWriter(path=None, arch=gguf.MODEL_ARCH_NAMES[arch])
+    writer.add_type(gguf.GGUFType.ADAPTER)
+    writer.add_string(gguf.Keys.Adapter.TYPE, "lora")
+    writer.add_float32(gguf.Keys.Adapter.LORA_ALPHA, float(lparams["lora_alpha"]))
+    writer.add_name(lparams.get("base_model_name_or_path") or arch_name)
+
+    for name in sorted(tensors):
+        if not name.endswith(".lora_A.weight"):
+            if not name.endswith(".lora_B.weight"):
+                logger.error(f"Unexpected tensor {name!r}, only lora_A/lora_B pairs are supported")
+                sys.exit(1)
+            continue
+
+        module = name[:-len(".lora_A.weight")]
+        name_b = module + ".lora_B.weight"
+        if name_b not in tensors:
+            logger.error(f"Missing {name_b!r}")
+            sys.exit(1)
+
+        # base_model.model.model.layers.0.self_attn.q_proj -> model.layers.0.self_attn.q_proj
+        hf_name = module.removeprefix("base_model.model.")
+        new_name = tensor_map.get_name(hf_name + ".weight", try_suffixes=(".weight",))
+        if new_name is None:
+            logger.error(f"Can not map tensor {hf_name!r}")
+            sys.exit(1)
+
+        lora_a = tensors[name]    # [rank, n_in]
+        lora_b = tensors[name_b]  # [n_out, rank]
+        if modify is not None:
+            lora_b = modify(hf_name, lora_b)
+
+        for suffix, t in ((".lora_a", lora_a), (".lora_b", lora_b)):
+            data = np.ascontiguousarray(t.astype(dtype))
+            logger.info(f"{new_name + suffix + ',':<40} {str(data.dtype):>8}, shape = {data.shape}")
+            writer.add_tensor(new_name + suffix, data)
+
+    writer.write_header_to_file(fname_out)
+    writer.write_kv_data_to_file()
+    writer.write_tensors_to_file()
+    writer.close()
+
+    logger.info(f"Adapter successfully exported to {fname_out}")
+
+
+if __name__ == '__main__':
+    main()
@@ -96,6 +96,7 @@ int main(int argc, char ** argv) {
                 batch.seq_id   + i,
                 batch.logits   + i,
                 0, 0, 0, // unused
+                nullptr, nullptr, // no per-token LoRA adapters
             };
 
             const int ret = llama_decode(ctx, batch_view);
@@ -97,6 +97,10 @@ int main(int argc, char ** argv) {
         fprintf(stderr, "%s: error: pooling type NONE not supported\n", __func__);
         return 1;
     }
+    if (pooling_type == LLAMA_POOLING_TYPE_RANK) {
+        fprintf(stderr, "%s: error: pooling type RANK not supported, use the /rerank endpoint of the server\n", __func__);
+        return 1;
+    }
 
     if (n_ctx > n_ctx_train) {
         fprintf(stderr, "%s: warning: model was trained on only %d context tokens (%d specified)\n",
@@ -699,6 +699,7 @@ static bool decode_helper(llama_context * ctx, llama_batch & batch, std::vector<
             batch.seq_id   + i,
             batch.logits   + i,
             0, 0, 0, // unused
+            nullptr, nullptr, // no per-token LoRA adapters
         };
 
         const int ret = llama_decode(ctx, batch_view);
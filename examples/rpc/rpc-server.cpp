@@ -9,16 +9,21 @@
 #include "ggml-rpc.h"
 #ifdef _WIN32
 #  include <windows.h>
+#  include <direct.h>
 #else
 #  include <unistd.h>
 #endif
+#include <sys/stat.h>
 #include <string>
+#include <vector>
 #include <stdio.h>
 
 struct rpc_server_params {
     std::string host        = "0.0.0.0";
     int         port        = 50052;
     size_t      backend_mem = 0;
+    std::string cache_dir;
+    std::vector<std::string> gguf_files;
 };
 
 static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
@@ -28,6 +33,9 @@ static void print_usage(int /*argc*/, char ** argv, rpc_server_params params) {
     fprintf(stderr, "  -H HOST, --host HOST  host to bind to (default: %s)\n", params.host.c_str());
     fprintf(stderr, "  -p PORT, --port PORT  port to bind to (default: %d)\n", params.port);
     fprintf(stderr, "  -m MEM, --mem MEM     backend memory size (in MB)\n");
+    fprintf(stderr, "  -c DIR, --cache DIR   cache the tensor data uploaded by the clients in DIR\n");
+    fprintf(stderr, "  -g FNAME, --gguf FNAME\n");
+    fprintf(stderr, "                        index the tensor data of a model, the clients do not upload it (can be repeated)\n");
     fprintf(stderr, "\n");
 }
 
@@ -53,6 +61,16 @@ static bool rpc_server_params_parse(int argc, char ** argv, rpc_server_params &
                 return false;
             }
             params.backend_mem = std::stoul(argv[i]) * 1024 * 1024;
+        } else if (arg == "-c" || arg == "--cache") {
+            if (++i >= argc) {
+                return false;
+            }
+            params.cache_dir = argv[i];
+        } else if (arg == "-g" || arg == "--gguf") {
+            if (++i >= argc) {
+                return false;
+            }
+            params.gguf_files.push_back(argv[i]);
         } else if (arg == "-h" || arg == "--help") {
             print_usage(argc, argv, params);
             exit(0);
@@ -127,8 +145,25 @@ int main(int argc, char * argv[]) {
     } else {
         get_backend_memory(&free_mem, &total_mem);
     }
+    if (!params.cache_dir.empty()) {
+#ifdef _WIN32
+        _mkdir(params.cache_dir.c_str());
+#else
+        mkdir(params.cache_dir.c_str(), 0755);
+#endif
+        struct stat st;
+        if (stat(params.cache_dir.c_str(), &st) != 0 || !(st.st_mode & S_IFDIR)) {
+            fprintf(stderr, "Invalid cache directory: %s\n", params.cache_dir.c_str());
+            return 1;
+        }
+    }
+    std::vector<const char *> gguf_files;
+    for (const auto & fname : params.gguf_files) {
+        gguf_files.push_back(fname.c_str());
+    }
     printf("Starting RPC server on %s, backend memory: %zu MB\n", endpoint.c_str(), free_mem / (1024 * 1024));
-    start_rpc_server(backend, endpoint.c_str(), free_mem, total_mem);
+    start_rpc_server(backend, endpoint.c_str(), free_mem, total_mem,
+        params.cache_dir.empty() ? nullptr : params.cache_dir.c_str(), gguf_files.data(), gguf_files.size());
     ggml_backend_free(backend);
     return 0;
 }
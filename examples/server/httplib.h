@@ -4,6 +4,12 @@
 //  Copyright (c) 2024 Yuji Hirose. All rights reserved.
 //  MIT License
 //
+//  llama.cpp: this copy is patched so that a handler can take over the
+//  connection of its response (Response::socket_handler_, used by the stream
+//  event loops of server.cpp). The changes are between the
+//  "llama.cpp patch begin" and "llama.cpp patch end" comments, they must be
+//  applied again when httplib is updated.
+//
 
 #ifndef CPPHTTPLIB_HTTPLIB_H
 #define CPPHTTPLIB_HTTPLIB_H
@@ -631,6 +637,13 @@ struct Response {
   ContentProviderResourceReleaser content_provider_resource_releaser_;
   bool is_chunked_content_provider_ = false;
   bool content_provider_success_ = false;
+
+  // llama.cpp patch begin: socket takeover
+  // when set by a handler, the server writes nothing for this response and
+  // hands the connection over to this function, which owns it from then on
+  // (plain sockets only)
+  std::function<void(socket_t sock)> socket_handler_;
+  // llama.cpp patch end
 };
 
 class Stream {
@@ -918,9 +931,12 @@ public:
   std::function<TaskQueue *(void)> new_task_queue;
 
 protected:
+  // llama.cpp patch begin: socket takeover (handed_over)
   bool process_request(Stream &strm, bool close_connection,
                        bool &connection_closed,
-                       const std::function<void(Request &)> &setup_request);
+                       const std::function<void(Request &)> &setup_request,
+                       bool *handed_over = nullptr);
+  // llama.cpp patch end
 
   std::atomic<socket_t> svr_sock_{INVALID_SOCKET};
   size_t keep_alive_max_count_ = CPPHTTPLIB_KEEPALIVE_MAX_COUNT;
@@ -6620,10 +6636,13 @@ inline bool Server::dispatch_request_for_content_reader(
   return false;
 }
 
+// llama.cpp patch begin: socket takeover (handed_over)
 inline bool
 Server::process_request(Stream &strm, bool close_connection,
                         bool &connection_closed,
-                        const std::function<void(Request &)> &setup_request) {
+                        const std::function<void(Request &)> &setup_request,
+                        bool *handed_over) {
+// llama.cpp patch end
   std::array<char, 2048> buf{};
 
   detail::stream_line_reader line_reader(strm, buf.data(), buf.size());
@@ -6745,6 +6764,15 @@ Server::process_request(Stream &strm, bool close_connection,
   }
 #endif
   if (routed) {
+    // llama.cpp patch begin: socket takeover
+    if (res.socket_handler_ && handed_over) {
+      *handed_over = true;
+      connection_closed = true;
+      res.socket_handler_(strm.socket());
+      return true;
+    }
+    // llama.cpp patch end
+
     if (res.status == -1) {
       res.status = req.ranges.empty() ? StatusCode::OK_200
                                       : StatusCode::PartialContent_206;
@@ -6768,16 +6796,22 @@ Server::process_request(Stream &strm, bool close_connection,
 
 inline bool Server::is_valid() const { return true; }
 
+// llama.cpp patch begin: socket takeover (the socket is not closed once it is
+// handed over)
 inline bool Server::process_and_close_socket(socket_t sock) {
+  auto handed_over = false;
   auto ret = detail::process_server_socket(
       svr_sock_, sock, keep_alive_max_count_, keep_alive_timeout_sec_,
       read_timeout_sec_, read_timeout_usec_, write_timeout_sec_,
       write_timeout_usec_,
-      [this](Stream &strm, bool close_connection, bool &connection_closed) {
+      [&](Stream &strm, bool close_connection, bool &connection_closed) {
         return process_request(strm, close_connection, connection_closed,
-                               nullptr);
+                               nullptr, &handed_over);
       });
 
+  if (handed_over) { return ret; }
+// llama.cpp patch end
+
   detail::shutdown_socket(sock);
   detail::close_socket(sock);
   return ret;
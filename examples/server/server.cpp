@@ -4,6 +4,7 @@
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 #include "grammar-parser.h"
+#include "ngram-cache.h"
 
 #ifndef NDEBUG
 // crash the server in debug mode, otherwise send an http 500 error
@@ -42,9 +43,35 @@
 #include <thread>
 #include <signal.h>
 #include <memory>
+#include <unordered_map>
+
+#if defined(__linux__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define SERVER_STREAM_LOOP 1
+#endif
 
 using json = nlohmann::ordered_json;
 
+#define SPEC_VOCAB_MAX_SIZE_DIFFERENCE  100
+#define SPEC_VOCAB_CHECK_START_TOKEN_ID 5
+
+// waiting time is converted to this many tokens of estimated cost per second, so that long prompts are not starved
+#define SERVER_SCHED_AGING_TOKENS_PER_S 256
+
+// a preempted slot is resumed when the KV cache has room for it and for this many more steps of the generating slots
+#define SERVER_KV_RESUME_STEPS 16
+
+// maximum number of embedding inputs packed into one batch, each of them has its own sequence after those of the slots
+#define SERVER_EMBD_N_SEQ 64
+
+// maximum number of n-grams in the dynamic lookup cache, the n-grams seen least often are dropped beyond it
+#define SERVER_NGRAM_DYNAMIC_MAX (1 << 20)
+
 bool server_verbose = false;
 bool server_log_json = true;
 
@@ -56,6 +83,7 @@ enum stop_type {
 enum slot_state {
     SLOT_STATE_IDLE,
     SLOT_STATE_PROCESSING,
+    SLOT_STATE_PREEMPTED, // the KV cache of the slot was given up to make room for other slots
 };
 
 enum slot_command {
@@ -78,6 +106,7 @@ enum server_task_type {
     SERVER_TASK_TYPE_SLOT_SAVE,
     SERVER_TASK_TYPE_SLOT_RESTORE,
     SERVER_TASK_TYPE_SLOT_ERASE,
+    SERVER_TASK_TYPE_LORA_ADAPTERS, // get and optionally set the default scales of the LoRA adapters
 };
 
 struct server_task {
@@ -90,6 +119,12 @@ struct server_task {
 
     bool infill    = false;
     bool embedding = false;
+
+    // scheduling of completion tasks that wait for a slot (see server_context::schedule_tasks)
+    int32_t     priority   =  0; // tasks with a higher priority are started first
+    int64_t     t_deadline = -1; // the task is rejected if it has not started by this time (us), -1 = no deadline
+    int64_t     t_enqueue  =  0; // time (us) at which the task was requested
+    std::string key;             // fairness key (API key of the request)
 };
 
 struct server_task_result {
@@ -100,6 +135,22 @@ struct server_task_result {
 
     bool stop;
     bool error;
+
+    // a streamed token delta without a JSON object in data, it is formatted by the HTTP thread (see server_sse_writer)
+    bool        partial   = false;
+    std::string content;
+    int         id_slot   = -1;
+    int32_t     n_decoded = 0;
+};
+
+// an embedding input that is decoded together with others, without a slot (see server_context::update_embeddings)
+struct server_embd_input {
+    int id       = -1;
+    int id_multi = -1;
+
+    bool rerank = false; // send the score of the classification head instead of the embedding
+
+    std::vector<llama_token> tokens;
 };
 
 struct server_task_multi {
@@ -123,11 +174,26 @@ struct slot_params {
     json input_suffix;
 };
 
+// a drafted token, verified by the target model together with the sampled token of the slot
+// the drafted tokens of a slot form a tree rooted at the sampled token - each branch of the tree
+// is evaluated in its own KV cache sequence
+struct server_draft_node {
+    llama_token id;
+
+    int32_t parent  = -1; // index of the parent node, -1 if the parent is the sampled token
+    int32_t depth   =  1; // distance from the sampled token
+    int32_t i_batch = -1; // index in the target batch
+
+    uint32_t seqs = 0; // bitmask of the branches that contain this node
+};
+
 struct server_slot {
     int id;
     int id_task = -1;
     int id_multi = -1;
 
+    std::string key; // fairness key of the task
+
     struct slot_params params;
 
     slot_state state = SLOT_STATE_IDLE;
@@ -181,10 +247,32 @@ struct server_slot {
 
     int32_t n_past_se = 0; // self-extend
 
+    // preemption under KV cache pressure (see server_context::kv_reserve)
+    int32_t              priority    =  0;
+    int64_t              t_preempted =  0;
+    int32_t              n_resumed   = -1; // tokens of cache_tokens evaluated again while resuming, -1 if not resuming
+    std::vector<uint8_t> kv_swap;          // KV cache of the sequence while it is swapped out to host memory
+
+    // speculative decoding
+    std::vector<server_draft_node> draft;
+    int32_t n_draft_seqs   = 0;  // number of branches used by the draft
+    int32_t i_draft_accept = -1; // last accepted node of the draft, -1 if none
+    int32_t draft_pos      = 0;  // position of the sampled token at the root of the draft
+
+    std::vector<llama_token> cache_tokens_dft; // tokens in the KV cache of the draft model
+
+    std::vector<float> lora; // scales of the LoRA adapters for the task, cache_tokens were evaluated with them
+
+    llama_ngram_cache ngram_cache;        // n-grams of cache_tokens, used for lookup decoding
+    size_t            n_ngram_tokens = 0; // number of cache_tokens added to ngram_cache
+
     // stats
     size_t n_sent_text = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
+    int32_t n_draft_total    = 0; // number of drafted tokens
+    int32_t n_draft_accepted = 0; // number of drafted tokens accepted by the target model
+
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
@@ -205,6 +293,8 @@ struct server_slot {
         infill             = false;
         ga_i               = 0;
         n_past_se          = 0;
+        n_draft_total      = 0;
+        n_draft_accepted   = 0;
 
         generated_token_probs.clear();
     }
@@ -241,7 +331,7 @@ struct server_slot {
     }
 
     void release() {
-        if (state == SLOT_STATE_PROCESSING) {
+        if (state == SLOT_STATE_PROCESSING || state == SLOT_STATE_PREEMPTED) {
             t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
             command = SLOT_COMMAND_RELEASE;
         }
@@ -258,9 +348,23 @@ struct server_slot {
             {"predicted_ms",           t_token_generation},
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
+
+            {"draft_n",                n_draft_total},
+            {"draft_n_accepted",       n_draft_accepted},
         };
     }
 
+    // find the child of a draft node (-1 for the root) with the given token
+    int32_t draft_find_child(int32_t i_node, llama_token id) const {
+        for (int32_t i = 0; i < (int32_t) draft.size(); ++i) {
+            if (draft[i].parent == i_node && draft[i].id == id) {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
     size_t find_stopping_strings(const std::string & text, const size_t last_token_size, const stop_type type) {
         size_t stop_pos = std::string::npos;
 
@@ -324,6 +428,21 @@ struct server_slot {
             {"n_tokens_second",    n_tokens_second},
         });
 
+        if (n_draft_total > 0) {
+            const float rate = (float) n_draft_accepted / n_draft_total;
+
+            snprintf(buffer, 512, "draft acceptance     = %10.2f %%  / %5d tokens (%5d accepted)",
+                    100.0f * rate, n_draft_total, n_draft_accepted);
+
+            LOG_INFO(buffer, {
+                {"id_slot",          id},
+                {"id_task",          id_task},
+                {"n_draft_total",    n_draft_total},
+                {"n_draft_accepted", n_draft_accepted},
+                {"rate",             rate},
+            });
+        }
+
         snprintf(buffer, 512, "          total time = %10.2f ms", t_prompt_processing + t_token_generation);
 
         LOG_INFO(buffer, {
@@ -350,6 +469,11 @@ struct server_metrics {
     uint64_t n_tokens_predicted  = 0;
     uint64_t t_tokens_generation = 0;
 
+    uint64_t n_requests_expired = 0; // deadline passed before the request could start
+    uint64_t n_preemptions      = 0; // slots that gave up their KV cache for other slots
+
+    std::atomic<uint64_t> n_requests_rejected{0}; // queue was full, updated by the HTTP threads
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -378,7 +502,7 @@ struct server_metrics {
 
 struct server_queue {
     int id = 0;
-    bool running;
+    bool running = true; // until terminate(), which may be called before start_loop()
 
     // queues
     std::vector<server_task> queue_tasks;
@@ -393,6 +517,8 @@ struct server_queue {
     std::function<void(server_task       &)> callback_new_task;
     std::function<void(server_task_multi &)> callback_finish_multitask;
     std::function<void(void)>                callback_update_slots;
+    std::function<void(std::vector<server_task> &)> callback_schedule;
+    std::function<void(server_task &)>              callback_expire;
 
     // Add a new task to the end of the queue
     int post(server_task task) {
@@ -412,6 +538,19 @@ struct server_queue {
         queue_tasks_deferred.push_back(std::move(task));
     }
 
+    // number of completion tasks that are waiting for a slot
+    size_t n_waiting_completions() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        size_t n = 0;
+        for (const auto & task : queue_tasks) {
+            n += task.type == SERVER_TASK_TYPE_COMPLETION;
+        }
+        for (const auto & task : queue_tasks_deferred) {
+            n += task.type == SERVER_TASK_TYPE_COMPLETION;
+        }
+        return n;
+    }
+
     // Get the next id for creating anew task
     int get_new_id() {
         std::unique_lock<std::mutex> lock(mutex_tasks);
@@ -435,14 +574,74 @@ struct server_queue {
         callback_update_slots = std::move(callback);
     }
 
+    // Register the function that orders the tasks waiting for a slot
+    void on_schedule(std::function<void(std::vector<server_task> &)> callback) {
+        callback_schedule = std::move(callback);
+    }
+
+    // Register the function that rejects a waiting task whose deadline has passed
+    void on_expire(std::function<void(server_task &)> callback) {
+        callback_expire = std::move(callback);
+    }
+
+    // reject the deferred tasks whose deadline has passed, returns the earliest deadline of the remaining ones or -1
+    int64_t expire_deferred() {
+        const int64_t t_now = ggml_time_us();
+
+        std::vector<server_task> expired;
+        int64_t t_next = -1;
+        {
+            std::unique_lock<std::mutex> lock(mutex_tasks);
+            std::vector<server_task> queue_rest;
+            for (auto & task : queue_tasks_deferred) {
+                if (task.t_deadline >= 0 && task.t_deadline < t_now) {
+                    expired.push_back(std::move(task));
+                    continue;
+                }
+                if (task.t_deadline >= 0 && (t_next < 0 || task.t_deadline < t_next)) {
+                    t_next = task.t_deadline;
+                }
+                queue_rest.push_back(std::move(task));
+            }
+            queue_tasks_deferred = std::move(queue_rest);
+        }
+
+        // the callback sends results, so it is called without holding the lock
+        for (auto & task : expired) {
+            callback_expire(task);
+        }
+
+        return t_next;
+    }
+
     // Call when the state of one slot is changed
     void notify_slot_changed() {
-        // move deferred tasks back to main loop
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : queue_tasks_deferred) {
-            queue_tasks.push_back(std::move(task));
+        // collect the deferred tasks and the completion tasks that have not been processed yet
+        std::vector<server_task> tasks;
+        {
+            std::unique_lock<std::mutex> lock(mutex_tasks);
+            tasks = std::move(queue_tasks_deferred);
+            queue_tasks_deferred.clear();
+
+            std::vector<server_task> queue_rest;
+            for (auto & task : queue_tasks) {
+                if (task.type == SERVER_TASK_TYPE_COMPLETION) {
+                    tasks.push_back(std::move(task));
+                } else {
+                    queue_rest.push_back(std::move(task));
+                }
+            }
+            queue_tasks = std::move(queue_rest);
         }
-        queue_tasks_deferred.clear();
+
+        // the scheduler may send results, so it is called without holding the lock
+        if (callback_schedule) {
+            callback_schedule(tasks);
+        }
+
+        // move them back to the front of the main loop, in the order of the scheduler
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        queue_tasks.insert(queue_tasks.begin(), std::make_move_iterator(tasks.begin()), std::make_move_iterator(tasks.end()));
     }
 
     // end the start_loop routine
@@ -460,8 +659,6 @@ struct server_queue {
      * - Update all slots
      */
     void start_loop() {
-        running = true;
-
         while (true) {
             LOG_VERBOSE("new task may arrive", {});
 
@@ -494,6 +691,9 @@ struct server_queue {
                 }
             }
 
+            // the deadlines of the tasks waiting for a slot are checked on every iteration, not only when a slot is released
+            const int64_t t_next_deadline = callback_expire ? expire_deferred() : -1;
+
             // all tasks in the current loop is processed, slots data is now ready
             LOG_VERBOSE("callback_update_slots", {});
 
@@ -507,9 +707,16 @@ struct server_queue {
                         LOG_VERBOSE("ending start_loop", {});
                         return;
                     }
-                    condition_tasks.wait(lock, [&]{
+                    const auto ready = [&]{
                         return (!queue_tasks.empty() || !running);
-                    });
+                    };
+                    if (t_next_deadline < 0) {
+                        condition_tasks.wait(lock, ready);
+                    } else {
+                        // wake up in time to reject the next deferred task that expires
+                        const int64_t t_wait_us = std::max<int64_t>(t_next_deadline - ggml_time_us(), 0) + 1000;
+                        condition_tasks.wait_for(lock, std::chrono::microseconds(t_wait_us), ready);
+                    }
                 }
             }
         }
@@ -540,25 +747,109 @@ struct server_queue {
     }
 };
 
+// single-producer single-consumer channel with the results of one task
+// the main loop pushes results and the HTTP thread waiting for the task pops them without taking a lock;
+// the consumer sleeps on the condition variable of its own channel, so a result wakes exactly one thread
+struct server_result_channel {
+    struct node {
+        server_task_result  result;
+        std::atomic<node *> next{nullptr};
+    };
+
+    node * head; // consumer side: the last popped node
+    node * tail; // producer side: the last pushed node
+
+    // set while the consumer is blocked (or about to block) in pop
+    std::atomic<bool> waiting{false};
+
+    std::mutex              mutex;
+    std::condition_variable condition;
+
+    // if set, called by the producer after each push instead of waking a blocked consumer (see server_stream_loop)
+    const std::function<void()> notify;
+
+    server_result_channel(std::function<void()> notify = nullptr) : notify(std::move(notify)) {
+        head = tail = new node();
+    }
+
+    ~server_result_channel() {
+        while (head != nullptr) {
+            node * next = head->next.load();
+            delete head;
+            head = next;
+        }
+    }
+
+    // called only by the producer
+    void push(server_task_result && result) {
+        node * n = new node();
+        n->result = std::move(result);
+
+        // seq_cst together with the accesses to waiting in pop: either the producer sees the consumer waiting,
+        // or the consumer sees the new node before it blocks
+        tail->next.store(n);
+        tail = n;
+
+        if (notify) {
+            notify();
+            return;
+        }
+
+        if (waiting.load()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            condition.notify_one();
+        }
+    }
+
+    // called only by the consumer
+    bool try_pop(server_task_result & result) {
+        node * next = head->next.load();
+        if (next == nullptr) {
+            return false;
+        }
+        result = std::move(next->result);
+        delete head;
+        head = next;
+        return true;
+    }
+
+    // called only by the consumer, blocks until a result is available
+    server_task_result pop() {
+        server_task_result result;
+        if (try_pop(result)) {
+            return result;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        waiting.store(true);
+        while (!try_pop(result)) {
+            condition.wait(lock);
+        }
+        waiting.store(false);
+
+        return result;
+    }
+};
+
 struct server_response {
     typedef std::function<void(int, int, server_task_result &)> callback_multitask_t;
     callback_multitask_t callback_update_multitask;
 
-    // for keeping track of all tasks waiting for the result
-    std::set<int> waiting_task_ids;
-
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+    // result channel of each task waiting for results
+    std::unordered_map<int, std::shared_ptr<server_result_channel>> channels;
 
+    // protects channels, it is never held while waiting for a result
     std::mutex mutex_results;
-    std::condition_variable condition_results;
 
     // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
+    // notify, if set, is called for each new result instead of waking a thread blocked in recv
+    void add_waiting_task_id(int id_task, std::function<void()> notify = nullptr) {
         LOG_VERBOSE("waiting for task id", {{"id_task", id_task}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        if (channels.find(id_task) == channels.end()) {
+            channels.emplace(id_task, std::make_shared<server_result_channel>(std::move(notify)));
+        }
     }
 
     // when the request is finished, we can remove task associated with it
@@ -566,28 +857,61 @@ struct server_response {
         LOG_VERBOSE("remove waiting for task id", {{"id_task", id_task}});
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        channels.erase(id_task);
     }
 
     // This function blocks the thread until there is a response for this id_task
     server_task_result recv(int id_task) {
-        while (true) {
+        std::shared_ptr<server_result_channel> channel;
+        {
             std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
+            auto it = channels.find(id_task);
+            GGML_ASSERT(it != channels.end() && "recv called for a task that is not waiting");
+            channel = it->second;
+        }
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (queue_results[i].id == id_task) {
-                    assert(queue_results[i].id_multi == -1);
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        server_task_result res = channel->pop();
+        assert(res.id_multi == -1);
+        return res;
+    }
+
+    // blocks until there is a response for this id_task, then takes all of the available responses
+    // consecutive token deltas are merged, so a stream that falls behind the generation catches up with fewer events
+    void recv_stream(int id_task, std::vector<server_task_result> & results) {
+        std::shared_ptr<server_result_channel> channel = get_channel(id_task);
+        GGML_ASSERT(channel && "recv_stream called for a task that is not waiting");
+
+        results.clear();
+        results.push_back(channel->pop());
+        take_results(*channel, results);
+    }
+
+    // same as recv_stream, without blocking: returns false if there are no responses
+    bool try_recv_stream(int id_task, std::vector<server_task_result> & results) {
+        std::shared_ptr<server_result_channel> channel = get_channel(id_task);
+
+        results.clear();
+        if (channel) {
+            take_results(*channel, results);
         }
+        return !results.empty();
+    }
+
+    std::shared_ptr<server_result_channel> get_channel(int id_task) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        auto it = channels.find(id_task);
+        return it != channels.end() ? it->second : nullptr;
+    }
 
-        // should never reach here
+    static void take_results(server_result_channel & channel, std::vector<server_task_result> & results) {
+        server_task_result res;
+        while (channel.try_pop(res)) {
+            if (res.partial && !results.empty() && results.back().partial) {
+                results.back().content += res.content;
+            } else {
+                results.push_back(std::move(res));
+            }
+        }
     }
 
     // Register the function to update multitask
@@ -596,26 +920,87 @@ struct server_response {
     }
 
     // Send a new result to a waiting id_task
+    // must only be called from the main loop, which is the single producer of all channels
     void send(server_task_result result) {
         LOG_VERBOSE("send new result", {{"id_task", result.id}});
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            // LOG_TEE("waiting task id %i \n", id_task);
+        std::shared_ptr<server_result_channel> channel;
+        bool is_subtask = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
             // for now, tasks that have associated parent multitasks just get erased once multitask picks up the result
-            if (result.id_multi == id_task) {
-                LOG_VERBOSE("callback_update_multitask", {{"id_task", id_task}});
-                callback_update_multitask(id_task, result.id, result);
-                continue;
+            if (result.id_multi != -1 && channels.find(result.id_multi) != channels.end()) {
+                is_subtask = true;
+            } else {
+                auto it = channels.find(result.id);
+                if (it != channels.end()) {
+                    channel = it->second;
+                }
             }
+        }
 
-            if (result.id == id_task) {
-                LOG_VERBOSE("queue_results.push_back", {{"id_task", id_task}});
-                queue_results.push_back(result);
-                condition_results.notify_all();
-                return;
+        if (is_subtask) {
+            LOG_VERBOSE("callback_update_multitask", {{"id_task", result.id_multi}});
+            callback_update_multitask(result.id_multi, result.id, result);
+            return;
+        }
+
+        if (channel) {
+            LOG_VERBOSE("channel push", {{"id_task", result.id}});
+            channel->push(std::move(result));
+        }
+    }
+};
+
+// formats the results of a streamed task as server-sent events
+struct server_stream_format {
+    bool oaicompat = false; // chat.completion.chunk events
+    bool errors    = true;  // send an error as an "error" event, otherwise the stream just ends
+
+    std::string completion_id;
+    std::string model;
+
+    // append the events of the results to writer, returns true at the end of the stream
+    bool format(const std::vector<server_task_result> & results, server_sse_writer & writer) const {
+        for (const auto & result : results) {
+            if (result.error) {
+                if (errors) {
+                    writer.event("error", result.data);
+                }
+                return true;
+            }
+
+            if (!oaicompat) {
+                if (result.partial) {
+                    writer.delta(result.content, result.id_slot);
+                } else {
+                    writer.event("data", result.data);
+                }
+            } else if (result.partial && result.n_decoded != 0) {
+                // empty deltas are not sent
+                if (!result.content.empty()) {
+                    writer.delta_oaicompat(result.content, completion_id, model);
+                }
+            } else {
+                const json data = result.partial ? json {
+                    {"content",             result.content},
+                    {"oaicompat_token_ctr", result.n_decoded},
+                    {"model",               model},
+                } : result.data;
+
+                for (const json & chunk : format_partial_response_oaicompat(data, completion_id)) {
+                    if (!chunk.empty()) {
+                        writer.event("data", chunk);
+                    }
+                }
+            }
+
+            if (result.stop) {
+                return true;
             }
         }
+
+        return false;
     }
 };
 
@@ -623,9 +1008,32 @@ struct server_context {
     llama_model * model = nullptr;
     llama_context * ctx = nullptr;
 
+    // draft model for speculative decoding
+    llama_model * model_dft = nullptr;
+    llama_context * ctx_dft = nullptr;
+
     gpt_params params;
 
     llama_batch batch;
+    llama_batch batch_dft = {};
+
+    std::vector<llama_token_data> cur_dft; // candidates of the draft model
+
+    // lookup decoding
+    bool lookup = false;
+
+    llama_ngram_cache ngram_cache_static;  // loaded from params.lookup_cache_static
+    llama_ngram_cache ngram_cache_dynamic; // n-grams of the previous completions
+
+    // GGUF LoRA adapters, applied at runtime with the scales of the slots in the batch
+    // the scales of the containers are the defaults of the requests that do not select adapters
+    std::vector<llama_lora_adapter_container> lora_adapters;
+    std::vector<float> lora_applied;    // scales currently set in ctx
+    size_t             i_slot_lora = 0; // first slot to choose the adapter scales of the next batch
+
+    // per-token adapters of the batch (llama_batch::lora_id), for the slots that use at most one adapter
+    std::vector<int32_t> batch_lora_id;
+    std::vector<float>   batch_lora_scale;
 
     bool clean_kv_cache = true;
     bool add_bos_token  = true;
@@ -640,6 +1048,14 @@ struct server_context {
 
     // slots / clients
     std::vector<server_slot> slots;
+    size_t  i_slot_prefill = 0;     // first slot to get a share of the prompt budget in the next step
+    bool    kv_preempt     = false; // the slots are overcommitted and are preempted when the KV cache is full
+    int32_t n_ctx_slot     = 0;     // context size of a slot
+
+    // with a pooled embedding model, the embedding inputs are packed into shared batches instead of using slots
+    bool                           embd_packed = false;
+    llama_seq_id                   embd_seq_0  = 0; // first of the SERVER_EMBD_N_SEQ sequences of the packed inputs
+    std::vector<server_embd_input> embd_pending;
     json default_generation_settings_for_props;
 
     server_queue    queue_tasks;
@@ -651,6 +1067,10 @@ struct server_context {
     float slot_prompt_similarity = 0.0f;
 
     ~server_context() {
+        if (lookup && !params.lookup_cache_dynamic.empty()) {
+            llama_ngram_cache_save(ngram_cache_dynamic, params.lookup_cache_dynamic);
+        }
+
         if (ctx) {
             llama_free(ctx);
             ctx = nullptr;
@@ -661,6 +1081,16 @@ struct server_context {
             model = nullptr;
         }
 
+        if (ctx_dft) {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+
+        if (model_dft) {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
+
         // Clear any sampling context
         for (server_slot & slot : slots) {
             if (slot.ctx_sampling != nullptr) {
@@ -669,26 +1099,144 @@ struct server_context {
         }
 
         llama_batch_free(batch);
+        llama_batch_free(batch_dft);
     }
 
     bool load_model(const gpt_params & params_) {
         params = params_;
 
-        // dedicate one sequence to the system prompt
-        params.n_parallel += 1;
+        if (params.model_draft.empty()) {
+            params.n_seq_draft = 1;
+        }
+        if (params.n_seq_draft < 1 || params.n_seq_draft > 32) {
+            LOG_ERROR("the number of draft sequences must be in [1, 32]", {{"n_seq_draft", params.n_seq_draft}});
+            return false;
+        }
+
+        const int32_t n_parallel = params.n_parallel;
+
+        // dedicate one sequence to the system prompt, n_seq_draft - 1 sequences per slot to the draft branches and
+        // SERVER_EMBD_N_SEQ sequences to the packed embedding inputs
+        params.n_parallel = 1 + n_parallel*params.n_seq_draft + (params.embedding ? SERVER_EMBD_N_SEQ : 0);
 
-        std::tie(model, ctx) = llama_init_from_gpt_params(params);
-        params.n_parallel -= 1; // but be sneaky about it
+        std::tie(model, ctx) = llama_init_from_gpt_params(params, &lora_adapters);
         if (model == nullptr) {
+            params.n_parallel = n_parallel;
             LOG_ERROR("unable to load model", {{"model", params.model}});
             return false;
         }
 
+        lora_applied = lora_scales();
+
         n_ctx = llama_n_ctx(ctx);
 
         add_bos_token = llama_should_add_bos_token(model);
         GGML_ASSERT(llama_add_eos_token(model) != 1);
 
+        if (!params.model_draft.empty()) {
+            gpt_params params_dft = params;
+
+            params_dft.model        = params.model_draft;
+            params_dft.n_ctx        = n_ctx;
+            params_dft.n_gpu_layers = params.n_gpu_layers_draft;
+            if (params.n_threads_draft > 0) {
+                params_dft.n_threads = params.n_threads_draft;
+            }
+            params_dft.n_threads_batch = params.n_threads_batch_draft;
+            params_dft.lora_adapter.clear();
+            params_dft.control_vectors.clear();
+
+            std::tie(model_dft, ctx_dft) = llama_init_from_gpt_params(params_dft);
+            if (model_dft == nullptr) {
+                params.n_parallel = n_parallel;
+                LOG_ERROR("unable to load draft model", {{"model", params.model_draft}});
+                return false;
+            }
+
+            if (!validate_draft_model()) {
+                params.n_parallel = n_parallel;
+                return false;
+            }
+
+            LOG_INFO("speculative decoding enabled", {
+                {"model_draft", params.model_draft},
+                {"n_draft",     params.n_draft},
+                {"n_seq_draft", params.n_seq_draft},
+                {"p_split",     params.p_split},
+            });
+        }
+
+        params.n_parallel = n_parallel; // but be sneaky about it
+
+        if (params.lookup_decoding && ctx_dft) {
+            LOG_WARNING("lookup decoding is not used together with a draft model", {});
+        } else if (params.lookup_decoding) {
+            if (!params.lookup_cache_static.empty()) {
+                try {
+                    ngram_cache_static = llama_ngram_cache_load(params.lookup_cache_static);
+                } catch (std::ifstream::failure const &) {
+                    LOG_ERROR("failed to open static lookup cache", {{"path", params.lookup_cache_static}});
+                    return false;
+                }
+            }
+
+            if (!params.lookup_cache_dynamic.empty()) {
+                try {
+                    ngram_cache_dynamic = llama_ngram_cache_load(params.lookup_cache_dynamic);
+                } catch (std::ifstream::failure const &) {} // if the file does not exist it will simply be created on exit
+            }
+
+            lookup = true;
+
+            LOG_INFO("lookup decoding enabled", {
+                {"n_draft",              params.n_draft},
+                {"n_ngrams_static",      ngram_cache_static.size()},
+                {"n_ngrams_dynamic",     ngram_cache_dynamic.size()},
+            });
+        }
+
+        return true;
+    }
+
+    bool validate_draft_model() const {
+        if (llama_vocab_type(model) != llama_vocab_type(model_dft)) {
+            LOG_ERROR("draft model vocab type must match the target model", {
+                {"vocab_type",     llama_vocab_type(model)},
+                {"vocab_type_dft", llama_vocab_type(model_dft)},
+            });
+            return false;
+        }
+
+        if (llama_add_bos_token(model) != llama_add_bos_token(model_dft) ||
+            llama_add_eos_token(model) != llama_add_eos_token(model_dft) ||
+            llama_token_bos(model)     != llama_token_bos(model_dft)     ||
+            llama_token_eos(model)     != llama_token_eos(model_dft)) {
+            LOG_ERROR("draft model special tokens must match the target model", {});
+            return false;
+        }
+
+        const int n_vocab     = llama_n_vocab(model);
+        const int n_vocab_dft = llama_n_vocab(model_dft);
+
+        if (std::abs(n_vocab - n_vocab_dft) > SPEC_VOCAB_MAX_SIZE_DIFFERENCE) {
+            LOG_ERROR("draft model vocab must closely match the target model", {
+                {"n_vocab",     n_vocab},
+                {"n_vocab_dft", n_vocab_dft},
+            });
+            return false;
+        }
+
+        for (int i = SPEC_VOCAB_CHECK_START_TOKEN_ID; i < std::min(n_vocab, n_vocab_dft); ++i) {
+            if (std::strcmp(llama_token_get_text(model, i), llama_token_get_text(model_dft, i)) != 0) {
+                LOG_ERROR("draft model vocab must match the target model", {
+                    {"token",      i},
+                    {"text",       llama_token_get_text(model, i)},
+                    {"text_draft", llama_token_get_text(model_dft, i)},
+                });
+                return false;
+            }
+        }
+
         return true;
     }
 
@@ -700,46 +1248,87 @@ struct server_context {
         return res > 0;
     }
 
-    void init() {
-        const int32_t n_ctx_slot = n_ctx / params.n_parallel;
+    // add a slot - all of them are added at start, unless they are added on demand to share a KV cache pool
+    server_slot * add_slot() {
+        server_slot slot;
 
-        LOG_INFO("initializing slots", {{"n_slots", params.n_parallel}});
+        slot.id = slots.size();
+        slot.n_ctx = n_ctx_slot;
+        slot.n_predict = params.n_predict;
+        slot.lora = lora_scales();
 
-        for (int i = 0; i < params.n_parallel; i++) {
-            server_slot slot;
+        LOG_INFO("new slot", {
+            {"id_slot",    slot.id},
+            {"n_ctx_slot", slot.n_ctx}
+        });
 
-            slot.id = i;
-            slot.n_ctx = n_ctx_slot;
-            slot.n_predict = params.n_predict;
+        const int ga_n = params.grp_attn_n;
+        const int ga_w = params.grp_attn_w;
 
-            LOG_INFO("new slot", {
-                {"id_slot",    slot.id},
-                {"n_ctx_slot", slot.n_ctx}
+        if (ga_n != 1) {
+            GGML_ASSERT(ga_n > 0                    && "ga_n must be positive");                       // NOLINT
+            GGML_ASSERT(ga_w % ga_n == 0            && "ga_w must be a multiple of ga_n");             // NOLINT
+            //GGML_ASSERT(n_ctx_train % ga_w == 0     && "n_ctx_train must be a multiple of ga_w");    // NOLINT
+            //GGML_ASSERT(n_ctx >= n_ctx_train * ga_n && "n_ctx must be at least n_ctx_train * ga_n"); // NOLINT
+
+            LOG_INFO("slot self-extend", {
+                {"id_slot", slot.id},
+                {"ga_n",    ga_n},
+                {"ga_w",    ga_w}
             });
+        }
 
-            const int ga_n = params.grp_attn_n;
-            const int ga_w = params.grp_attn_w;
+        slot.ga_i = 0;
+        slot.ga_n = ga_n;
+        slot.ga_w = ga_w;
 
-            if (ga_n != 1) {
-                GGML_ASSERT(ga_n > 0                    && "ga_n must be positive");                       // NOLINT
-                GGML_ASSERT(ga_w % ga_n == 0            && "ga_w must be a multiple of ga_n");             // NOLINT
-                //GGML_ASSERT(n_ctx_train % ga_w == 0     && "n_ctx_train must be a multiple of ga_w");    // NOLINT
-                //GGML_ASSERT(n_ctx >= n_ctx_train * ga_n && "n_ctx must be at least n_ctx_train * ga_n"); // NOLINT
+        slot.reset();
 
-                LOG_INFO("slot self-extend", {
-                    {"id_slot", slot.id},
-                    {"ga_n",    ga_n},
-                    {"ga_w",    ga_w}
-                });
+        slots.push_back(slot);
+
+        return &slots.back();
+    }
+
+    // with a KV cache pool, slots are added on demand while no slot waits for room in the cache
+    bool can_add_slot() const {
+        if (!params.kv_pool || (int32_t) slots.size() >= params.n_parallel) {
+            return false;
+        }
+
+        for (const server_slot & slot : slots) {
+            if (slot.state == SLOT_STATE_PREEMPTED) {
+                return false;
             }
+        }
+
+        return true;
+    }
+
+    void init() {
+        // with overcommit, the slots together may need more KV cells than there are - they are preempted when the cache is full
+        // with a KV cache pool, a single slot can use the whole cache
+        n_ctx_slot = params.kv_pool ? n_ctx : std::min(n_ctx, (int32_t) (n_ctx * params.kv_overcommit / params.n_parallel));
+
+        kv_preempt = params.kv_pool || params.kv_overcommit > 1.0f;
+
+        embd_packed = params.embedding && llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE;
+        embd_seq_0  = 1 + params.n_parallel*params.n_seq_draft;
 
-            slot.ga_i = 0;
-            slot.ga_n = ga_n;
-            slot.ga_w = ga_w;
+        // the pooled embeddings are only computed for the packed inputs, the slots generate tokens from the logits
+        if (embd_packed) {
+            llama_set_embeddings(ctx, false);
+        }
+
+        LOG_INFO("initializing slots", {
+            {"n_slots", params.n_parallel},
+            {"kv_pool", params.kv_pool},
+        });
 
-            slot.reset();
+        // add_slot() must not move the slots
+        slots.reserve(params.n_parallel);
 
-            slots.push_back(slot);
+        for (int i = 0; i < (params.kv_pool ? 1 : params.n_parallel); i++) {
+            add_slot();
         }
 
         default_generation_settings_for_props = get_formated_generation(slots.front());
@@ -750,8 +1339,17 @@ struct server_context {
         {
             const int32_t n_batch = llama_n_batch(ctx);
 
-            // only a single seq_id per token is needed
-            batch = llama_batch_init(n_batch, 0, 1);
+            // a single seq_id per token is needed, except for the tokens shared by the branches of a draft
+            batch = llama_batch_init(n_batch, 0, params.n_seq_draft);
+
+            if (!lora_adapters.empty()) {
+                batch_lora_id.resize(n_batch);
+                batch_lora_scale.resize(n_batch);
+            }
+
+            if (ctx_dft) {
+                batch_dft = llama_batch_init(std::max(llama_n_batch(ctx_dft), (uint32_t) params.n_seq_draft), 0, 1);
+            }
         }
 
         metrics.init();
@@ -879,16 +1477,162 @@ struct server_context {
             }
         }
 
+        if (ret == nullptr && can_add_slot()) {
+            ret = add_slot();
+        }
+
         return ret;
     }
 
-    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
-        slot_params default_params;
-        llama_sampling_params default_sparams;
-        auto & data = task.data;
+    // estimated number of prompt tokens that a completion task has to process, without the part of the prompt
+    // that is cached in one of the available slots
+    int32_t estimate_task_cost(const server_task & task) const {
+        if (!task.data.contains("prompt")) {
+            return 0;
+        }
+        const json & prompt = task.data.at("prompt");
 
-        if (data.count("__oaicompat") != 0) {
-            slot.oaicompat = true;
+        if (prompt.is_string()) {
+            const std::string & str = prompt.get_ref<const std::string &>();
+
+            size_t n_cached = 0;
+            if (json_value(task.data, "cache_prompt", false)) {
+                for (const server_slot & slot : slots) {
+                    if (slot.available() && slot.prompt.is_string()) {
+                        n_cached = std::max(n_cached, common_part(slot.prompt.get_ref<const std::string &>(), str));
+                    }
+                }
+            }
+
+            // roughly 4 characters per token
+            return (str.size() - n_cached) / 4 + 1;
+        }
+
+        return prompt.is_array() ? prompt.size() : 1;
+    }
+
+    // reject a completion task whose deadline has passed before it could start
+    void expire_task(const server_task & task) {
+        LOG_INFO("request deadline exceeded before start", {
+            {"id_task",   task.id},
+            {"t_wait_ms", (ggml_time_us() - task.t_enqueue) / 1000},
+        });
+
+        metrics.n_requests_expired++;
+        send_error(task, "Deadline exceeded before the request could be started", ERROR_TYPE_UNAVAILABLE);
+    }
+
+    // order the tasks that wait for a slot - the ones at the front are started first:
+    //  - other tasks keep their order and go before the completions
+    //  - higher priority first
+    //  - then the tasks of the fairness key with the fewest active slots, counting the tasks ordered before
+    //  - then the earliest deadline
+    //  - then the lowest estimated cost, minus SERVER_SCHED_AGING_TOKENS_PER_S for each second of waiting
+    //  - then the order of arrival
+    // completion tasks whose deadline has passed are rejected
+    // only the tasks that can start now are ordered, the others keep their order until the next slot is released
+    void schedule_tasks(std::vector<server_task> & tasks) {
+        const int64_t t_now = ggml_time_us();
+
+        std::vector<server_task> result;
+        std::vector<server_task> pending;
+
+        for (auto & task : tasks) {
+            if (task.type != SERVER_TASK_TYPE_COMPLETION) {
+                result.push_back(std::move(task));
+                continue;
+            }
+
+            if (task.t_deadline >= 0 && task.t_deadline < t_now) {
+                expire_task(task);
+                continue;
+            }
+
+            pending.push_back(std::move(task));
+        }
+
+        std::stable_sort(pending.begin(), pending.end(), [](const server_task & a, const server_task & b) {
+            return a.id < b.id;
+        });
+
+        std::map<std::string, int32_t> n_active;
+        int32_t n_available = can_add_slot() ? params.n_parallel - (int32_t) slots.size() : 0;
+        for (const server_slot & slot : slots) {
+            if (slot.available()) {
+                n_available++;
+            } else {
+                n_active[slot.key]++;
+            }
+        }
+
+        std::vector<int64_t> score(pending.size());
+        for (size_t i = 0; i < pending.size(); ++i) {
+            score[i] = estimate_task_cost(pending[i]) - SERVER_SCHED_AGING_TOKENS_PER_S*(t_now - pending[i].t_enqueue)/1000000;
+        }
+
+        const auto before = [&](size_t a, size_t b) {
+            const server_task & ta = pending[a];
+            const server_task & tb = pending[b];
+
+            if (ta.priority != tb.priority) {
+                return ta.priority > tb.priority;
+            }
+
+            const int32_t n_active_a = n_active[ta.key];
+            const int32_t n_active_b = n_active[tb.key];
+            if (n_active_a != n_active_b) {
+                return n_active_a < n_active_b;
+            }
+
+            const int64_t t_deadline_a = ta.t_deadline < 0 ? INT64_MAX : ta.t_deadline;
+            const int64_t t_deadline_b = tb.t_deadline < 0 ? INT64_MAX : tb.t_deadline;
+            if (t_deadline_a != t_deadline_b) {
+                return t_deadline_a < t_deadline_b;
+            }
+
+            if (score[a] != score[b]) {
+                return score[a] < score[b];
+            }
+
+            return ta.id < tb.id;
+        };
+
+        std::vector<bool> scheduled(pending.size(), false);
+        for (int32_t k = 0; k < n_available && k < (int32_t) pending.size(); ++k) {
+            size_t i_best = pending.size();
+            for (size_t i = 0; i < pending.size(); ++i) {
+                if (!scheduled[i] && (i_best == pending.size() || before(i, i_best))) {
+                    i_best = i;
+                }
+            }
+
+            LOG_VERBOSE("scheduled task", {
+                {"id_task",  pending[i_best].id},
+                {"priority", pending[i_best].priority},
+                {"score",    score[i_best]},
+            });
+
+            scheduled[i_best] = true;
+            n_active[pending[i_best].key]++;
+            result.push_back(std::move(pending[i_best]));
+        }
+
+        for (size_t i = 0; i < pending.size(); ++i) {
+            if (!scheduled[i]) {
+                result.push_back(std::move(pending[i]));
+            }
+        }
+
+        tasks = std::move(result);
+    }
+
+    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
+        slot_params default_params;
+        llama_sampling_params default_sparams;
+        auto & data = task.data;
+
+        if (data.count("__oaicompat") != 0) {
+            slot.oaicompat = true;
             slot.oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
         } else {
             slot.oaicompat = false;
@@ -936,6 +1680,25 @@ struct server_context {
             slot.sparams.grammar       = json_value(data, "grammar",           default_sparams.grammar);
         }
 
+        // LoRA adapters of the task, the default scales unless the request lists its own
+        {
+            std::vector<float> lora = lora_scales();
+            if (data.contains("lora")) {
+                try {
+                    lora = parse_lora(data.at("lora"));
+                } catch (const std::exception & e) {
+                    send_error(task, std::string("\"lora\": ") + e.what(), ERROR_TYPE_INVALID_REQUEST);
+                    return false;
+                }
+            }
+
+            if (lora != slot.lora) {
+                // the cached tokens of the slot were evaluated with other adapters
+                slot.cache_tokens.clear();
+                slot.lora = std::move(lora);
+            }
+        }
+
         if (slot.params.cache_prompt && slot.ga_n != 1) {
             LOG_WARNING("cache_prompt is not supported with group-attention", {});
             slot.params.cache_prompt = false;
@@ -1106,12 +1869,86 @@ struct server_context {
         return true;
     }
 
+    std::vector<float> lora_scales() const {
+        std::vector<float> lora(lora_adapters.size());
+        for (size_t i = 0; i < lora_adapters.size(); ++i) {
+            lora[i] = lora_adapters[i].scale;
+        }
+        return lora;
+    }
+
+    // [{"id": 0, "scale": 0.5}, ...] - the adapters that are not listed are disabled
+    std::vector<float> parse_lora(const json & data) const {
+        if (!data.is_array()) {
+            throw std::runtime_error("expected an array of adapters");
+        }
+
+        std::vector<float> lora(lora_adapters.size(), 0.0f);
+        for (const auto & entry : data) {
+            const int id = json_value(entry, "id", -1);
+            if (id < 0 || id >= (int) lora.size()) {
+                throw std::runtime_error("invalid adapter id " + std::to_string(id));
+            }
+            lora[id] = json_value(entry, "scale", 0.0f);
+        }
+
+        return lora;
+    }
+
+    json lora_to_json(const std::vector<float> & lora) const {
+        json result = json::array();
+        for (size_t i = 0; i < lora.size(); ++i) {
+            result.push_back({
+                {"id",    i},
+                {"path",  lora_adapters[i].path},
+                {"scale", lora[i]},
+            });
+        }
+        return result;
+    }
+
+    // the adapter of a slot that uses at most one adapter (-1 for none), or -2 if it combines several adapters
+    static int32_t lora_single(const std::vector<float> & lora) {
+        int32_t id = -1;
+        for (size_t i = 0; i < lora.size(); ++i) {
+            if (lora[i] != 0.0f) {
+                if (id != -1) {
+                    return -2;
+                }
+                id = (int32_t) i;
+            }
+        }
+        return id;
+    }
+
+    // set the adapter scales of the next decode - adapters with a zero scale are left out of the graph
+    // the adapters are never removed from ctx, so that their position is the id used by llama_batch::lora_id
+    void lora_apply(const std::vector<float> & lora) {
+        if (lora == lora_applied) {
+            return;
+        }
+
+        for (size_t i = 0; i < lora_adapters.size(); ++i) {
+            llama_lora_adapter_set(ctx, lora_adapters[i].adapter, lora[i]);
+        }
+
+        lora_applied = lora;
+    }
+
     void kv_cache_clear() {
         LOG_VERBOSE("clearing KV cache", {});
 
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        if (ctx_dft) {
+            llama_kv_cache_clear(ctx_dft);
+
+            for (server_slot & slot : slots) {
+                slot.cache_tokens_dft.clear();
+            }
+        }
     }
 
     void system_prompt_update() {
@@ -1133,6 +1970,9 @@ struct server_context {
 
             const int32_t n_batch = llama_n_batch(ctx);
 
+            // the system prompt is shared by all slots and is evaluated with the default adapters
+            lora_apply(lora_scales());
+
             for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
                 const int32_t n_tokens = std::min(params.n_batch, batch.n_tokens - i);
                 llama_batch batch_view = {
@@ -1144,17 +1984,27 @@ struct server_context {
                     batch.seq_id   + i,
                     batch.logits   + i,
                     0, 0, 0, // unused
+                    nullptr, nullptr, // the adapter scales of the context
                 };
 
                 if (llama_decode(ctx, batch_view) != 0) {
                     LOG_ERROR("llama_decode() failed", {});
                     return;
                 }
+
+                if (ctx_dft && llama_decode(ctx_dft, batch_view) != 0) {
+                    LOG_ERROR("llama_decode() failed for the draft model", {});
+                    return;
+                }
             }
 
             // assign the system KV cache to all parallel sequences
             for (int32_t i = 1; i <= params.n_parallel; ++i) {
                 llama_kv_cache_seq_cp(ctx, 0, i, -1, -1);
+
+                if (ctx_dft) {
+                    llama_kv_cache_seq_cp(ctx_dft, 0, i, -1, -1);
+                }
             }
         }
 
@@ -1350,7 +2200,8 @@ struct server_context {
             {"n_probs",                   slot.sparams.n_probs},
             {"min_keep",                  slot.sparams.min_keep},
             {"grammar",                   slot.sparams.grammar},
-            {"samplers",                  samplers_sequence}
+            {"samplers",                  samplers_sequence},
+            {"lora",                      lora_to_json(slot.lora)},
         };
     }
 
@@ -1385,6 +2236,17 @@ struct server_context {
         res.id_multi = slot.id_multi;
         res.error    = false;
         res.stop     = false;
+
+        if (slot.sparams.n_probs == 0) {
+            res.partial   = true;
+            res.content   = std::move(tkn.text_to_send);
+            res.id_slot   = slot.id;
+            res.n_decoded = slot.n_decoded;
+
+            queue_results.send(std::move(res));
+            return;
+        }
+
         res.data     = json {
             {"content",    tkn.text_to_send},
             {"stop",       false},
@@ -1510,7 +2372,160 @@ struct server_context {
         queue_results.send(res);
     }
 
-    void request_completion(int id_task, int id_multi, json data, bool infill, bool embedding) {
+    void send_embedding(const server_embd_input & input, llama_seq_id seq_id) {
+        server_task_result res;
+        res.id       = input.id;
+        res.id_multi = input.id_multi;
+        res.error    = false;
+        res.stop     = true;
+
+        const float * embd = llama_get_embeddings_seq(ctx, seq_id);
+        if (embd == NULL) {
+            LOG_ERROR("failed to get embeddings", {
+                {"id_task", input.id},
+                {"seq_id",  seq_id}
+            });
+        }
+
+        if (input.rerank) {
+            res.data = json {
+                {"score",            embd == NULL ? -1e6f : embd[0]},
+                {"tokens_evaluated", input.tokens.size()},
+            };
+        } else {
+            const int n_embd = llama_n_embd(model);
+
+            std::vector<float> embd_res(n_embd, 0.0f);
+            if (embd != NULL) {
+                llama_embd_normalize(embd, embd_res.data(), n_embd);
+            }
+
+            res.data = json {
+                {"embedding", embd_res},
+            };
+        }
+
+        queue_results.send(res);
+    }
+
+    // queue the input of an embedding task for update_embeddings()
+    void add_embedding(const server_task & task) {
+        server_embd_input input;
+        input.id       = task.id;
+        input.id_multi = task.id_multi;
+        input.tokens   = tokenize(task.data.at("prompt"), system_prompt.empty());
+        input.rerank   = json_value(task.data, "rerank", false);
+
+        if (input.tokens.empty()) {
+            send_error(task, "input is empty", ERROR_TYPE_INVALID_REQUEST);
+            return;
+        }
+
+        if ((int32_t) input.tokens.size() > (int32_t) llama_n_ubatch(ctx)) {
+            send_error(task, "input is too large to process. increase the physical batch size", ERROR_TYPE_SERVER);
+            return;
+        }
+
+        embd_pending.push_back(std::move(input));
+    }
+
+    // decode as many pending embedding inputs as fit in one ubatch and in the free KV cells, each with its own sequence,
+    // and send their pooled embeddings - the pooled outputs of a sequence are only available if all of its tokens are in
+    // the same ubatch
+    // the inputs use their own sequences, so this is done between the batches of the slots without touching their caches
+    void update_embeddings() {
+        bool all_available = true;
+        for (const auto & slot : slots) {
+            all_available = all_available && slot.available();
+        }
+
+        // the prompt caches of idle slots give way to the inputs, the KV cache of the busy slots is kept
+        const int32_t n_need = embd_pending.front().tokens.size();
+        server_slot * victim = nullptr;
+        while (n_kv_free() < n_need && (victim = get_kv_victim(true)) != nullptr) {
+            preempt_slot(*victim);
+        }
+
+        const int32_t n_max = std::min({ (int32_t) llama_n_batch(ctx), (int32_t) llama_n_ubatch(ctx), n_kv_free() });
+
+        std::vector<server_embd_input> inputs;
+        std::vector<server_embd_input> rest;
+
+        int32_t n_tokens = 0;
+        for (auto & input : embd_pending) {
+            if ((int32_t) inputs.size() < SERVER_EMBD_N_SEQ && n_tokens + (int32_t) input.tokens.size() <= n_max) {
+                n_tokens += input.tokens.size();
+                inputs.push_back(std::move(input));
+            } else {
+                rest.push_back(std::move(input));
+            }
+        }
+        embd_pending = std::move(rest);
+
+        if (inputs.empty()) {
+            if (all_available) {
+                send_error(embd_pending.front().id, embd_pending.front().id_multi, "input is too large for the KV cache", ERROR_TYPE_SERVER);
+                embd_pending.erase(embd_pending.begin());
+            }
+            // otherwise wait for the slots to free some of the KV cache
+            return;
+        }
+
+        const llama_seq_id n_seqs = inputs.size();
+
+        llama_batch_clear(batch);
+
+        // the pooling uses the outputs of all tokens
+        for (llama_seq_id s = 0; s < n_seqs; ++s) {
+            const auto & tokens = inputs[s].tokens;
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                llama_batch_add(batch, tokens[i], i, { embd_seq_0 + s }, true);
+            }
+        }
+
+        // the packed inputs are evaluated with the default adapters
+        lora_apply(lora_scales());
+
+        LOG_VERBOSE("decoding embeddings", {
+            {"n_inputs",  n_seqs},
+            {"n_tokens",  batch.n_tokens},
+            {"n_pending", embd_pending.size()},
+        });
+
+        llama_set_embeddings(ctx, true);
+
+        int ret = llama_decode(ctx, batch);
+        if (ret == 1) {
+            // no contiguous range of free KV cells
+            kv_defrag();
+            ret = llama_decode(ctx, batch);
+        }
+
+        llama_set_embeddings(ctx, false);
+
+        for (llama_seq_id s = 0; s < n_seqs; ++s) {
+            llama_kv_cache_seq_rm(ctx, embd_seq_0 + s, -1, -1);
+        }
+
+        if (ret == 1 && !all_available) {
+            // try again after the next batch of the slots
+            embd_pending.insert(embd_pending.begin(), std::make_move_iterator(inputs.begin()), std::make_move_iterator(inputs.end()));
+            return;
+        }
+
+        for (llama_seq_id s = 0; s < n_seqs; ++s) {
+            if (ret != 0) {
+                send_error(inputs[s].id, inputs[s].id_multi, "failed to decode the embedding inputs", ERROR_TYPE_SERVER);
+            } else {
+                send_embedding(inputs[s], embd_seq_0 + s);
+            }
+        }
+
+        metrics.n_prompt_tokens_processed_total += batch.n_tokens;
+        metrics.n_prompt_tokens_processed       += batch.n_tokens;
+    }
+
+    void request_completion(int id_task, int id_multi, json data, bool infill, bool embedding, const std::string & key = "") {
         server_task task;
         task.id        = id_task;
         task.id_multi  = id_multi;
@@ -1519,6 +2534,22 @@ struct server_context {
         task.infill    = infill;
         task.embedding = embedding;
         task.type      = SERVER_TASK_TYPE_COMPLETION;
+        task.key       = key;
+        task.t_enqueue = ggml_time_us();
+
+        // request class: an integer, or one of the named classes
+        const json priority = task.data.contains("priority") ? task.data.at("priority") : json(0);
+        if (priority.is_string()) {
+            const std::string name = priority.get<std::string>();
+            task.priority = name == "interactive" ? 1 : name == "batch" ? -1 : 0;
+        } else if (priority.is_number_integer()) {
+            task.priority = priority.get<int32_t>();
+        }
+
+        const int64_t deadline_ms = json_value(task.data, "deadline_ms", (int64_t) -1);
+        if (deadline_ms >= 0) {
+            task.t_deadline = ggml_time_us() + 1000*deadline_ms;
+        }
 
         // when a completion task's prompt array is not a singleton, we split it into multiple requests
         // otherwise, it's a single-prompt task, we actually queue it
@@ -1577,7 +2608,7 @@ struct server_context {
             subtask_data["prompt"] = subtask_data.at("prompt")[i];
 
             // subtasks inherit everything else (infill mode, embedding mode, etc.)
-            request_completion(subtask_ids[i], id_multi, subtask_data, multiprompt_task.infill, multiprompt_task.embedding);
+            request_completion(subtask_ids[i], id_multi, subtask_data, multiprompt_task.infill, multiprompt_task.embedding, multiprompt_task.key);
         }
     }
 
@@ -1585,12 +2616,23 @@ struct server_context {
         switch (task.type) {
             case SERVER_TASK_TYPE_COMPLETION:
                 {
+                    if (task.embedding && embd_packed) {
+                        add_embedding(task);
+                        break;
+                    }
+
                     const int id_slot = json_value(task.data, "id_slot", -1);
 
                     server_slot * slot;
 
                     if (id_slot != -1) {
                         slot = get_slot_by_id(id_slot);
+
+                        // the slots of a KV cache pool are added in order
+                        while (slot == nullptr && id_slot < params.n_parallel && can_add_slot()) {
+                            slot = add_slot();
+                            slot = slot->id == id_slot ? slot : nullptr;
+                        }
                     } else {
                         std::string prompt;
                         if (task.data.contains("prompt") && task.data.at("prompt").is_string()) {
@@ -1627,6 +2669,8 @@ struct server_context {
 
                     slot->id_task   = task.id;
                     slot->id_multi  = task.id_multi;
+                    slot->key       = task.key;
+                    slot->priority  = task.priority;
                     slot->infill    = task.infill;
                     slot->embedding = task.embedding;
 
@@ -1680,6 +2724,12 @@ struct server_context {
 
                         slots_data.push_back(slot_data);
                     }
+
+                    // the slots that can still be added to a KV cache pool are idle
+                    if (can_add_slot()) {
+                        n_idle_slots += params.n_parallel - (int) slots.size();
+                    }
+
                     LOG_INFO("slot data", {
                         {"id_task",            task.id},
                         {"n_idle_slots",       n_idle_slots},
@@ -1702,6 +2752,9 @@ struct server_context {
                         { "idle",                            n_idle_slots       },
                         { "processing",                      n_processing_slots },
                         { "deferred",                        queue_tasks.queue_tasks_deferred.size() },
+                        { "n_requests_expired",              metrics.n_requests_expired },
+                        { "n_requests_rejected",             metrics.n_requests_rejected.load() },
+                        { "n_preemptions",                   metrics.n_preemptions },
                         { "t_start",                         metrics.t_start},
 
                         { "n_prompt_tokens_processed_total", metrics.n_prompt_tokens_processed_total},
@@ -1844,6 +2897,23 @@ struct server_context {
                     };
                     queue_results.send(result);
                 } break;
+            case SERVER_TASK_TYPE_LORA_ADAPTERS:
+                {
+                    // the new defaults apply to the requests that are launched from now on
+                    if (task.data.contains("lora")) {
+                        const std::vector<float> lora = parse_lora(task.data.at("lora"));
+                        for (size_t i = 0; i < lora_adapters.size(); ++i) {
+                            lora_adapters[i].scale = lora[i];
+                        }
+                    }
+
+                    server_task_result result;
+                    result.id = task.id;
+                    result.stop = true;
+                    result.error = false;
+                    result.data = lora_to_json(lora_scales());
+                    queue_results.send(result);
+                } break;
         }
     }
 
@@ -1854,9 +2924,15 @@ struct server_context {
         result.stop  = true;
         result.error = false;
 
+        // the subtasks can finish in any order, their ids follow the order of the prompts
+        std::vector<server_task_result> results = multitask.results;
+        std::sort(results.begin(), results.end(), [](const server_task_result & a, const server_task_result & b) {
+            return a.id < b.id;
+        });
+
         // collect json results into one json result
         std::vector<json> result_jsons;
-        for (const auto & subres : multitask.results) {
+        for (const auto & subres : results) {
             result_jsons.push_back(subres.data);
             result.error = result.error && subres.error;
         }
@@ -1867,69 +2943,689 @@ struct server_context {
         queue_results.send(result);
     }
 
-    void update_slots() {
-        if (system_need_update) {
-            system_prompt_update();
-        }
-
-        // release slots
-        for (auto & slot : slots) {
-            if (slot.command == SLOT_COMMAND_RELEASE) {
-                slot.state       = SLOT_STATE_IDLE;
-                slot.command     = SLOT_COMMAND_NONE;
-                slot.t_last_used = ggml_time_us();
+    // accept a token sampled for the slot and send it to the client
+    // returns false if the slot has stopped generating
+    bool process_sampled_token(server_slot & slot, llama_token id) {
+        completion_token_output result;
 
-                LOG_INFO("slot released", {
-                    {"id_slot",         slot.id},
-                    {"id_task",         slot.id_task},
-                    {"n_ctx",           n_ctx},
-                    {"n_past",          slot.n_past},
-                    {"n_system_tokens", system_tokens.size()},
-                    {"n_cache_tokens",  slot.cache_tokens.size()},
-                    {"truncated",       slot.truncated}
-                });
+        llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
 
-                queue_tasks.notify_slot_changed();
-            }
+        slot.n_decoded += 1;
+        if (slot.n_decoded == 1) {
+            slot.t_start_generation = ggml_time_us();
+            slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+            metrics.on_prompt_eval(slot);
         }
 
-        // check if all slots are idle
-        {
-            bool all_idle = true;
+        llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+        result.tok = id;
 
-            for (auto & slot : slots) {
-                if (slot.state != SLOT_STATE_IDLE || slot.command != SLOT_COMMAND_NONE) {
-                    all_idle = false;
-                    break;
-                }
+        const size_t n_probs = std::min(cur_p.size, (size_t) slot.sparams.n_probs);
+        if (n_probs > 0) {
+            const size_t n_valid = slot.ctx_sampling->n_valid;
+
+            // Make sure at least n_probs top tokens are at the front of the vector:
+            if (slot.sparams.temp == 0.0f && n_probs > n_valid) {
+                llama_sample_top_k(ctx, &cur_p, n_probs, 0);
             }
 
-            if (all_idle) {
-                LOG_INFO("all slots are idle", {});
-                if (system_prompt.empty() && clean_kv_cache) {
-                    kv_cache_clear();
+            if (slot.sparams.temp == 0.0f) {
+                // With greedy sampling the probabilities have possibly not been calculated.
+                for (size_t i = 0; i < n_probs; ++i) {
+                    result.probs.push_back({
+                        cur_p.data[i].id,
+                        i == 0 ? 1.0f : 0.0f
+                    });
+                }
+            } else {
+                for (size_t i = 0; i < n_probs; ++i) {
+                    result.probs.push_back({
+                        cur_p.data[i].id,
+                        i >= n_valid ? 0.0f : cur_p.data[i].p // Tokens filtered out due to e.g. top_k have 0 probability.
+                    });
                 }
-
-                return;
             }
         }
 
-        {
-            LOG_VERBOSE("posting NEXT_RESPONSE", {});
+        if (!process_token(result, slot)) {
+            slot.release();
+            slot.print_timings();
+            send_final_response(slot);
+            metrics.on_prediction(slot);
+        }
 
-            server_task task;
-            task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
-            task.id_target = -1;
+        return slot.has_next_token;
+    }
 
-            queue_tasks.post(task);
+    // the sequence of a branch of the draft of the slot - the first branch uses the sequence of the slot itself
+    llama_seq_id draft_seq_id(const server_slot & slot, int32_t i_seq) const {
+        if (i_seq == 0) {
+            return slot.id + 1;
         }
 
-        // apply context-shift if needed
-        // TODO: simplify and improve
-        for (server_slot & slot : slots) {
-            if (slot.ga_n == 1) {
-                if (slot.is_processing() && (int) system_tokens.size() + slot.n_past >= slot.n_ctx - 1) {
-                    // Shift context
+        return 1 + params.n_parallel + slot.id*(params.n_seq_draft - 1) + i_seq - 1;
+    }
+
+    // the slot of a sequence of the batch, inverse of draft_seq_id
+    int32_t draft_seq_slot(llama_seq_id seq_id) const {
+        if (seq_id <= params.n_parallel) {
+            return seq_id - 1;
+        }
+
+        return (seq_id - 1 - params.n_parallel) / (params.n_seq_draft - 1);
+    }
+
+    // evaluate the tokens of the slot that are not yet in the KV cache of the draft model
+    // returns the index of the output of the last token in batch_dft, or -1 on failure
+    int32_t draft_sync(server_slot & slot) {
+        const auto & tokens = slot.cache_tokens;
+
+        const llama_seq_id seq_id   = slot.id + 1;
+        const int32_t      n_system = system_tokens.size();
+
+        size_t n_common = common_part(slot.cache_tokens_dft, tokens);
+        if (n_common == tokens.size()) {
+            // the logits of the last token are needed
+            n_common--;
+        }
+
+        llama_kv_cache_seq_rm(ctx_dft, seq_id, n_system + n_common, -1);
+        slot.cache_tokens_dft.resize(n_common);
+
+        const size_t n_batch = llama_n_batch(ctx_dft);
+
+        for (size_t i = n_common; i < tokens.size(); i += n_batch) {
+            const size_t n_tokens = std::min(n_batch, tokens.size() - i);
+
+            llama_batch_clear(batch_dft);
+
+            for (size_t j = i; j < i + n_tokens; ++j) {
+                llama_batch_add(batch_dft, tokens[j], n_system + j, { seq_id }, j == tokens.size() - 1);
+            }
+
+            if (llama_decode(ctx_dft, batch_dft) != 0) {
+                LOG_WARNING("failed to decode the batch of the draft model", {
+                    {"id_slot",  slot.id},
+                    {"n_tokens", n_tokens},
+                });
+
+                llama_kv_cache_seq_rm(ctx_dft, seq_id, n_system + i, -1);
+                return -1;
+            }
+
+            slot.cache_tokens_dft.insert(slot.cache_tokens_dft.end(), tokens.begin() + i, tokens.begin() + i + n_tokens);
+        }
+
+        return batch_dft.n_tokens - 1;
+    }
+
+    // the n most probable tokens of the draft model for output idx of the last draft batch
+    void draft_candidates(int32_t idx, int32_t n) {
+        const float * logits = llama_get_logits_ith(ctx_dft, idx);
+
+        // only tokens known to the target model can be drafted
+        const int32_t n_vocab = std::min(llama_n_vocab(model), llama_n_vocab(model_dft));
+
+        cur_dft.resize(n_vocab);
+
+        float max_l = -INFINITY;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            cur_dft[id] = llama_token_data{ id, logits[id], 0.0f };
+            max_l = std::max(max_l, logits[id]);
+        }
+
+        double sum = 0.0;
+        for (llama_token id = 0; id < n_vocab; ++id) {
+            sum += expf(logits[id] - max_l);
+        }
+
+        n = std::min(n, n_vocab);
+
+        std::partial_sort(cur_dft.begin(), cur_dft.begin() + n, cur_dft.end(), [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        });
+        cur_dft.resize(n);
+
+        for (auto & cur : cur_dft) {
+            cur.p = expf(cur.logit - max_l) / sum;
+        }
+    }
+
+    // draft a tree of at most n_draft_max tokens continuing the sampled token of the slot
+    // a branch is split for every candidate with a probability above p_split, up to n_seq_draft branches
+    void draft_tokens(server_slot & slot, int32_t n_draft_max) {
+        slot.draft.clear();
+        slot.n_draft_seqs   = 0;
+        slot.i_draft_accept = -1;
+
+        if (n_draft_max <= 0) {
+            return;
+        }
+
+        const int32_t i_root = draft_sync(slot);
+        if (i_root < 0) {
+            return;
+        }
+
+        struct draft_branch {
+            bool    drafting;
+            int32_t i_batch_dft; // output of the last token of the branch in batch_dft
+            int32_t i_leaf;      // last node of the branch, -1 for the root
+        };
+
+        std::vector<draft_branch> branches;
+        branches.reserve(params.n_seq_draft);
+        branches.push_back({ true, i_root, -1 });
+
+        const int32_t pos_root = system_tokens.size() + slot.cache_tokens.size() - 1;
+
+        for (int32_t depth = 1; (int32_t) slot.draft.size() < n_draft_max; ++depth) {
+            llama_batch_clear(batch_dft);
+
+            const int32_t n_seqs_cur = branches.size();
+
+            for (int32_t s = 0; s < n_seqs_cur && (int32_t) slot.draft.size() < n_draft_max; ++s) {
+                if (!branches[s].drafting) {
+                    continue;
+                }
+
+                draft_candidates(branches[s].i_batch_dft, params.n_seq_draft);
+
+                std::vector<int32_t> sa(1, s);
+
+                // attempt to split the branch if the probability is high enough
+                for (size_t f = 1; f < cur_dft.size(); ++f) {
+                    if ((int32_t) branches.size() >= params.n_seq_draft ||
+                        (int32_t) (slot.draft.size() + sa.size()) >= n_draft_max ||
+                        cur_dft[f].p <= params.p_split) {
+                        break;
+                    }
+
+                    const int32_t s_new = branches.size();
+
+                    llama_kv_cache_seq_rm(ctx_dft, draft_seq_id(slot, s_new), -1, -1);
+                    llama_kv_cache_seq_cp(ctx_dft, draft_seq_id(slot, s), draft_seq_id(slot, s_new), -1, -1);
+
+                    branches.push_back(branches[s]);
+                    sa.push_back(s_new);
+                }
+
+                const int32_t i_parent = branches[s].i_leaf;
+
+                for (size_t is = 0; is < sa.size(); ++is) {
+                    server_draft_node node;
+                    node.id     = cur_dft[is].id;
+                    node.parent = i_parent;
+                    node.depth  = depth;
+
+                    slot.draft.push_back(node);
+
+                    draft_branch & branch = branches[sa[is]];
+
+                    branch.i_leaf      = slot.draft.size() - 1;
+                    branch.i_batch_dft = batch_dft.n_tokens;
+
+                    // nothing can follow the end of generation
+                    if (llama_token_is_eog(model, node.id)) {
+                        branch.drafting = false;
+                    }
+
+                    llama_batch_add(batch_dft, node.id, pos_root + depth, { draft_seq_id(slot, sa[is]) }, true);
+                }
+            }
+
+            if (batch_dft.n_tokens == 0 || (int32_t) slot.draft.size() >= n_draft_max) {
+                break;
+            }
+
+            if (llama_decode(ctx_dft, batch_dft) != 0) {
+                break;
+            }
+        }
+
+        // keep only the tokens of the slot in the KV cache of the draft model
+        llama_kv_cache_seq_rm(ctx_dft, draft_seq_id(slot, 0), pos_root + 1, -1);
+        for (int32_t s = 1; s < (int32_t) branches.size(); ++s) {
+            llama_kv_cache_seq_rm(ctx_dft, draft_seq_id(slot, s), -1, -1);
+        }
+
+        for (int32_t s = 0; s < (int32_t) branches.size(); ++s) {
+            for (int32_t i = branches[s].i_leaf; i >= 0; i = slot.draft[i].parent) {
+                slot.draft[i].seqs |= 1u << s;
+            }
+        }
+
+        slot.n_draft_seqs = branches.size();
+    }
+
+    // draft the continuation of the sampled token of the slot from the n-grams of its context
+    // the n-gram caches yield a single sequence of at most n_draft_max tokens
+    void draft_lookup(server_slot & slot, int32_t n_draft_max) {
+        slot.draft.clear();
+        slot.n_draft_seqs   = 0;
+        slot.i_draft_accept = -1;
+
+        if (n_draft_max <= 0) {
+            return;
+        }
+
+        auto & tokens = slot.cache_tokens;
+
+        if (slot.n_ngram_tokens > tokens.size()) {
+            slot.ngram_cache.clear();
+            slot.n_ngram_tokens = 0;
+        }
+
+        llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, tokens, tokens.size() - slot.n_ngram_tokens, false);
+        slot.n_ngram_tokens = tokens.size();
+
+        std::vector<llama_token> draft(1, slot.sampled);
+
+        llama_ngram_cache_draft(tokens, draft, n_draft_max, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+
+        const int32_t n_vocab = llama_n_vocab(model);
+
+        for (size_t i = 1; i < draft.size(); ++i) {
+            // the caches loaded from disk may come from another vocab
+            if (draft[i] < 0 || draft[i] >= n_vocab) {
+                break;
+            }
+
+            server_draft_node node;
+            node.id     = draft[i];
+            node.parent = (int32_t) i - 2;
+            node.depth  = i;
+            node.seqs   = 1;
+
+            slot.draft.push_back(node);
+        }
+
+        slot.n_draft_seqs = slot.draft.empty() ? 0 : 1;
+    }
+
+    // keep the accepted draft tokens in the sequence of the slot and remove everything else from the KV cache
+    void draft_rollback(server_slot & slot) {
+        const llama_seq_id seq_id  = slot.id + 1;
+        const int32_t      pos_end = system_tokens.size() + slot.n_past;
+
+        if (slot.i_draft_accept >= 0) {
+            const uint32_t seqs = slot.draft[slot.i_draft_accept].seqs;
+
+            if ((seqs & 1u) == 0) {
+                // the accepted tokens belong to another branch
+                int32_t s = 1;
+                while ((seqs & (1u << s)) == 0) {
+                    s++;
+                }
+
+                llama_kv_cache_seq_rm(ctx, seq_id, slot.draft_pos + 1, -1);
+                llama_kv_cache_seq_cp(ctx, draft_seq_id(slot, s), seq_id, slot.draft_pos + 1, pos_end);
+            }
+        }
+
+        llama_kv_cache_seq_rm(ctx, seq_id, pos_end, -1);
+        for (int32_t s = 1; s < slot.n_draft_seqs; ++s) {
+            llama_kv_cache_seq_rm(ctx, draft_seq_id(slot, s), -1, -1);
+        }
+
+        LOG_VERBOSE("draft verified", {
+            {"id_slot",    slot.id},
+            {"id_task",    slot.id_task},
+            {"n_draft",    slot.draft.size()},
+            {"n_seqs",     slot.n_draft_seqs},
+            {"n_accepted", slot.i_draft_accept >= 0 ? slot.draft[slot.i_draft_accept].depth : 0},
+        });
+
+        slot.draft.clear();
+        slot.n_draft_seqs   = 0;
+        slot.i_draft_accept = -1;
+    }
+
+    // number of free cells in the KV cache
+    int32_t n_kv_free() const {
+        return n_ctx - llama_get_kv_cache_used_cells(ctx);
+    }
+
+    // number of KV cells that a generating slot uses in one step: the sampled token and its draft
+    int32_t n_kv_step(const server_slot & slot) const {
+        return 1 + ((ctx_dft || lookup) && slot.ga_n == 1 && !slot.embedding ? params.n_draft : 0);
+    }
+
+    // the slot that gives up its KV cache first when the cache is full:
+    //  - the prompt caches of idle slots, least recently used first
+    //  - then the slots of the requests with the lowest priority, most recently started first
+    // the last generating slot is kept so that there is always progress
+    server_slot * get_kv_victim(bool idle_only) {
+        int32_t n_generating = 0;
+        for (const server_slot & slot : slots) {
+            n_generating += slot.state == SLOT_STATE_PROCESSING;
+        }
+
+        server_slot * victim = nullptr;
+        bool victim_idle = false;
+
+        for (server_slot & slot : slots) {
+            if (slot.cache_tokens.empty() || slot.ga_n != 1 || slot.embedding) {
+                continue;
+            }
+
+            const bool idle = slot.available();
+            if (!idle) {
+                const bool prompt     = slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT;
+                const bool generating = slot.state == SLOT_STATE_PROCESSING && slot.command == SLOT_COMMAND_NONE;
+                if (idle_only || !(prompt || (generating && n_generating > 1))) {
+                    continue;
+                }
+            }
+
+            bool better = victim == nullptr;
+            if (!better && idle != victim_idle) {
+                better = idle;
+            } else if (!better && idle) {
+                better = slot.t_last_used < victim->t_last_used;
+            } else if (!better) {
+                better = slot.priority < victim->priority ||
+                        (slot.priority == victim->priority && slot.t_start_process_prompt > victim->t_start_process_prompt);
+            }
+
+            if (better) {
+                victim      = &slot;
+                victim_idle = idle;
+            }
+        }
+
+        return victim;
+    }
+
+    // give up the KV cache of a slot, except for the system prompt
+    //  - an idle slot loses its prompt cache
+    //  - a slot that is processing its prompt starts over
+    //  - a generating slot is swapped out to host memory (or only dropped) and waits in SLOT_STATE_PREEMPTED
+    void preempt_slot(server_slot & slot) {
+        const llama_seq_id seq_id   = slot.id + 1;
+        const int32_t      n_system = system_tokens.size();
+
+        size_t n_swap = 0;
+        if (slot.state == SLOT_STATE_PROCESSING && params.kv_preempt_swap) {
+            n_swap = llama_state_seq_get_size(ctx, seq_id);
+            slot.kv_swap.resize(n_swap);
+            if (llama_state_seq_get_data(ctx, slot.kv_swap.data(), seq_id) != n_swap) {
+                std::vector<uint8_t>().swap(slot.kv_swap);
+                n_swap = 0;
+            }
+        }
+
+        llama_kv_cache_seq_rm(ctx, seq_id, n_system, -1);
+        if (ctx_dft) {
+            llama_kv_cache_seq_rm(ctx_dft, seq_id, n_system, -1);
+            slot.cache_tokens_dft.clear();
+        }
+
+        if (slot.available()) {
+            LOG_VERBOSE("slot prompt cache dropped", {
+                {"id_slot",        slot.id},
+                {"n_cache_tokens", slot.cache_tokens.size()},
+            });
+
+            slot.cache_tokens.clear();
+            return;
+        }
+
+        LOG_INFO("slot preempted", {
+            {"id_slot",  slot.id},
+            {"id_task",  slot.id_task},
+            {"priority", slot.priority},
+            {"n_past",   slot.n_past},
+            {"n_swap",   n_swap},
+            {"n_free",   n_kv_free()},
+        });
+
+        metrics.n_preemptions++;
+
+        if (slot.state == SLOT_STATE_IDLE) {
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+            slot.n_prompt_tokens_processed = 0;
+            return;
+        }
+
+        GGML_ASSERT((int32_t) slot.cache_tokens.size() == slot.n_past);
+
+        slot.state       = SLOT_STATE_PREEMPTED;
+        slot.t_preempted = ggml_time_us();
+        slot.n_resumed   = -1;
+    }
+
+    // bring back the KV cache of a preempted slot - the swapped out state is restored directly, otherwise the tokens
+    // of the slot are evaluated again with the prompts (see n_resumed)
+    void resume_slot(server_slot & slot) {
+        const llama_seq_id seq_id = slot.id + 1;
+
+        if (!slot.kv_swap.empty()) {
+            const size_t n_read = llama_state_seq_set_data(ctx, slot.kv_swap.data(), seq_id);
+            std::vector<uint8_t>().swap(slot.kv_swap);
+
+            if (n_read > 0) {
+                LOG_INFO("slot resumed", {
+                    {"id_slot",   slot.id},
+                    {"id_task",   slot.id_task},
+                    {"n_past",    slot.n_past},
+                    {"t_wait_ms", (ggml_time_us() - slot.t_preempted) / 1000},
+                });
+
+                slot.state = SLOT_STATE_PROCESSING;
+                return;
+            }
+
+            // there was no contiguous space for the swapped out cells
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+            if (!system_tokens.empty()) {
+                llama_kv_cache_seq_cp(ctx, 0, seq_id, -1, -1);
+            }
+        }
+
+        LOG_INFO("slot resumed, evaluating its tokens again", {
+            {"id_slot",   slot.id},
+            {"id_task",   slot.id_task},
+            {"n_past",    slot.n_past},
+            {"t_wait_ms", (ggml_time_us() - slot.t_preempted) / 1000},
+        });
+
+        slot.n_resumed = 0;
+    }
+
+    // move the used cells of the KV caches together, the freed cells of preempted slots are scattered between the cells
+    // of the other slots while the batches and the swapped out states need contiguous room
+    void kv_defrag() {
+        llama_kv_cache_defrag(ctx);
+        llama_kv_cache_update(ctx);
+
+        if (ctx_dft) {
+            llama_kv_cache_defrag(ctx_dft);
+            llama_kv_cache_update(ctx_dft);
+        }
+    }
+
+    // resume the preempted slots for which there is room again and preempt slots until the generating slots have room
+    // for their tokens in this step
+    // returns the number of KV cells left for the prompts
+    int32_t kv_reserve() {
+        bool defrag = false;
+
+        int32_t n_reserved   = 0;
+        int32_t n_generating = 0;
+        for (const server_slot & slot : slots) {
+            if (slot.state == SLOT_STATE_PROCESSING) {
+                n_reserved += n_kv_step(slot);
+                n_generating++;
+            }
+        }
+
+        // highest priority first, then the one that waits the longest
+        while (true) {
+            server_slot * next = nullptr;
+            for (server_slot & slot : slots) {
+                if (slot.state != SLOT_STATE_PREEMPTED || slot.n_resumed >= 0 || slot.command == SLOT_COMMAND_RELEASE) {
+                    continue;
+                }
+                if (next == nullptr || slot.priority > next->priority ||
+                   (slot.priority == next->priority && slot.t_preempted < next->t_preempted)) {
+                    next = &slot;
+                }
+            }
+            if (next == nullptr) {
+                break;
+            }
+
+            // leave room for a few steps of all generating slots, so that the slot is not preempted again right away
+            const int32_t n_need = std::min(n_ctx - (int32_t) system_tokens.size(),
+                (int32_t) system_tokens.size() + next->n_past + SERVER_KV_RESUME_STEPS*(n_reserved + n_kv_step(*next)));
+
+            server_slot * victim = nullptr;
+            while (n_kv_free() < n_need && (victim = get_kv_victim(true)) != nullptr) {
+                preempt_slot(*victim);
+            }
+            if (n_kv_free() < n_need) {
+                break;
+            }
+
+            if (!next->kv_swap.empty()) {
+                kv_defrag();
+            }
+            resume_slot(*next);
+
+            if (next->state == SLOT_STATE_PROCESSING) {
+                n_reserved += n_kv_step(*next);
+                n_generating++;
+            }
+        }
+
+        while (n_kv_free() < n_reserved) {
+            server_slot * victim = get_kv_victim(false);
+            if (victim == nullptr) {
+                break;
+            }
+            if (victim->state == SLOT_STATE_PROCESSING) {
+                n_reserved -= n_kv_step(*victim);
+                n_generating--;
+            }
+            preempt_slot(*victim);
+            defrag = true;
+        }
+
+        // the prompts that are being processed can fill up the cache without any slot generating - start one over
+        if (n_generating == 0 && n_kv_free() <= 0) {
+            server_slot * victim = get_kv_victim(false);
+            if (victim != nullptr) {
+                preempt_slot(*victim);
+                defrag = true;
+            }
+        }
+
+        if (defrag) {
+            kv_defrag();
+        }
+
+        return n_kv_free() - n_reserved;
+    }
+
+    void update_slots() {
+        if (system_need_update) {
+            system_prompt_update();
+        }
+
+        // release slots
+        for (auto & slot : slots) {
+            if (slot.command == SLOT_COMMAND_RELEASE) {
+                if (slot.state == SLOT_STATE_PREEMPTED) {
+                    // only the tokens evaluated again so far are in the KV cache
+                    slot.cache_tokens.resize(std::max(slot.n_resumed, 0));
+                    slot.n_resumed = -1;
+                    std::vector<uint8_t>().swap(slot.kv_swap);
+                }
+
+                slot.state       = SLOT_STATE_IDLE;
+                slot.command     = SLOT_COMMAND_NONE;
+                slot.t_last_used = ggml_time_us();
+
+                if (lookup && slot.n_decoded > 0 && !slot.cache_tokens.empty()) {
+                    // only the n-grams predicting the generated tokens are kept across requests, the prompts are not
+                    const int n_gen = std::min<int>(slot.n_decoded, slot.cache_tokens.size());
+
+                    llama_ngram_cache ngram_cache_gen;
+                    llama_ngram_cache_update(ngram_cache_gen, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.cache_tokens, n_gen, false);
+                    llama_ngram_cache_merge(ngram_cache_dynamic, ngram_cache_gen);
+                    llama_ngram_cache_prune(ngram_cache_dynamic, SERVER_NGRAM_DYNAMIC_MAX);
+                }
+
+                LOG_INFO("slot released", {
+                    {"id_slot",         slot.id},
+                    {"id_task",         slot.id_task},
+                    {"n_ctx",           n_ctx},
+                    {"n_past",          slot.n_past},
+                    {"n_system_tokens", system_tokens.size()},
+                    {"n_cache_tokens",  slot.cache_tokens.size()},
+                    {"truncated",       slot.truncated}
+                });
+
+                queue_tasks.notify_slot_changed();
+            }
+        }
+
+        // the pending embedding inputs are decoded in their own batch, between the batches of the slots
+        const bool embd_decoded = !embd_pending.empty();
+        if (embd_decoded) {
+            update_embeddings();
+        }
+
+        // check if all slots are idle
+        {
+            bool all_idle = true;
+
+            for (auto & slot : slots) {
+                if (slot.state != SLOT_STATE_IDLE || slot.command != SLOT_COMMAND_NONE) {
+                    all_idle = false;
+                    break;
+                }
+            }
+
+            if (all_idle && embd_decoded) {
+                // come back for the remaining inputs and to finish the multitasks of the sent results
+                server_task task;
+                task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
+                task.id_target = -1;
+
+                queue_tasks.post(task);
+
+                return;
+            }
+
+            if (all_idle) {
+                LOG_INFO("all slots are idle", {});
+                if (system_prompt.empty() && clean_kv_cache) {
+                    kv_cache_clear();
+                }
+
+                return;
+            }
+        }
+
+        {
+            LOG_VERBOSE("posting NEXT_RESPONSE", {});
+
+            server_task task;
+            task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
+            task.id_target = -1;
+
+            queue_tasks.post(task);
+        }
+
+        // apply context-shift if needed
+        // TODO: simplify and improve
+        for (server_slot & slot : slots) {
+            if (slot.ga_n == 1) {
+                if (slot.is_processing() && (int) system_tokens.size() + slot.n_past >= slot.n_ctx - 1) {
+                    // Shift context
                     const int n_keep    = slot.params.n_keep + add_bos_token;
                     const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
                     const int n_discard = slot.params.n_discard ? slot.params.n_discard : (n_left / 2);
@@ -1949,14 +3645,21 @@ struct server_context {
                     llama_kv_cache_seq_rm (ctx, slot.id + 1, n_keep            , n_keep + n_discard);
                     llama_kv_cache_seq_add(ctx, slot.id + 1, n_keep + n_discard, system_tokens.size() + slot.n_past, -n_discard);
 
-                    if (slot.params.cache_prompt) {
-                        for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
-                            slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
-                        }
+                    for (size_t i = n_keep + n_discard; i < slot.cache_tokens.size(); i++) {
+                        slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
+                    }
+
+                    slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
 
-                        slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
+                    // the draft model evaluates the shifted tokens again on the next sync
+                    if (slot.cache_tokens_dft.size() > (size_t) n_keep) {
+                        slot.cache_tokens_dft.resize(n_keep);
                     }
 
+                    // the n-grams of the slot are collected again on the next lookup
+                    slot.ngram_cache.clear();
+                    slot.n_ngram_tokens = 0;
+
                     slot.n_past -= n_discard;
 
                     slot.truncated = true;
@@ -1964,12 +3667,47 @@ struct server_context {
             }
         }
 
+        // KV cells left for the prompts in this step, after making room for the generating slots
+        int32_t n_kv_room = kv_preempt ? kv_reserve() : INT32_MAX;
+
+        // process in chunks of params.n_batch
+        int32_t n_batch  = llama_n_batch(ctx);
+        int32_t n_ubatch = llama_n_ubatch(ctx);
+
+        // a batch either selects the adapter of each token, which serves together all the slots that use at most one
+        // adapter, or is evaluated with one set of adapter scales for a slot that combines several adapters
+        // the first busy slot, rotated every step, chooses the mode and the slots that do not fit wait for a later step
+        std::vector<float> lora_batch = lora_applied;
+        bool lora_per_token = false;
+        if (!lora_adapters.empty()) {
+            const size_t i_slot_first = i_slot_lora;
+            i_slot_lora = (i_slot_lora + 1) % slots.size();
+
+            for (size_t k = 0; k < slots.size(); ++k) {
+                const server_slot & slot = slots[(i_slot_first + k) % slots.size()];
+                if (slot.state == SLOT_STATE_PROCESSING || slot.command == SLOT_COMMAND_LOAD_PROMPT || (slot.state == SLOT_STATE_PREEMPTED && slot.n_resumed >= 0)) {
+                    lora_batch     = slot.lora;
+                    lora_per_token = lora_single(slot.lora) != -2;
+                    break;
+                }
+            }
+        }
+
+        const auto lora_match = [&](const server_slot & slot) {
+            return lora_per_token ? lora_single(slot.lora) != -2 : slot.lora == lora_batch;
+        };
+
         // start populating the batch for this iteration
         llama_batch_clear(batch);
 
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
-            if (slot.state == SLOT_STATE_IDLE) {
+            if (slot.state != SLOT_STATE_PROCESSING) {
+                continue;
+            }
+
+            if (!lora_match(slot)) {
+                slot.i_batch = -1;
                 continue;
             }
 
@@ -1977,16 +3715,62 @@ struct server_context {
 
             const int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
 
+            slot.cache_tokens.push_back(slot.sampled);
+
+            // draft the continuation of the sampled token, so it can be verified in the same batch
+            if ((ctx_dft || lookup) && slot.ga_n == 1 && !slot.embedding) {
+                const int32_t n_draft_max = std::min({
+                    params.n_draft,
+                    slot.n_ctx - 2 - (int32_t) system_tokens.size() - slot.n_past, // stay within the context of the slot
+                    n_batch - batch.n_tokens - 1,                                  // verify the whole draft in the first batch view
+                });
+
+                if (ctx_dft) {
+                    draft_tokens(slot, n_draft_max);
+                } else {
+                    draft_lookup(slot, n_draft_max);
+                }
+            }
+
             // TODO: we always have to take into account the "system_tokens"
             //       this is not great and needs to be improved somehow
-            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id + 1 }, true);
+            if (slot.draft.empty()) {
+                llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id + 1 }, true);
+            } else {
+                std::vector<llama_seq_id> seq_ids(slot.n_draft_seqs);
 
-            slot.n_past += 1;
+                for (int32_t s = 0; s < slot.n_draft_seqs; ++s) {
+                    seq_ids[s] = draft_seq_id(slot, s);
+
+                    if (s > 0) {
+                        // every branch continues the tokens of the slot
+                        llama_kv_cache_seq_rm(ctx, seq_ids[s], -1, -1);
+                        llama_kv_cache_seq_cp(ctx, seq_ids[0], seq_ids[s], -1, -1);
+                    }
+                }
+
+                slot.draft_pos = system_tokens.size() + slot_npast;
+
+                llama_batch_add(batch, slot.sampled, slot.draft_pos, seq_ids, true);
+
+                for (auto & node : slot.draft) {
+                    seq_ids.clear();
+                    for (int32_t s = 0; s < slot.n_draft_seqs; ++s) {
+                        if (node.seqs & (1u << s)) {
+                            seq_ids.push_back(draft_seq_id(slot, s));
+                        }
+                    }
 
-            if (slot.params.cache_prompt) {
-                slot.cache_tokens.push_back(slot.sampled);
+                    node.i_batch = batch.n_tokens;
+
+                    llama_batch_add(batch, node.id, slot.draft_pos + node.depth, seq_ids, true);
+                }
+
+                slot.n_draft_total += slot.draft.size();
             }
 
+            slot.n_past += 1;
+
             LOG_VERBOSE("slot decode token", {
                 {"id_slot",         slot.id},
                 {"id_task",         slot.id_task},
@@ -1994,21 +3778,93 @@ struct server_context {
                 {"n_past",          slot.n_past},
                 {"n_system_tokens", system_tokens.size()},
                 {"n_cache_tokens",  slot.cache_tokens.size()},
+                {"n_draft",         slot.draft.size()},
                 {"truncated",       slot.truncated}
             });
         }
 
-        // process in chunks of params.n_batch
-        int32_t n_batch  = llama_n_batch(ctx);
-        int32_t n_ubatch = llama_n_ubatch(ctx);
+        // next, batch any pending prompts without exceeding n_batch
+        // while slots are generating, the prompts only get what is left of the token budget of the step after the sampled
+        // tokens, so that a long prompt does not stall the generation; the pending prompts share that budget evenly
+        if (params.cont_batching || batch.n_tokens == 0) {
+            int32_t n_budget = n_batch;
+            if (batch.n_tokens > 0 && params.prefill_budget != 0) {
+                n_budget = std::min(n_batch, params.prefill_budget < 0 ? n_ubatch : params.prefill_budget);
+            }
+
+            // make progress on the prompts even if the sampled tokens use up the budget
+            int32_t n_budget_prompt = std::max(n_budget - batch.n_tokens, 1);
+
+            // while preempted slots wait for room in the KV cache, no new prompts are started
+            bool kv_waiting = false;
+            bool generating = false;
+            for (const auto & slot : slots) {
+                kv_waiting = kv_waiting || (slot.state == SLOT_STATE_PREEMPTED && slot.n_resumed < 0);
+                generating = generating || slot.state == SLOT_STATE_PROCESSING;
+            }
+            kv_waiting = kv_waiting && generating;
+
+            int32_t n_pending = 0;
+            for (const auto & slot : slots) {
+                if (!lora_match(slot)) {
+                    continue;
+                }
+                if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT && !kv_waiting) {
+                    n_pending++;
+                }
+                if (slot.state == SLOT_STATE_PREEMPTED && slot.n_resumed >= 0) {
+                    n_pending++;
+                }
+            }
+
+            // the first slot to receive a share of the budget is rotated every step
+            const size_t i_slot_first = i_slot_prefill;
+            i_slot_prefill = (i_slot_prefill + 1) % slots.size();
+
+            for (size_t k = 0; k < slots.size() && n_pending > 0; ++k) {
+                server_slot & slot = slots[(i_slot_first + k) % slots.size()];
+
+                if (!lora_match(slot)) {
+                    continue;
+                }
+
+                // this slot was preempted and evaluates its tokens again before it continues to generate
+                if (slot.state == SLOT_STATE_PREEMPTED && slot.n_resumed >= 0) {
+                    n_pending--;
+
+                    int32_t n_take = std::min({
+                        slot.n_past - slot.n_resumed,
+                        (n_budget_prompt + n_pending) / (n_pending + 1),
+                        n_batch - batch.n_tokens,
+                        n_kv_room,
+                    });
+                    if (params.prefill_chunk > 0) {
+                        n_take = std::min(n_take, params.prefill_chunk);
+                    }
+
+                    for (int32_t j = 0; j < n_take; ++j, ++slot.n_resumed) {
+                        llama_batch_add(batch, slot.cache_tokens[slot.n_resumed], system_tokens.size() + slot.n_resumed, { slot.id + 1 }, false);
+                    }
+
+                    if (n_take > 0) {
+                        n_budget_prompt -= n_take;
+                        n_kv_room       -= n_take;
+                    }
+
+                    if (slot.n_resumed == slot.n_past) {
+                        slot.state     = SLOT_STATE_PROCESSING;
+                        slot.n_resumed = -1;
+                        slot.i_batch   = -1;
+                    }
+                }
 
-        // next, batch any pending prompts without exceeding n_batch
-        if (params.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
                 // this slot still has a prompt to be processed
-                if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
+                if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT && !kv_waiting) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
+                    // number of pending prompts after this one
+                    n_pending--;
+
                     // we haven't tokenized the prompt yet - do it now:
                     if (prompt_tokens.empty()) {
                         LOG_VERBOSE("tokenizing prompt", {
@@ -2133,6 +3989,9 @@ struct server_context {
 
                             llama_sampling_reset(slot.ctx_sampling);
 
+                            slot.ngram_cache.clear();
+                            slot.n_ngram_tokens = 0;
+
                             if (!slot.params.cache_prompt) {
                                 slot.n_past_se = 0;
                                 slot.ga_i      = 0;
@@ -2165,9 +4024,24 @@ struct server_context {
                         slot.n_prompt_tokens_processed = 0;
                     }
 
+                    // number of prompt tokens to add for this slot in the current batch
+                    int32_t n_take = slot.n_prompt_tokens - slot.n_past;
+
                     if (slot.embedding) {
                         // cannot fit the prompt in the current batch - will try next iter
-                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch) {
+                        if (batch.n_tokens + slot.n_prompt_tokens > n_batch || n_take > n_kv_room) {
+                            continue;
+                        }
+                    } else {
+                        // an even share of the remaining budget, what a slot does not use is left for the next ones
+                        n_take = std::min(n_take, (n_budget_prompt + n_pending) / (n_pending + 1));
+                        if (params.prefill_chunk > 0) {
+                            n_take = std::min(n_take, params.prefill_chunk);
+                        }
+                        n_take = std::min(n_take, n_batch - batch.n_tokens);
+                        n_take = std::min(n_take, n_kv_room);
+
+                        if (n_take <= 0) {
                             continue;
                         }
                     }
@@ -2209,7 +4083,9 @@ struct server_context {
 
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                    const int32_t n_past_end = slot.n_past + n_take;
+
+                    for (; slot.n_past < n_past_end; ++slot.n_past) {
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -2220,14 +4096,15 @@ struct server_context {
 
                         llama_batch_add(batch, prompt_tokens[slot.n_past], system_tokens.size() + slot_npast, { slot.id + 1 }, false);
 
-                        if (slot.params.cache_prompt) {
-                            slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
-                        }
+                        slot.cache_tokens.push_back(prompt_tokens[slot.n_past]);
 
                         slot.n_prompt_tokens_processed++;
                         slot_npast++;
                     }
 
+                    n_budget_prompt -= n_take;
+                    n_kv_room       -= n_take;
+
                     LOG_VERBOSE("prompt processing progress", {
                         {"id_slot",  slot.id},
                         {"n_past",   slot.n_past},
@@ -2258,7 +4135,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch || n_budget_prompt <= 0) {
                     break;
                 }
             }
@@ -2273,6 +4150,18 @@ struct server_context {
             {"n_tokens", batch.n_tokens},
         });
 
+        if (lora_per_token) {
+            for (int32_t i = 0; i < batch.n_tokens; ++i) {
+                const server_slot & slot = slots[draft_seq_slot(batch.seq_id[i][0])];
+                const int32_t id = lora_single(slot.lora);
+
+                batch_lora_id[i]    = id;
+                batch_lora_scale[i] = id < 0 ? 0.0f : slot.lora[id];
+            }
+        } else {
+            lora_apply(lora_batch);
+        }
+
         // process the created batch of tokens
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
@@ -2315,6 +4204,8 @@ struct server_context {
                 batch.seq_id   + i,
                 batch.logits   + i,
                 0, 0, 0, // unused
+                lora_per_token ? batch_lora_id.data()    + i : nullptr,
+                lora_per_token ? batch_lora_scale.data() + i : nullptr,
             };
 
             const int ret = llama_decode(ctx, batch_view);
@@ -2349,6 +4240,11 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
+            // collect the slots that need a new token from this batch view, so they can be sampled in one pass
+            std::vector<server_slot *>            slots_sample;
+            std::vector<llama_sampling_context *> ctxs_sampling;
+            std::vector<int32_t>                  idxs_sample;
+
             for (auto & slot : slots) {
                 if (slot.state != SLOT_STATE_PROCESSING || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
                     continue; // continue loop of slots
@@ -2362,71 +4258,658 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+                slots_sample.push_back(&slot);
+                ctxs_sampling.push_back(slot.ctx_sampling);
+                idxs_sample.push_back(slot.i_batch - i);
+            }
+
+            const std::vector<llama_token> ids = llama_sampling_sample_batch(ctxs_sampling, ctx, idxs_sample, llama_n_threads(ctx));
+
+            for (size_t is = 0; is < slots_sample.size(); ++is) {
+                server_slot & slot = *slots_sample[is];
+
+                llama_token id = ids[is];
+
+                // walk down the draft for as long as the sampled tokens match the drafted ones
+                while (process_sampled_token(slot, id)) {
+                    const int32_t i_node = slot.draft_find_child(slot.i_draft_accept, id);
+                    if (i_node < 0 || slot.draft[i_node].i_batch >= (int32_t) (i + n_tokens)) {
+                        break;
+                    }
+
+                    // the drafted token has already been evaluated - sample the next one from its logits
+                    slot.n_past += 1;
+                    slot.cache_tokens.push_back(id);
+
+                    slot.n_draft_accepted += 1;
+                    slot.i_draft_accept    = i_node;
+
+                    id = llama_sampling_sample(slot.ctx_sampling, ctx, nullptr, slot.draft[i_node].i_batch - i);
+                }
+
+                slot.i_batch = -1;
+            }
+        }
+
+        // remove the rejected draft tokens from the KV cache
+        for (auto & slot : slots) {
+            if (!slot.draft.empty()) {
+                draft_rollback(slot);
+            }
+        }
+
+        LOG_VERBOSE("run slots completed", {});
+    }
+
+    json model_meta() const {
+        return json {
+            {"vocab_type",  llama_vocab_type    (model)},
+            {"n_vocab",     llama_n_vocab       (model)},
+            {"n_ctx_train", llama_n_ctx_train   (model)},
+            {"n_embd",      llama_n_embd        (model)},
+            {"n_params",    llama_model_n_params(model)},
+            {"size",        llama_model_size    (model)},
+        };
+    }
+};
+
+#ifdef SERVER_STREAM_LOOP
+// serves the connections of streamed responses from one thread with epoll, instead of blocking an HTTP thread per stream
+// a stream is added before its task is queued, so that its result channel notifies the loop of each new result, and
+// the HTTP thread hands the connection over to the loop once the request is routed (see httplib::Response::socket_handler_)
+struct server_stream_loop {
+    struct connection {
+        int id      = -1;
+        int id_task = -1;
+        int sock    = -1;
+
+        std::shared_ptr<server_context> ctx; // the model of the task, kept loaded until the stream ends
+
+        server_stream_format format;
+        server_sse_writer    writer;
+
+        std::string out;        // response head and chunks that are not sent yet
+        size_t      n_sent = 0;
+
+        bool finished = false; // the last result has been formatted
+        bool writing  = false; // waiting for the socket to become writable
+    };
+
+    int fd_epoll = -1;
+    int fd_event = -1;
+
+    std::thread       thread;
+    std::atomic<bool> running{false};
+
+    // connections of the loop thread, by connection id
+    std::unordered_map<int, std::unique_ptr<connection>> conns;
+    std::atomic<int> id_conn{0};
+    std::vector<server_task_result> results;
+
+    // protects the lists below, which are filled by the other threads
+    std::mutex mutex;
+    bool       signaled = false;
+
+    std::vector<std::unique_ptr<connection>> added;
+    std::vector<std::pair<int, int>>         attached;  // (id, socket)
+    std::vector<int>                         cancelled; // connections whose response is not handed over
+    std::vector<int>                         ready;     // connections with new results
+
+    static const uint64_t EVENT_KEY = UINT64_MAX;
+
+    ~server_stream_loop() {
+        stop();
+    }
+
+    bool start() {
+        fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        fd_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd_epoll < 0 || fd_event < 0) {
+            LOG_ERROR("failed to create the stream event loop", {{"errno", errno}});
+            return false;
+        }
+
+        epoll_event ev = {};
+        ev.events   = EPOLLIN;
+        ev.data.u64 = EVENT_KEY;
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_event, &ev);
+
+        running = true;
+        thread = std::thread([this]() { run(); });
+        return true;
+    }
+
+    void stop() {
+        if (running.exchange(false)) {
+            wake();
+            thread.join();
+        }
+        for (auto & it : conns) {
+            if (it.second->sock >= 0) {
+                close(it.second->sock);
+            }
+        }
+        conns.clear();
+        if (fd_event >= 0) {
+            close(fd_event);
+            fd_event = -1;
+        }
+        if (fd_epoll >= 0) {
+            close(fd_epoll);
+            fd_epoll = -1;
+        }
+    }
+
+    // status line and headers of a streamed response: the headers set on res by httplib (default headers) and by the handler,
+    // with the framing of the loop, which sends chunks and closes the connection at the end of the stream
+    static std::string format_head(const httplib::Response & res) {
+        std::string head = "HTTP/1.1 200 OK\r\n";
+        for (const auto & header : res.headers) {
+            if (header.first == "Transfer-Encoding" || header.first == "Content-Length" || header.first == "Connection") {
+                continue;
+            }
+            head += header.first + ": " + header.second + "\r\n";
+        }
+        head += "Transfer-Encoding: chunked\r\n";
+        head += "Connection: close\r\n";
+        head += "\r\n";
+        return head;
+    }
+
+    // called by the HTTP thread before the task is queued, returns the id of the connection
+    int add(const std::shared_ptr<server_context> & ctx, int id_task, const server_stream_format & format, const std::string & head) {
+        const int id = id_conn++;
+
+        std::unique_ptr<connection> conn(new connection());
+        conn->id      = id;
+        conn->id_task = id_task;
+        conn->ctx     = ctx;
+        conn->format  = format;
+        conn->out     = head;
+
+        ctx->queue_results.add_waiting_task_id(id_task, [this, id]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.push_back(id);
+            signal(lock);
+        });
+
+        std::unique_lock<std::mutex> lock(mutex);
+        added.push_back(std::move(conn));
+        signal(lock);
+
+        return id;
+    }
+
+    // called by the HTTP thread once the request is routed, the loop owns the socket from then on
+    void attach(int id, int sock) {
+        std::unique_lock<std::mutex> lock(mutex);
+        attached.emplace_back(id, sock);
+        signal(lock);
+    }
+
+    // called by the HTTP thread when the connection is not handed over (error response, exception in the handler),
+    // the task is cancelled and the connection is removed
+    void cancel(int id) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cancelled.push_back(id);
+        signal(lock);
+    }
+
+private:
+    void signal(std::unique_lock<std::mutex> & lock) {
+        const bool need_wake = !signaled;
+        signaled = true;
+        lock.unlock();
+
+        if (need_wake) {
+            wake();
+        }
+    }
+
+    void wake() {
+        const uint64_t one = 1;
+        if (write(fd_event, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG_ERROR("failed to wake the stream event loop", {{"errno", errno}});
+        }
+    }
+
+    void run() {
+        std::vector<epoll_event> events(64);
+
+        std::vector<std::unique_ptr<connection>> added_cur;
+        std::vector<std::pair<int, int>>         attached_cur;
+        std::vector<int>                         cancelled_cur;
+        std::vector<int>                         ready_cur;
+
+        while (running) {
+            const int n_events = epoll_wait(fd_epoll, events.data(), events.size(), -1);
+            if (n_events < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("stream event loop failed", {{"errno", errno}});
+                break;
+            }
+
+            for (int i = 0; i < n_events; ++i) {
+                if (events[i].data.u64 == EVENT_KEY) {
+                    uint64_t value;
+                    while (read(fd_event, &value, sizeof(value)) > 0) {}
+                    continue;
+                }
+
+                auto it = conns.find((int) events[i].data.u64);
+                if (it == conns.end()) {
+                    continue;
+                }
+                connection & conn = *it->second;
+
+                if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                    close_connection(conn.id);
+                    continue;
+                }
+                if (events[i].events & EPOLLIN) {
+                    // nothing is expected from the client, except closing the connection
+                    char buf[256];
+                    const ssize_t n = recv(conn.sock, buf, sizeof(buf), 0);
+                    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                        close_connection(conn.id);
+                        continue;
+                    }
+                }
+                if (events[i].events & EPOLLOUT) {
+                    flush(conn);
+                }
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                signaled = false;
+                added_cur.swap(added);
+                attached_cur.swap(attached);
+                cancelled_cur.swap(cancelled);
+                ready_cur.swap(ready);
+            }
+
+            for (auto & conn : added_cur) {
+                const int id = conn->id;
+                conns[id] = std::move(conn);
+            }
+            added_cur.clear();
+
+            for (const auto & a : attached_cur) {
+                auto it = conns.find(a.first);
+                if (it == conns.end()) {
+                    close(a.second);
+                    continue;
+                }
+                connection & conn = *it->second;
+                conn.sock = a.second;
+
+                fcntl(conn.sock, F_SETFL, fcntl(conn.sock, F_GETFL, 0) | O_NONBLOCK);
+
+                epoll_event ev = {};
+                ev.events   = EPOLLIN | EPOLLRDHUP;
+                ev.data.u64 = (uint64_t) conn.id;
+                epoll_ctl(fd_epoll, EPOLL_CTL_ADD, conn.sock, &ev);
+
+                flush(conn);
+            }
+            attached_cur.clear();
+
+            for (const int id : cancelled_cur) {
+                close_connection(id);
+            }
+            cancelled_cur.clear();
+
+            for (const int id : ready_cur) {
+                auto it = conns.find(id);
+                if (it != conns.end()) {
+                    update(*it->second);
+                }
+            }
+            ready_cur.clear();
+        }
+    }
+
+    // format the new results of the task into a chunk
+    void update(connection & conn) {
+        if (conn.finished || !conn.ctx->queue_results.try_recv_stream(conn.id_task, results)) {
+            return;
+        }
+
+        conn.writer.clear();
+        conn.finished = conn.format.format(results, conn.writer);
+
+        if (!conn.writer.empty()) {
+            char head[32];
+            snprintf(head, sizeof(head), "%zx\r\n", conn.writer.buf.size());
+            conn.out += head;
+            conn.out += conn.writer.buf;
+            conn.out += "\r\n";
+        }
+
+        if (conn.finished) {
+            conn.out += "0\r\n\r\n";
+            conn.ctx->queue_results.remove_waiting_task_id(conn.id_task);
+        }
+
+        flush(conn);
+    }
+
+    void flush(connection & conn) {
+        if (conn.sock < 0) {
+            return;
+        }
+
+        while (conn.n_sent < conn.out.size()) {
+            const ssize_t n = send(conn.sock, conn.out.data() + conn.n_sent, conn.out.size() - conn.n_sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.n_sent += n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // the client falls behind, the next results are coalesced until the socket is writable
+                set_writing(conn, true);
+                return;
+            }
+            close_connection(conn.id);
+            return;
+        }
+
+        conn.out.clear();
+        conn.n_sent = 0;
+        set_writing(conn, false);
+
+        if (conn.finished) {
+            close_connection(conn.id);
+        }
+    }
+
+    void set_writing(connection & conn, bool writing) {
+        if (conn.writing == writing) {
+            return;
+        }
+        conn.writing = writing;
+
+        epoll_event ev = {};
+        ev.events   = EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0);
+        ev.data.u64 = (uint64_t) conn.id;
+        epoll_ctl(fd_epoll, EPOLL_CTL_MOD, conn.sock, &ev);
+    }
+
+    void close_connection(int id) {
+        auto it = conns.find(id);
+        if (it == conns.end()) {
+            return;
+        }
+        connection & conn = *it->second;
+
+        if (conn.sock >= 0) {
+            epoll_ctl(fd_epoll, EPOLL_CTL_DEL, conn.sock, nullptr);
+            shutdown(conn.sock, SHUT_RDWR);
+            close(conn.sock);
+        }
+
+        if (!conn.finished) {
+            conn.ctx->request_cancel(conn.id_task);
+            conn.ctx->queue_results.remove_waiting_task_id(conn.id_task);
+        }
+
+        conns.erase(it);
+    }
+};
+#endif
+
+// the models served by the server, by alias: the model given with -m is always loaded, the models given with --serve-model
+// are loaded on first use, and the least recently used idle ones are unloaded to keep their total size within a budget
+// a model is in use while its server_context is shared by a request (see get), it is never unloaded then
+struct server_models {
+    struct entry {
+        std::string alias;
+        std::string path;
+        size_t      size = 0; // size of the model file
+
+        std::shared_ptr<server_context> ctx;    // null while not loaded
+        std::thread                     thread; // runs the task loop of ctx
+
+        bool    pinned      = false;
+        bool    loading     = false;
+        int64_t t_last_used = 0;
+    };
+
+    gpt_params params; // of the additional models
+    size_t     mem_max = 0;
+
+    // the steps of all models are serialized, so that they share the CPU threads instead of oversubscribing them
+    std::mutex mutex_compute;
+
+    std::mutex              mutex;
+    std::condition_variable condition;
+
+    std::vector<std::unique_ptr<entry>> entries; // the default model first
+
+    ~server_models() {
+        for (auto & e : entries) {
+            if (!e->pinned && e->ctx) {
+                unload(*e);
+            }
+        }
+    }
+
+    static size_t file_size(const std::string & path) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        return file ? (size_t) file.tellg() : 0;
+    }
+
+    // set the callbacks of the task loop of a model
+    void bind(server_context & ctx) {
+        ctx.queue_tasks.on_new_task(std::bind(
+            &server_context::process_single_task, &ctx, std::placeholders::_1));
+        ctx.queue_tasks.on_finish_multitask(std::bind(
+            &server_context::on_finish_multitask, &ctx, std::placeholders::_1));
+        ctx.queue_tasks.on_update_slots([this, &ctx]() {
+            std::lock_guard<std::mutex> lock(mutex_compute);
+            ctx.update_slots();
+        });
+        ctx.queue_tasks.on_schedule(std::bind(
+            &server_context::schedule_tasks, &ctx, std::placeholders::_1));
+        ctx.queue_tasks.on_expire(std::bind(
+            &server_context::expire_task, &ctx, std::placeholders::_1));
+        ctx.queue_results.on_multitask_update(std::bind(
+            &server_queue::update_multitask,
+            &ctx.queue_tasks,
+            std::placeholders::_1,
+            std::placeholders::_2,
+            std::placeholders::_3
+        ));
+    }
+
+    void init(server_context & ctx_default, const gpt_params & params_default) {
+        params = params_default;
+        params.model_draft.clear();
+        params.lora_adapter.clear();
+        params.control_vectors.clear();
+        params.lookup_cache_static.clear();
+        params.lookup_cache_dynamic.clear();
+
+        mem_max = (size_t) params_default.models_mem_max*1024*1024;
+
+        std::unique_ptr<entry> e(new entry());
+        e->alias  = params_default.model_alias;
+        e->path   = params_default.model;
+        e->size   = file_size(e->path);
+        e->pinned = true;
+        e->ctx    = std::shared_ptr<server_context>(&ctx_default, [](server_context *) {}); // owned by main
+        entries.push_back(std::move(e));
+
+        for (const auto & served : params_default.served_models) {
+            e.reset(new entry());
+            e->alias = served.first;
+            e->path  = served.second;
+            e->size  = file_size(e->path);
+            entries.push_back(std::move(e));
+
+            LOG_INFO("serving model", {
+                {"alias", served.first},
+                {"model", served.second},
+            });
+        }
+    }
+
+    // the model of a request, loaded if needed - the default model if the name is not served, null if it fails to load
+    std::shared_ptr<server_context> get(const std::string & name) {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        entry * e = entries.front().get();
+        for (auto & it : entries) {
+            if (it->alias == name) {
+                e = it.get();
+                break;
+            }
+        }
+
+        condition.wait(lock, [e]() { return !e->loading; });
+
+        e->t_last_used = ggml_time_us();
+        if (e->ctx) {
+            return e->ctx;
+        }
+
+        e->loading = true;
+
+        std::vector<entry *> evicted = evict(e->size);
+        lock.unlock();
+
+        for (entry * ev : evicted) {
+            unload(*ev);
+        }
+
+        std::shared_ptr<server_context> ctx = load(*e);
+
+        lock.lock();
+        e->ctx     = ctx;
+        e->loading = false;
+        condition.notify_all();
+
+        return ctx;
+    }
+
+    json list() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        json data = json::array();
+        for (const auto & e : entries) {
+            json model = {
+                {"id",       e->alias},
+                {"object",   "model"},
+                {"created",  std::time(0)},
+                {"owned_by", "llamacpp"},
+            };
+            if (e->ctx) {
+                model["meta"] = e->ctx->model_meta();
+            }
+            data.push_back(model);
+        }
+
+        return data;
+    }
+
+private:
+    // mark the least recently used idle models for unloading, until size more fits in the budget
+    std::vector<entry *> evict(size_t size) {
+        std::vector<entry *> evicted;
+        if (mem_max == 0) {
+            return evicted;
+        }
+
+        // the default model is not part of the budget
+        size_t used = 0;
+        for (const auto & e : entries) {
+            if (!e->pinned && (e->ctx || e->loading)) {
+                used += e->size;
+            }
+        }
+
+        while (used > mem_max || mem_max - used < size) {
+            entry * lru = nullptr;
+            for (const auto & e : entries) {
+                // the only reference of an idle model is the entry
+                if (e->pinned || e->loading || !e->ctx || e->ctx.use_count() > 1) {
+                    continue;
+                }
+                if (lru == nullptr || e->t_last_used < lru->t_last_used) {
+                    lru = e.get();
+                }
+            }
+
+            if (lru == nullptr) {
+                LOG_WARNING("the models in use do not fit in the memory budget", {
+                    {"used",    used},
+                    {"size",    size},
+                    {"mem_max", mem_max},
+                });
+                break;
+            }
+
+            // the entry is loading again until it is unloaded, so that it is not used in the meantime
+            lru->loading = true;
+            used -= lru->size;
+            evicted.push_back(lru);
+        }
 
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+        return evicted;
+    }
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
+    std::shared_ptr<server_context> load(entry & e) {
+        LOG_INFO("loading model", {{"alias", e.alias}, {"model", e.path}});
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
+        gpt_params params_model = params;
+        params_model.model       = e.path;
+        params_model.model_alias = e.alias;
 
-                const size_t n_probs = std::min(cur_p.size, (size_t) slot.sparams.n_probs);
-                if (n_probs > 0) {
-                    const size_t n_valid = slot.ctx_sampling->n_valid;
+        std::shared_ptr<server_context> ctx = std::make_shared<server_context>();
+        ctx->slot_prompt_similarity = params.slot_prompt_similarity;
+        if (!params.system_prompt.empty()) {
+            ctx->system_prompt_set(params.system_prompt);
+        }
 
-                    // Make sure at least n_probs top tokens are at the front of the vector:
-                    if (slot.sparams.temp == 0.0f && n_probs > n_valid) {
-                        llama_sample_top_k(ctx, &cur_p, n_probs, 0);
-                    }
+        if (!ctx->load_model(params_model)) {
+            return nullptr;
+        }
+        ctx->init();
 
-                    if (slot.sparams.temp == 0.0f) {
-                        // With greedy sampling the probabilities have possibly not been calculated.
-                        for (size_t i = 0; i < n_probs; ++i) {
-                            result.probs.push_back({
-                                cur_p.data[i].id,
-                                i == 0 ? 1.0f : 0.0f
-                            });
-                        }
-                    } else {
-                        for (size_t i = 0; i < n_probs; ++i) {
-                            result.probs.push_back({
-                                cur_p.data[i].id,
-                                i >= n_valid ? 0.0f : cur_p.data[i].p // Tokens filtered out due to e.g. top_k have 0 probability.
-                            });
-                        }
-                    }
-                }
+        if (ctx->params.chat_template.empty() && !ctx->validate_model_chat_template()) {
+            LOG_WARNING("the chat template of the model is not supported, falling back to chatml", {{"alias", e.alias}});
+            ctx->params.chat_template = "chatml";
+        }
 
-                if (!process_token(result, slot)) {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
-                }
+        bind(*ctx);
 
-                slot.i_batch = -1;
-            }
-        }
+        server_context * ptr = ctx.get();
+        e.thread = std::thread([ptr]() {
+            ptr->queue_tasks.start_loop();
+        });
 
-        LOG_VERBOSE("run slots completed", {});
+        return ctx;
     }
 
-    json model_meta() const {
-        return json {
-            {"vocab_type",  llama_vocab_type    (model)},
-            {"n_vocab",     llama_n_vocab       (model)},
-            {"n_ctx_train", llama_n_ctx_train   (model)},
-            {"n_embd",      llama_n_embd        (model)},
-            {"n_params",    llama_model_n_params(model)},
-            {"size",        llama_model_size    (model)},
-        };
+    void unload(entry & e) {
+        LOG_INFO("unloading model", {{"alias", e.alias}});
+
+        e.ctx->queue_tasks.terminate();
+        e.thread.join();
+
+        std::shared_ptr<server_context> ctx;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ctx = std::move(e.ctx);
+            e.loading = false;
+            condition.notify_all();
+        }
     }
 };
 
@@ -2508,9 +4991,11 @@ int main(int argc, char ** argv) {
     });
 
     std::unique_ptr<httplib::Server> svr;
+    bool ssl = false;
 #ifdef CPPHTTPLIB_OPENSSL_SUPPORT
     if (params.ssl_file_key != "" && params.ssl_file_cert != "") {
         LOG_INFO("Running with SSL", {{"key", params.ssl_file_key}, {"cert", params.ssl_file_cert}});
+        ssl = true;
         svr.reset(
             new httplib::SSLServer(params.ssl_file_cert.c_str(), params.ssl_file_key.c_str())
         );
@@ -2524,6 +5009,26 @@ int main(int argc, char ** argv) {
 
     std::atomic<server_state> state{SERVER_STATE_LOADING_MODEL};
 
+    server_models models;
+    models.init(ctx_server, params);
+
+#ifdef SERVER_STREAM_LOOP
+    // the connections of streamed responses are handed over to event loops, the SSL server cannot hand them over
+    std::vector<std::unique_ptr<server_stream_loop>> stream_loops;
+    if (!ssl) {
+        for (int i = 0; i < params.n_threads_stream; ++i) {
+            std::unique_ptr<server_stream_loop> loop(new server_stream_loop());
+            if (!loop->start()) {
+                stream_loops.clear();
+                break;
+            }
+            stream_loops.push_back(std::move(loop));
+        }
+    }
+#else
+    GGML_UNUSED(ssl);
+#endif
+
     svr->set_default_headers({{"Server", "llama.cpp"}});
 
     // CORS preflight
@@ -2600,8 +5105,6 @@ int main(int argc, char ** argv) {
 
     LOG_INFO("model loaded", {});
 
-    const auto model_meta = ctx_server.model_meta();
-
     // if a custom chat template is not supplied, we will use the one that comes with the model (if any)
     if (params.chat_template.empty()) {
         if (!ctx_server.validate_model_chat_template()) {
@@ -2617,6 +5120,110 @@ int main(int argc, char ** argv) {
             {"built_in",     params.chat_template.empty()},
         });
     }
+    ctx_server.params.chat_template = params.chat_template;
+
+    // fairness key of a request for the scheduler: its API key
+    const auto request_key = [](const httplib::Request & req) {
+        const std::string auth_header = req.get_header_value("Authorization");
+        const std::string prefix = "Bearer ";
+        return auth_header.substr(0, prefix.size()) == prefix ? auth_header.substr(prefix.size()) : std::string();
+    };
+
+    // admission control: reject a request right away while too many completions are waiting for a slot
+    const auto reject_if_queue_full = [&params, &res_error](httplib::Response & res, server_context & ctx_server) {
+        if (params.n_queue_max <= 0 || (int32_t) ctx_server.queue_tasks.n_waiting_completions() < params.n_queue_max) {
+            return false;
+        }
+
+        ctx_server.metrics.n_requests_rejected++;
+
+        res.set_header("Retry-After", "1");
+        res_error(res, format_error_response("Too many requests are waiting for a slot, try again later", ERROR_TYPE_TOO_MANY_REQUESTS));
+        return true;
+    };
+
+    // the model of a request: the one named by its "model" field, or the default model
+    const auto get_model = [&models, &res_error](const json & data, httplib::Response & res) {
+        std::shared_ptr<server_context> ctx = models.get(json_value(data, "model", std::string()));
+        if (!ctx) {
+            res_error(res, format_error_response("Model failed to load", ERROR_TYPE_UNAVAILABLE));
+        }
+        return ctx;
+    };
+
+    // queue a streamed task of the model ctx with queue_task and send its results as server-sent events
+    const auto res_stream = [&](const httplib::Request & req, httplib::Response & res, const std::shared_ptr<server_context> & ctx, int id_task,
+                                const server_stream_format & format, const std::function<void()> & queue_task) {
+#ifdef SERVER_STREAM_LOOP
+        if (!stream_loops.empty()) {
+            server_stream_loop * loop = stream_loops[id_task % stream_loops.size()].get();
+
+            res.set_header("Content-Type", "text/event-stream");
+            const int id_conn = loop->add(ctx, id_task, format, server_stream_loop::format_head(res));
+
+            // the handler is destroyed with the response: if the connection was not handed over by then, it is cancelled
+            struct handover {
+                server_stream_loop * loop;
+                int  id_conn;
+                bool attached = false;
+
+                ~handover() {
+                    if (!attached) {
+                        loop->cancel(id_conn);
+                    }
+                }
+            };
+            auto ho = std::make_shared<handover>();
+            ho->loop    = loop;
+            ho->id_conn = id_conn;
+
+            res.socket_handler_ = [ho](socket_t sock) {
+                ho->attached = true;
+                ho->loop->attach(ho->id_conn, sock);
+            };
+
+            queue_task();
+            return;
+        }
+#endif
+
+        ctx->queue_results.add_waiting_task_id(id_task);
+        queue_task();
+
+        // the providers share the model, so that it stays loaded until the stream ends
+        const auto chunked_content_provider = [id_task, format, ctx](size_t, httplib::DataSink & sink) {
+            std::vector<server_task_result> results;
+            server_sse_writer writer;
+
+            bool done = false;
+            while (!done) {
+                ctx->queue_results.recv_stream(id_task, results);
+
+                writer.clear();
+                done = format.format(results, writer);
+
+                LOG_VERBOSE("data stream", {{"to_send", writer.buf}});
+
+                if (!writer.empty() && !sink.write(writer.buf.data(), writer.buf.size())) {
+                    ctx->queue_results.remove_waiting_task_id(id_task);
+                    return false;
+                }
+            }
+
+            ctx->queue_results.remove_waiting_task_id(id_task);
+            sink.done();
+
+            return true;
+        };
+
+        auto on_complete = [id_task, ctx](bool) {
+            // cancel the task if the client disconnected
+            ctx->request_cancel(id_task);
+            ctx->queue_results.remove_waiting_task_id(id_task);
+        };
+
+        res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+    };
 
     //
     // Middlewares
@@ -2808,6 +5415,10 @@ int main(int argc, char ** argv) {
                     {"name",  "tokens_predicted_seconds_total"},
                     {"help",  "Predict process time"},
                     {"value",  (uint64_t) data.at("t_tokens_generation_total") / 1.e3}
+            }, {
+                    {"name",  "preemptions_total"},
+                    {"help",  "Number of times a slot gave up its KV cache for other slots."},
+                    {"value",  (uint64_t) data.at("n_preemptions")}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -2833,6 +5444,14 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of request deferred."},
                     {"value",  (uint64_t) data.at("deferred")}
+            },{
+                    {"name",  "requests_rejected"},
+                    {"help",  "Number of requests rejected because the queue was full."},
+                    {"value",  (uint64_t) data.at("n_requests_rejected")}
+            },{
+                    {"name",  "requests_expired"},
+                    {"help",  "Number of requests whose deadline passed before they could start."},
+                    {"value",  (uint64_t) data.at("n_requests_expired")}
             }}}
         };
 
@@ -2940,6 +5559,39 @@ int main(int argc, char ** argv) {
         }
     };
 
+    const auto handle_lora_adapters = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+        res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+
+        server_task task;
+        task.id_multi  = -1;
+        task.id_target = -1;
+        task.type = SERVER_TASK_TYPE_LORA_ADAPTERS;
+
+        if (req.method == "POST") {
+            const json body = json::parse(req.body);
+            try {
+                ctx_server.parse_lora(body); // validate before the task is queued
+            } catch (const std::exception & e) {
+                res_error(res, format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            task.data = {
+                { "lora", body },
+            };
+        }
+
+        // the task id is registered before the task is posted, so that its result cannot arrive first
+        task.id = ctx_server.queue_tasks.get_new_id();
+
+        ctx_server.queue_results.add_waiting_task_id(task.id);
+        ctx_server.queue_tasks.post(task);
+
+        server_task_result result = ctx_server.queue_results.recv(task.id);
+        ctx_server.queue_results.remove_waiting_task_id(task.id);
+
+        res.set_content(result.data.dump(), "application/json");
+    };
+
     const auto handle_slots_action = [&res_error, &handle_slots_save, &handle_slots_restore, &handle_slots_erase](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
@@ -2977,17 +5629,23 @@ int main(int argc, char ** argv) {
         res.set_content(data.dump(), "application/json; charset=utf-8");
     };
 
-    const auto handle_completions = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_completions = [&res_error, &res_stream, &get_model, &request_key, &reject_if_queue_full](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
         json data = json::parse(req.body);
 
-        const int id_task = ctx_server.queue_tasks.get_new_id();
+        const auto ctx = get_model(data, res);
+        if (!ctx || reject_if_queue_full(res, *ctx)) {
+            return;
+        }
+        server_context & ctx_server = *ctx;
 
-        ctx_server.queue_results.add_waiting_task_id(id_task);
-        ctx_server.request_completion(id_task, -1, data, false, false);
+        const int id_task = ctx_server.queue_tasks.get_new_id();
 
         if (!json_value(data, "stream", false)) {
+            ctx_server.queue_results.add_waiting_task_id(id_task);
+            ctx_server.request_completion(id_task, -1, data, false, false, request_key(req));
+
             server_task_result result = ctx_server.queue_results.recv(id_task);
             if (!result.error && result.stop) {
                 res.set_content(result.data.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
@@ -2997,92 +5655,44 @@ int main(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_id(id_task);
         } else {
-            const auto chunked_content_provider = [id_task, &ctx_server](size_t, httplib::DataSink & sink) {
-                while (true) {
-                    server_task_result result = ctx_server.queue_results.recv(id_task);
-                    if (!result.error) {
-                        const std::string str =
-                            "data: " +
-                            result.data.dump(-1, ' ', false, json::error_handler_t::replace) +
-                            "\n\n";
-
-                        LOG_VERBOSE("data stream", {
-                            { "to_send", str }
-                        });
-
-                        if (!sink.write(str.c_str(), str.size())) {
-                            ctx_server.queue_results.remove_waiting_task_id(id_task);
-                            return false;
-                        }
-
-                        if (result.stop) {
-                            break;
-                        }
-                    } else {
-                        const std::string str =
-                            "error: " +
-                            result.data.dump(-1, ' ', false, json::error_handler_t::replace) +
-                            "\n\n";
-
-                        LOG_VERBOSE("data stream", {
-                            { "to_send", str }
-                        });
-
-                        if (!sink.write(str.c_str(), str.size())) {
-                            ctx_server.queue_results.remove_waiting_task_id(id_task);
-                            return false;
-                        }
-
-                        break;
-                    }
-                }
-
-                ctx_server.queue_results.remove_waiting_task_id(id_task);
-                sink.done();
-
-                return true;
-            };
-
-            auto on_complete = [id_task, &ctx_server] (bool) {
-                // cancel
-                ctx_server.request_cancel(id_task);
-                ctx_server.queue_results.remove_waiting_task_id(id_task);
-            };
-
-            res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+            res_stream(req, res, ctx, id_task, server_stream_format(), [&]() {
+                ctx_server.request_completion(id_task, -1, data, false, false, request_key(req));
+            });
         }
     };
 
-    const auto handle_models = [&params, &model_meta](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_models = [&models](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
-        json models = {
+        // the served models, with the metadata of the loaded ones
+        const json data = {
             {"object", "list"},
-            {"data", {
-                 {
-                     {"id",       params.model_alias},
-                     {"object",   "model"},
-                     {"created",  std::time(0)},
-                     {"owned_by", "llamacpp"},
-                     {"meta",     model_meta}
-                 },
-             }}
+            {"data",   models.list()},
         };
 
-        res.set_content(models.dump(), "application/json; charset=utf-8");
+        res.set_content(data.dump(), "application/json; charset=utf-8");
     };
 
-    const auto handle_chat_completions = [&ctx_server, &params, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_chat_completions = [&res_error, &res_stream, &get_model, &request_key, &reject_if_queue_full](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
-        json data = oaicompat_completion_params_parse(ctx_server.model, json::parse(req.body), params.chat_template);
 
-        const int id_task = ctx_server.queue_tasks.get_new_id();
+        const json body = json::parse(req.body);
 
-        ctx_server.queue_results.add_waiting_task_id(id_task);
-        ctx_server.request_completion(id_task, -1, data, false, false);
+        const auto ctx = get_model(body, res);
+        if (!ctx || reject_if_queue_full(res, *ctx)) {
+            return;
+        }
+        server_context & ctx_server = *ctx;
+
+        json data = oaicompat_completion_params_parse(ctx_server.model, body, ctx_server.params.chat_template);
+
+        const int id_task = ctx_server.queue_tasks.get_new_id();
 
         const auto completion_id = gen_chatcmplid();
         if (!json_value(data, "stream", false)) {
+            ctx_server.queue_results.add_waiting_task_id(id_task);
+            ctx_server.request_completion(id_task, -1, data, false, false, request_key(req));
+
             server_task_result result = ctx_server.queue_results.recv(id_task);
 
             if (!result.error && result.stop) {
@@ -3094,67 +5704,34 @@ int main(int argc, char ** argv) {
             }
             ctx_server.queue_results.remove_waiting_task_id(id_task);
         } else {
-            const auto chunked_content_provider = [id_task, &ctx_server, completion_id](size_t, httplib::DataSink & sink) {
-                while (true) {
-                    server_task_result result = ctx_server.queue_results.recv(id_task);
-                    if (!result.error) {
-                        std::vector<json> result_array = format_partial_response_oaicompat(result.data, completion_id);
-
-                        for (auto it = result_array.begin(); it != result_array.end(); ++it) {
-                            if (!it->empty()) {
-                                const std::string str =
-                                    "data: " +
-                                    it->dump(-1, ' ', false, json::error_handler_t::replace) +
-                                    "\n\n";
-                                LOG_VERBOSE("data stream", {{"to_send", str}});
-                                if (!sink.write(str.c_str(), str.size())) {
-                                    ctx_server.queue_results.remove_waiting_task_id(id_task);
-                                    return false;
-                                }
-                            }
-                        }
-                        if (result.stop) {
-                            break;
-                        }
-                    } else {
-                        const std::string str =
-                            "error: " +
-                            result.data.dump(-1, ' ', false, json::error_handler_t::replace) +
-                            "\n\n";
-                        LOG_VERBOSE("data stream", {{"to_send", str}});
-                        if (!sink.write(str.c_str(), str.size())) {
-                            ctx_server.queue_results.remove_waiting_task_id(id_task);
-                            return false;
-                        }
-                        break;
-                    }
-                }
-                sink.done();
-                ctx_server.queue_results.remove_waiting_task_id(id_task);
-                return true;
-            };
-
-            auto on_complete = [id_task, &ctx_server](bool) {
-                // cancel request
-                ctx_server.request_cancel(id_task);
-                ctx_server.queue_results.remove_waiting_task_id(id_task);
-            };
+            server_stream_format format;
+            format.oaicompat     = true;
+            format.completion_id = completion_id;
+            format.model         = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
 
-            res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+            res_stream(req, res, ctx, id_task, format, [&]() {
+                ctx_server.request_completion(id_task, -1, data, false, false, request_key(req));
+            });
         }
     };
 
-    const auto handle_infill = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_infill = [&res_error, &res_stream, &get_model, &request_key, &reject_if_queue_full](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
         json data = json::parse(req.body);
 
-        const int id_task = ctx_server.queue_tasks.get_new_id();
+        const auto ctx = get_model(data, res);
+        if (!ctx || reject_if_queue_full(res, *ctx)) {
+            return;
+        }
+        server_context & ctx_server = *ctx;
 
-        ctx_server.queue_results.add_waiting_task_id(id_task);
-        ctx_server.request_completion(id_task, -1, data, true, false);
+        const int id_task = ctx_server.queue_tasks.get_new_id();
 
         if (!json_value(data, "stream", false)) {
+            ctx_server.queue_results.add_waiting_task_id(id_task);
+            ctx_server.request_completion(id_task, -1, data, true, false, request_key(req));
+
             server_task_result result = ctx_server.queue_results.recv(id_task);
             if (!result.error && result.stop) {
                 res.set_content(result.data.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
@@ -3164,50 +5741,26 @@ int main(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_id(id_task);
         } else {
-            const auto chunked_content_provider = [id_task, &ctx_server](size_t, httplib::DataSink & sink) {
-                while (true) {
-                    server_task_result result = ctx_server.queue_results.recv(id_task);
-                    if (!result.error) {
-                        const std::string str =
-                            "data: " +
-                            result.data.dump(-1, ' ', false, json::error_handler_t::replace) +
-                            "\n\n";
-
-                        LOG_VERBOSE("data stream", {
-                            { "to_send", str }
-                        });
-
-                        if (!sink.write(str.c_str(), str.size())) {
-                            ctx_server.queue_results.remove_waiting_task_id(id_task);
-                            return false;
-                        }
-
-                        if (result.stop) {
-                            break;
-                        }
-                    } else {
-                        break;
-                    }
-                }
-
-                ctx_server.queue_results.remove_waiting_task_id(id_task);
-                sink.done();
-
-                return true;
-            };
-
-            auto on_complete = [id_task, &ctx_server] (bool) {
-                ctx_server.request_cancel(id_task);
-            };
+            // infill streams end without an error event
+            server_stream_format format;
+            format.errors = false;
 
-            res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+            res_stream(req, res, ctx, id_task, format, [&]() {
+                ctx_server.request_completion(id_task, -1, data, true, false, request_key(req));
+            });
         }
     };
 
-    const auto handle_tokenize = [&ctx_server](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_tokenize = [&get_model](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
         const json body = json::parse(req.body);
 
+        const auto ctx = get_model(body, res);
+        if (!ctx) {
+            return;
+        }
+        server_context & ctx_server = *ctx;
+
         std::vector<llama_token> tokens;
         if (body.count("content") != 0) {
             const bool add_special = json_value(body, "add_special", false);
@@ -3217,10 +5770,16 @@ int main(int argc, char ** argv) {
         return res.set_content(data.dump(), "application/json; charset=utf-8");
     };
 
-    const auto handle_detokenize = [&ctx_server](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_detokenize = [&get_model](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
         const json body = json::parse(req.body);
 
+        const auto ctx = get_model(body, res);
+        if (!ctx) {
+            return;
+        }
+        server_context & ctx_server = *ctx;
+
         std::string content;
         if (body.count("tokens") != 0) {
             const std::vector<llama_token> tokens = body.at("tokens");
@@ -3231,7 +5790,7 @@ int main(int argc, char ** argv) {
         return res.set_content(data.dump(), "application/json; charset=utf-8");
     };
 
-    const auto handle_embeddings = [&params, &ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_embeddings = [&params, &res_error, &get_model, &request_key, &reject_if_queue_full](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
         if (!params.embedding) {
             res.status = 501;
@@ -3240,6 +5799,22 @@ int main(int argc, char ** argv) {
         }
 
         const json body = json::parse(req.body);
+
+        const auto ctx = get_model(body, res);
+        if (!ctx) {
+            return;
+        }
+        server_context & ctx_server = *ctx;
+
+        if (llama_pooling_type(ctx_server.ctx) == LLAMA_POOLING_TYPE_RANK) {
+            res.status = 501;
+            res.set_content("This model does not support embeddings, it is a reranker", "text/plain; charset=utf-8");
+            return;
+        }
+        if (reject_if_queue_full(res, ctx_server)) {
+            return;
+        }
+
         bool is_openai = false;
 
         // an input prompt can be a string or a list of tokens (integer)
@@ -3260,7 +5835,7 @@ int main(int argc, char ** argv) {
         {
             const int id_task = ctx_server.queue_tasks.get_new_id();
             ctx_server.queue_results.add_waiting_task_id(id_task);
-            ctx_server.request_completion(id_task, -1, {{"prompt", prompt}}, false, true);
+            ctx_server.request_completion(id_task, -1, {{"prompt", prompt}}, false, true, request_key(req));
 
             // get the result
             server_task_result result = ctx_server.queue_results.recv(id_task);
@@ -3287,6 +5862,88 @@ int main(int argc, char ** argv) {
         return res.set_content(root.dump(), "application/json; charset=utf-8");
     };
 
+    const auto handle_rerank = [&params, &res_error, &get_model, &request_key, &reject_if_queue_full](const httplib::Request & req, httplib::Response & res) {
+        res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+        if (!params.embedding) {
+            res.status = 501;
+            res.set_content("This server does not support reranking. Start it with `--reranking` and a reranker model", "text/plain; charset=utf-8");
+            return;
+        }
+
+        const json body = json::parse(req.body);
+
+        const auto ctx = get_model(body, res);
+        if (!ctx) {
+            return;
+        }
+        server_context & ctx_server = *ctx;
+
+        if (llama_pooling_type(ctx_server.ctx) != LLAMA_POOLING_TYPE_RANK) {
+            res.status = 501;
+            res.set_content("This server does not support reranking. Start it with `--reranking` and a reranker model", "text/plain; charset=utf-8");
+            return;
+        }
+        if (reject_if_queue_full(res, ctx_server)) {
+            return;
+        }
+
+        if (!body.contains("query") || !body.at("query").is_string()) {
+            res_error(res, format_error_response("\"query\" must be provided as a string", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        const json documents = json_value(body, "documents", json::array());
+        if (!documents.is_array() || documents.empty()) {
+            res_error(res, format_error_response("\"documents\" must be a non-empty array", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        // the query is tokenized once and shared by all the query-document pairs,
+        // which are scored as separate sequences packed into the same batches (see update_embeddings)
+        const std::vector<llama_token> tokens_query = ctx_server.tokenize(body.at("query"), false);
+
+        json prompts = json::array();
+        for (const auto & doc : documents) {
+            const json text = doc.is_object() ? json_value(doc, "text", json()) : doc;
+            if (!text.is_string()) {
+                res_error(res, format_error_response("\"documents\" must contain strings or objects with a \"text\" field", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            prompts.push_back(format_rerank(ctx_server.model, tokens_query, ctx_server.tokenize(text, false)));
+        }
+
+        // a single prompt is a plain list of tokens
+        const json prompt = prompts.size() == 1 ? prompts[0] : prompts;
+
+        // create and queue the task
+        json responses;
+        {
+            const int id_task = ctx_server.queue_tasks.get_new_id();
+            ctx_server.queue_results.add_waiting_task_id(id_task);
+            ctx_server.request_completion(id_task, -1, {{"prompt", prompt}, {"rerank", true}}, false, true, request_key(req));
+
+            // get the result
+            server_task_result result = ctx_server.queue_results.recv(id_task);
+            ctx_server.queue_results.remove_waiting_task_id(id_task);
+            if (!result.error) {
+                if (result.data.count("results")) {
+                    // result for multi-task
+                    responses = result.data.at("results");
+                } else {
+                    // result for single task
+                    responses = std::vector<json>{result.data};
+                }
+            } else {
+                // error received, ignore everything else
+                res_error(res, result.data);
+                return;
+            }
+        }
+
+        const json root = format_rerank_response(body, responses);
+        return res.set_content(root.dump(), "application/json; charset=utf-8");
+    };
+
     auto handle_static_file = [](unsigned char * content, size_t len, const char * mime_type) {
         return [content, len, mime_type](const httplib::Request &, httplib::Response & res) {
             res.set_content(reinterpret_cast<const char*>(content), len, mime_type);
@@ -3338,8 +5995,12 @@ int main(int argc, char ** argv) {
     svr->Post("/embedding",           handle_embeddings); // legacy
     svr->Post("/embeddings",          handle_embeddings);
     svr->Post("/v1/embeddings",       handle_embeddings);
+    svr->Post("/rerank",              handle_rerank);
+    svr->Post("/v1/rerank",           handle_rerank);
     svr->Post("/tokenize",            handle_tokenize);
     svr->Post("/detokenize",          handle_detokenize);
+    svr->Get ("/lora-adapters",       handle_lora_adapters);
+    svr->Post("/lora-adapters",       handle_lora_adapters);
     if (!params.slot_save_path.empty()) {
         // only enable slot endpoints if slot_save_path is set
         svr->Post("/slots/:id_slot",  handle_slots_action);
@@ -3367,19 +6028,7 @@ int main(int argc, char ** argv) {
         return 0;
     });
 
-    ctx_server.queue_tasks.on_new_task(std::bind(
-        &server_context::process_single_task, &ctx_server, std::placeholders::_1));
-    ctx_server.queue_tasks.on_finish_multitask(std::bind(
-        &server_context::on_finish_multitask, &ctx_server, std::placeholders::_1));
-    ctx_server.queue_tasks.on_update_slots(std::bind(
-        &server_context::update_slots, &ctx_server));
-    ctx_server.queue_results.on_multitask_update(std::bind(
-        &server_queue::update_multitask,
-        &ctx_server.queue_tasks,
-        std::placeholders::_1,
-        std::placeholders::_2,
-        std::placeholders::_3
-    ));
+    models.bind(ctx_server);
 
     shutdown_handler = [&](int) {
         ctx_server.queue_tasks.terminate();
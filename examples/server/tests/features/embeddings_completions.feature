@@ -0,0 +1,46 @@
+@llama.cpp
+@embeddings
+Feature: llama.cpp server embeddings computed while the slots generate tokens
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   2 slots
+    And   512 KV cache size
+    And   continuous batching
+    And   embeddings extraction
+    And   mean as pooling type
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Packed embeddings do not disturb the completions of the slots
+    Given a completion request reference_completion is queued with:
+      """
+      {"prompt": "Once upon a time", "n_predict": 64, "temperature": 0}
+      """
+    And   an embedding request reference_embedding is queued with:
+      """
+      {"content": "What is the capital of France ?"}
+      """
+    Then  the queued requests are answered
+    Given a completion request completion_0 is queued with:
+      """
+      {"prompt": "Once upon a time", "n_predict": 64, "temperature": 0}
+      """
+    And   an embedding request embedding_0 is queued with:
+      """
+      {"content": "What is the capital of France ?"}
+      """
+    And   a completion request completion_1 is queued with:
+      """
+      {"prompt": "Once upon a time", "n_predict": 64, "temperature": 0}
+      """
+    And   an embedding request embedding_1 is queued with:
+      """
+      {"content": "What is the capital of France ?"}
+      """
+    Then  the queued requests are answered
+    And   the queued requests reference_completion,completion_0,completion_1 have the same result
+    And   the queued requests reference_embedding,embedding_0,embedding_1 have the same result
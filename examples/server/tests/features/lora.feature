@@ -0,0 +1,63 @@
+@llama.cpp
+@lora
+Feature: llama.cpp server LoRA adapters
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file stories15M_MOE-F16.gguf from HF repo ggml-org/stories15M_MOE
+    And   a LoRA adapter moe_shakespeare15M.gguf from url https://huggingface.co/ggml-org/stories15M_MOE/resolve/main/moe_shakespeare15M.gguf
+    And   42 as server seed
+    And   1 slots
+    And   1024 KV cache size
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: The default scales of the adapters are set and removed at runtime
+    Then  the LoRA adapter 0 has scale 1.0
+    Given a completion request adapted is queued with:
+      """
+      {"prompt": "Look in thy glass", "n_predict": 32, "temperature": 0}
+      """
+    Then  the queued requests are answered
+    Given the LoRA adapters are set to:
+      """
+      [{"id": 0, "scale": 0.0}]
+      """
+    Then  the server responds with status code 200
+    And   the LoRA adapter 0 has scale 0.0
+    Given a completion request base is queued with:
+      """
+      {"prompt": "Look in thy glass", "n_predict": 32, "temperature": 0}
+      """
+    Then  the queued requests are answered
+    Given the LoRA adapters are set to:
+      """
+      [{"id": 0, "scale": 1.0}]
+      """
+    Then  the LoRA adapter 0 has scale 1.0
+    Given a completion request adapted_again is queued with:
+      """
+      {"prompt": "Look in thy glass", "n_predict": 32, "temperature": 0}
+      """
+    Then  the queued requests are answered
+    Given the LoRA adapters are set to:
+      """
+      []
+      """
+    Then  the LoRA adapter 0 has scale 0.0
+    Given a completion request base_again is queued with:
+      """
+      {"prompt": "Look in thy glass", "n_predict": 32, "temperature": 0}
+      """
+    Then  the queued requests are answered
+    And   the queued requests adapted,adapted_again have the same result
+    And   the queued requests base,base_again have the same result
+    And   the queued requests adapted and base have different results
+
+  Scenario: Unknown adapters are rejected
+    Given the LoRA adapters are set to:
+      """
+      [{"id": 1, "scale": 1.0}]
+      """
+    Then  the server responds with status code 400
+    And   the LoRA adapter 0 has scale 1.0
@@ -0,0 +1,55 @@
+@llama.cpp
+@models
+Feature: llama.cpp server serving multiple models
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   a model alias tinyllama-2
+    And   a served model stories-a from test-model.gguf
+    And   a served model stories-b from test-model.gguf
+    And   1 MiB as models memory budget
+    And   42 as server seed
+    And   128 KV cache size
+    And   2 slots
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Models available
+    Given available models
+    Then  3 models are supported
+    Then  model 0 is identified by tinyllama-2
+    Then  model 1 is identified by stories-a
+    Then  model 2 is identified by stories-b
+    Then  1 models are loaded
+
+  Scenario Outline: Completion routed by model
+    Given a model <model>
+    And   a user prompt Write a story
+    And   8 max tokens to predict
+    And   streaming is <enable_streaming>
+    Given an OAI compatible chat completions request with no api error
+    Then  8 tokens are predicted
+
+    Examples: Models
+      | model        | enable_streaming |
+      | stories-a    | disabled         |
+      | stories-b    | enabled          |
+      | unknown      | enabled          |
+
+  Scenario: Least recently used models are unloaded
+    Given a model stories-a
+    And   a user prompt Write a story
+    And   8 max tokens to predict
+    Given an OAI compatible chat completions request with no api error
+    Then  8 tokens are predicted
+    Given available models
+    Then  2 models are loaded
+    Given a model stories-b
+    And   a user prompt Write a story
+    And   8 max tokens to predict
+    Given an OAI compatible chat completions request with no api error
+    Then  8 tokens are predicted
+    Given available models
+    Then  2 models are loaded
@@ -0,0 +1,65 @@
+@llama.cpp
+@preemption
+Feature: llama.cpp server slot preemption under KV cache pressure
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   256 KV cache size
+    And   4 slots
+    And   continuous batching
+    And   4.0 as KV cache overcommit
+    And   prometheus compatible metrics exposed
+
+  Scenario Outline: Multi users with more tokens than the KV cache fits
+    Given <preempt> as KV cache preemption
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Write another very long music lyrics.
+      """
+    And a prompt:
+      """
+      Write a very long poem.
+      """
+    And a prompt:
+      """
+      Write a very long joke.
+      """
+    And 128 max tokens to predict
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are predicted with 128 tokens
+    Given prometheus metrics are exposed
+
+    Examples:
+      | preempt   |
+      | swap      |
+      | recompute |
+
+  Scenario: Slots added on demand to a shared KV cache pool
+    Given a KV cache pool
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Write another very long music lyrics.
+      """
+    And 128 max tokens to predict
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    Then all prompts are predicted with 128 tokens
@@ -0,0 +1,36 @@
+@llama.cpp
+@prefill
+Feature: llama.cpp server chunked prompt processing
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   512 KV cache size
+    And   128 as batch size
+    And   2 slots
+    And   continuous batching
+    And   16 as prefill budget
+    And   8 as prefill chunk size
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Multi users with a long prompt
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends.
+      One day, she saw a big tree with a swing. She ran to the swing and sat on it. She swung high and low, and she
+      laughed and laughed. Then her mom called her home for dinner. Lily was sad to leave the park, but she was happy
+      because she knew she could come back tomorrow and play on the swing again with all of her friends.
+      """
+    And 32 max tokens to predict
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are predicted with 32 tokens
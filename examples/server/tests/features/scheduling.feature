@@ -0,0 +1,70 @@
+@llama.cpp
+@scheduling
+Feature: llama.cpp server scheduling of the requests waiting for a slot
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   512 KV cache size
+    And   1 slots
+    And   prometheus compatible metrics exposed
+
+  Scenario: Higher priority requests are started first
+    Then  the server is starting
+    Then  the server is healthy
+    Given a completion request blocker is queued with:
+      """
+      {"prompt": "Once upon a time", "n_predict": 4096, "ignore_eos": true}
+      """
+    And   a completion request batch is queued with:
+      """
+      {"prompt": "Hello batch", "n_predict": 8, "priority": "batch"}
+      """
+    And   a completion request normal is queued with:
+      """
+      {"prompt": "Hello normal", "n_predict": 8}
+      """
+    And   a completion request interactive is queued with:
+      """
+      {"prompt": "Hello interactive", "n_predict": 8, "priority": "interactive"}
+      """
+    Then  the queued requests are completed in order blocker,interactive,normal,batch
+
+  Scenario: Requests are rejected when their deadline passes while waiting
+    Then  the server is starting
+    Then  the server is healthy
+    Given a completion request blocker is queued with:
+      """
+      {"prompt": "Once upon a time", "n_predict": 4096, "ignore_eos": true}
+      """
+    And   a completion request expired is queued with:
+      """
+      {"prompt": "Hello", "n_predict": 8, "deadline_ms": 100}
+      """
+    Then  the queued request expired is answered with status code 503 within 1000 ms
+    Then  the queued requests are completed in order blocker
+    Given prometheus metrics are exposed
+    Then  metric llamacpp:requests_expired is 1
+
+  Scenario: Requests are rejected when the queue is full
+    Given 1 as max queued requests
+    Then  the server is starting
+    Then  the server is healthy
+    Given a completion request blocker is queued with:
+      """
+      {"prompt": "Once upon a time", "n_predict": 4096, "ignore_eos": true}
+      """
+    And   a completion request waiting is queued with:
+      """
+      {"prompt": "Hello waiting", "n_predict": 8}
+      """
+    And   a completion request rejected is queued with:
+      """
+      {"prompt": "Hello rejected", "n_predict": 8}
+      """
+    Then  the queued request rejected is answered with status code 429 within 1000 ms
+    Then  the queued requests are completed in order blocker,waiting
+    Given prometheus metrics are exposed
+    Then  metric llamacpp:requests_rejected is 1
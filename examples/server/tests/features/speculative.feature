@@ -0,0 +1,64 @@
+@llama.cpp
+@speculative
+Feature: llama.cpp server speculative decoding
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   256 KV cache size
+    And   32 as batch size
+    And   2 slots
+    And   64 server max tokens to predict
+    And   continuous batching
+
+  Scenario Outline: Completion with drafted tokens
+    Given a draft model file test-model.gguf
+    And   <n_draft> as draft
+    And   <n_seq_draft> draft sequences
+    Then  the server is starting
+    Then  the server is healthy
+
+    Given a prompt I believe the meaning of life is
+    And   8 max tokens to predict
+    And   a completion request with no api error
+    Then  8 tokens are predicted matching (read|going)+
+
+    Examples: Drafts
+      | n_draft | n_seq_draft |
+      | 4       | 1           |
+      | 8       | 3           |
+
+  Scenario: Multi users with drafted tokens
+    Given a draft model file test-model.gguf
+    And   4 as draft
+    And   2 draft sequences
+    Then  the server is starting
+    Then  the server is healthy
+
+    Given a prompt:
+      """
+      Write a very long story about AI.
+      """
+    And a prompt:
+      """
+      Write another very long music lyrics.
+      """
+    And 32 max tokens to predict
+    Given concurrent completion requests
+    Then the server is busy
+    Then the server is idle
+    And  all slots are idle
+    Then all prompts are predicted with 32 tokens
+
+  Scenario: Completion with lookup decoding
+    Given lookup decoding
+    And   8 as draft
+    Then  the server is starting
+    Then  the server is healthy
+
+    Given a prompt I believe the meaning of life is
+    And   8 max tokens to predict
+    And   a completion request with no api error
+    Then  8 tokens are predicted matching (read|going)+
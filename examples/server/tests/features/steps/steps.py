@@ -8,6 +8,7 @@ import subprocess
 import sys
 import threading
 import time
+import urllib.request
 from contextlib import closing
 from re import RegexFlag
 
@@ -63,6 +64,19 @@ def step_server_config(context, server_fqdn, server_port):
     context.server_process = None
     context.seed = None
     context.draft = None
+    context.model_draft = None
+    context.n_seq_draft = None
+    context.lookup = False
+    context.prefill_budget = None
+    context.prefill_chunk = None
+    context.kv_overcommit = None
+    context.kv_preempt = None
+    context.kv_pool = False
+    context.n_queue_max = None
+    context.pooling = None
+    context.lora_files = []
+    context.served_models = []
+    context.models_mem_max = None
     context.server_seed = None
     context.user_api_key = None
     context.response_format = None
@@ -71,6 +85,9 @@ def step_server_config(context, server_fqdn, server_port):
     context.tasks_result = []
     context.concurrent_tasks = []
     context.prompts = []
+    context.queued_requests = {}
+    context.queued_requests_done = []
+    context.queued_results = {}
 
 
 @step('a model file {hf_file} from HF repo {hf_repo}')
@@ -120,6 +137,73 @@ def step_draft(context, draft):
     context.draft = draft
 
 
+@step('a draft model file {model_draft}')
+def step_model_draft(context, model_draft):
+    context.model_draft = model_draft
+
+
+@step('{n_seq_draft:d} draft sequences')
+def step_n_seq_draft(context, n_seq_draft):
+    context.n_seq_draft = n_seq_draft
+
+
+@step('lookup decoding')
+def step_lookup(context):
+    context.lookup = True
+
+
+@step('{prefill_budget:d} as prefill budget')
+def step_prefill_budget(context, prefill_budget):
+    context.prefill_budget = prefill_budget
+
+
+@step('{prefill_chunk:d} as prefill chunk size')
+def step_prefill_chunk(context, prefill_chunk):
+    context.prefill_chunk = prefill_chunk
+
+
+@step('{kv_overcommit:f} as KV cache overcommit')
+def step_kv_overcommit(context, kv_overcommit):
+    context.kv_overcommit = kv_overcommit
+
+
+@step('{kv_preempt} as KV cache preemption')
+def step_kv_preempt(context, kv_preempt):
+    context.kv_preempt = kv_preempt
+
+
+@step('a KV cache pool')
+def step_kv_pool(context):
+    context.kv_pool = True
+
+
+@step('a LoRA adapter {lora_file} from url {lora_url}')
+def step_lora_adapter(context, lora_file, lora_url):
+    if not os.path.exists(lora_file):
+        urllib.request.urlretrieve(lora_url, lora_file)
+    context.lora_files.append(lora_file)
+
+
+@step('{pooling} as pooling type')
+def step_pooling(context, pooling):
+    context.pooling = pooling
+
+
+@step('{n_queue_max:d} as max queued requests')
+def step_n_queue_max(context, n_queue_max):
+    context.n_queue_max = n_queue_max
+
+
+@step('a served model {model_alias} from {model_file}')
+def step_served_model(context, model_alias, model_file):
+    context.served_models.append(f'{model_alias}={model_file}')
+
+
+@step('{models_mem_max:d} MiB as models memory budget')
+def step_models_mem_max(context, models_mem_max):
+    context.models_mem_max = models_mem_max
+
+
 @step('{n_ctx:d} KV cache size')
 def step_n_ctx(context, n_ctx):
     context.n_ctx = n_ctx
@@ -788,6 +872,13 @@ def step_supported_models(context, n_model):
     assert len(context.models) == n_model
 
 
+@step('{n_loaded:d} models are loaded')
+def step_loaded_models(context, n_loaded):
+    # only the loaded models have metadata
+    n_models = len([model for model in context.models if 'meta' in model])
+    assert n_models == n_loaded, f"{n_models} models are loaded instead of {n_loaded}"
+
+
 @step('model {i_model:d} is {param} {preposition} {param_value}')
 def step_supported_models(context, i_model, param, preposition, param_value):
     assert i_model < len(context.models)
@@ -850,6 +941,84 @@ def step_server_responds_with_status_code(context, status_code):
     assert context.response.status == status_code
 
 
+@step('a completion request {name} is queued with')
+@async_run_until_complete
+async def step_queue_completion(context, name):
+    # the request body is given as JSON, the requests are answered in the background
+    context.queued_requests[name] = asyncio.create_task(
+        request_queued(context, name, '/completion', json.loads(context.text)))
+    await asyncio.sleep(0.1)
+
+
+@step('an embedding request {name} is queued with')
+@async_run_until_complete
+async def step_queue_embedding(context, name):
+    context.queued_requests[name] = asyncio.create_task(
+        request_queued(context, name, '/embedding', json.loads(context.text)))
+    await asyncio.sleep(0.1)
+
+
+@step('the queued requests are answered')
+@async_run_until_complete
+async def step_queued_requests_answered(context):
+    await asyncio.gather(*context.queued_requests.values())
+    for name, status, _ in context.queued_requests_done:
+        assert status == 200, f"{name}: status code {status}"
+
+
+@step('the LoRA adapters are set to')
+@async_run_until_complete
+async def step_set_lora_adapters(context):
+    async with aiohttp.ClientSession() as session:
+        async with session.post(f'{context.base_url}/lora-adapters',
+                                json=json.loads(context.text)) as response:
+            context.response = response
+            if response.status == 200:
+                context.lora_adapters = await response.json()
+
+
+@step('the LoRA adapter {id_adapter:d} has scale {scale:f}')
+@async_run_until_complete
+async def step_lora_adapter_scale(context, id_adapter, scale):
+    async with aiohttp.ClientSession() as session:
+        async with session.get(f'{context.base_url}/lora-adapters') as response:
+            assert response.status == 200
+            adapters = await response.json()
+    assert adapters[id_adapter]['id'] == id_adapter
+    assert adapters[id_adapter]['scale'] == scale, f"adapter {id_adapter}: scale {adapters[id_adapter]['scale']} != {scale}"
+
+
+@step('the queued requests {name_a} and {name_b} have different results')
+def step_queued_requests_different_result(context, name_a, name_b):
+    assert context.queued_results[name_a]['content'] != context.queued_results[name_b]['content']
+
+
+@step('the queued requests {names} have the same result')
+def step_queued_requests_same_result(context, names):
+    results = [context.queued_results[name] for name in names.split(',')]
+    for result in results[1:]:
+        if 'embedding' in results[0]:
+            assert np.allclose(result['embedding'], results[0]['embedding'], atol=1e-4), "embeddings differ"
+        else:
+            assert result['content'] == results[0]['content'], f"{result['content']} != {results[0]['content']}"
+
+
+@step('the queued requests are completed in order {names}')
+@async_run_until_complete
+async def step_queued_requests_order(context, names):
+    await asyncio.gather(*context.queued_requests.values())
+    order = [name for name, status, _ in context.queued_requests_done if status == 200]
+    assert order == names.split(','), f"completion order: {order}"
+
+
+@step('the queued request {name} is answered with status code {status_code:d} within {max_ms:d} ms')
+@async_run_until_complete
+async def step_queued_request_status(context, name, status_code, max_ms):
+    status, t_ms = await context.queued_requests[name]
+    assert status == status_code, f"{name}: status code {status} != {status_code}"
+    assert t_ms < max_ms, f"{name}: answered after {t_ms:.0f} ms"
+
+
 async def request_completion(prompt,
                              seed,
                              base_url,
@@ -896,6 +1065,21 @@ async def request_completion(prompt,
                 return response.status
 
 
+async def request_queued(context, name, path, body):
+    t_start = time.time()
+    async with aiohttp.ClientSession() as session:
+        async with session.post(f'{context.base_url}{path}',
+                                json=body,
+                                timeout=3600) as response:
+            if response.status == 200:
+                context.queued_results[name] = await response.json()
+            else:
+                await response.read()
+            t_ms = 1000 * (time.time() - t_start)
+            context.queued_requests_done.append((name, response.status, t_ms))
+            return response.status, t_ms
+
+
 async def oai_chat_completions(user_prompt,
                                seed,
                                system_prompt,
@@ -1300,6 +1484,32 @@ def start_server_background(context):
         server_args.extend(['--n-gpu-layers', context.n_gpu_layer])
     if context.draft is not None:
         server_args.extend(['--draft', context.draft])
+    if context.model_draft:
+        server_args.extend(['--model-draft', context.model_draft])
+    if context.n_seq_draft:
+        server_args.extend(['--draft-seqs', context.n_seq_draft])
+    if context.lookup:
+        server_args.append('--lookup')
+    if context.prefill_budget is not None:
+        server_args.extend(['--prefill-budget', context.prefill_budget])
+    if context.prefill_chunk is not None:
+        server_args.extend(['--prefill-chunk', context.prefill_chunk])
+    if context.kv_overcommit is not None:
+        server_args.extend(['--kv-overcommit', context.kv_overcommit])
+    if context.kv_preempt is not None:
+        server_args.extend(['--kv-preempt', context.kv_preempt])
+    if context.kv_pool:
+        server_args.append('--kv-pool')
+    if context.n_queue_max is not None:
+        server_args.extend(['--max-queue', context.n_queue_max])
+    if context.pooling is not None:
+        server_args.extend(['--pooling', context.pooling])
+    for lora_file in context.lora_files:
+        server_args.extend(['--lora', lora_file])
+    for served_model in context.served_models:
+        server_args.extend(['--serve-model', served_model])
+    if context.models_mem_max is not None:
+        server_args.extend(['--models-mem-max', context.models_mem_max])
     if context.server_continuous_batching:
         server_args.append('--cont-batching')
     if context.server_embeddings:
@@ -11,6 +11,7 @@
 #include <vector>
 #include <sstream>
 #include <random>
+#include <algorithm>
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo-0613"
 
@@ -25,6 +26,7 @@ enum error_type {
     ERROR_TYPE_PERMISSION,
     ERROR_TYPE_UNAVAILABLE, // custom error
     ERROR_TYPE_NOT_SUPPORTED, // custom error
+    ERROR_TYPE_TOO_MANY_REQUESTS, // custom error
 };
 
 extern bool server_verbose;
@@ -559,6 +561,125 @@ static std::vector<json> format_partial_response_oaicompat(json result, const st
     return std::vector<json>({ret});
 }
 
+// length of the UTF-8 sequence at the start of str, 0 if it is not valid (overlong, surrogate, > U+10FFFF or truncated)
+static size_t utf8_sequence_len(const unsigned char * str, size_t len) {
+    const unsigned char c = str[0];
+    size_t n;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    if (c < 0x80) {
+        return 1;
+    } else if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        n  = 3;
+        lo = c == 0xE0 ? 0xA0 : 0x80;
+        hi = c == 0xED ? 0x9F : 0xBF;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        n  = 4;
+        lo = c == 0xF0 ? 0x90 : 0x80;
+        hi = c == 0xF4 ? 0x8F : 0xBF;
+    } else {
+        return 0;
+    }
+    if (n > len || str[1] < lo || str[1] > hi) {
+        return 0;
+    }
+    for (size_t i = 2; i < n; ++i) {
+        if (str[i] < 0x80 || str[i] > 0xBF) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+// append str to out as a JSON string, the same as json(str).dump(-1, ' ', false, json::error_handler_t::replace)
+static void json_append_string(std::string & out, const std::string & str) {
+    const size_t n_out = out.size();
+
+    out += '"';
+    const unsigned char * p = (const unsigned char *) str.data();
+    const size_t len = str.size();
+    for (size_t i = 0; i < len; ) {
+        const unsigned char c = p[i];
+        if (c >= 0x80) {
+            const size_t n = utf8_sequence_len(p + i, len - i);
+            if (n == 0) {
+                // invalid UTF-8 is rare, leave the replacement characters to the JSON library
+                out.resize(n_out);
+                out += json(str).dump(-1, ' ', false, json::error_handler_t::replace);
+                return;
+            }
+            out.append((const char *) p + i, n);
+            i += n;
+            continue;
+        }
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b";  break;
+            case '\f': out += "\\f";  break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += (char) c;
+                }
+        }
+        ++i;
+    }
+    out += '"';
+}
+
+// builds the events of a server-sent event stream in a buffer that is reused for the whole stream
+// the token deltas are formatted directly, they produce the same text as the JSON objects of
+// send_partial_response() and format_partial_response_oaicompat() without building them
+struct server_sse_writer {
+    std::string buf;
+
+    void clear() {
+        buf.clear();
+    }
+
+    bool empty() const {
+        return buf.empty();
+    }
+
+    void event(const char * field, const json & data) {
+        buf += field;
+        buf += ": ";
+        buf += data.dump(-1, ' ', false, json::error_handler_t::replace);
+        buf += "\n\n";
+    }
+
+    // a /completion token delta
+    void delta(const std::string & content, int id_slot) {
+        buf += "data: {\"content\":";
+        json_append_string(buf, content);
+        buf += ",\"stop\":false,\"id_slot\":";
+        buf += std::to_string(id_slot);
+        buf += ",\"multimodal\":false}\n\n";
+    }
+
+    // a chat.completion.chunk token delta, after the first one
+    void delta_oaicompat(const std::string & content, const std::string & completion_id, const std::string & model) {
+        buf += "data: {\"choices\":[{\"finish_reason\":null,\"index\":0,\"delta\":{\"content\":";
+        json_append_string(buf, content);
+        buf += "}}],\"created\":";
+        buf += std::to_string((int64_t) std::time(0));
+        buf += ",\"id\":";
+        json_append_string(buf, completion_id);
+        buf += ",\"model\":";
+        json_append_string(buf, model);
+        buf += ",\"object\":\"chat.completion.chunk\"}\n\n";
+    }
+};
+
 static json format_embeddings_response_oaicompat(const json & request, const json & embeddings) {
     json data = json::array();
     int i = 0;
@@ -583,6 +704,77 @@ static json format_embeddings_response_oaicompat(const json & request, const jso
     return res;
 }
 
+// build the input of a cross-encoder from a query and a document:
+//   [CLS] query [SEP] document [SEP]           (WPM vocabs, e.g. BERT)
+//   <s> query </s></s> document </s>           (otherwise, e.g. XLM-RoBERTa)
+static std::vector<llama_token> format_rerank(const struct llama_model * model, const std::vector<llama_token> & query, const std::vector<llama_token> & doc) {
+    const llama_token tok_cls = llama_token_cls(model);
+    const llama_token tok_sep = llama_token_sep(model);
+
+    const llama_token tok_beg = tok_cls != -1 ? tok_cls : llama_token_bos(model);
+    const llama_token tok_end = tok_sep != -1 ? tok_sep : llama_token_eos(model);
+
+    std::vector<llama_token> result;
+    result.reserve(query.size() + doc.size() + 4);
+
+    if (tok_beg != -1) {
+        result.push_back(tok_beg);
+    }
+    result.insert(result.end(), query.begin(), query.end());
+    result.push_back(tok_end);
+    if (llama_vocab_type(model) != LLAMA_VOCAB_TYPE_WPM) {
+        result.push_back(tok_end);
+    }
+    result.insert(result.end(), doc.begin(), doc.end());
+    result.push_back(tok_end);
+
+    return result;
+}
+
+// ranks: the results of the documents in the order of the request, sorted by decreasing score in the response
+static json format_rerank_response(const json & request, const json & ranks) {
+    const json documents = json_value(request, "documents", json::array());
+    const bool return_documents = json_value(request, "return_documents", false);
+
+    std::vector<std::pair<float, int>> order;
+    int n_tokens = 0;
+    for (size_t i = 0; i < ranks.size(); ++i) {
+        order.emplace_back(json_value(ranks[i], "score", 0.0f), (int) i);
+        n_tokens += json_value(ranks[i], "tokens_evaluated", 0);
+    }
+    std::stable_sort(order.begin(), order.end(), [](const std::pair<float, int> & a, const std::pair<float, int> & b) {
+        return a.first > b.first;
+    });
+
+    const int top_n = json_value(request, "top_n", (int) order.size());
+    if (top_n >= 0 && top_n < (int) order.size()) {
+        order.resize(top_n);
+    }
+
+    json results = json::array();
+    for (const auto & o : order) {
+        json elem = json {
+            {"index",           o.second},
+            {"relevance_score", o.first},
+        };
+        if (return_documents && o.second < (int) documents.size()) {
+            const json & doc = documents[o.second];
+            elem["document"] = doc.is_string() ? json {{"text", doc}} : doc;
+        }
+        results.push_back(elem);
+    }
+
+    return json {
+        {"model", json_value(request, "model", std::string(DEFAULT_OAICOMPAT_MODEL))},
+        {"object", "list"},
+        {"usage", json {
+            {"prompt_tokens", n_tokens},
+            {"total_tokens",  n_tokens}
+        }},
+        {"results", results}
+    };
+}
+
 static json format_tokenizer_response(const std::vector<llama_token> & tokens) {
     return json {
         {"tokens", tokens}
@@ -627,6 +819,10 @@ static json format_error_response(const std::string & message, const enum error_
             type_str = "unavailable_error";
             code = 503;
             break;
+        case ERROR_TYPE_TOO_MANY_REQUESTS:
+            type_str = "too_many_requests_error";
+            code = 429;
+            break;
     }
     return json {
         {"code", code},
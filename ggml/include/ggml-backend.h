@@ -111,6 +111,22 @@ extern "C" {
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void);
 #endif
 
+    //
+    // Split buffer
+    //
+
+    // Buffer type that distributes the rows of the matrices between several buffer types
+    // tensor_split contains the proportion of the rows stored in each buffer type (all zero: equal split)
+    // Each part of a matrix (shard) is a regular tensor allocated in one of the buffer types, so that the mat-mul of each shard
+    // can be scheduled on the backend that holds it. The matrices themselves cannot be used in a graph, only their shards.
+    // Tensors that are not matrices are not split, they are allocated whole in one of the buffer types.
+    GGML_API ggml_backend_buffer_type_t ggml_backend_split_buffer_type(ggml_backend_buffer_type_t * bufts, const float * tensor_split, int n_bufts);
+
+    GGML_API bool                 ggml_backend_buft_is_split           (ggml_backend_buffer_type_t buft);
+    GGML_API bool                 ggml_backend_buffer_is_split         (ggml_backend_buffer_t buffer);
+    GGML_API int                  ggml_backend_split_tensor_n_shards   (const struct ggml_tensor * tensor);
+    GGML_API struct ggml_tensor * ggml_backend_split_tensor_get_shard  (const struct ggml_tensor * tensor, int i);
+
     //
     // Backend registry
     //
@@ -17,7 +17,11 @@ GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const
 
 GGML_API GGML_CALL void ggml_backend_rpc_get_device_memory(const char * endpoint, size_t * free, size_t * total);
 
-GGML_API GGML_CALL void start_rpc_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem);
+// serves every client in its own thread, the clients share the backend and free_mem
+// cache_dir (optional): directory of the cached tensor data uploaded by the clients
+// gguf_files: models whose tensors are indexed at startup, the clients do not upload the data found in them
+GGML_API GGML_CALL void start_rpc_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem,
+                                         const char * cache_dir, const char * const * gguf_files, size_t n_gguf_files);
 
 #ifdef  __cplusplus
 }
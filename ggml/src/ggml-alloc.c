@@ -22,6 +22,7 @@ static bool ggml_is_view(const struct ggml_tensor * t) {
     return t->view_src != NULL;
 }
 
+// strides of dimensions with a single element do not change the position of any element
 static bool ggml_are_same_layout(const struct ggml_tensor * a, const struct ggml_tensor * b) {
     if (a->type != b->type) {
         return false;
@@ -30,31 +31,44 @@ static bool ggml_are_same_layout(const struct ggml_tensor * a, const struct ggml
         if (a->ne[i] != b->ne[i]) {
             return false;
         }
-        if (a->nb[i] != b->nb[i]) {
+        if (a->ne[i] > 1 && a->nb[i] != b->nb[i]) {
             return false;
         }
     }
     return true;
 }
 
-static bool ggml_op_can_inplace(enum ggml_op op) {
-    switch (op) {
-        case GGML_OP_SCALE:
-        case GGML_OP_DIAG_MASK_ZERO:
-        case GGML_OP_DIAG_MASK_INF:
+// returns true if the result of the node can be written over src[i]
+// this is the case when each element of the result only depends on the element of src[i] in the same position,
+// or on a row (or group of rows) of src[i] that is read entirely before the same row of the result is written
+static bool ggml_op_can_inplace(const struct ggml_tensor * node, int i) {
+    switch (node->op) {
+        // element-wise, any operand with the same layout as the result
         case GGML_OP_ADD:
         case GGML_OP_ADD1:
         case GGML_OP_SUB:
         case GGML_OP_MUL:
         case GGML_OP_DIV:
+            return true;
+
+        // element-wise
+        case GGML_OP_SCALE:
         case GGML_OP_SQR:
         case GGML_OP_SQRT:
         case GGML_OP_LOG:
+        case GGML_OP_CLAMP:
+        case GGML_OP_LEAKY_RELU:
         case GGML_OP_UNARY:
+        case GGML_OP_DIAG_MASK_ZERO:
+        case GGML_OP_DIAG_MASK_INF:
+        // pairs of elements of the same row
         case GGML_OP_ROPE:
-        case GGML_OP_RMS_NORM:
+        // rows, the other operands are the mask and the positions
         case GGML_OP_SOFT_MAX:
-            return true;
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_GROUP_NORM:
+            return i == 0;
 
         default:
             return false;
@@ -335,9 +349,30 @@ struct hash_node {
     int n_views;
     int buffer_id;
     size_t offset; // offset within the buffer
+    int block;     // index in ggml_gallocr::blocks
     bool allocated;
 };
 
+// a range of memory allocated by ggml_dyn_tallocr, shared by a tensor and the tensors that reuse it inplace
+// the lifetimes of the blocks are used to re-plan their offsets after the graph has been simulated
+struct alloc_block {
+    int buffer_id;    // first buffer that uses the same allocator
+    int start;        // index of the node in which the block is allocated (-1 = before the first node)
+    int end;          // index of the node after which the block is freed (INT_MAX = never)
+    size_t size;
+    size_t offset;      // offset assigned by ggml_dyn_tallocr
+    size_t plan_offset; // offset used in the buffer
+};
+
+// cache of the planned offsets, to avoid re-planning when the same graph is reserved again
+#define GGML_GALLOCR_MAX_PLANS 8
+
+struct alloc_plan {
+    uint64_t hash;
+    int n_blocks;
+    struct alloc_block * blocks;
+};
+
 struct tensor_alloc {
     int buffer_id;
     size_t offset;
@@ -368,6 +403,15 @@ struct ggml_gallocr {
 
     struct leaf_alloc * leaf_allocs; // [n_leafs]
     int n_leafs;
+
+    struct alloc_block * blocks; // [n_blocks]
+    int n_blocks;
+    int blocks_size;
+    int cur_node;
+
+    struct alloc_plan plans[GGML_GALLOCR_MAX_PLANS];
+    int n_plans;
+    int next_plan;
 };
 
 ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs) {
@@ -450,6 +494,10 @@ void ggml_gallocr_free(ggml_gallocr_t galloc) {
     free(galloc->buf_tallocs);
     free(galloc->node_allocs);
     free(galloc->leaf_allocs);
+    free(galloc->blocks);
+    for (int i = 0; i < galloc->n_plans; i++) {
+        free(galloc->plans[i].blocks);
+    }
     free(galloc);
 }
 
@@ -475,6 +523,36 @@ static bool ggml_gallocr_is_allocated(ggml_gallocr_t galloc, struct ggml_tensor
     return t->data != NULL || ggml_gallocr_hash_get(galloc, t)->allocated;
 }
 
+// buffers with the same allocator share the same address space, the blocks are assigned to the first of them
+static int ggml_gallocr_block_buffer_id(ggml_gallocr_t galloc, int buffer_id) {
+    for (int i = 0; i < buffer_id; i++) {
+        if (galloc->buf_tallocs[i] == galloc->buf_tallocs[buffer_id]) {
+            return i;
+        }
+    }
+    return buffer_id;
+}
+
+static int ggml_gallocr_new_block(ggml_gallocr_t galloc, int buffer_id, size_t offset, size_t size) {
+    buffer_id = ggml_gallocr_block_buffer_id(galloc, buffer_id);
+
+    if (galloc->n_blocks == galloc->blocks_size) {
+        galloc->blocks_size = MAX(2*galloc->blocks_size, 256);
+        galloc->blocks = realloc(galloc->blocks, galloc->blocks_size * sizeof(struct alloc_block));
+        GGML_ASSERT(galloc->blocks != NULL);
+    }
+
+    struct alloc_block * block = &galloc->blocks[galloc->n_blocks];
+    block->buffer_id   = buffer_id;
+    block->start       = galloc->cur_node;
+    block->end         = INT_MAX;
+    block->size        = aligned_offset(NULL, size, galloc->buf_tallocs[buffer_id]->alignment);
+    block->offset      = offset;
+    block->plan_offset = offset;
+
+    return galloc->n_blocks++;
+}
+
 static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor * node, int buffer_id) {
     struct hash_node * hn = ggml_gallocr_hash_get(galloc, node);
 
@@ -483,53 +561,70 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
         assert(hn->offset == 0);
 
         // try to reuse a parent's buffer (inplace)
-        if (ggml_op_can_inplace(node->op)) {
-            for (int i = 0; i < GGML_MAX_SRC; i++) {
-                struct ggml_tensor * parent = node->src[i];
-                if (parent == NULL) {
-                    continue;
-                }
+        for (int i = 0; i < GGML_MAX_SRC; i++) {
+            struct ggml_tensor * parent = node->src[i];
+            if (parent == NULL) {
+                continue;
+            }
 
-                // if the node's data is external, then we cannot re-use it
-                if (!ggml_gallocr_is_own(galloc, parent)) {
-                    AT_PRINTF("not reusing parent %s for %s as %p is external\n", parent->name, node->name, parent->data);
-                    continue;
-                }
+            if (!ggml_op_can_inplace(node, i)) {
+                continue;
+            }
 
-                // outputs cannot be reused
-                if (parent->flags & GGML_TENSOR_FLAG_OUTPUT || (parent->view_src != NULL && parent->view_src->flags & GGML_TENSOR_FLAG_OUTPUT)) {
-                    AT_PRINTF("not reusing parent %s for %s as it is an output\n", parent->name, node->name);
-                    continue;
-                }
+            // views reuse the memory of their source
+            struct ggml_tensor * owner = ggml_is_view(parent) ? parent->view_src : parent;
+
+            // if the node's data is external, then we cannot re-use it
+            if (!ggml_gallocr_is_own(galloc, owner)) {
+                AT_PRINTF("not reusing parent %s for %s as %p is external\n", parent->name, node->name, parent->data);
+                continue;
+            }
+
+            // outputs cannot be reused
+            if (parent->flags & GGML_TENSOR_FLAG_OUTPUT || owner->flags & GGML_TENSOR_FLAG_OUTPUT) {
+                AT_PRINTF("not reusing parent %s for %s as it is an output\n", parent->name, node->name);
+                continue;
+            }
+
+            if (!ggml_are_same_layout(node, parent)) {
+                AT_PRINTF("not reusing parent %s for %s as layouts are different\n", parent->name, node->name);
+                continue;
+            }
+
+            // the parent can be used more than once by this node (e.g. x*x), but not by the nodes that come after it
+            int n_uses = 0;
+            for (int j = 0; j < GGML_MAX_SRC; j++) {
+                n_uses += node->src[j] == parent;
+            }
 
-                if (!ggml_are_same_layout(node, parent)) {
-                    AT_PRINTF("not reusing parent %s for %s as layouts are different\n", parent->name, node->name);
+            struct hash_node * p_hn = ggml_gallocr_hash_get(galloc, parent);
+            if (p_hn->n_children != n_uses || p_hn->n_views != 0) {
+                continue;
+            }
+
+            if (ggml_is_view(parent)) {
+                // the source must not be used anymore, except through this view
+                struct hash_node * view_src_hn = ggml_gallocr_hash_get(galloc, owner);
+                if (view_src_hn->n_views != 1 || view_src_hn->n_children != 0) {
                     continue;
                 }
-
-                struct hash_node * p_hn = ggml_gallocr_hash_get(galloc, parent);
-                if (p_hn->n_children == 1 && p_hn->n_views == 0) {
-                    if (ggml_is_view(parent)) {
-                        struct ggml_tensor * view_src = parent->view_src;
-                        struct hash_node * view_src_hn = ggml_gallocr_hash_get(galloc, view_src);
-                        if (view_src_hn->n_views == 1 && view_src_hn->n_children == 0 && view_src->data == parent->data) {
-                            AT_PRINTF("reusing view parent %s (%s) for %s\n", parent->name, view_src->name, node->name);
-                            assert(view_src_hn->offset == p_hn->offset);
-                            hn->buffer_id = p_hn->buffer_id;
-                            hn->offset = p_hn->offset;
-                            p_hn->allocated = false; // avoid freeing the parent
-                            view_src_hn->allocated = false;
-                            return;
-                        }
-                    } else {
-                        AT_PRINTF("reusing parent %s for %s\n", parent->name, node->name);
-                        hn->buffer_id = p_hn->buffer_id;
-                        hn->offset = p_hn->offset;
-                        p_hn->allocated = false; // avoid freeing the parent
-                        return;
-                    }
+                if (parent->view_offs % galloc->buf_tallocs[view_src_hn->buffer_id]->alignment != 0) {
+                    continue;
                 }
+                AT_PRINTF("reusing view parent %s (%s) for %s\n", parent->name, owner->name, node->name);
+                hn->buffer_id = view_src_hn->buffer_id;
+                hn->offset = view_src_hn->offset + parent->view_offs;
+                hn->block = view_src_hn->block;
+                view_src_hn->allocated = false; // avoid freeing the parent
+                return;
             }
+
+            AT_PRINTF("reusing parent %s for %s\n", parent->name, node->name);
+            hn->buffer_id = p_hn->buffer_id;
+            hn->offset = p_hn->offset;
+            hn->block = p_hn->block;
+            p_hn->allocated = false; // avoid freeing the parent
+            return;
         }
         // allocate tensor from the buffer
         struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[buffer_id];
@@ -538,6 +633,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
         size_t offset = ggml_dyn_tallocr_alloc(alloc, size, node);
         hn->buffer_id = buffer_id;
         hn->offset = offset;
+        hn->block = ggml_gallocr_new_block(galloc, buffer_id, offset, size);
         return;
     }
 }
@@ -549,13 +645,12 @@ static void ggml_gallocr_free_node(ggml_gallocr_t galloc, struct ggml_tensor * n
         return;
     }
 
+    // free the whole block, the node may be using only a part of it
     struct hash_node * hn = ggml_gallocr_hash_get(galloc, node);
-    size_t offset = hn->offset;
-    int buffer_id = hn->buffer_id;
-    struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[buffer_id];
-    ggml_backend_buffer_type_t buft = galloc->bufts[buffer_id];
-    size_t size = ggml_backend_buft_get_alloc_size(buft, node);
-    ggml_dyn_tallocr_free_tensor(alloc, offset, size, node);
+    struct alloc_block * block = &galloc->blocks[hn->block];
+    struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[block->buffer_id];
+    ggml_dyn_tallocr_free_tensor(alloc, block->offset, block->size, node);
+    block->end = galloc->cur_node;
     hn->allocated = false;
 }
 
@@ -568,6 +663,9 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     memset(galloc->hash_set.keys, 0, galloc->hash_set.size * sizeof(struct ggml_tensor *));
     memset(galloc->hash_values,   0, galloc->hash_set.size * sizeof(struct hash_node));
 
+    galloc->n_blocks = 0;
+    galloc->cur_node = -1;
+
     // allocate leafs
     // these may be tensors that the application is not using in the graph, but may still want to allocate for other purposes
     for (int i = 0; i < graph->n_leafs; i++) {
@@ -612,6 +710,7 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     for (int i = 0; i < graph->n_nodes; i++) {
         struct ggml_tensor * node = graph->nodes[i];
         int buffer_id = get_node_buffer_id(node_buffer_ids, i);
+        galloc->cur_node = i;
 
         // allocate parents (only leafs need to be allocated at this point)
         for (int j = 0; j < GGML_MAX_SRC; j++) {
@@ -670,6 +769,169 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     }
 }
 
+// offline planning of the block offsets
+// ggml_dyn_tallocr assigns the offsets while the graph is simulated, without knowing when the blocks will be freed
+// once the lifetimes of all the blocks are known, the offsets are assigned again by placing the largest blocks first,
+// each at the lowest offset where it does not overlap another block that is alive at the same time
+// the plan is only used if it results in a smaller buffer than the offsets of ggml_dyn_tallocr
+
+static int ggml_gallocr_block_cmp(const void * a, const void * b) {
+    const struct alloc_block * ba = *(const struct alloc_block * const *)a;
+    const struct alloc_block * bb = *(const struct alloc_block * const *)b;
+    if (ba->size != bb->size) {
+        return ba->size > bb->size ? -1 : 1;
+    }
+    if (ba->start != bb->start) {
+        return ba->start < bb->start ? -1 : 1;
+    }
+    return ba < bb ? -1 : (ba > bb ? 1 : 0);
+}
+
+static bool ggml_gallocr_blocks_overlap(const struct alloc_block * a, const struct alloc_block * b) {
+    return a->start <= b->end && b->start <= a->end;
+}
+
+static void ggml_gallocr_plan_buffer(ggml_gallocr_t galloc, int buffer_id, struct alloc_block ** sorted, struct alloc_block ** placed) {
+    int n_sorted = 0;
+    for (int i = 0; i < galloc->n_blocks; i++) {
+        if (galloc->blocks[i].buffer_id == buffer_id) {
+            sorted[n_sorted++] = &galloc->blocks[i];
+        }
+    }
+    qsort(sorted, n_sorted, sizeof(struct alloc_block *), ggml_gallocr_block_cmp);
+
+    // placed blocks, sorted by offset
+    int n_placed = 0;
+    for (int i = 0; i < n_sorted; i++) {
+        struct alloc_block * block = sorted[i];
+        size_t offset = 0;
+        for (int j = 0; j < n_placed; j++) {
+            const struct alloc_block * other = placed[j];
+            if (!ggml_gallocr_blocks_overlap(block, other)) {
+                continue;
+            }
+            if (other->plan_offset >= offset + block->size) {
+                // the block fits in the gap before this one
+                break;
+            }
+            offset = MAX(offset, other->plan_offset + other->size);
+        }
+        block->plan_offset = offset;
+
+        int pos = n_placed++;
+        while (pos > 0 && placed[pos - 1]->plan_offset > offset) {
+            placed[pos] = placed[pos - 1];
+            pos--;
+        }
+        placed[pos] = block;
+    }
+}
+
+static uint64_t ggml_gallocr_blocks_hash(ggml_gallocr_t galloc) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < galloc->n_blocks; i++) {
+        const struct alloc_block * block = &galloc->blocks[i];
+        const uint64_t values[4] = { (uint64_t)block->buffer_id, (uint64_t)block->start, (uint64_t)block->end, (uint64_t)block->size };
+        for (int j = 0; j < 4; j++) {
+            hash ^= values[j];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+static bool ggml_gallocr_plan_matches(ggml_gallocr_t galloc, const struct alloc_plan * plan, uint64_t hash) {
+    if (plan->hash != hash || plan->n_blocks != galloc->n_blocks) {
+        return false;
+    }
+    for (int i = 0; i < galloc->n_blocks; i++) {
+        const struct alloc_block * a = &plan->blocks[i];
+        const struct alloc_block * b = &galloc->blocks[i];
+        if (a->buffer_id != b->buffer_id || a->start != b->start || a->end != b->end || a->size != b->size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void ggml_gallocr_plan_blocks(ggml_gallocr_t galloc) {
+    if (galloc->n_blocks == 0) {
+        return;
+    }
+
+    uint64_t hash = ggml_gallocr_blocks_hash(galloc);
+
+    const struct alloc_plan * cached = NULL;
+    for (int i = 0; i < galloc->n_plans; i++) {
+        if (ggml_gallocr_plan_matches(galloc, &galloc->plans[i], hash)) {
+            cached = &galloc->plans[i];
+            break;
+        }
+    }
+
+    if (cached != NULL) {
+        for (int i = 0; i < galloc->n_blocks; i++) {
+            galloc->blocks[i].plan_offset = cached->blocks[i].plan_offset;
+        }
+    } else {
+        struct alloc_block ** sorted = malloc(galloc->n_blocks * sizeof(struct alloc_block *));
+        struct alloc_block ** placed = malloc(galloc->n_blocks * sizeof(struct alloc_block *));
+        GGML_ASSERT(sorted != NULL && placed != NULL);
+        for (int i = 0; i < galloc->n_buffers; i++) {
+            if (ggml_gallocr_block_buffer_id(galloc, i) == i) {
+                ggml_gallocr_plan_buffer(galloc, i, sorted, placed);
+            }
+        }
+        free(sorted);
+        free(placed);
+
+        // replace the oldest plan
+        struct alloc_plan * plan = &galloc->plans[galloc->next_plan];
+        galloc->next_plan = (galloc->next_plan + 1) % GGML_GALLOCR_MAX_PLANS;
+        if (galloc->n_plans < GGML_GALLOCR_MAX_PLANS) {
+            galloc->n_plans++;
+        }
+        plan->hash = hash;
+        plan->n_blocks = galloc->n_blocks;
+        plan->blocks = realloc(plan->blocks, galloc->n_blocks * sizeof(struct alloc_block));
+        GGML_ASSERT(plan->blocks != NULL);
+        memcpy(plan->blocks, galloc->blocks, galloc->n_blocks * sizeof(struct alloc_block));
+    }
+
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        if (ggml_gallocr_block_buffer_id(galloc, i) != i) {
+            continue;
+        }
+        struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[i];
+        size_t plan_size = 0;
+        for (int j = 0; j < galloc->n_blocks; j++) {
+            const struct alloc_block * block = &galloc->blocks[j];
+            if (block->buffer_id == i) {
+                plan_size = MAX(plan_size, block->plan_offset + block->size);
+            }
+        }
+        AT_PRINTF("%s: buffer %d: planned size %zu, allocator size %zu\n", __func__, i, plan_size, alloc->max_size);
+        if (plan_size < alloc->max_size) {
+            alloc->max_size = plan_size;
+            continue;
+        }
+        for (int j = 0; j < galloc->n_blocks; j++) {
+            struct alloc_block * block = &galloc->blocks[j];
+            if (block->buffer_id == i) {
+                block->plan_offset = block->offset;
+            }
+        }
+    }
+}
+
+// offset of a tensor in its buffer
+// tensors that reuse a view of their parent inplace can start after the beginning of the block
+static size_t ggml_gallocr_get_offset(ggml_gallocr_t galloc, const struct hash_node * hn) {
+    const struct alloc_block * block = &galloc->blocks[hn->block];
+    return block->plan_offset + (hn->offset - block->offset);
+}
+
 bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids) {
     size_t hash_size = graph->visited_hash_table.size;
 
@@ -696,6 +958,9 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
     // allocate in hash table
     ggml_gallocr_alloc_graph_impl(galloc, graph, node_buffer_ids, leaf_buffer_ids);
 
+    // re-plan the offsets with the lifetimes of the tensors
+    ggml_gallocr_plan_blocks(galloc);
+
     // set the node_allocs from the hash table
     if (galloc->n_nodes < graph->n_nodes) {
         free(galloc->node_allocs);
@@ -713,7 +978,7 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
         } else {
             struct hash_node * hn = ggml_gallocr_hash_get(galloc, node);
             node_alloc->dst.buffer_id = hn->buffer_id;
-            node_alloc->dst.offset    = hn->offset;
+            node_alloc->dst.offset    = ggml_gallocr_get_offset(galloc, hn);
             node_alloc->dst.size_max  = ggml_backend_buft_get_alloc_size(galloc->bufts[hn->buffer_id], node);
         }
         for (int j = 0; j < GGML_MAX_SRC; j++) {
@@ -725,7 +990,7 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
             } else {
                 struct hash_node * hn = ggml_gallocr_hash_get(galloc, src);
                 node_alloc->src[j].buffer_id = hn->buffer_id;
-                node_alloc->src[j].offset   = hn->offset;
+                node_alloc->src[j].offset   = ggml_gallocr_get_offset(galloc, hn);
                 node_alloc->src[j].size_max = ggml_backend_buft_get_alloc_size(galloc->bufts[hn->buffer_id], src);
             }
         }
@@ -746,7 +1011,7 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
             galloc->leaf_allocs[i].leaf.size_max = 0;
         } else {
             galloc->leaf_allocs[i].leaf.buffer_id = hn->buffer_id;
-            galloc->leaf_allocs[i].leaf.offset = hn->offset;
+            galloc->leaf_allocs[i].leaf.offset = ggml_gallocr_get_offset(galloc, hn);
             galloc->leaf_allocs[i].leaf.size_max = ggml_backend_buft_get_alloc_size(galloc->bufts[hn->buffer_id], leaf);
         }
     }
@@ -132,6 +132,9 @@ void ggml_backend_buffer_set_usage(ggml_backend_buffer_t buffer, enum ggml_backe
     if (ggml_backend_buffer_is_multi_buffer(buffer)) {
         ggml_backend_multi_buffer_set_usage(buffer, usage);
     }
+    if (ggml_backend_buffer_is_split(buffer)) {
+        ggml_backend_split_buffer_set_usage(buffer, usage);
+    }
 }
 
 ggml_backend_buffer_type_t ggml_backend_buffer_get_type(ggml_backend_buffer_t buffer) {
@@ -995,6 +998,388 @@ GGML_CALL void ggml_backend_multi_buffer_set_usage(ggml_backend_buffer_t buffer,
     }
 }
 
+// split buffer
+
+#define GGML_BACKEND_SPLIT_MAX_BUFTS 16
+#define GGML_BACKEND_SPLIT_MAX_TYPES 16
+
+struct ggml_backend_split_buffer_type_context {
+    int n_bufts;
+    ggml_backend_buffer_type_t bufts[GGML_BACKEND_SPLIT_MAX_BUFTS];
+    float tensor_split[GGML_BACKEND_SPLIT_MAX_BUFTS]; // first row of each buffer type, as a fraction of the rows
+};
+
+// a matrix split by rows, stored in tensor->extra
+struct ggml_backend_split_tensor {
+    struct ggml_backend_split_tensor * next;
+    int n_shards;
+    struct ggml_tensor shards[GGML_BACKEND_SPLIT_MAX_BUFTS];
+};
+
+struct ggml_backend_split_buffer_context {
+    struct ggml_backend_split_buffer_type_context * buft_ctx;
+    enum ggml_backend_buffer_usage usage;
+
+    // buffers allocated in the buffer types, the tensors are allocated sequentially in the last buffer of each buffer type
+    ggml_backend_buffer_t * buffers;
+    size_t n_buffers;
+    ggml_backend_buffer_t cur   [GGML_BACKEND_SPLIT_MAX_BUFTS];
+    size_t                offset[GGML_BACKEND_SPLIT_MAX_BUFTS];
+
+    size_t expected [GGML_BACKEND_SPLIT_MAX_BUFTS]; // share of the buffer size of each buffer type
+    size_t allocated[GGML_BACKEND_SPLIT_MAX_BUFTS]; // size of the buffers allocated in each buffer type
+    size_t used     [GGML_BACKEND_SPLIT_MAX_BUFTS]; // size of the tensors allocated in each buffer type
+
+    struct ggml_backend_split_tensor * tensors;
+};
+
+static bool ggml_backend_split_is_matrix(const struct ggml_tensor * tensor) {
+    return tensor->ne[1] > 1 && tensor->ne[2] == 1 && tensor->ne[3] == 1 && ggml_is_contiguous(tensor);
+}
+
+static void ggml_backend_split_get_rows(const struct ggml_backend_split_buffer_type_context * ctx, int64_t nrows, int i, int64_t * row_low, int64_t * row_high) {
+    *row_low  = i == 0                ? 0     : (int64_t)(nrows*ctx->tensor_split[i]);
+    *row_high = i == ctx->n_bufts - 1 ? nrows : (int64_t)(nrows*ctx->tensor_split[i + 1]);
+}
+
+static void ggml_backend_split_shard_init(const struct ggml_tensor * tensor, int64_t row_low, int64_t row_high, struct ggml_tensor * shard) {
+    *shard = *tensor;
+    shard->ne[1]  = row_high - row_low;
+    shard->nb[2]  = shard->nb[1]*shard->ne[1];
+    shard->nb[3]  = shard->nb[2]*shard->ne[2];
+    shard->buffer = NULL;
+    shard->data   = NULL;
+    shard->extra  = NULL;
+}
+
+static bool ggml_backend_split_buffer_reserve(struct ggml_backend_split_buffer_context * ctx, int i, size_t size) {
+    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ctx->buft_ctx->bufts[i], size);
+    if (buffer == NULL) {
+        return false;
+    }
+    ggml_backend_buffer_set_usage(buffer, ctx->usage);
+
+    ctx->buffers = realloc(ctx->buffers, sizeof(ggml_backend_buffer_t) * (ctx->n_buffers + 1));
+    ctx->buffers[ctx->n_buffers++] = buffer;
+    ctx->cur[i]        = buffer;
+    ctx->offset[i]     = 0;
+    ctx->allocated[i] += ggml_backend_buffer_get_size(buffer);
+    return true;
+}
+
+// allocates a tensor in buffer type i, returns its address and the buffer that contains it
+static void * ggml_backend_split_buffer_alloc(struct ggml_backend_split_buffer_context * ctx, int i, struct ggml_tensor * tensor, ggml_backend_buffer_t * buffer) {
+    ggml_backend_buffer_type_t buft = ctx->buft_ctx->bufts[i];
+
+    size_t size   = ggml_backend_buft_get_alloc_size(buft, tensor);
+    size_t offset = GGML_PAD(ctx->offset[i], ggml_backend_buft_get_alignment(buft));
+
+    if (ctx->cur[i] == NULL || offset + size > ggml_backend_buffer_get_size(ctx->cur[i])) {
+        // the rounding of the rows can exceed the share of a buffer type, the remaining tensors go to a new buffer
+        size_t left = ctx->expected[i] > ctx->allocated[i] ? ctx->expected[i] - ctx->allocated[i] : 0;
+        left = MIN(left, ggml_backend_buft_get_max_size(buft));
+        if (!ggml_backend_split_buffer_reserve(ctx, i, MAX(size, left))) {
+            fprintf(stderr, "%s: failed to allocate %s buffer of size %zu for tensor %s\n", __func__, ggml_backend_buft_name(buft), MAX(size, left), tensor->name);
+            GGML_ASSERT(false);
+        }
+        offset = 0;
+    }
+
+    ctx->offset[i] = offset + size;
+    ctx->used[i]  += size;
+    *buffer = ctx->cur[i];
+
+    return (char *)ggml_backend_buffer_get_base(ctx->cur[i]) + offset;
+}
+
+GGML_CALL static const char * ggml_backend_split_buffer_get_name(ggml_backend_buffer_t buffer) {
+    return "Split";
+
+    GGML_UNUSED(buffer);
+}
+
+GGML_CALL static void ggml_backend_split_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    struct ggml_backend_split_buffer_context * ctx = (struct ggml_backend_split_buffer_context *) buffer->context;
+    for (size_t i = 0; i < ctx->n_buffers; i++) {
+        ggml_backend_buffer_free(ctx->buffers[i]);
+    }
+    while (ctx->tensors != NULL) {
+        struct ggml_backend_split_tensor * next = ctx->tensors->next;
+        free(ctx->tensors);
+        ctx->tensors = next;
+    }
+
+    free(ctx->buffers);
+    free(ctx);
+}
+
+GGML_CALL static void * ggml_backend_split_buffer_get_base(ggml_backend_buffer_t buffer) {
+    // the data of the tensors is in the buffers of the shards, this is a dummy address that is never dereferenced
+    return (void *)0x1000;
+
+    GGML_UNUSED(buffer);
+}
+
+GGML_CALL static void ggml_backend_split_buffer_init_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor) {
+    if (tensor->view_src != NULL) {
+        // views are mapped to their source in set_tensor and get_tensor
+        return;
+    }
+
+    struct ggml_backend_split_buffer_context * ctx = (struct ggml_backend_split_buffer_context *) buffer->context;
+    const struct ggml_backend_split_buffer_type_context * buft_ctx = ctx->buft_ctx;
+
+    if (!ggml_backend_split_is_matrix(tensor)) {
+        // the tensor is moved to the buffer type with the most space left from its share
+        int best = 0;
+        for (int i = 1; i < buft_ctx->n_bufts; i++) {
+            if ((int64_t)(ctx->expected[i] - ctx->used[i]) > (int64_t)(ctx->expected[best] - ctx->used[best])) {
+                best = i;
+            }
+        }
+        ggml_backend_buffer_t shard_buffer;
+        tensor->data   = ggml_backend_split_buffer_alloc(ctx, best, tensor, &shard_buffer);
+        tensor->buffer = shard_buffer;
+        ggml_backend_buffer_init_tensor(shard_buffer, tensor);
+        return;
+    }
+
+    struct ggml_backend_split_tensor * extra = (struct ggml_backend_split_tensor *) calloc(1, sizeof(struct ggml_backend_split_tensor));
+    extra->next  = ctx->tensors;
+    ctx->tensors = extra;
+
+    for (int i = 0; i < buft_ctx->n_bufts; i++) {
+        int64_t row_low, row_high;
+        ggml_backend_split_get_rows(buft_ctx, tensor->ne[1], i, &row_low, &row_high);
+        if (row_low == row_high) {
+            continue;
+        }
+
+        struct ggml_tensor * shard = &extra->shards[extra->n_shards++];
+        ggml_backend_split_shard_init(tensor, row_low, row_high, shard);
+        ggml_format_name(shard, "%s (%s)", tensor->name, ggml_backend_buft_name(buft_ctx->bufts[i]));
+
+        ggml_backend_buffer_t shard_buffer;
+        void * addr = ggml_backend_split_buffer_alloc(ctx, i, shard, &shard_buffer);
+        ggml_backend_tensor_alloc(shard_buffer, shard, addr);
+    }
+
+    tensor->extra = extra;
+}
+
+GGML_CALL static void ggml_backend_split_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    if (tensor->view_src != NULL) {
+        offset += tensor->view_offs;
+        tensor  = tensor->view_src;
+    }
+
+    // the shards are the consecutive ranges of rows of the tensor
+    struct ggml_backend_split_tensor * extra = (struct ggml_backend_split_tensor *) tensor->extra;
+    size_t shard_offset = 0;
+    for (int i = 0; i < extra->n_shards; i++) {
+        struct ggml_tensor * shard = &extra->shards[i];
+        const size_t shard_size = ggml_nbytes(shard);
+        const size_t begin = MAX(offset, shard_offset);
+        const size_t end   = MIN(offset + size, shard_offset + shard_size);
+        if (begin < end) {
+            ggml_backend_tensor_set(shard, (const char *)data + (begin - offset), begin - shard_offset, end - begin);
+        }
+        shard_offset += shard_size;
+    }
+
+    GGML_UNUSED(buffer);
+}
+
+GGML_CALL static void ggml_backend_split_buffer_get_tensor(ggml_backend_buffer_t buffer, const struct ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    if (tensor->view_src != NULL) {
+        offset += tensor->view_offs;
+        tensor  = tensor->view_src;
+    }
+
+    const struct ggml_backend_split_tensor * extra = (const struct ggml_backend_split_tensor *) tensor->extra;
+    size_t shard_offset = 0;
+    for (int i = 0; i < extra->n_shards; i++) {
+        const struct ggml_tensor * shard = &extra->shards[i];
+        const size_t shard_size = ggml_nbytes(shard);
+        const size_t begin = MAX(offset, shard_offset);
+        const size_t end   = MIN(offset + size, shard_offset + shard_size);
+        if (begin < end) {
+            ggml_backend_tensor_get(shard, (char *)data + (begin - offset), begin - shard_offset, end - begin);
+        }
+        shard_offset += shard_size;
+    }
+
+    GGML_UNUSED(buffer);
+}
+
+GGML_CALL static void ggml_backend_split_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    struct ggml_backend_split_buffer_context * ctx = (struct ggml_backend_split_buffer_context *) buffer->context;
+    for (size_t i = 0; i < ctx->n_buffers; i++) {
+        ggml_backend_buffer_clear(ctx->buffers[i], value);
+    }
+}
+
+static struct ggml_backend_buffer_i ggml_backend_split_buffer_interface = {
+    /* .get_name        = */ ggml_backend_split_buffer_get_name,
+    /* .free_buffer     = */ ggml_backend_split_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_split_buffer_get_base,
+    /* .init_tensor     = */ ggml_backend_split_buffer_init_tensor,
+    /* .set_tensor      = */ ggml_backend_split_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_split_buffer_get_tensor,
+    /* .cpy_tensor      = */ NULL,
+    /* .clear           = */ ggml_backend_split_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+GGML_CALL static const char * ggml_backend_split_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return "Split";
+
+    GGML_UNUSED(buft);
+}
+
+GGML_CALL static ggml_backend_buffer_t ggml_backend_split_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    struct ggml_backend_split_buffer_type_context * buft_ctx = (struct ggml_backend_split_buffer_type_context *) buft->context;
+
+    struct ggml_backend_split_buffer_context * ctx = (struct ggml_backend_split_buffer_context *) calloc(1, sizeof(struct ggml_backend_split_buffer_context));
+    ctx->buft_ctx = buft_ctx;
+    ctx->usage    = GGML_BACKEND_BUFFER_USAGE_ANY;
+
+    // the share of each buffer type is allocated now, so that running out of memory is reported here and not when the tensors are initialized
+    for (int i = 0; i < buft_ctx->n_bufts; i++) {
+        const float end = i == buft_ctx->n_bufts - 1 ? 1.0f : buft_ctx->tensor_split[i + 1];
+        ctx->expected[i] = (size_t)(size*(end - buft_ctx->tensor_split[i]));
+        if (ctx->expected[i] == 0) {
+            continue;
+        }
+        if (!ggml_backend_split_buffer_reserve(ctx, i, MIN(ctx->expected[i], ggml_backend_buft_get_max_size(buft_ctx->bufts[i])))) {
+            fprintf(stderr, "%s: failed to allocate %s buffer of size %zu\n", __func__, ggml_backend_buft_name(buft_ctx->bufts[i]), ctx->expected[i]);
+            for (size_t j = 0; j < ctx->n_buffers; j++) {
+                ggml_backend_buffer_free(ctx->buffers[j]);
+            }
+            free(ctx->buffers);
+            free(ctx);
+            return NULL;
+        }
+    }
+
+    return ggml_backend_buffer_init(buft, ggml_backend_split_buffer_interface, ctx, size);
+}
+
+GGML_CALL static size_t ggml_backend_split_buffer_type_get_alignment(ggml_backend_buffer_type_t buft) {
+    return 1;
+
+    GGML_UNUSED(buft);
+}
+
+GGML_CALL static size_t ggml_backend_split_buffer_type_get_alloc_size(ggml_backend_buffer_type_t buft, const struct ggml_tensor * tensor) {
+    struct ggml_backend_split_buffer_type_context * ctx = (struct ggml_backend_split_buffer_type_context *) buft->context;
+
+    size_t size = 0;
+
+    if (!ggml_backend_split_is_matrix(tensor)) {
+        // stored whole in one of the buffer types
+        struct ggml_tensor whole = *tensor;
+        for (int i = 0; i < ctx->n_bufts; i++) {
+            size_t alloc_size = ggml_backend_buft_get_alloc_size(ctx->bufts[i], &whole);
+            size = MAX(size, GGML_PAD(alloc_size, ggml_backend_buft_get_alignment(ctx->bufts[i])));
+        }
+        return size;
+    }
+
+    for (int i = 0; i < ctx->n_bufts; i++) {
+        int64_t row_low, row_high;
+        ggml_backend_split_get_rows(ctx, tensor->ne[1], i, &row_low, &row_high);
+        if (row_low == row_high) {
+            continue;
+        }
+
+        struct ggml_tensor shard;
+        ggml_backend_split_shard_init(tensor, row_low, row_high, &shard);
+        size += GGML_PAD(ggml_backend_buft_get_alloc_size(ctx->bufts[i], &shard), ggml_backend_buft_get_alignment(ctx->bufts[i]));
+    }
+
+    return size;
+}
+
+ggml_backend_buffer_type_t ggml_backend_split_buffer_type(ggml_backend_buffer_type_t * bufts, const float * tensor_split, int n_bufts) {
+    static struct ggml_backend_split_buffer_type_context contexts[GGML_BACKEND_SPLIT_MAX_TYPES];
+    static struct ggml_backend_buffer_type               types   [GGML_BACKEND_SPLIT_MAX_TYPES];
+    static int n_types = 0;
+
+    GGML_ASSERT(n_bufts > 0 && n_bufts <= GGML_BACKEND_SPLIT_MAX_BUFTS);
+
+    struct ggml_backend_split_buffer_type_context ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.n_bufts = n_bufts;
+
+    float split_sum = 0.0f;
+    for (int i = 0; i < n_bufts; i++) {
+        split_sum += tensor_split != NULL ? tensor_split[i] : 0.0f;
+    }
+    float split_start = 0.0f;
+    for (int i = 0; i < n_bufts; i++) {
+        ctx.bufts[i] = bufts[i];
+        if (split_sum > 0.0f) {
+            ctx.tensor_split[i] = split_start/split_sum;
+            split_start += tensor_split[i];
+        } else {
+            ctx.tensor_split[i] = (float)i/n_bufts;
+        }
+    }
+
+    for (int i = 0; i < n_types; i++) {
+        if (memcmp(&contexts[i], &ctx, sizeof(ctx)) == 0) {
+            return &types[i];
+        }
+    }
+
+    GGML_ASSERT(n_types < GGML_BACKEND_SPLIT_MAX_TYPES && "too many split buffer types");
+
+    contexts[n_types] = ctx;
+    types[n_types] = (struct ggml_backend_buffer_type) {
+        /* .iface = */ {
+            /* .get_name         = */ ggml_backend_split_buffer_type_get_name,
+            /* .alloc_buffer     = */ ggml_backend_split_buffer_type_alloc_buffer,
+            /* .get_alignment    = */ ggml_backend_split_buffer_type_get_alignment,
+            /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+            /* .get_alloc_size   = */ ggml_backend_split_buffer_type_get_alloc_size,
+            /* .is_host          = */ NULL,
+        },
+        /* .context = */ &contexts[n_types],
+    };
+
+    return &types[n_types++];
+}
+
+bool ggml_backend_buft_is_split(ggml_backend_buffer_type_t buft) {
+    return buft->iface.get_name == ggml_backend_split_buffer_type_get_name;
+}
+
+bool ggml_backend_buffer_is_split(ggml_backend_buffer_t buffer) {
+    return buffer->iface.get_name == ggml_backend_split_buffer_get_name;
+}
+
+void ggml_backend_split_buffer_set_usage(ggml_backend_buffer_t buffer, enum ggml_backend_buffer_usage usage) {
+    GGML_ASSERT(ggml_backend_buffer_is_split(buffer));
+    struct ggml_backend_split_buffer_context * ctx = (struct ggml_backend_split_buffer_context *) buffer->context;
+    ctx->usage = usage;
+    for (size_t i = 0; i < ctx->n_buffers; i++) {
+        ggml_backend_buffer_set_usage(ctx->buffers[i], usage);
+    }
+}
+
+int ggml_backend_split_tensor_n_shards(const struct ggml_tensor * tensor) {
+    GGML_ASSERT(tensor->buffer != NULL && ggml_backend_buffer_is_split(tensor->buffer));
+    const struct ggml_backend_split_tensor * extra = (const struct ggml_backend_split_tensor *) tensor->extra;
+    return extra->n_shards;
+}
+
+struct ggml_tensor * ggml_backend_split_tensor_get_shard(const struct ggml_tensor * tensor, int i) {
+    GGML_ASSERT(i >= 0 && i < ggml_backend_split_tensor_n_shards(tensor));
+    struct ggml_backend_split_tensor * extra = (struct ggml_backend_split_tensor *) tensor->extra;
+    return &extra->shards[i];
+}
+
 // creates a copy of the tensor with the same memory layout
 static struct ggml_tensor * ggml_dup_tensor_layout(struct ggml_context * ctx, const struct ggml_tensor * tensor) {
     struct ggml_tensor * dup = ggml_dup_tensor(ctx, tensor);
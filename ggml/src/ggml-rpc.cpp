@@ -2,11 +2,18 @@
 #include "ggml.h"
 #include "ggml-backend-impl.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <string>
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #ifdef _WIN32
@@ -43,9 +50,32 @@ using ssize_t = __int64;
 typedef int sockfd_t;
 #endif
 
+// client side: a graph stored on the server, as it was last computed
+struct rpc_graph_slot {
+    std::vector<uint8_t> graph; // serialized as in GRAPH_COMPUTE
+    uint64_t last_use = 0;
+};
+
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+
+    // client side: the BATCH request of the queued commands, see queue_rpc_cmd
+    std::vector<uint8_t> batch;
+    uint64_t next_id  = 0; // id of the next request, counted in the same way by the server
+    uint32_t features = 0; // RPC_FEATURE_* of the server
+    bool     compress = false;
+    std::vector<rpc_graph_slot> graphs; // see ggml_backend_rpc_graph_compute
+    uint64_t n_graph_computes = 0;
+
+    // the socket is used by the callers of the buffer functions and by the streams of the backends
+    std::recursive_mutex mutex;
+
+    // operations of the streams that use the socket and are not completed yet, see rpc_stream_push
+    std::mutex              pending_mutex;
+    std::condition_variable pending_cv;
+    uint64_t                n_pending = 0;
+
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -93,8 +123,34 @@ enum rpc_cmd {
     COPY_TENSOR,
     GRAPH_COMPUTE,
     GET_DEVICE_MEMORY,
+    HELLO,
+    BATCH,
+    SET_TENSOR_COMPRESSED,
+    SET_TENSOR_HASH,
+    GRAPH_STORE,
+    GRAPH_COMPUTE_STORED,
 };
 
+#define RPC_PROTO_VERSION 2
+
+// features reported by the server in the response to HELLO
+enum rpc_feature {
+    RPC_FEATURE_COPY_HOST = 1, // the buffers of the server are in host memory, so COPY_TENSOR between them cannot fail
+    RPC_FEATURE_HASH      = 2, // the server has a cache of tensor data, see SET_TENSOR_HASH
+};
+
+// the queued commands are sent when they reach this size, larger commands are sent on their own without a copy
+#define RPC_BATCH_MAX_SIZE (1u << 20)
+
+// number of graphs stored on the server for each connection
+#define RPC_MAX_GRAPHS 8
+
+// tensor data is compressed and looked up in the cache of the server in independent chunks of this size
+#define RPC_CHUNK_SIZE (4u << 20)
+
+// smaller uploads are not looked up in the cache of the server
+#define RPC_HASH_MIN_SIZE (1u << 20)
+
 // RPC data structures
 
 static ggml_guid_t ggml_backend_rpc_guid() {
@@ -109,9 +165,101 @@ struct ggml_backend_rpc_buffer_type_context {
     size_t max_size;
 };
 
+// The asynchronous operations of a backend (graph computes, async tensor copies) are executed in order by a worker thread,
+// so that the caller can queue the work of the other backends meanwhile, e.g. the next micro-batch of a pipeline.
+// An event is a position in this queue.
+struct rpc_stream {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> ops;
+    uint64_t n_pushed = 0;
+    uint64_t n_done   = 0;
+    bool     stop     = false;
+    std::thread worker; // last, started when the other members are initialized
+
+    rpc_stream() : worker([this] { run(); }) {}
+
+    ~rpc_stream() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    // returns the position after the operation
+    uint64_t push(std::function<void()> op) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ops.push_back(std::move(op));
+        cv.notify_all();
+        return ++n_pushed;
+    }
+
+    uint64_t position() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_pushed;
+    }
+
+    // wait for the operations before the position
+    void wait(uint64_t pos) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return n_done >= pos; });
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&] { return stop || !ops.empty(); });
+            if (ops.empty()) {
+                return;
+            }
+            std::function<void()> op = std::move(ops.front());
+            ops.pop_front();
+            lock.unlock();
+            op();
+            lock.lock();
+            n_done++;
+            cv.notify_all();
+        }
+    }
+};
+
+// queues an operation of the stream that uses the socket, returns its position in the stream
+static uint64_t rpc_stream_push(rpc_stream & stream, const std::shared_ptr<socket_t> & sock, std::function<void()> op) {
+    {
+        std::lock_guard<std::mutex> lock(sock->pending_mutex);
+        sock->n_pending++;
+    }
+    return stream.push([sock, op]() {
+        op();
+        {
+            std::lock_guard<std::mutex> lock(sock->pending_mutex);
+            sock->n_pending--;
+        }
+        sock->pending_cv.notify_all();
+    });
+}
+
+// the buffer functions send their commands directly, so they wait for the operations queued before them
+static void rpc_wait_pending(const std::shared_ptr<socket_t> & sock) {
+    std::unique_lock<std::mutex> lock(sock->pending_mutex);
+    sock->pending_cv.wait(lock, [&] { return sock->n_pending == 0; });
+}
+
+struct rpc_event {
+    rpc_stream * stream;
+    uint64_t     pos;
+};
+
 struct ggml_backend_rpc_context {
     std::string endpoint;
     std::string name;
+    rpc_stream  stream;
+    // first failure of a graph compute in the stream, reported by ggml_backend_rpc_synchronize
+    std::atomic<int> status{GGML_STATUS_SUCCESS};
+
+    ggml_backend_rpc_context(const std::string & endpoint, const std::string & name) : endpoint(endpoint), name(name) {}
 };
 
 struct ggml_backend_rpc_buffer_context {
@@ -245,19 +393,268 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
     return true;
 }
 
-// RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
+// fast LZ77 compression of tensor data, in the LZ4 block format:
+// | token (4 bits literal length, 4 bits match length - 4) | literal length - 15 (255-byte runs) | literals | offset (2 bytes) | match length - 19 (255-byte runs) |
+// the last sequence has only literals
+
+static void rpc_lz_put_length(std::vector<uint8_t> & dst, size_t len) {
+    while (len >= 255) {
+        dst.push_back(255);
+        len -= 255;
+    }
+    dst.push_back((uint8_t) len);
+}
+
+static void rpc_lz_put_sequence(std::vector<uint8_t> & dst, const uint8_t * lit, size_t n_lit, size_t offset, size_t n_match) {
+    const size_t n_ml = n_match ? n_match - 4 : 0;
+    dst.push_back((uint8_t) ((std::min<size_t>(n_lit, 15) << 4) | std::min<size_t>(n_ml, 15)));
+    if (n_lit >= 15) {
+        rpc_lz_put_length(dst, n_lit - 15);
+    }
+    dst.insert(dst.end(), lit, lit + n_lit);
+    if (n_match) {
+        dst.push_back((uint8_t) (offset & 0xff));
+        dst.push_back((uint8_t) (offset >> 8));
+        if (n_ml >= 15) {
+            rpc_lz_put_length(dst, n_ml - 15);
+        }
+    }
+}
+
+static void rpc_compress(const uint8_t * src, size_t size, std::vector<uint8_t> & dst) {
+    GGML_ASSERT(size <= UINT32_MAX);
+    const int hash_log = 14;
+    std::vector<uint32_t> table(1 << hash_log, 0);
+
+    dst.clear();
+    dst.reserve(size + size/255 + 16);
+
+    auto read32 = [src](size_t i) {
+        uint32_t v;
+        memcpy(&v, src + i, sizeof(v));
+        return v;
+    };
+
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + 4 <= size) {
+        const uint32_t seq = read32(i);
+        const uint32_t h   = (seq * 2654435761u) >> (32 - hash_log);
+        const size_t   ref = table[h];
+        table[h] = (uint32_t) i;
+        if (ref < i && i - ref <= 65535 && read32(ref) == seq) {
+            size_t n_match = 4;
+            while (i + n_match + 8 <= size) {
+                uint64_t a;
+                uint64_t b;
+                memcpy(&a, src + ref + n_match, sizeof(a));
+                memcpy(&b, src + i   + n_match, sizeof(b));
+                if (a != b) {
+                    break;
+                }
+                n_match += 8;
+            }
+            while (i + n_match < size && src[ref + n_match] == src[i + n_match]) {
+                n_match++;
+            }
+            rpc_lz_put_sequence(dst, src + anchor, i - anchor, i - ref, n_match);
+            i += n_match;
+            anchor = i;
+        } else {
+            // skip faster through data that does not compress
+            i += 1 + ((i - anchor) >> 6);
+        }
+    }
+    rpc_lz_put_sequence(dst, src + anchor, size - anchor, 0, 0);
+}
+
+static bool rpc_lz_get_length(const uint8_t * & src, const uint8_t * end, size_t & len) {
+    uint8_t b;
+    do {
+        if (src >= end) {
+            return false;
+        }
+        b = *src++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+static bool rpc_decompress(const uint8_t * src, size_t size, uint8_t * dst, size_t dst_size) {
+    const uint8_t * end = src + size;
+    size_t n = 0;
+    while (src < end) {
+        const uint8_t token = *src++;
+        size_t n_lit = token >> 4;
+        if (n_lit == 15 && !rpc_lz_get_length(src, end, n_lit)) {
+            return false;
+        }
+        if (n_lit > (size_t) (end - src) || n_lit > dst_size - n) {
+            return false;
+        }
+        memcpy(dst + n, src, n_lit);
+        src += n_lit;
+        n   += n_lit;
+        if (src == end) {
+            break; // last sequence
+        }
+        if (end - src < 2) {
+            return false;
+        }
+        const size_t offset = src[0] | (src[1] << 8);
+        src += 2;
+        size_t n_match = token & 15;
+        if (n_match == 15 && !rpc_lz_get_length(src, end, n_match)) {
+            return false;
+        }
+        n_match += 4;
+        if (offset == 0 || offset > n || n_match > dst_size - n) {
+            return false;
+        }
+        // the match can overlap the output: it repeats the last offset bytes, so the copied span doubles at every step
+        for (size_t span = offset; n_match > 0; span *= 2) {
+            const size_t n_copy = std::min(n_match, span);
+            memcpy(dst + n, dst + n - span, n_copy);
+            n       += n_copy;
+            n_match -= n_copy;
+        }
+    }
+    return n == dst_size;
+}
+
+// hash of tensor data, the key of the cache of the server
+// the data is hashed in 4 independent lanes of 8-byte words (murmur3 mixing), so that it runs at memory speed
+
+static inline uint64_t rpc_rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t rpc_fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+static inline uint64_t rpc_hash_round(uint64_t h, uint64_t k) {
+    k *= 0x87c37b91114253d5ull;
+    k  = rpc_rotl64(k, 31);
+    k *= 0x4cf5ad432745937full;
+    h ^= k;
+    return rpc_rotl64(h, 27)*5 + 0x52dce729;
+}
+
+static uint64_t rpc_hash(const uint8_t * data, size_t size) {
+    uint64_t h[4] = { 0x9e3779b97f4a7c15ull, 0xbf58476d1ce4e5b9ull, 0x94d049bb133111ebull, 0x2545f4914f6cdd1dull };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        uint64_t k[4];
+        memcpy(k, data + i, sizeof(k));
+        h[0] = rpc_hash_round(h[0], k[0]);
+        h[1] = rpc_hash_round(h[1], k[1]);
+        h[2] = rpc_hash_round(h[2], k[2]);
+        h[3] = rpc_hash_round(h[3], k[3]);
+    }
+    for (int j = 0; i < size; i += 8, j++) {
+        uint64_t k = 0;
+        memcpy(&k, data + i, std::min<size_t>(8, size - i));
+        h[j] = rpc_hash_round(h[j], k);
+    }
+    uint64_t res = size;
+    for (int j = 0; j < 4; j++) {
+        res = rpc_fmix64(res ^ rpc_fmix64(h[j]));
+    }
+    return res;
+}
+
+// RPC request :| rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
 // RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+//
+// The commands without a response (SET_TENSOR, BUFFER_CLEAR, ...) are not sent one by one: the client queues them and sends
+// them together in a BATCH request, without waiting for the server, when the queue is full or together with the next command
+// that needs a response. The server processes the requests of a connection in order and closes it if a command fails.
+// Every command has an id, counted from 0 on both sides of the connection.
+//
+// BATCH request: | first_id (8 bytes) | rpc_cmd (1 byte) | cmd_size (8 bytes) | cmd_data (cmd_size bytes) | ... |
+
+static void append_data(std::vector<uint8_t> & buf, const void * data, size_t size) {
+    const uint8_t * p = (const uint8_t *) data;
+    buf.insert(buf.end(), p, p + size);
+}
+
+static void append_cmd_header(std::vector<uint8_t> & buf, enum rpc_cmd cmd, uint64_t size) {
     uint8_t cmd_byte = cmd;
-    if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
+    append_data(buf, &cmd_byte, sizeof(cmd_byte));
+    append_data(buf, &size, sizeof(size));
+}
+
+// the BATCH request of the queued commands, completed with its size
+static bool take_batch(const std::shared_ptr<socket_t> & sock, std::vector<uint8_t> & out) {
+    if (sock->batch.empty()) {
         return false;
     }
-    uint64_t input_size = input.size();
-    if (!send_data(sock->fd, &input_size, sizeof(input_size))) {
-        return false;
+    uint64_t batch_size = sock->batch.size() - 1 - sizeof(uint64_t);
+    memcpy(sock->batch.data() + 1, &batch_size, sizeof(batch_size));
+    out.swap(sock->batch);
+    sock->batch.clear();
+    return true;
+}
+
+static bool flush_rpc_cmds(const std::shared_ptr<socket_t> & sock) {
+    std::lock_guard<std::recursive_mutex> lock(sock->mutex);
+    std::vector<uint8_t> msg;
+    if (!take_batch(sock, msg)) {
+        return true;
     }
-    if (!send_data(sock->fd, input.data(), input.size())) {
-        return false;
+    return send_data(sock->fd, msg.data(), msg.size());
+}
+
+// queue a command without a response: | header | data |
+static bool queue_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * header, size_t header_size, const void * data, size_t size) {
+    std::lock_guard<std::recursive_mutex> lock(sock->mutex);
+    const uint64_t cmd_size = header_size + size;
+    if (sock->batch.size() + cmd_size > RPC_BATCH_MAX_SIZE) {
+        if (!flush_rpc_cmds(sock)) {
+            return false;
+        }
+    }
+    if (sock->batch.empty()) {
+        append_cmd_header(sock->batch, BATCH, 0);
+        append_data(sock->batch, &sock->next_id, sizeof(sock->next_id));
+    }
+    sock->next_id++;
+    append_cmd_header(sock->batch, cmd, cmd_size);
+    append_data(sock->batch, header, header_size);
+    if (cmd_size <= RPC_BATCH_MAX_SIZE) {
+        append_data(sock->batch, data, size);
+        return true;
+    }
+    // send large data as its own BATCH, from the memory of the caller
+    std::vector<uint8_t> msg;
+    take_batch(sock, msg);
+    uint64_t batch_size = msg.size() - 1 - sizeof(uint64_t) + size;
+    memcpy(msg.data() + 1, &batch_size, sizeof(batch_size));
+    return send_data(sock->fd, msg.data(), msg.size()) && send_data(sock->fd, data, size);
+}
+
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    std::lock_guard<std::recursive_mutex> lock(sock->mutex);
+    // the queued commands and the request go out together
+    std::vector<uint8_t> msg;
+    take_batch(sock, msg);
+    sock->next_id++;
+    append_cmd_header(msg, cmd, input.size());
+    if (input.size() <= RPC_BATCH_MAX_SIZE) {
+        append_data(msg, input.data(), input.size());
+        if (!send_data(sock->fd, msg.data(), msg.size())) {
+            return false;
+        }
+    } else {
+        if (!send_data(sock->fd, msg.data(), msg.size()) || !send_data(sock->fd, input.data(), input.size())) {
+            return false;
+        }
     }
     uint64_t output_size;
     if (!recv_data(sock->fd, &output_size, sizeof(output_size))) {
@@ -309,7 +706,20 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     if (sock == nullptr) {
         return nullptr;
     }
-    GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
+    // input serialization format: | version (4 bytes) |
+    // output serialization format: | version (4 bytes) | features (4 bytes) |
+    std::vector<uint8_t> input(sizeof(uint32_t));
+    uint32_t version = RPC_PROTO_VERSION;
+    memcpy(input.data(), &version, sizeof(version));
+    std::vector<uint8_t> output;
+    if (!send_rpc_cmd(sock, HELLO, input, output) || output.size() != 2*sizeof(uint32_t)) {
+        fprintf(stderr, "RPC server at %s does not support protocol version %d\n", endpoint.c_str(), RPC_PROTO_VERSION);
+        return nullptr;
+    }
+    memcpy(&sock->features, output.data() + sizeof(uint32_t), sizeof(sock->features));
+    const char * compress = getenv("GGML_RPC_COMPRESS");
+    sock->compress = compress != nullptr && atoi(compress) != 0;
+    GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d, features=%u\n", __func__, endpoint.c_str(), sock->fd, sock->features);
     sockets[endpoint] = sock;
     return sock;
 }
@@ -326,8 +736,14 @@ GGML_CALL static void ggml_backend_rpc_buffer_free_buffer(ggml_backend_buffer_t
     uint64_t remote_ptr = ctx->remote_ptr;
     memcpy(input.data(), &remote_ptr, sizeof(remote_ptr));
     std::vector<uint8_t> output;
-    bool status = send_rpc_cmd(ctx->sock, FREE_BUFFER, input, output);
-    GGML_ASSERT(status);
+    rpc_wait_pending(ctx->sock);
+    {
+        std::lock_guard<std::recursive_mutex> lock(ctx->sock->mutex);
+        bool status = send_rpc_cmd(ctx->sock, FREE_BUFFER, input, output);
+        GGML_ASSERT(status);
+        // the server drops the stored graphs that use the buffer, a new buffer can get the same address
+        ctx->sock->graphs.clear();
+    }
     GGML_ASSERT(output.empty());
     delete ctx;
 }
@@ -355,6 +771,7 @@ GGML_CALL static void * ggml_backend_rpc_buffer_get_base(ggml_backend_buffer_t b
 
 static rpc_tensor serialize_tensor(const ggml_tensor * tensor) {
     rpc_tensor result;
+    memset(&result, 0, sizeof(result));
     result.id = reinterpret_cast<uint64_t>(tensor);
     result.type = tensor->type;
     if (tensor->buffer) {
@@ -391,37 +808,95 @@ GGML_CALL static void ggml_backend_rpc_buffer_init_tensor(ggml_backend_buffer_t
     }
 }
 
-GGML_CALL static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
-    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+// queue the SET_TENSOR command of a chunk, compressed if it saves at least 1/16
+static bool queue_set_tensor_chunk(const std::shared_ptr<socket_t> & sock, const rpc_tensor & tensor, const uint8_t * chunk, uint64_t offset, uint64_t size, std::vector<uint8_t> & compressed) {
+    if (sock->compress && size >= 4096) {
+        rpc_compress(chunk, size, compressed);
+        if (compressed.size() < size - size/16) {
+            // input serialization format: | rpc_tensor | offset (8 bytes) | size (8 bytes) | compressed data |
+            uint8_t header[sizeof(rpc_tensor) + 2*sizeof(uint64_t)];
+            memcpy(header, &tensor, sizeof(rpc_tensor));
+            memcpy(header + sizeof(rpc_tensor), &offset, sizeof(offset));
+            memcpy(header + sizeof(rpc_tensor) + sizeof(offset), &size, sizeof(size));
+            return queue_rpc_cmd(sock, SET_TENSOR_COMPRESSED, header, sizeof(header), compressed.data(), compressed.size());
+        }
+    }
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
-    size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
-    std::vector<uint8_t> input(input_size, 0);
-    rpc_tensor rpc_tensor = serialize_tensor(tensor);
-    memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
-    memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
-    memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), data, size);
-    std::vector<uint8_t> output;
-    bool status = send_rpc_cmd(ctx->sock, SET_TENSOR, input, output);
-    GGML_ASSERT(status);
+    uint8_t header[sizeof(rpc_tensor) + sizeof(uint64_t)];
+    memcpy(header, &tensor, sizeof(rpc_tensor));
+    memcpy(header + sizeof(rpc_tensor), &offset, sizeof(offset));
+    return queue_rpc_cmd(sock, SET_TENSOR, header, sizeof(header), chunk, size);
 }
 
-GGML_CALL static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+static void rpc_set_tensor(const std::shared_ptr<socket_t> & sock, const rpc_tensor & rpc_tensor, const void * data, size_t offset, size_t size) {
+    const bool hashed = (sock->features & RPC_FEATURE_HASH) && size >= RPC_HASH_MIN_SIZE;
+    if (!hashed && !(sock->compress && size >= 4096)) {
+        std::vector<uint8_t> unused;
+        bool status = queue_set_tensor_chunk(sock, rpc_tensor, (const uint8_t *)data, offset, size, unused);
+        GGML_ASSERT(status);
+        return;
+    }
+    const size_t n_chunks = (size + RPC_CHUNK_SIZE - 1)/RPC_CHUNK_SIZE;
+    std::vector<uint8_t> cached(n_chunks, 0);
+    if (hashed) {
+        // the chunks found in the cache of the server are not sent
+        // input serialization format: | rpc_tensor | offset (8 bytes) | size (8 bytes) | hash (8 bytes) of each chunk |
+        std::vector<uint8_t> input(sizeof(rpc_tensor) + 2*sizeof(uint64_t) + n_chunks*sizeof(uint64_t));
+        const uint64_t offs = offset;
+        const uint64_t sz   = size;
+        memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
+        memcpy(input.data() + sizeof(rpc_tensor), &offs, sizeof(offs));
+        memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offs), &sz, sizeof(sz));
+        for (size_t i = 0; i < n_chunks; i++) {
+            const uint64_t hash = rpc_hash((const uint8_t *)data + i*RPC_CHUNK_SIZE, std::min<size_t>(RPC_CHUNK_SIZE, size - i*RPC_CHUNK_SIZE));
+            memcpy(input.data() + sizeof(rpc_tensor) + 2*sizeof(uint64_t) + i*sizeof(uint64_t), &hash, sizeof(hash));
+        }
+        // output serialization format: | found (1 byte) of each chunk |
+        std::vector<uint8_t> output;
+        bool status = send_rpc_cmd(sock, SET_TENSOR_HASH, input, output);
+        GGML_ASSERT(status);
+        GGML_ASSERT(output.size() == n_chunks);
+        cached = std::move(output);
+    }
+    std::vector<uint8_t> compressed;
+    for (size_t i = 0; i < n_chunks; i++) {
+        if (cached[i]) {
+            continue;
+        }
+        const size_t chunk_offs = i*RPC_CHUNK_SIZE;
+        bool status = queue_set_tensor_chunk(sock, rpc_tensor, (const uint8_t *)data + chunk_offs, offset + chunk_offs,
+            std::min<size_t>(RPC_CHUNK_SIZE, size - chunk_offs), compressed);
+        GGML_ASSERT(status);
+    }
+}
+
+GGML_CALL static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    rpc_wait_pending(ctx->sock);
+    rpc_set_tensor(ctx->sock, serialize_tensor(tensor), data, offset, size);
+}
+
+static void rpc_get_tensor(const std::shared_ptr<socket_t> & sock, const rpc_tensor & rpc_tensor, void * data, size_t offset, size_t size) {
     // input serialization format: | rpc_tensor | offset (8 bytes) | size (8 bytes) |
     int input_size = sizeof(rpc_tensor) + 2*sizeof(uint64_t);
     std::vector<uint8_t> input(input_size, 0);
-    rpc_tensor rpc_tensor = serialize_tensor(tensor);
     memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
     memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
     memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), &size, sizeof(size));
     std::vector<uint8_t> output;
-    bool status = send_rpc_cmd(ctx->sock, GET_TENSOR, input, output);
+    bool status = send_rpc_cmd(sock, GET_TENSOR, input, output);
     GGML_ASSERT(status);
     GGML_ASSERT(output.size() == size);
     // output serialization format: | data (size bytes) |
     memcpy(data, output.data(), size);
 }
 
+GGML_CALL static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
+    rpc_wait_pending(ctx->sock);
+    rpc_get_tensor(ctx->sock, serialize_tensor(tensor), data, offset, size);
+}
+
 GGML_CALL static bool ggml_backend_rpc_buffer_cpy_tensor(ggml_backend_buffer_t buffer, const ggml_tensor * src, ggml_tensor * dst) {
     // check if src and dst are on the same server
     ggml_backend_buffer_t src_buffer = src->buffer;
@@ -439,6 +914,13 @@ GGML_CALL static bool ggml_backend_rpc_buffer_cpy_tensor(ggml_backend_buffer_t b
     rpc_tensor rpc_dst = serialize_tensor(dst);
     memcpy(input.data(), &rpc_src, sizeof(rpc_src));
     memcpy(input.data() + sizeof(rpc_src), &rpc_dst, sizeof(rpc_dst));
+    rpc_wait_pending(ctx->sock);
+    if (ctx->sock->features & RPC_FEATURE_COPY_HOST) {
+        // the copy cannot fail, there is no need to wait for the result
+        bool status = queue_rpc_cmd(ctx->sock, COPY_TENSOR, input.data(), input.size(), nullptr, 0);
+        GGML_ASSERT(status);
+        return true;
+    }
     std::vector<uint8_t> output;
     bool status = send_rpc_cmd(ctx->sock, COPY_TENSOR, input, output);
     GGML_ASSERT(status);
@@ -454,8 +936,8 @@ GGML_CALL static void ggml_backend_rpc_buffer_clear(ggml_backend_buffer_t buffer
     std::vector<uint8_t> input(input_size, 0);
     memcpy(input.data(), &ctx->remote_ptr, sizeof(ctx->remote_ptr));
     memcpy(input.data() + sizeof(ctx->remote_ptr), &value, sizeof(value));
-    std::vector<uint8_t> output;
-    bool status = send_rpc_cmd(ctx->sock, BUFFER_CLEAR, input, output);
+    rpc_wait_pending(ctx->sock);
+    bool status = queue_rpc_cmd(ctx->sock, BUFFER_CLEAR, input.data(), input.size(), nullptr, 0);
     GGML_ASSERT(status);
 }
 
@@ -561,6 +1043,7 @@ GGML_CALL static const char * ggml_backend_rpc_name(ggml_backend_t backend) {
 
 GGML_CALL static void ggml_backend_rpc_free(ggml_backend_t backend) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    // the stream completes its operations first
     delete rpc_ctx;
     delete backend;
 }
@@ -570,9 +1053,67 @@ GGML_CALL static ggml_backend_buffer_type_t ggml_backend_rpc_get_default_buffer_
     return ggml_backend_rpc_buffer_type(ctx->endpoint.c_str());
 }
 
+GGML_CALL static void ggml_backend_rpc_set_tensor_async(ggml_backend_t backend, ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    ggml_backend_rpc_buffer_context * buf_ctx = (ggml_backend_rpc_buffer_context *)tensor->buffer->context;
+    // the data can change after the call
+    std::shared_ptr<std::vector<uint8_t>> buf = std::make_shared<std::vector<uint8_t>>((const uint8_t *)data, (const uint8_t *)data + size);
+    auto sock = buf_ctx->sock;
+    rpc_tensor rpc_tensor = serialize_tensor(tensor);
+    rpc_stream_push(rpc_ctx->stream, sock, [sock, rpc_tensor, buf, offset]() {
+        rpc_set_tensor(sock, rpc_tensor, buf->data(), offset, buf->size());
+    });
+}
+
+GGML_CALL static void ggml_backend_rpc_get_tensor_async(ggml_backend_t backend, const ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    ggml_backend_rpc_buffer_context * buf_ctx = (ggml_backend_rpc_buffer_context *)tensor->buffer->context;
+    auto sock = buf_ctx->sock;
+    rpc_tensor rpc_tensor = serialize_tensor(tensor);
+    rpc_stream_push(rpc_ctx->stream, sock, [sock, rpc_tensor, data, offset, size]() {
+        rpc_get_tensor(sock, rpc_tensor, data, offset, size);
+    });
+}
+
+// copies between RPC servers go through the host: the stream of the source reads the tensor, the stream of the destination
+// waits for it and writes it, the caller does not wait for either
+GGML_CALL static bool ggml_backend_rpc_cpy_tensor_async(ggml_backend_t backend_src, ggml_backend_t backend_dst, const ggml_tensor * src, ggml_tensor * dst) {
+    if (!ggml_backend_is_rpc(backend_src) || !ggml_backend_is_rpc(backend_dst) ||
+        src->buffer->iface.get_name != ggml_backend_rpc_buffer_get_name || dst->buffer->iface.get_name != ggml_backend_rpc_buffer_get_name) {
+        return false;
+    }
+    rpc_stream & stream_src = ((ggml_backend_rpc_context *)backend_src->context)->stream;
+    rpc_stream & stream_dst = ((ggml_backend_rpc_context *)backend_dst->context)->stream;
+    auto sock_src = ((ggml_backend_rpc_buffer_context *)src->buffer->context)->sock;
+    auto sock_dst = ((ggml_backend_rpc_buffer_context *)dst->buffer->context)->sock;
+    rpc_tensor rpc_src = serialize_tensor(src);
+    rpc_tensor rpc_dst = serialize_tensor(dst);
+    const size_t size = ggml_nbytes(src);
+    std::shared_ptr<std::vector<uint8_t>> buf = std::make_shared<std::vector<uint8_t>>(size);
+    const uint64_t pos = rpc_stream_push(stream_src, sock_src, [sock_src, rpc_src, buf]() {
+        rpc_get_tensor(sock_src, rpc_src, buf->data(), 0, buf->size());
+    });
+    rpc_stream * wait_stream = &stream_src;
+    rpc_stream_push(stream_dst, sock_dst, [wait_stream, pos, sock_dst, rpc_dst, buf]() {
+        wait_stream->wait(pos);
+        rpc_set_tensor(sock_dst, rpc_dst, buf->data(), 0, buf->size());
+    });
+    return true;
+}
+
 GGML_CALL static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
-    UNUSED(backend);
-    // this is no-op because we don't have any async operations
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    rpc_ctx->stream.wait(rpc_ctx->stream.position());
+    // the graph computes of the stream are asynchronous, their failures are reported here
+    const int compute_status = rpc_ctx->status.exchange(GGML_STATUS_SUCCESS);
+    if (compute_status != GGML_STATUS_SUCCESS) {
+        fprintf(stderr, "%s: graph compute failed with status %d\n", rpc_ctx->name.c_str(), compute_status);
+    }
+    GGML_ASSERT(compute_status == GGML_STATUS_SUCCESS);
+    // the queued commands are completed by the server before the next command that needs a response, only send them
+    auto sock = get_socket(rpc_ctx->endpoint);
+    bool status = flush_rpc_cmds(sock);
+    GGML_ASSERT(status);
 }
 
 static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited) {
@@ -612,18 +1153,88 @@ static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & o
     memcpy(out_tensors, tensors.data(), n_tensors * sizeof(rpc_tensor));
 }
 
-GGML_CALL static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
-    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
-    std::vector<uint8_t> input;
-    serialize_graph(cgraph, input);
+// the tensors of graph b that differ from graph a, false if the graphs do not have the same nodes and sources
+static bool graph_diff(const std::vector<uint8_t> & a, const std::vector<uint8_t> & b, std::vector<uint8_t> & changed) {
+    uint32_t n_nodes;
+    memcpy(&n_nodes, b.data(), sizeof(n_nodes));
+    const size_t tensors_offs = sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t);
+    if (a.size() != b.size() || memcmp(a.data(), b.data(), tensors_offs) != 0) {
+        return false;
+    }
+    changed.clear();
+    for (size_t offs = tensors_offs; offs < b.size(); offs += sizeof(rpc_tensor)) {
+        const rpc_tensor * ta = (const rpc_tensor *)(a.data() + offs);
+        const rpc_tensor * tb = (const rpc_tensor *)(b.data() + offs);
+        if (memcmp(ta, tb, sizeof(rpc_tensor)) == 0) {
+            continue;
+        }
+        if (ta->id != tb->id || ta->view_src != tb->view_src || memcmp(ta->src, tb->src, sizeof(ta->src)) != 0) {
+            return false;
+        }
+        append_data(changed, tb, sizeof(rpc_tensor));
+    }
+    return true;
+}
+
+// The server keeps the graphs of the last computes. A graph with the same nodes and sources as one of them, as built for the
+// next token, is sent as the few tensors that changed (e.g. the views of the KV cache at the position of the token).
+static enum ggml_status rpc_graph_compute(const std::shared_ptr<socket_t> & sock, std::vector<uint8_t> & graph) {
+    std::lock_guard<std::recursive_mutex> lock(sock->mutex);
+    // input serialization format: | graph_id (4 bytes) | changed tensors (n * sizeof(rpc_tensor)) |
+    std::vector<uint8_t> input(sizeof(uint32_t));
+    std::vector<uint8_t> changed;
+    uint32_t graph_id = 0;
+    for (; graph_id < sock->graphs.size(); graph_id++) {
+        if (graph_diff(sock->graphs[graph_id].graph, graph, changed)) {
+            break;
+        }
+    }
+    if (graph_id == sock->graphs.size()) {
+        // store the graph in place of the least recently used one
+        if (sock->graphs.size() < RPC_MAX_GRAPHS) {
+            sock->graphs.emplace_back();
+        } else {
+            graph_id = 0;
+            for (uint32_t i = 1; i < sock->graphs.size(); i++) {
+                if (sock->graphs[i].last_use < sock->graphs[graph_id].last_use) {
+                    graph_id = i;
+                }
+            }
+        }
+        // input serialization format: | graph_id (4 bytes) | graph (as in GRAPH_COMPUTE) |
+        bool status = queue_rpc_cmd(sock, GRAPH_STORE, &graph_id, sizeof(graph_id), graph.data(), graph.size());
+        GGML_ASSERT(status);
+        changed.clear();
+    }
+    sock->graphs[graph_id].graph = std::move(graph);
+    sock->graphs[graph_id].last_use = ++sock->n_graph_computes;
+    memcpy(input.data(), &graph_id, sizeof(graph_id));
+    input.insert(input.end(), changed.begin(), changed.end());
     std::vector<uint8_t> output;
-    auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, GRAPH_COMPUTE, input, output);
+    bool status = send_rpc_cmd(sock, GRAPH_COMPUTE_STORED, input, output);
     GGML_ASSERT(status);
     GGML_ASSERT(output.size() == 1);
     return (enum ggml_status)output[0];
 }
 
+// the graph is serialized by the caller, as its tensors can change after the call, and computed by the stream
+// like the launch of a graph on a GPU, the call only reports that the graph is queued, the status of the compute is
+// checked when the backend is synchronized
+GGML_CALL static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    std::shared_ptr<std::vector<uint8_t>> graph = std::make_shared<std::vector<uint8_t>>();
+    serialize_graph(cgraph, *graph);
+    auto sock = get_socket(rpc_ctx->endpoint);
+    rpc_stream_push(rpc_ctx->stream, sock, [rpc_ctx, sock, graph]() {
+        enum ggml_status status = rpc_graph_compute(sock, *graph);
+        if (status != GGML_STATUS_SUCCESS) {
+            int expected = GGML_STATUS_SUCCESS;
+            rpc_ctx->status.compare_exchange_strong(expected, status);
+        }
+    });
+    return GGML_STATUS_SUCCESS;
+}
+
 GGML_CALL static bool ggml_backend_rpc_supports_op(ggml_backend_t backend, const ggml_tensor * op) {
     UNUSED(backend);
     UNUSED(op);
@@ -640,13 +1251,50 @@ GGML_CALL static bool ggml_backend_rpc_supports_buft(ggml_backend_t backend, ggm
     return buft_ctx->endpoint == rpc_ctx->endpoint;
 }
 
+GGML_CALL static ggml_backend_event_t ggml_backend_rpc_event_new(ggml_backend_t backend) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    return new ggml_backend_event {
+        /* .backend = */ backend,
+        /* .context = */ new rpc_event { &rpc_ctx->stream, 0 },
+    };
+}
+
+GGML_CALL static void ggml_backend_rpc_event_free(ggml_backend_event_t event) {
+    delete (rpc_event *)event->context;
+    delete event;
+}
+
+GGML_CALL static void ggml_backend_rpc_event_record(ggml_backend_event_t event) {
+    rpc_event * ev = (rpc_event *)event->context;
+    ev->pos = ev->stream->position();
+}
+
+GGML_CALL static void ggml_backend_rpc_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    rpc_event * ev = (rpc_event *)event->context;
+    if (ev->stream == &rpc_ctx->stream) {
+        return; // the operations of a stream are in order
+    }
+    GGML_ASSERT(ggml_backend_is_rpc(event->backend));
+    rpc_stream * stream = ev->stream;
+    const uint64_t pos = ev->pos;
+    rpc_ctx->stream.push([stream, pos]() {
+        stream->wait(pos);
+    });
+}
+
+GGML_CALL static void ggml_backend_rpc_event_synchronize(ggml_backend_event_t event) {
+    rpc_event * ev = (rpc_event *)event->context;
+    ev->stream->wait(ev->pos);
+}
+
 static ggml_backend_i ggml_backend_rpc_interface = {
     /* .get_name                = */ ggml_backend_rpc_name,
     /* .free                    = */ ggml_backend_rpc_free,
     /* .get_default_buffer_type = */ ggml_backend_rpc_get_default_buffer_type,
-    /* .set_tensor_async        = */ NULL,
-    /* .get_tensor_async        = */ NULL,
-    /* .cpy_tensor_async        = */ NULL,
+    /* .set_tensor_async        = */ ggml_backend_rpc_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_rpc_get_tensor_async,
+    /* .cpy_tensor_async        = */ ggml_backend_rpc_cpy_tensor_async,
     /* .synchronize             = */ ggml_backend_rpc_synchronize,
     /* .graph_plan_create       = */ NULL,
     /* .graph_plan_free         = */ NULL,
@@ -656,11 +1304,11 @@ static ggml_backend_i ggml_backend_rpc_interface = {
     /* .supports_op             = */ ggml_backend_rpc_supports_op,
     /* .supports_buft           = */ ggml_backend_rpc_supports_buft,
     /* .offload_op              = */ NULL,
-    /* .event_new               = */ NULL,
-    /* .event_free              = */ NULL,
-    /* .event_record            = */ NULL,
-    /* .event_wait              = */ NULL,
-    /* .event_synchronize       = */ NULL,
+    /* .event_new               = */ ggml_backend_rpc_event_new,
+    /* .event_free              = */ ggml_backend_rpc_event_free,
+    /* .event_record            = */ ggml_backend_rpc_event_record,
+    /* .event_wait              = */ ggml_backend_rpc_event_wait,
+    /* .event_synchronize       = */ ggml_backend_rpc_event_synchronize,
 };
 
 GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const char * endpoint) {
@@ -694,10 +1342,7 @@ GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_rpc_buffer_type(const
 }
 
 GGML_CALL ggml_backend_t ggml_backend_rpc_init(const char * endpoint) {
-    ggml_backend_rpc_context * ctx = new ggml_backend_rpc_context {
-        /* .endpoint  = */ endpoint,
-        /* .name      = */ "RPC[" + std::string(endpoint) + "]",
-    };
+    ggml_backend_rpc_context * ctx = new ggml_backend_rpc_context(endpoint, "RPC[" + std::string(endpoint) + "]");
 
     ggml_backend_t backend = new ggml_backend {
         /* .guid      = */ ggml_backend_rpc_guid(),
@@ -739,24 +1384,183 @@ GGML_API GGML_CALL void ggml_backend_rpc_get_device_memory(const char * endpoint
 
 // RPC server-side implementation
 
+// tensor data of the server, looked up by its hash: in the files of the cache directory, named by the hash, which are
+// written when the client uploads data that was not found, and in the tensors of GGUF files, indexed at startup
+class rpc_tensor_cache {
+public:
+    bool init(const char * cache_dir, const char * const * gguf_files, size_t n_gguf_files);
+    bool enabled() const { return !dir.empty() || !index.empty(); }
+    bool writable() const { return !dir.empty(); }
+
+    // read the data into dst, returns false if it is not found
+    bool load(uint64_t hash, uint64_t size, uint8_t * dst);
+    void store(uint64_t hash, const uint8_t * data, size_t size);
+
+private:
+    bool index_gguf(const char * fname);
+    std::string cache_path(uint64_t hash) const;
+
+    struct location {
+        size_t   file;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    std::string dir;
+    std::vector<std::string> files;
+    std::unordered_map<uint64_t, location> index; // not modified after init, read by all the connections
+    std::atomic<uint64_t> n_stores{0};
+};
+
+bool rpc_tensor_cache::init(const char * cache_dir, const char * const * gguf_files, size_t n_gguf_files) {
+    dir = cache_dir ? cache_dir : "";
+    for (size_t i = 0; i < n_gguf_files; i++) {
+        if (!index_gguf(gguf_files[i])) {
+            fprintf(stderr, "Failed to index %s\n", gguf_files[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// the tensors are hashed in the same chunks as the uploads of the client, which set a whole tensor at once
+bool rpc_tensor_cache::index_gguf(const char * fname) {
+    struct ggml_context * meta = nullptr;
+    struct gguf_init_params params = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ &meta,
+    };
+    struct gguf_context * gguf = gguf_init_from_file(fname, params);
+    if (gguf == nullptr) {
+        return false;
+    }
+    std::ifstream file(fname, std::ios::binary);
+    const size_t file_idx = files.size();
+    files.push_back(fname);
+    std::vector<uint8_t> buf;
+    size_t n_chunks = 0;
+    bool ok = file.good();
+    for (int i = 0; ok && i < gguf_get_n_tensors(gguf); i++) {
+        const ggml_tensor * tensor = ggml_get_tensor(meta, gguf_get_tensor_name(gguf, i));
+        const uint64_t offset = gguf_get_data_offset(gguf) + gguf_get_tensor_offset(gguf, i);
+        const uint64_t size   = ggml_nbytes(tensor);
+        if (size < RPC_HASH_MIN_SIZE) {
+            continue;
+        }
+        file.seekg(offset);
+        for (uint64_t chunk_offs = 0; ok && chunk_offs < size; chunk_offs += RPC_CHUNK_SIZE) {
+            const uint64_t chunk_size = std::min<uint64_t>(RPC_CHUNK_SIZE, size - chunk_offs);
+            buf.resize(chunk_size);
+            ok = (bool) file.read((char *) buf.data(), chunk_size);
+            index[rpc_hash(buf.data(), chunk_size)] = { file_idx, offset + chunk_offs, chunk_size };
+            n_chunks++;
+        }
+    }
+    ggml_free(meta);
+    gguf_free(gguf);
+    if (ok) {
+        printf("Indexed %zu chunks of tensor data in %s\n", n_chunks, fname);
+    }
+    return ok;
+}
+
+std::string rpc_tensor_cache::cache_path(uint64_t hash) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".bin", hash);
+    return dir + "/" + name;
+}
+
+// the data is checked against the hash, the files can change after they are indexed
+bool rpc_tensor_cache::load(uint64_t hash, uint64_t size, uint8_t * dst) {
+    std::ifstream file;
+    auto it = index.find(hash);
+    if (it != index.end() && it->second.size == size) {
+        file.open(files[it->second.file], std::ios::binary);
+        file.seekg(it->second.offset);
+    } else if (!dir.empty()) {
+        file.open(cache_path(hash), std::ios::binary | std::ios::ate);
+        if (!file || (uint64_t) file.tellg() != size) {
+            return false;
+        }
+        file.seekg(0);
+    } else {
+        return false;
+    }
+    return file.read((char *) dst, size) && rpc_hash(dst, size) == hash;
+}
+
+// the data was not found, so an existing file is damaged and replaced
+// the file is written under a temporary name, unique among the connections, so that a partial file is never found
+void rpc_tensor_cache::store(uint64_t hash, const uint8_t * data, size_t size) {
+    const std::string path = cache_path(hash);
+    const std::string tmp_path = path + "." + std::to_string(n_stores++) + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary);
+        if (!file.write((const char *) data, size)) {
+            fprintf(stderr, "Failed to write %s\n", tmp_path.c_str());
+            file.close();
+            std::remove(tmp_path.c_str());
+            return;
+        }
+    }
+    std::remove(path.c_str());
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+    }
+}
+
+// state of the server shared by its connections
+struct rpc_server_shared {
+    ggml_backend_t backend;
+    size_t free_mem;
+    size_t total_mem;
+    rpc_tensor_cache cache;
+
+    // the graphs of the connections are computed one at a time, each with all the threads of the backend
+    std::mutex compute_mutex;
+
+    // size of the buffers of all the connections, they are not allocated beyond free_mem
+    std::atomic<size_t> allocated{0};
+
+    std::mutex              clients_mutex;
+    std::condition_variable clients_cv;
+    int                     n_clients = 0;
+};
+
+// a connection, with its own buffers and graphs
 class rpc_server {
 public:
-    rpc_server(ggml_backend_t backend) : backend(backend) {}
+    rpc_server(rpc_server_shared * shared) : backend(shared->backend), cache(&shared->cache), shared(shared) {}
     ~rpc_server();
 
+    bool hello(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
     bool alloc_buffer(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
     void get_alignment(std::vector<uint8_t> & output);
     void get_max_size(std::vector<uint8_t> & output);
     bool buffer_get_base(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
     bool free_buffer(const std::vector<uint8_t> & input);
     bool buffer_clear(const std::vector<uint8_t> & input);
-    bool set_tensor(const std::vector<uint8_t> & input);
+    bool set_tensor(const uint8_t * input, size_t input_size);
+    bool set_tensor_compressed(const uint8_t * input, size_t input_size);
+    bool set_tensor_hash(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
     bool get_tensor(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
     bool copy_tensor(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
     bool graph_compute(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
+    bool graph_store(const uint8_t * input, size_t input_size);
+    bool graph_compute_stored(const std::vector<uint8_t> & input, std::vector<uint8_t> & output);
+    void get_device_memory(std::vector<uint8_t> & output);
 
 private:
+    struct rpc_graph {
+        struct ggml_context * ctx = nullptr;
+        struct ggml_cgraph * graph = nullptr;
+        std::unordered_map<uint64_t, ggml_tensor*> tensors; // by id
+    };
+
     ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
+    bool update_tensor(ggml_tensor * result, const rpc_tensor * tensor);
+    bool deserialize_graph(const uint8_t * input, size_t input_size, rpc_graph & result);
+    void free_buffer_memory(ggml_backend_buffer_t buffer);
     ggml_tensor * create_node(uint64_t id,
                               struct ggml_context * ctx,
                               const std::unordered_map<uint64_t, const rpc_tensor*> & tensor_ptrs,
@@ -764,9 +1568,39 @@ private:
 
 
     ggml_backend_t backend;
+    rpc_tensor_cache * cache;
+    rpc_server_shared * shared;
     std::unordered_set<ggml_backend_buffer_t> buffers;
+    // chunks not found by SET_TENSOR_HASH, by destination address: (hash, size) of the data to store in the cache
+    std::unordered_map<const uint8_t *, std::pair<uint64_t, uint64_t>> cache_misses;
+    rpc_graph graphs[RPC_MAX_GRAPHS]; // see GRAPH_STORE
 };
 
+bool rpc_server::hello(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    // input serialization format: | version (4 bytes) |
+    if (input.size() != sizeof(uint32_t)) {
+        return false;
+    }
+    uint32_t version;
+    memcpy(&version, input.data(), sizeof(version));
+    if (version != RPC_PROTO_VERSION) {
+        fprintf(stderr, "Unsupported client protocol version %u, expected %d\n", version, RPC_PROTO_VERSION);
+        return false;
+    }
+    uint32_t features = 0;
+    if (ggml_backend_buft_is_host(ggml_backend_get_default_buffer_type(backend))) {
+        features |= RPC_FEATURE_COPY_HOST;
+    }
+    if (cache->enabled()) {
+        features |= RPC_FEATURE_HASH;
+    }
+    // output serialization format: | version (4 bytes) | features (4 bytes) |
+    output.resize(2*sizeof(uint32_t), 0);
+    memcpy(output.data(), &version, sizeof(version));
+    memcpy(output.data() + sizeof(uint32_t), &features, sizeof(features));
+    return true;
+}
+
 bool rpc_server::alloc_buffer(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
     // input serialization format: | size (8 bytes) |
     if (input.size() != sizeof(uint64_t)) {
@@ -775,7 +1609,26 @@ bool rpc_server::alloc_buffer(const std::vector<uint8_t> & input, std::vector<ui
     uint64_t size;
     memcpy(&size, input.data(), sizeof(size));
     ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
-    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(buft, size);
+    ggml_backend_buffer_t buffer = nullptr;
+    // reserve the memory first, so that the connections cannot allocate more than free_mem together
+    // the size comes from the client, the total is only updated if it stays within free_mem
+    bool reserved = false;
+    size_t allocated = shared->allocated.load();
+    while (size <= shared->free_mem && allocated <= shared->free_mem - size) {
+        if (shared->allocated.compare_exchange_weak(allocated, allocated + size)) {
+            reserved = true;
+            break;
+        }
+    }
+    if (reserved) {
+        buffer = ggml_backend_buft_alloc_buffer(buft, size);
+        if (buffer == nullptr || buffer->size != size) {
+            shared->allocated -= size;
+            if (buffer != nullptr) {
+                shared->allocated += buffer->size;
+            }
+        }
+    }
     uint64_t remote_ptr = 0;
     uint64_t remote_size = 0;
     if (buffer != nullptr) {
@@ -845,11 +1698,43 @@ bool rpc_server::free_buffer(const std::vector<uint8_t> & input) {
         GGML_PRINT_DEBUG("[%s] buffer not found\n", __func__);
         return false;
     }
-    ggml_backend_buffer_free(buffer);
+    // the stored graphs keep pointers to the tensors of the buffer
+    for (auto & graph : graphs) {
+        if (graph.ctx == nullptr) {
+            continue;
+        }
+        bool uses_buffer = false;
+        for (const auto & it : graph.tensors) {
+            uses_buffer = uses_buffer || it.second->buffer == buffer;
+        }
+        if (uses_buffer) {
+            ggml_free(graph.ctx);
+            graph.ctx = nullptr;
+            graph.graph = nullptr;
+            graph.tensors.clear();
+        }
+    }
+    free_buffer_memory(buffer);
     buffers.erase(buffer);
     return true;
 }
 
+void rpc_server::free_buffer_memory(ggml_backend_buffer_t buffer) {
+    shared->allocated -= ggml_backend_buffer_get_size(buffer);
+    ggml_backend_buffer_free(buffer);
+}
+
+void rpc_server::get_device_memory(std::vector<uint8_t> & output) {
+    // the memory of the buffers of all the connections is used
+    const uint64_t allocated = shared->allocated;
+    const uint64_t free_mem  = allocated < shared->free_mem ? shared->free_mem - allocated : 0;
+    const uint64_t total_mem = shared->total_mem;
+    // output serialization format: | free (8 bytes) | total (8 bytes) |
+    output.resize(2*sizeof(uint64_t), 0);
+    memcpy(output.data(), &free_mem, sizeof(free_mem));
+    memcpy(output.data() + sizeof(uint64_t), &total_mem, sizeof(total_mem));
+}
+
 bool rpc_server::buffer_clear(const std::vector<uint8_t> & input) {
     // input serialization format: | remote_ptr (8 bytes) | value (1 byte) |
     if (input.size() != sizeof(uint64_t) + sizeof(uint8_t)) {
@@ -870,14 +1755,30 @@ bool rpc_server::buffer_clear(const std::vector<uint8_t> & input) {
 }
 
 ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor) {
+    if (tensor->type >= GGML_TYPE_COUNT) {
+        return nullptr;
+    }
     ggml_tensor * result = ggml_new_tensor_4d(ctx, (ggml_type) tensor->type,
         tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
+    if (!update_tensor(result, tensor)) {
+        return nullptr;
+    }
+    return result;
+}
+
+// everything but the sources, also used to update the tensors of a stored graph
+bool rpc_server::update_tensor(ggml_tensor * result, const rpc_tensor * tensor) {
+    if (tensor->type >= GGML_TYPE_COUNT || tensor->op >= GGML_OP_COUNT) {
+        return false;
+    }
+    result->type = (ggml_type) tensor->type;
     for (uint32_t i = 0; i < GGML_MAX_DIMS; i++) {
+        result->ne[i] = tensor->ne[i];
         result->nb[i] = tensor->nb[i];
     }
     result->buffer = reinterpret_cast<ggml_backend_buffer_t>(tensor->buffer);
     if (result->buffer && buffers.find(result->buffer) == buffers.end()) {
-        return nullptr;
+        return false;
     }
     result->op = (ggml_op) tensor->op;
     for (uint32_t i = 0; i < GGML_MAX_OP_PARAMS / sizeof(int32_t); i++) {
@@ -885,20 +1786,31 @@ ggml_tensor * rpc_server::deserialize_tensor(struct ggml_context * ctx, const rp
     }
     result->flags = tensor->flags;
     result->data = reinterpret_cast<void *>(tensor->data);
+    result->view_offs = tensor->view_offs;
+    // the data of the tensor must be within its buffer, a tensor without a buffer has no data
+    if (result->buffer) {
+        const uint64_t base = (uint64_t) ggml_backend_buffer_get_base(result->buffer);
+        const uint64_t buf_size = ggml_backend_buffer_get_size(result->buffer);
+        if (tensor->data < base || tensor->data - base > buf_size || ggml_nbytes(result) > buf_size - (tensor->data - base)) {
+            return false;
+        }
+    } else if (tensor->data != 0) {
+        return false;
+    }
     ggml_set_name(result, tensor->name);
-    return result;
+    return true;
 }
 
 
-bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
+bool rpc_server::set_tensor(const uint8_t * input, size_t input_size) {
     // serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes) |
-    if (input.size() < sizeof(rpc_tensor) + sizeof(uint64_t)) {
+    if (input_size < sizeof(rpc_tensor) + sizeof(uint64_t)) {
         return false;
     }
-    const rpc_tensor * in_tensor = (const rpc_tensor *)input.data();
+    const rpc_tensor * in_tensor = (const rpc_tensor *)input;
     uint64_t offset;
-    memcpy(&offset, input.data() + sizeof(rpc_tensor), sizeof(offset));
-    size_t size = input.size() - sizeof(rpc_tensor) - sizeof(offset);
+    memcpy(&offset, input + sizeof(rpc_tensor), sizeof(offset));
+    size_t size = input_size - sizeof(rpc_tensor) - sizeof(offset);
 
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
@@ -907,14 +1819,107 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
     };
     struct ggml_context * ctx = ggml_init(params);
     ggml_tensor * tensor = deserialize_tensor(ctx, in_tensor);
-    if (tensor == nullptr) {
+    if (tensor == nullptr || tensor->buffer == nullptr || offset > ggml_nbytes(tensor) || size > ggml_nbytes(tensor) - offset) {
         GGML_PRINT_DEBUG("[%s] error deserializing tensor\n", __func__);
         ggml_free(ctx);
         return false;
     }
     GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %zu\n", __func__, (void*)tensor->buffer, tensor->data, offset, size);
-    const void * data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
+    const uint8_t * data = input + sizeof(rpc_tensor) + sizeof(offset);
     ggml_backend_tensor_set(tensor, data, offset, size);
+    if (!cache_misses.empty()) {
+        auto it = cache_misses.find((const uint8_t *) tensor->data + offset);
+        if (it != cache_misses.end()) {
+            if (it->second.second == size && rpc_hash(data, size) == it->second.first) {
+                cache->store(it->second.first, data, size);
+            }
+            cache_misses.erase(it);
+        }
+    }
+    ggml_free(ctx);
+    return true;
+}
+
+bool rpc_server::set_tensor_compressed(const uint8_t * input, size_t input_size) {
+    // serialization format: | rpc_tensor | offset (8 bytes) | size (8 bytes) | compressed data |
+    if (input_size < sizeof(rpc_tensor) + 2*sizeof(uint64_t)) {
+        return false;
+    }
+    uint64_t size;
+    memcpy(&size, input + sizeof(rpc_tensor) + sizeof(uint64_t), sizeof(size));
+    if (size > RPC_CHUNK_SIZE) {
+        return false;
+    }
+    // decompress into the layout of a SET_TENSOR command
+    const size_t header_size = sizeof(rpc_tensor) + sizeof(uint64_t);
+    std::vector<uint8_t> buf(header_size + size);
+    memcpy(buf.data(), input, header_size);
+    const size_t compressed_offs = header_size + sizeof(uint64_t);
+    if (!rpc_decompress(input + compressed_offs, input_size - compressed_offs, buf.data() + header_size, size)) {
+        GGML_PRINT_DEBUG("[%s] invalid compressed data\n", __func__);
+        return false;
+    }
+    return set_tensor(buf.data(), buf.size());
+}
+
+bool rpc_server::set_tensor_hash(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    // serialization format: | rpc_tensor | offset (8 bytes) | size (8 bytes) | hash (8 bytes) of each chunk |
+    const size_t header_size = sizeof(rpc_tensor) + 2*sizeof(uint64_t);
+    if (input.size() < header_size) {
+        return false;
+    }
+    const rpc_tensor * in_tensor = (const rpc_tensor *)input.data();
+    uint64_t offset;
+    memcpy(&offset, input.data() + sizeof(rpc_tensor), sizeof(offset));
+    uint64_t size;
+    memcpy(&size, input.data() + sizeof(rpc_tensor) + sizeof(offset), sizeof(size));
+    const uint64_t n_chunks = size/RPC_CHUNK_SIZE + (size % RPC_CHUNK_SIZE != 0);
+    if ((input.size() - header_size)/sizeof(uint64_t) != n_chunks || (input.size() - header_size) % sizeof(uint64_t) != 0) {
+        return false;
+    }
+
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx = ggml_init(params);
+    ggml_tensor * tensor = deserialize_tensor(ctx, in_tensor);
+    // offset and size come from the client, the checks are written so that they cannot overflow
+    if (tensor == nullptr || tensor->buffer == nullptr || offset > ggml_nbytes(tensor) || size > ggml_nbytes(tensor) - offset) {
+        GGML_PRINT_DEBUG("[%s] error deserializing tensor\n", __func__);
+        ggml_free(ctx);
+        return false;
+    }
+    GGML_PRINT_DEBUG("[%s] buffer: %p, data: %p, offset: %" PRIu64 ", size: %" PRIu64 "\n", __func__, (void*)tensor->buffer, tensor->data, offset, size);
+    // host buffers are read into directly
+    const uint8_t * base    = (const uint8_t *) ggml_backend_buffer_get_base(tensor->buffer);
+    const uint8_t * buf_end = base + ggml_backend_buffer_get_size(tensor->buffer);
+    const uint8_t * data    = (const uint8_t *) tensor->data;
+    const bool is_host = ggml_backend_buffer_is_host(tensor->buffer) &&
+        data >= base && data <= buf_end && offset <= (uint64_t) (buf_end - data) && size <= (uint64_t) (buf_end - data) - offset;
+    std::vector<uint8_t> buf;
+    // output serialization format: | found (1 byte) of each chunk |
+    output.resize(n_chunks, 0);
+    for (uint64_t i = 0; i < n_chunks; i++) {
+        uint64_t hash;
+        memcpy(&hash, input.data() + header_size + i*sizeof(uint64_t), sizeof(hash));
+        const uint64_t chunk_offs = offset + i*RPC_CHUNK_SIZE;
+        const uint64_t chunk_size = std::min<uint64_t>(RPC_CHUNK_SIZE, size - i*RPC_CHUNK_SIZE);
+        uint8_t * dst = (uint8_t *) tensor->data + chunk_offs;
+        if (is_host) {
+            output[i] = cache->load(hash, chunk_size, dst);
+        } else {
+            buf.resize(chunk_size);
+            output[i] = cache->load(hash, chunk_size, buf.data());
+            if (output[i]) {
+                ggml_backend_tensor_set(tensor, buf.data(), chunk_offs, chunk_size);
+            }
+        }
+        if (!output[i] && cache->writable()) {
+            cache_misses[dst] = std::make_pair(hash, chunk_size);
+        }
+    }
     ggml_free(ctx);
     return true;
 }
@@ -937,7 +1942,7 @@ bool rpc_server::get_tensor(const std::vector<uint8_t> & input, std::vector<uint
     };
     struct ggml_context * ctx = ggml_init(params);
     ggml_tensor * tensor = deserialize_tensor(ctx, in_tensor);
-    if (tensor == nullptr) {
+    if (tensor == nullptr || tensor->buffer == nullptr || offset > ggml_nbytes(tensor) || size > ggml_nbytes(tensor) - offset) {
         GGML_PRINT_DEBUG("[%s] error deserializing tensor\n", __func__);
         ggml_free(ctx);
         return false;
@@ -956,7 +1961,7 @@ bool rpc_server::copy_tensor(const std::vector<uint8_t> & input, std::vector<uin
         return false;
     }
     const rpc_tensor * rpc_src = (const rpc_tensor *)input.data();
-    const rpc_tensor * rpc_dst = (const rpc_tensor *)(input.data() + sizeof(rpc_src));
+    const rpc_tensor * rpc_dst = (const rpc_tensor *)(input.data() + sizeof(rpc_tensor));
 
     struct ggml_init_params params {
         /*.mem_size   =*/ 2*ggml_tensor_overhead(),
@@ -966,7 +1971,7 @@ bool rpc_server::copy_tensor(const std::vector<uint8_t> & input, std::vector<uin
     struct ggml_context * ctx = ggml_init(params);
     ggml_tensor * src = deserialize_tensor(ctx, rpc_src);
     ggml_tensor * dst = deserialize_tensor(ctx, rpc_dst);
-    if (src == nullptr || dst == nullptr) {
+    if (src == nullptr || dst == nullptr || src->buffer == nullptr || dst->buffer == nullptr || ggml_nbytes(src) > ggml_nbytes(dst)) {
         GGML_PRINT_DEBUG("[%s] error deserializing tensors\n", __func__);
         ggml_free(ctx);
         return false;
@@ -990,7 +1995,12 @@ ggml_tensor * rpc_server::create_node(uint64_t id,
     if (tensor_map.find(id) != tensor_map.end()) {
         return tensor_map[id];
     }
-    const rpc_tensor * tensor = tensor_ptrs.at(id);
+    // the ids come from the client: an unknown id or an invalid tensor makes the whole graph invalid
+    auto it = tensor_ptrs.find(id);
+    if (it == tensor_ptrs.end()) {
+        return nullptr;
+    }
+    const rpc_tensor * tensor = it->second;
     struct ggml_tensor * result = deserialize_tensor(ctx, tensor);
     if (result == nullptr) {
         return nullptr;
@@ -998,67 +2008,253 @@ ggml_tensor * rpc_server::create_node(uint64_t id,
     tensor_map[id] = result;
     for (int i = 0; i < GGML_MAX_SRC; i++) {
         result->src[i] = create_node(tensor->src[i], ctx, tensor_ptrs, tensor_map);
+        if (tensor->src[i] != 0 && result->src[i] == nullptr) {
+            return nullptr;
+        }
     }
     result->view_src = create_node(tensor->view_src, ctx, tensor_ptrs, tensor_map);
-    result->view_offs = tensor->view_offs;
+    if (tensor->view_src != 0 && result->view_src == nullptr) {
+        return nullptr;
+    }
     return result;
 }
 
-bool rpc_server::graph_compute(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+bool rpc_server::deserialize_graph(const uint8_t * input, size_t input_size, rpc_graph & result) {
     // serialization format:
     // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
-    if (input.size() < sizeof(uint32_t)) {
+    if (input_size < sizeof(uint32_t)) {
         return false;
     }
     uint32_t n_nodes;
-    memcpy(&n_nodes, input.data(), sizeof(n_nodes));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
+    memcpy(&n_nodes, input, sizeof(n_nodes));
+    if (input_size < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
         return false;
     }
-    const uint64_t * nodes = (const uint64_t *)(input.data() + sizeof(n_nodes));
+    const uint64_t * nodes = (const uint64_t *)(input + sizeof(n_nodes));
     uint32_t n_tensors;
-    memcpy(&n_tensors, input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
+    memcpy(&n_tensors, input + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
+    if (input_size < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
         return false;
     }
-    const rpc_tensor * tensors = (const rpc_tensor *)(input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
+    const rpc_tensor * tensors = (const rpc_tensor *)(input + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
     GGML_PRINT_DEBUG("[%s] n_nodes: %u, n_tensors: %u\n", __func__, n_nodes, n_tensors);
 
-    static size_t buf_size = ggml_tensor_overhead()*(n_nodes + n_tensors) + ggml_graph_overhead_custom(n_nodes, false);
+    size_t buf_size = ggml_tensor_overhead()*(n_nodes + n_tensors) + ggml_graph_overhead_custom(n_nodes, false);
     struct ggml_init_params params = {
         /*.mem_size   =*/ buf_size,
         /*.mem_buffer =*/ NULL,
         /*.no_alloc   =*/ true,
     };
-    struct ggml_context * ctx = ggml_init(params);
-    struct ggml_cgraph * graph = ggml_new_graph_custom(ctx, n_nodes, false);
-    graph->n_nodes = n_nodes;
+    result.ctx = ggml_init(params);
+    result.graph = ggml_new_graph_custom(result.ctx, n_nodes, false);
+    result.graph->n_nodes = n_nodes;
     std::unordered_map<uint64_t, const rpc_tensor*> tensor_ptrs;
     for (uint32_t i = 0; i < n_tensors; i++) {
         tensor_ptrs[tensors[i].id] = &tensors[i];
     }
-    std::unordered_map<uint64_t, ggml_tensor*> tensor_map;
+    result.tensors.clear();
     for (uint32_t i = 0; i < n_nodes; i++) {
         int64_t id;
         memcpy(&id, &nodes[i], sizeof(id));
-        graph->nodes[i] = create_node(id, ctx, tensor_ptrs, tensor_map);
+        result.graph->nodes[i] = create_node(id, result.ctx, tensor_ptrs, result.tensors);
+        if (result.graph->nodes[i] == nullptr) {
+            GGML_PRINT_DEBUG("[%s] invalid node %u (id %" PRId64 ")\n", __func__, i, id);
+            ggml_free(result.ctx);
+            result.ctx   = nullptr;
+            result.graph = nullptr;
+            result.tensors.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool rpc_server::graph_compute(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    rpc_graph graph;
+    if (!deserialize_graph(input.data(), input.size(), graph)) {
+        return false;
+    }
+    ggml_status status;
+    {
+        std::lock_guard<std::mutex> lock(shared->compute_mutex);
+        status = ggml_backend_graph_compute(backend, graph.graph);
+    }
+    // output serialization format: | status (1 byte) |
+    output.resize(1, 0);
+    output[0] = status;
+    ggml_free(graph.ctx);
+    return true;
+}
+
+bool rpc_server::graph_store(const uint8_t * input, size_t input_size) {
+    // serialization format: | graph_id (4 bytes) | graph (as in GRAPH_COMPUTE) |
+    if (input_size < sizeof(uint32_t)) {
+        return false;
+    }
+    uint32_t graph_id;
+    memcpy(&graph_id, input, sizeof(graph_id));
+    if (graph_id >= RPC_MAX_GRAPHS) {
+        return false;
+    }
+    rpc_graph & graph = graphs[graph_id];
+    if (graph.ctx) {
+        ggml_free(graph.ctx);
+        graph.ctx = nullptr;
+    }
+    return deserialize_graph(input + sizeof(graph_id), input_size - sizeof(graph_id), graph);
+}
+
+bool rpc_server::graph_compute_stored(const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    // serialization format: | graph_id (4 bytes) | changed tensors (n * sizeof(rpc_tensor)) |
+    if (input.size() < sizeof(uint32_t) || (input.size() - sizeof(uint32_t)) % sizeof(rpc_tensor) != 0) {
+        return false;
+    }
+    uint32_t graph_id;
+    memcpy(&graph_id, input.data(), sizeof(graph_id));
+    if (graph_id >= RPC_MAX_GRAPHS || graphs[graph_id].ctx == nullptr) {
+        return false;
+    }
+    rpc_graph & graph = graphs[graph_id];
+    const rpc_tensor * tensors = (const rpc_tensor *)(input.data() + sizeof(graph_id));
+    const size_t n_tensors = (input.size() - sizeof(graph_id)) / sizeof(rpc_tensor);
+    GGML_PRINT_DEBUG("[%s] graph_id: %u, n_changed: %zu\n", __func__, graph_id, n_tensors);
+    for (size_t i = 0; i < n_tensors; i++) {
+        auto it = graph.tensors.find(tensors[i].id);
+        if (it == graph.tensors.end() || !update_tensor(it->second, &tensors[i])) {
+            return false;
+        }
+    }
+    ggml_status status;
+    {
+        std::lock_guard<std::mutex> lock(shared->compute_mutex);
+        status = ggml_backend_graph_compute(backend, graph.graph);
     }
-    ggml_status status = ggml_backend_graph_compute(backend, graph);
     // output serialization format: | status (1 byte) |
     output.resize(1, 0);
     output[0] = status;
-    ggml_free(ctx);
     return true;
 }
 
 rpc_server::~rpc_server() {
+    for (auto & graph : graphs) {
+        if (graph.ctx) {
+            ggml_free(graph.ctx);
+        }
+    }
     for (auto buffer : buffers) {
-        ggml_backend_buffer_free(buffer);
+        free_buffer_memory(buffer);
     }
 }
 
-static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend);
+static bool rpc_serve_cmd(rpc_server & server, uint8_t cmd, const std::vector<uint8_t> & input, std::vector<uint8_t> & output) {
+    switch (cmd) {
+        case HELLO: {
+            return server.hello(input, output);
+        }
+        case ALLOC_BUFFER: {
+            return server.alloc_buffer(input, output);
+        }
+        case GET_ALIGNMENT: {
+            server.get_alignment(output);
+            return true;
+        }
+        case GET_MAX_SIZE: {
+            server.get_max_size(output);
+            return true;
+        }
+        case BUFFER_GET_BASE: {
+            return server.buffer_get_base(input, output);
+        }
+        case FREE_BUFFER: {
+            return server.free_buffer(input);
+        }
+        case BUFFER_CLEAR: {
+            return server.buffer_clear(input);
+        }
+        case SET_TENSOR: {
+            return server.set_tensor(input.data(), input.size());
+        }
+        case SET_TENSOR_HASH: {
+            return server.set_tensor_hash(input, output);
+        }
+        case GET_TENSOR: {
+            return server.get_tensor(input, output);
+        }
+        case COPY_TENSOR: {
+            return server.copy_tensor(input, output);
+        }
+        case GRAPH_COMPUTE: {
+            return server.graph_compute(input, output);
+        }
+        case GRAPH_COMPUTE_STORED: {
+            return server.graph_compute_stored(input, output);
+        }
+        case GET_DEVICE_MEMORY: {
+            server.get_device_memory(output);
+            return true;
+        }
+        default: {
+            fprintf(stderr, "Unknown command: %d\n", cmd);
+            return false;
+        }
+    }
+}
+
+// the commands of a BATCH request, they have no response
+static bool rpc_serve_batch(rpc_server & server, const std::vector<uint8_t> & input, uint64_t & next_id) {
+    // serialization format: | first_id (8 bytes) | rpc_cmd (1 byte) | cmd_size (8 bytes) | cmd_data (cmd_size bytes) | ... |
+    if (input.size() < sizeof(uint64_t)) {
+        return false;
+    }
+    uint64_t first_id;
+    memcpy(&first_id, input.data(), sizeof(first_id));
+    if (first_id != next_id) {
+        fprintf(stderr, "Unexpected request id %" PRIu64 ", expected %" PRIu64 "\n", first_id, next_id);
+        return false;
+    }
+    std::vector<uint8_t> cmd_input;
+    std::vector<uint8_t> cmd_output;
+    size_t pos = sizeof(uint64_t);
+    while (pos < input.size()) {
+        if (input.size() - pos < 1 + sizeof(uint64_t)) {
+            return false;
+        }
+        const uint8_t cmd = input[pos];
+        uint64_t cmd_size;
+        memcpy(&cmd_size, input.data() + pos + 1, sizeof(cmd_size));
+        pos += 1 + sizeof(uint64_t);
+        if (input.size() - pos < cmd_size) {
+            return false;
+        }
+        const uint8_t * cmd_data = input.data() + pos;
+        pos += cmd_size;
+        bool ok;
+        switch (cmd) {
+            // tensor data is used in place
+            case SET_TENSOR:            ok = server.set_tensor(cmd_data, cmd_size);            break;
+            case SET_TENSOR_COMPRESSED: ok = server.set_tensor_compressed(cmd_data, cmd_size); break;
+            case GRAPH_STORE:           ok = server.graph_store(cmd_data, cmd_size);           break;
+            case BUFFER_CLEAR:
+            case COPY_TENSOR:
+                cmd_input.assign(cmd_data, cmd_data + cmd_size);
+                ok = rpc_serve_cmd(server, cmd, cmd_input, cmd_output);
+                break;
+            default:
+                fprintf(stderr, "Unexpected command %d in batch\n", cmd);
+                ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "Request %" PRIu64 " (command %d) failed\n", next_id, cmd);
+            return false;
+        }
+        next_id++;
+    }
+    return true;
+}
+
+static void rpc_serve_client(rpc_server_shared * shared, sockfd_t sockfd) {
+    rpc_server server(shared);
+    uint64_t next_id = 0;
     while (true) {
         uint8_t cmd;
         if (!recv_data(sockfd, &cmd, 1)) {
@@ -1074,63 +2270,21 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
         if (!recv_data(sockfd, input.data(), input_size)) {
             break;
         }
-        bool ok = true;
-        switch (cmd) {
-            case ALLOC_BUFFER: {
-                ok = server.alloc_buffer(input, output);
-                break;
-            }
-            case GET_ALIGNMENT: {
-                server.get_alignment(output);
-                break;
-            }
-            case GET_MAX_SIZE: {
-                server.get_max_size(output);
+        if (cmd == BATCH) {
+            if (next_id == 0 || !rpc_serve_batch(server, input, next_id)) {
                 break;
             }
-            case BUFFER_GET_BASE: {
-                ok = server.buffer_get_base(input, output);
-                break;
-            }
-            case FREE_BUFFER: {
-                ok = server.free_buffer(input);
-                break;
-            }
-            case BUFFER_CLEAR: {
-                ok = server.buffer_clear(input);
-                break;
-            }
-            case SET_TENSOR: {
-                ok = server.set_tensor(input);
-                break;
-            }
-            case GET_TENSOR: {
-                ok = server.get_tensor(input, output);
-                break;
-            }
-            case COPY_TENSOR: {
-                ok = server.copy_tensor(input, output);
-                break;
-            }
-            case GRAPH_COMPUTE: {
-                ok = server.graph_compute(input, output);
-                break;
-            }
-            case GET_DEVICE_MEMORY: {
-                // output serialization format: | free (8 bytes) | total (8 bytes) |
-                output.resize(2*sizeof(uint64_t), 0);
-                memcpy(output.data(), &free_mem, sizeof(free_mem));
-                memcpy(output.data() + sizeof(uint64_t), &total_mem, sizeof(total_mem));
-                break;
-            }
-            default: {
-                fprintf(stderr, "Unknown command: %d\n", cmd);
-                ok = false;
-            }
+            continue;
         }
-        if (!ok) {
+        // the first command of a connection must be HELLO
+        if ((next_id == 0) != (cmd == HELLO)) {
+            fprintf(stderr, "Unexpected command %d, the client must start with HELLO\n", cmd);
+            break;
+        }
+        if (!rpc_serve_cmd(server, cmd, input, output)) {
             break;
         }
+        next_id++;
         uint64_t output_size = output.size();
         if (!send_data(sockfd, &output_size, sizeof(output_size))) {
             break;
@@ -1141,12 +2295,20 @@ static void rpc_serve_client(ggml_backend_t backend, sockfd_t sockfd, size_t fre
     }
 }
 
-void start_rpc_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem) {
+void start_rpc_server(ggml_backend_t backend, const char * endpoint, size_t free_mem, size_t total_mem,
+                      const char * cache_dir, const char * const * gguf_files, size_t n_gguf_files) {
     std::string host;
     int port;
     if (!parse_endpoint(endpoint, host, port)) {
         return;
     }
+    rpc_server_shared shared;
+    shared.backend   = backend;
+    shared.free_mem  = free_mem;
+    shared.total_mem = total_mem;
+    if (!shared.cache.init(cache_dir, gguf_files, n_gguf_files)) {
+        return;
+    }
 #ifdef _WIN32
     {
         WSADATA wsaData;
@@ -1162,15 +2324,29 @@ void start_rpc_server(ggml_backend_t backend, const char * endpoint, size_t free
         fprintf(stderr, "Failed to create server socket\n");
         return;
     }
+    // every client is served by its own thread
     while (true) {
         auto client_socket = socket_accept(server_socket->fd);
         if (client_socket == nullptr) {
             fprintf(stderr, "Failed to accept client connection\n");
-            return;
+            break;
         }
-        printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
-        rpc_serve_client(backend, client_socket->fd, free_mem, total_mem);
-        printf("Client connection closed\n");
+        int n_clients;
+        {
+            std::lock_guard<std::mutex> lock(shared.clients_mutex);
+            n_clients = ++shared.n_clients;
+        }
+        printf("Accepted client connection, clients=%d, free_mem=%zu, total_mem=%zu\n", n_clients, free_mem - std::min<size_t>(free_mem, shared.allocated), total_mem);
+        std::thread([&shared, client_socket]() {
+            rpc_serve_client(&shared, client_socket->fd);
+            std::lock_guard<std::mutex> lock(shared.clients_mutex);
+            printf("Client connection closed, clients=%d\n", --shared.n_clients);
+            shared.clients_cv.notify_all();
+        }).detach();
+    }
+    {
+        std::unique_lock<std::mutex> lock(shared.clients_mutex);
+        shared.clients_cv.wait(lock, [&shared] { return shared.n_clients == 0; });
     }
 #ifdef _WIN32
     WSACleanup();
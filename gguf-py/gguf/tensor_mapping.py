@@ -75,6 +75,18 @@ class TensorNameMap:
         MODEL_TENSOR.ROPE_FREQS: (
             "rope.freqs",  # llama-pth
         ),
+
+        # Classifier
+        MODEL_TENSOR.CLS: (
+            "classifier.dense",  # roberta jina-bert-v2
+            "pooler.dense",      # bert (sequence classification)
+        ),
+
+        # Classifier output
+        MODEL_TENSOR.CLS_OUT: (
+            "classifier.out_proj",  # roberta jina-bert-v2
+            "classifier",           # bert (sequence classification)
+        ),
     }
 
     block_mappings_cfg: dict[MODEL_TENSOR, tuple[str, ...]] = {
@@ -57,6 +57,7 @@ extern "C" {
 
     struct llama_model;
     struct llama_context;
+    struct llama_lora_adapter;
 
     typedef int32_t llama_pos;
     typedef int32_t llama_token;
@@ -178,6 +179,7 @@ extern "C" {
         LLAMA_POOLING_TYPE_MEAN = 1,
         LLAMA_POOLING_TYPE_CLS  = 2,
         LLAMA_POOLING_TYPE_LAST = 3,
+        LLAMA_POOLING_TYPE_RANK = 4, // used by reranking models to attach the classification head to the graph
     };
 
     enum llama_split_mode {
@@ -228,6 +230,16 @@ extern "C" {
         llama_pos    all_pos_0;  // used if pos == NULL
         llama_pos    all_pos_1;  // used if pos == NULL
         llama_seq_id all_seq_id; // used if seq_id == NULL
+
+        // optional per-token LoRA adapter selection (not allocated by llama_batch_init, owned by the caller)
+        // when lora_id is set, only the selected adapter is applied to each token instead of all the adapters of the context:
+        //
+        // - lora_id    : position of the adapter in the context (adapters keep the order in which they were set), or -1 for none
+        // - lora_scale : the scale of the adapter for the respective token (used instead of the scale of the context if not NULL)
+        //
+        // the tokens are gathered by adapter, so that sequences that use different adapters can share one batch
+        int32_t      *  lora_id;
+        float        *  lora_scale;
     } llama_batch;
 
     enum llama_model_kv_override_type {
@@ -504,6 +516,39 @@ extern "C" {
                           const char * path_base_model,
                              int32_t   n_threads);
 
+    // Load a LoRA adapter from a GGUF file (see convert-lora-to-gguf.py)
+    // The adapter tensors are kept separate from the base weights and are applied
+    // as W*x + scale*B*(A*x) when the graph is built, so the base model is not modified
+    // and any number of adapters can stay resident at the same time.
+    // The adapter is freed together with the model if llama_lora_adapter_free is not called.
+    // Returns NULL on failure
+    LLAMA_API struct llama_lora_adapter * llama_lora_adapter_init(
+            struct llama_model * model,
+                    const char * path_lora);
+
+    // Add a loaded LoRA adapter to the given context, or update its scale if it is already set
+    // This does not modify the model's weights and takes effect on the next decode
+    // An adapter with a zero scale keeps its position in the context but is skipped unless selected with llama_batch::lora_id
+    // Returns 0 on success
+    LLAMA_API int32_t llama_lora_adapter_set(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            float scale);
+
+    // Remove a LoRA adapter from the given context
+    // Returns -1 if the adapter is not present in the context
+    LLAMA_API int32_t llama_lora_adapter_remove(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter);
+
+    // Remove all LoRA adapters from the given context
+    LLAMA_API void llama_lora_adapter_clear(
+            struct llama_context * ctx);
+
+    // Manually free a LoRA adapter
+    // It must not be set in any context when it is freed
+    LLAMA_API void llama_lora_adapter_free(struct llama_lora_adapter * adapter);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -835,7 +880,8 @@ extern "C" {
 
     // Get the embeddings for a sequence id
     // Returns NULL if pooling_type is LLAMA_POOLING_TYPE_NONE
-    // shape: [n_embd] (1-dimensional)
+    // when pooling_type == LLAMA_POOLING_TYPE_RANK, returns float[1] with the rank of the sequence
+    // otherwise: float[n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
 
     //
@@ -961,6 +1007,21 @@ extern "C" {
                            float   penalty_freq,
                            float   penalty_present);
 
+    /// @details Same as llama_sample_repetition_penalties, but with the occurrences of the penalized tokens already counted.
+    /// @param tokens The distinct tokens in the penalty window.
+    /// @param counts The number of occurrences of each of the tokens in the penalty window.
+    /// @param n_tokens The number of distinct tokens.
+    /// If the candidates are still indexed by token id (as returned by llama_get_logits), the penalties are applied in O(n_tokens).
+    LLAMA_API void llama_sample_repetition_penalties_counts(
+            struct llama_context * ctx,
+          llama_token_data_array * candidates,
+               const llama_token * tokens,
+                   const int32_t * counts,
+                          size_t   n_tokens,
+                           float   penalty_repeat,
+                           float   penalty_freq,
+                           float   penalty_present);
+
     /// @details Apply classifier-free guidance to the logits as described in academic paper "Stay on topic with Classifier-Free Guidance" https://arxiv.org/abs/2306.17806
     /// @param logits Logits extracted from the original generation context.
     /// @param logits_guidance Logits extracted from a separate context from the same model. Other than a negative prompt at the beginning, it should have all generated and user input tokens copied from the main context.
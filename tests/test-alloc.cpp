@@ -0,0 +1,308 @@
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <vector>
+
+// builds a graph on the inputs and returns its output
+typedef std::function<struct ggml_tensor * (struct ggml_context *, const std::vector<struct ggml_tensor *> &)> build_fn;
+
+struct test_graph {
+    struct ggml_context * ctx;
+    struct ggml_cgraph  * gf;
+    std::vector<struct ggml_tensor *> inputs;
+    struct ggml_tensor * out;
+};
+
+static test_graph build_graph(const build_fn & build, const std::vector<std::vector<int64_t>> & shapes, bool no_alloc) {
+    struct ggml_init_params params = { 64*1024*1024, NULL, no_alloc };
+    test_graph g;
+    g.ctx = ggml_init(params);
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        struct ggml_tensor * t = ggml_new_tensor(g.ctx, GGML_TYPE_F32, (int)shapes[i].size(), shapes[i].data());
+        ggml_format_name(t, "in%zu", i);
+        ggml_set_input(t);
+        g.inputs.push_back(t);
+    }
+    g.out = build(g.ctx, g.inputs);
+    ggml_set_name(g.out, "out");
+    ggml_set_output(g.out);
+    g.gf = ggml_new_graph(g.ctx);
+    ggml_build_forward_expand(g.gf, g.out);
+    return g;
+}
+
+static std::vector<float> input_data(const struct ggml_tensor * t, size_t i) {
+    std::vector<float> data(ggml_nelements(t));
+    for (size_t j = 0; j < data.size(); ++j) {
+        data[j] = sinf(0.37f*j + i);
+    }
+    return data;
+}
+
+// the output computed with the graph allocator must match the output computed in a context where nothing is reused
+static void check_result(const test_graph & g, const build_fn & build, const std::vector<std::vector<int64_t>> & shapes, ggml_backend_t backend) {
+    for (size_t i = 0; i < g.inputs.size(); ++i) {
+        std::vector<float> data = input_data(g.inputs[i], i);
+        ggml_backend_tensor_set(g.inputs[i], data.data(), 0, ggml_nbytes(g.inputs[i]));
+    }
+    assert(ggml_backend_graph_compute(backend, g.gf) == GGML_STATUS_SUCCESS);
+    std::vector<float> out(ggml_nelements(g.out));
+    ggml_backend_tensor_get(g.out, out.data(), 0, ggml_nbytes(g.out));
+
+    test_graph ref = build_graph(build, shapes, false);
+    for (size_t i = 0; i < ref.inputs.size(); ++i) {
+        std::vector<float> data = input_data(ref.inputs[i], i);
+        memcpy(ref.inputs[i]->data, data.data(), ggml_nbytes(ref.inputs[i]));
+    }
+    ggml_graph_compute_with_ctx(ref.ctx, ref.gf, 1);
+
+    assert(ggml_nelements(ref.out) == (int64_t)out.size());
+    const float * ref_out = (const float *)ref.out->data;
+    for (size_t i = 0; i < out.size(); ++i) {
+        assert(fabsf(out[i] - ref_out[i]) <= 1e-5f*(1.0f + fabsf(ref_out[i])));
+    }
+
+    ggml_free(ref.ctx);
+}
+
+// the memory of a tensor allocated by the graph allocator and the nodes in which it is allocated and last used
+struct tensor_lifetime {
+    struct ggml_tensor * tensor;
+    int start;
+    int end;
+};
+
+// two tensors that are alive at the same time never share memory, except for a node computed in place over an operand that it is
+// the last consumer of
+static void check_no_overlap(struct ggml_cgraph * gf) {
+    std::map<struct ggml_tensor *, tensor_lifetime> lifetimes;
+    for (int i = 0; i < gf->n_leafs; ++i) {
+        struct ggml_tensor * leaf = gf->leafs[i];
+        if (leaf->view_src == NULL) {
+            lifetimes[leaf] = { leaf, leaf->flags & GGML_TENSOR_FLAG_INPUT ? -1 : INT_MAX, INT_MAX };
+        }
+    }
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        struct ggml_tensor * node = gf->nodes[i];
+        if (node->view_src == NULL) {
+            lifetimes[node] = { node, i, INT_MAX };
+        }
+    }
+
+    // the memory is used until the last consumer of the tensor or of any of its views, the outputs and the unused tensors are never freed
+    std::map<struct ggml_tensor *, int> last_use;
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        struct ggml_tensor * node = gf->nodes[i];
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            struct ggml_tensor * src = node->src[j];
+            if (src == NULL) {
+                continue;
+            }
+            struct ggml_tensor * owner = src->view_src ? src->view_src : src;
+            if (lifetimes.count(owner) == 0) {
+                continue;
+            }
+            tensor_lifetime & lt = lifetimes[owner];
+            lt.start = std::min(lt.start, i);
+            last_use[owner] = i;
+        }
+    }
+    for (auto & it : lifetimes) {
+        if (last_use.count(it.first) && !(it.first->flags & GGML_TENSOR_FLAG_OUTPUT)) {
+            it.second.end = last_use[it.first];
+        }
+    }
+
+    // whether node i reads the memory of t
+    auto reads = [&](int i, const struct ggml_tensor * t) {
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            const struct ggml_tensor * src = gf->nodes[i]->src[j];
+            if (src != NULL && (src == t || src->view_src == t)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    for (const auto & it_a : lifetimes) {
+        for (const auto & it_b : lifetimes) {
+            const tensor_lifetime & a = it_a.second;
+            const tensor_lifetime & b = it_b.second;
+            if (a.tensor == b.tensor || a.start > b.start) {
+                continue;
+            }
+            const uintptr_t a_begin = (uintptr_t)a.tensor->data;
+            const uintptr_t b_begin = (uintptr_t)b.tensor->data;
+            if (a_begin + ggml_nbytes(a.tensor) <= b_begin || b_begin + ggml_nbytes(b.tensor) <= a_begin) {
+                continue;
+            }
+            // b starts after a is freed, or b is computed in place over a
+            assert(a.end < b.start || (a.end == b.start && b.start >= 0 && reads(b.start, a.tensor)));
+        }
+    }
+}
+
+static struct ggml_tensor * find_node(struct ggml_cgraph * gf, const char * name) {
+    struct ggml_tensor * t = ggml_graph_get_tensor(gf, name);
+    assert(t != NULL);
+    return t;
+}
+
+// a fused gate|up mat-mul split by views: the product with the up part is computed in place, at the view's offset
+static void test_inplace_fused_views(ggml_backend_t backend, ggml_gallocr_t galloc) {
+    const int64_t n_embd = 16, n_ff = 64;
+    const build_fn build = [=](struct ggml_context * ctx, const std::vector<struct ggml_tensor *> & in) {
+        struct ggml_tensor * fused = ggml_mul_mat(ctx, in[0], in[1]);
+        struct ggml_tensor * gate  = ggml_view_2d(ctx, fused, n_ff, 1, fused->nb[1], 0);
+        struct ggml_tensor * up    = ggml_view_2d(ctx, fused, n_ff, 1, fused->nb[1], n_ff*ggml_element_size(fused));
+        ggml_set_name(up, "up");
+        struct ggml_tensor * act = ggml_silu(ctx, gate);
+        struct ggml_tensor * par = ggml_mul(ctx, up, act);
+        ggml_set_name(par, "par");
+        return ggml_scale(ctx, par, 0.5f);
+    };
+    const std::vector<std::vector<int64_t>> shapes = { { n_embd, 2*n_ff }, { n_embd, 1 } };
+
+    test_graph g = build_graph(build, shapes, true);
+    assert(ggml_gallocr_alloc_graph(galloc, g.gf));
+    check_no_overlap(g.gf);
+    assert(find_node(g.gf, "par")->data == find_node(g.gf, "up")->data);
+    check_result(g, build, shapes, backend);
+    ggml_free(g.ctx);
+}
+
+// x*x reuses x, it is the last consumer of x
+static void test_inplace_square(ggml_backend_t backend, ggml_gallocr_t galloc) {
+    const build_fn build = [](struct ggml_context * ctx, const std::vector<struct ggml_tensor *> & in) {
+        struct ggml_tensor * x = ggml_add(ctx, in[0], in[1]);
+        ggml_set_name(x, "x");
+        struct ggml_tensor * sq = ggml_mul(ctx, x, x);
+        ggml_set_name(sq, "sq");
+        return ggml_scale(ctx, sq, 2.0f);
+    };
+    const std::vector<std::vector<int64_t>> shapes = { { 32, 4 }, { 32, 4 } };
+
+    test_graph g = build_graph(build, shapes, true);
+    assert(ggml_gallocr_alloc_graph(galloc, g.gf));
+    check_no_overlap(g.gf);
+    assert(find_node(g.gf, "sq")->data == find_node(g.gf, "x")->data);
+    check_result(g, build, shapes, backend);
+    ggml_free(g.ctx);
+}
+
+// softmax can be computed over its input, but never over a mask of the same shape
+static void test_inplace_soft_max_mask(ggml_backend_t backend, ggml_gallocr_t galloc) {
+    // kq is still used after the softmax, so the mask is the only operand that is free at that point
+    const build_fn build = [](struct ggml_context * ctx, const std::vector<struct ggml_tensor *> & in) {
+        struct ggml_tensor * kq = ggml_mul_mat(ctx, in[0], in[1]);
+        ggml_set_name(kq, "kq");
+        struct ggml_tensor * mask = ggml_scale(ctx, in[2], -1.0f);
+        ggml_set_name(mask, "mask");
+        struct ggml_tensor * probs = ggml_soft_max_ext(ctx, kq, mask, 0.125f, 0.0f);
+        ggml_set_name(probs, "probs");
+        return ggml_add(ctx, probs, kq);
+    };
+    const std::vector<std::vector<int64_t>> shapes = { { 8, 32 }, { 8, 32 }, { 32, 32 } };
+
+    test_graph g = build_graph(build, shapes, true);
+    assert(ggml_gallocr_alloc_graph(galloc, g.gf));
+    check_no_overlap(g.gf);
+    assert(find_node(g.gf, "probs")->data != find_node(g.gf, "mask")->data);
+    assert(find_node(g.gf, "probs")->data != find_node(g.gf, "kq")->data);
+    check_result(g, build, shapes, backend);
+    ggml_free(g.ctx);
+}
+
+// a few transformer layers, with a fused gate|up FFN
+static struct ggml_tensor * build_layers(struct ggml_context * ctx, const std::vector<struct ggml_tensor *> & in, int n_layer) {
+    const int64_t n_ff = in[6]->ne[1]/2;
+    struct ggml_tensor * x = in[0];
+    for (int il = 0; il < n_layer; ++il) {
+        struct ggml_tensor * h = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), in[1]);
+        struct ggml_tensor * q = ggml_mul_mat(ctx, in[2], h);
+        struct ggml_tensor * k = ggml_mul_mat(ctx, in[3], h);
+        struct ggml_tensor * v = ggml_cont(ctx, ggml_transpose(ctx, ggml_mul_mat(ctx, in[5], h)));
+        struct ggml_tensor * kq = ggml_soft_max_ext(ctx, ggml_mul_mat(ctx, k, q), in[4], 0.125f, 0.0f);
+        x = ggml_add(ctx, x, ggml_mul_mat(ctx, v, kq));
+
+        h = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), in[1]);
+        struct ggml_tensor * fused = ggml_mul_mat(ctx, in[6], h);
+        struct ggml_tensor * gate  = ggml_view_2d(ctx, fused, n_ff, fused->ne[1], fused->nb[1], 0);
+        struct ggml_tensor * up    = ggml_view_2d(ctx, fused, n_ff, fused->ne[1], fused->nb[1], n_ff*ggml_element_size(fused));
+        x = ggml_add(ctx, x, ggml_mul_mat(ctx, in[7], ggml_mul(ctx, ggml_silu(ctx, ggml_cont(ctx, gate)), up)));
+    }
+    return x;
+}
+
+static std::vector<std::vector<int64_t>> layers_shapes(int64_t n_tokens) {
+    const int64_t n_embd = 32, n_ff = 64;
+    return {
+        { n_embd, n_tokens }, { n_embd }, { n_embd, n_embd }, { n_embd, n_embd }, { n_tokens, n_tokens }, { n_embd, n_embd },
+        { n_embd, 2*n_ff }, { n_ff, n_embd },
+    };
+}
+
+// offsets of the allocated tensors, relative to the first one
+static std::vector<intptr_t> get_layout(struct ggml_cgraph * gf) {
+    std::vector<intptr_t> layout;
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        layout.push_back((intptr_t)gf->nodes[i]->data - (intptr_t)gf->nodes[0]->data);
+    }
+    return layout;
+}
+
+// the planned offsets of graphs of several sizes, and of the same graphs when their plans are found in the cache
+static void test_plans(ggml_backend_t backend, ggml_gallocr_t galloc) {
+    const int n_tokens[] = { 7, 1, 32, 7 };
+    std::map<int, std::vector<intptr_t>> layouts;
+
+    for (int n : n_tokens) {
+        const build_fn build = [](struct ggml_context * ctx, const std::vector<struct ggml_tensor *> & in) {
+            return build_layers(ctx, in, 3);
+        };
+        test_graph g = build_graph(build, layers_shapes(n), true);
+        assert(ggml_gallocr_reserve_n(galloc, g.gf, NULL, NULL));
+        assert(ggml_gallocr_alloc_graph(galloc, g.gf));
+        check_no_overlap(g.gf);
+        check_result(g, build, layers_shapes(n), backend);
+
+        std::vector<intptr_t> layout = get_layout(g.gf);
+        if (layouts.count(n)) {
+            assert(layouts[n] == layout);
+        }
+        layouts[n] = layout;
+        ggml_free(g.ctx);
+    }
+}
+
+int main(void) {
+    // single thread, like the reference
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    ggml_backend_cpu_set_n_threads(backend, 1);
+    ggml_gallocr_t galloc = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+
+    test_inplace_fused_views(backend, galloc);
+    test_inplace_square(backend, galloc);
+    test_inplace_soft_max_mask(backend, galloc);
+    test_plans(backend, galloc);
+
+    ggml_gallocr_free(galloc);
+    ggml_backend_free(backend);
+
+    printf("OK\n");
+
+    return 0;
+}
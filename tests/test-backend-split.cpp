@@ -0,0 +1,178 @@
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// split of the rows between three buffer types, the second one gets no rows
+static const float tensor_split[3] = { 1.0f, 0.0f, 2.0f };
+
+static std::vector<float> iota(size_t n, float start) {
+    std::vector<float> data(n);
+    for (size_t i = 0; i < n; ++i) {
+        data[i] = start + i;
+    }
+    return data;
+}
+
+static std::vector<float> get_data(const struct ggml_tensor * t, size_t offset, size_t n) {
+    std::vector<float> data(n);
+    ggml_backend_tensor_get(t, data.data(), offset*sizeof(float), n*sizeof(float));
+    return data;
+}
+
+static ggml_backend_buffer_type_t split_buffer_type() {
+    ggml_backend_buffer_type_t bufts[3] = {
+        ggml_backend_cpu_buffer_type(), ggml_backend_cpu_buffer_type(), ggml_backend_cpu_buffer_type(),
+    };
+    return ggml_backend_split_buffer_type(bufts, tensor_split, 3);
+}
+
+static void test_set_get() {
+    struct ggml_init_params params = { 16*ggml_tensor_overhead(), NULL, true };
+    struct ggml_context * ctx = ggml_init(params);
+
+    // 7 rows: rows [0, 2) in the first buffer type, rows [2, 7) in the third
+    struct ggml_tensor * mat  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 5, 7);
+    struct ggml_tensor * vec  = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 11);
+    struct ggml_tensor * t3d  = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 4, 3, 2);
+    // rows [1, 4) of mat, across the shard boundary
+    struct ggml_tensor * rows = ggml_view_2d(ctx, mat, 5, 3, mat->nb[1], 1*mat->nb[1]);
+    // elements [7, 16) of mat, starting and ending in the middle of a row
+    struct ggml_tensor * span = ggml_view_1d(ctx, mat, 9, 7*sizeof(float));
+    struct ggml_tensor * part = ggml_view_1d(ctx, t3d, 6, 10*sizeof(float));
+
+    ggml_backend_buffer_t buffer = ggml_backend_alloc_ctx_tensors_from_buft(ctx, split_buffer_type());
+    assert(buffer != NULL);
+    assert(ggml_backend_buffer_is_split(buffer));
+
+    // the matrix is split, the other tensors are stored whole in one of the buffer types
+    assert(ggml_backend_buffer_is_split(mat->buffer));
+    assert(ggml_backend_split_tensor_n_shards(mat) == 2);
+    assert(ggml_backend_split_tensor_get_shard(mat, 0)->ne[1] == 2);
+    assert(ggml_backend_split_tensor_get_shard(mat, 1)->ne[1] == 5);
+    assert(!ggml_backend_buffer_is_split(vec->buffer));
+    assert(!ggml_backend_buffer_is_split(t3d->buffer));
+
+    // round trips of the whole tensors
+    std::vector<float> ref_mat = iota(ggml_nelements(mat), 0.0f);
+    std::vector<float> ref_vec = iota(ggml_nelements(vec), 100.0f);
+    std::vector<float> ref_t3d = iota(ggml_nelements(t3d), 200.0f);
+    ggml_backend_tensor_set(mat, ref_mat.data(), 0, ggml_nbytes(mat));
+    ggml_backend_tensor_set(vec, ref_vec.data(), 0, ggml_nbytes(vec));
+    ggml_backend_tensor_set(t3d, ref_t3d.data(), 0, ggml_nbytes(t3d));
+    assert(get_data(mat, 0, ref_mat.size()) == ref_mat);
+    assert(get_data(vec, 0, ref_vec.size()) == ref_vec);
+    assert(get_data(t3d, 0, ref_t3d.size()) == ref_t3d);
+
+    // the shards hold the consecutive rows
+    assert(get_data(ggml_backend_split_tensor_get_shard(mat, 0), 0, 10) == std::vector<float>(ref_mat.begin(), ref_mat.begin() + 10));
+    assert(get_data(ggml_backend_split_tensor_get_shard(mat, 1), 0, 25) == std::vector<float>(ref_mat.begin() + 10, ref_mat.end()));
+
+    // partial ranges across the shard boundary
+    assert(get_data(mat, 8, 4) == std::vector<float>(ref_mat.begin() + 8, ref_mat.begin() + 12));
+    std::vector<float> patch = iota(6, 1000.0f);
+    ggml_backend_tensor_set(mat, patch.data(), 7*sizeof(float), patch.size()*sizeof(float));
+    std::copy(patch.begin(), patch.end(), ref_mat.begin() + 7);
+    assert(get_data(mat, 0, ref_mat.size()) == ref_mat);
+
+    // views of a split matrix
+    assert(get_data(rows, 0, 15) == std::vector<float>(ref_mat.begin() + 5, ref_mat.begin() + 20));
+    std::vector<float> new_rows = iota(15, 2000.0f);
+    ggml_backend_tensor_set(rows, new_rows.data(), 0, ggml_nbytes(rows));
+    std::copy(new_rows.begin(), new_rows.end(), ref_mat.begin() + 5);
+    assert(get_data(mat, 0, ref_mat.size()) == ref_mat);
+
+    assert(get_data(span, 0, 9) == std::vector<float>(ref_mat.begin() + 7, ref_mat.begin() + 16));
+    std::vector<float> new_span = iota(4, 3000.0f);
+    ggml_backend_tensor_set(span, new_span.data(), 3*sizeof(float), new_span.size()*sizeof(float));
+    std::copy(new_span.begin(), new_span.end(), ref_mat.begin() + 10);
+    assert(get_data(mat, 0, ref_mat.size()) == ref_mat);
+
+    // views of a tensor that is not split
+    assert(get_data(part, 0, 6) == std::vector<float>(ref_t3d.begin() + 10, ref_t3d.begin() + 16));
+    std::vector<float> new_part = iota(6, 4000.0f);
+    ggml_backend_tensor_set(part, new_part.data(), 0, ggml_nbytes(part));
+    std::copy(new_part.begin(), new_part.end(), ref_t3d.begin() + 10);
+    assert(get_data(t3d, 0, ref_t3d.size()) == ref_t3d);
+
+    ggml_backend_buffer_free(buffer);
+    ggml_free(ctx);
+}
+
+// the mat-mul of a split matrix as built by llama (llm_build_mm) matches the mat-mul of the whole matrix
+static void test_mul_mat() {
+    const int64_t n_embd = 32, n_rows = 13, n_tokens = 3;
+
+    struct ggml_init_params params = { 8*ggml_tensor_overhead(), NULL, true };
+    struct ggml_context * ctx_w = ggml_init(params);
+    struct ggml_tensor * w_split = ggml_new_tensor_2d(ctx_w, GGML_TYPE_F32, n_embd, n_rows);
+    ggml_backend_buffer_t buf_split = ggml_backend_alloc_ctx_tensors_from_buft(ctx_w, split_buffer_type());
+
+    struct ggml_context * ctx_cpu = ggml_init(params);
+    struct ggml_tensor * w = ggml_new_tensor_2d(ctx_cpu, GGML_TYPE_F32, n_embd, n_rows);
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx_cpu, GGML_TYPE_F32, n_embd, n_tokens);
+    ggml_backend_buffer_t buf_cpu = ggml_backend_alloc_ctx_tensors_from_buft(ctx_cpu, ggml_backend_cpu_buffer_type());
+
+    std::vector<float> data_w(ggml_nelements(w));
+    std::vector<float> data_x(ggml_nelements(x));
+    for (size_t i = 0; i < data_w.size(); ++i) {
+        data_w[i] = sinf(i);
+    }
+    for (size_t i = 0; i < data_x.size(); ++i) {
+        data_x[i] = cosf(i);
+    }
+    ggml_backend_tensor_set(w_split, data_w.data(), 0, ggml_nbytes(w_split));
+    ggml_backend_tensor_set(w,       data_w.data(), 0, ggml_nbytes(w));
+    ggml_backend_tensor_set(x,       data_x.data(), 0, ggml_nbytes(x));
+
+    struct ggml_init_params params_graph = { ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead(), NULL, true };
+    struct ggml_context * ctx0 = ggml_init(params_graph);
+    struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    const int n_shards = ggml_backend_split_tensor_n_shards(w_split);
+    struct ggml_tensor * res = ggml_mul_mat(ctx0, ggml_backend_split_tensor_get_shard(w_split, n_shards - 1), x);
+    for (int i = n_shards - 2; i >= 0; --i) {
+        res = ggml_concat(ctx0, ggml_mul_mat(ctx0, ggml_backend_split_tensor_get_shard(w_split, i), x), res, 0);
+    }
+    struct ggml_tensor * ref = ggml_mul_mat(ctx0, w, x);
+    ggml_build_forward_expand(gf, res);
+    ggml_build_forward_expand(gf, ref);
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    ggml_gallocr_t galloc = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+    assert(ggml_gallocr_alloc_graph(galloc, gf));
+    assert(ggml_backend_graph_compute(backend, gf) == GGML_STATUS_SUCCESS);
+
+    assert(ggml_are_same_shape(res, ref));
+    std::vector<float> out_res = get_data(res, 0, ggml_nelements(res));
+    std::vector<float> out_ref = get_data(ref, 0, ggml_nelements(ref));
+    for (size_t i = 0; i < out_ref.size(); ++i) {
+        assert(fabsf(out_res[i] - out_ref[i]) <= 1e-5f*(1.0f + fabsf(out_ref[i])));
+    }
+
+    ggml_gallocr_free(galloc);
+    ggml_backend_free(backend);
+    ggml_free(ctx0);
+    ggml_backend_buffer_free(buf_cpu);
+    ggml_free(ctx_cpu);
+    ggml_backend_buffer_free(buf_split);
+    ggml_free(ctx_w);
+}
+
+int main(void) {
+    test_set_get();
+    test_mul_mat();
+
+    printf("OK\n");
+
+    return 0;
+}
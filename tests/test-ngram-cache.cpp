@@ -0,0 +1,231 @@
+#include "ngram-cache.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef std::map<std::vector<llama_token>, std::map<llama_token, int32_t>> reference_cache;
+
+static std::vector<llama_token> to_vector(const llama_ngram & ngram) {
+    std::vector<llama_token> result;
+    for (int i = 0; i < LLAMA_NGRAM_MAX && ngram.tokens[i] != -1; ++i) {
+        result.push_back(ngram.tokens[i]);
+    }
+    return result;
+}
+
+static void check_equal(const llama_ngram_cache & cache, const reference_cache & ref) {
+    assert(cache.size() == ref.size());
+
+    for (const auto & item : ref) {
+        const llama_ngram_cache_part part = cache.find(llama_ngram(item.first.data(), item.first.size()));
+        assert(part.size() == item.second.size());
+
+        // the distribution is sorted by token, like the reference
+        size_t i = 0;
+        for (const auto & token_count : item.second) {
+            assert(part.begin()[i].token == token_count.first);
+            assert(part.begin()[i].count == token_count.second);
+            assert(part.count(token_count.first) == token_count.second);
+            ++i;
+        }
+    }
+
+    size_t n_visited = 0;
+    cache.for_each([&](const llama_ngram & ngram, const llama_ngram_cache_part & part) {
+        assert(ref.count(to_vector(ngram)) == 1);
+        assert(!part.empty());
+        ++n_visited;
+    });
+    assert(n_visited == ref.size());
+}
+
+static void test_hash() {
+    const llama_token a[2] = { 1, 2 };
+    const llama_token b[2] = { 2, 1 };
+    const llama_ngram_hash_function hash;
+    assert(hash(llama_ngram(a, 2)) != hash(llama_ngram(b, 2)));
+    assert(hash(llama_ngram(a, 1)) != hash(llama_ngram(a, 2)));
+
+    llama_ngram_cache cache;
+    cache.add(llama_ngram(a, 2), 7, 1);
+    assert(cache.find(llama_ngram(a, 2)).count(7) == 1);
+    assert(cache.find(llama_ngram(b, 2)).empty());
+    assert(cache.find(llama_ngram(a, 1)).empty());
+}
+
+int main(void) {
+    test_hash();
+
+    std::mt19937 rng(42);
+
+    // a small vocabulary so that both inline and overflow distributions occur
+    std::vector<llama_token> inp;
+    for (int i = 0; i < 20000; ++i) {
+        inp.push_back(std::uniform_int_distribution<llama_token>(0, 15)(rng));
+    }
+
+    reference_cache ref;
+    for (int ngram_size = LLAMA_NGRAM_MIN; ngram_size <= LLAMA_NGRAM_MAX; ++ngram_size) {
+        for (size_t i = ngram_size; i < inp.size(); ++i) {
+            ref[std::vector<llama_token>(inp.begin() + i - ngram_size, inp.begin() + i)][inp[i]]++;
+        }
+    }
+
+    // incremental updates give the same result as a single one
+    llama_ngram_cache cache;
+    std::vector<llama_token> inp_partial;
+    for (size_t i = 0; i < inp.size(); i += 777) {
+        const size_t n_new = std::min<size_t>(777, inp.size() - i);
+        inp_partial.insert(inp_partial.end(), inp.begin() + i, inp.begin() + i + n_new);
+        llama_ngram_cache_update(cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp_partial, n_new, false);
+    }
+    check_equal(cache, ref);
+
+    std::string filename = "test-ngram-cache.bin";
+
+    // round trip through the file format, the loaded cache is queried in place
+    llama_ngram_cache_save(cache, filename);
+    {
+        llama_ngram_cache loaded = llama_ngram_cache_load(filename);
+        assert(loaded.mapping != nullptr);
+        check_equal(loaded, ref);
+
+        // drafts are the same from memory and from the mapped file
+        std::vector<llama_token> inp_draft(inp.begin(), inp.begin() + 100);
+        std::vector<llama_token> draft_mem = { inp_draft.back() };
+        std::vector<llama_token> draft_map = { inp_draft.back() };
+        llama_ngram_cache nc_context;
+        llama_ngram_cache_update(nc_context, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp_draft, inp_draft.size(), false);
+        llama_ngram_cache_draft(inp_draft, draft_mem, 8, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, nc_context, cache,  cache);
+        llama_ngram_cache_draft(inp_draft, draft_map, 8, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, nc_context, loaded, loaded);
+        assert(draft_mem == draft_map);
+
+        // saving another cache to the file does not change the mapped one
+        llama_ngram_cache other;
+        llama_ngram_cache_update(other, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, inp_draft, inp_draft.size(), false);
+        llama_ngram_cache_save(other, filename);
+        check_equal(loaded, ref);
+        assert(llama_ngram_cache_load(filename).size() == other.size());
+        llama_ngram_cache_save(cache, filename);
+
+        // merging into a mapped cache copies it first
+        llama_ngram_cache_merge(loaded, cache);
+        assert(loaded.mapping == nullptr);
+        reference_cache ref2 = ref;
+        for (auto & item : ref2) {
+            for (auto & token_count : item.second) {
+                token_count.second *= 2;
+            }
+        }
+        check_equal(loaded, ref2);
+    }
+
+    // a distribution pointing outside of the overflow storage is rejected at load
+    {
+        std::vector<char> bytes;
+        {
+            std::ifstream file_in(filename, std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(file_in), std::istreambuf_iterator<char>());
+        }
+        // header: magic, version, ngram_max, n_inline, n_buckets, n_used, n_overflow
+        const size_t header_size = 4*sizeof(uint32_t) + 3*sizeof(uint64_t);
+        llama_ngram_cache_bucket * buckets = reinterpret_cast<llama_ngram_cache_bucket *>(bytes.data() + header_size);
+        size_t i = 0;
+        while (buckets[i].ngram.tokens[0] == -1 || buckets[i].n_counts <= LLAMA_NGRAM_CACHE_N_INLINE) {
+            ++i;
+        }
+        buckets[i].ext.offset = UINT64_MAX - 1;
+        {
+            std::ofstream file_out(filename, std::ios::binary);
+            file_out.write(bytes.data(), bytes.size());
+        }
+
+        bool thrown = false;
+        try {
+            llama_ngram_cache_load(filename);
+        } catch (const std::ifstream::failure &) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    // files in the legacy format are still readable
+    {
+        std::ofstream file_out(filename, std::ios::binary);
+        for (const auto & item : ref) {
+            const llama_ngram ngram(item.first.data(), item.first.size());
+            const int32_t ntokens = item.second.size();
+            file_out.write(reinterpret_cast<const char *>(&ngram),   sizeof(llama_ngram));
+            file_out.write(reinterpret_cast<const char *>(&ntokens), sizeof(int32_t));
+            for (const auto & token_count : item.second) {
+                file_out.write(reinterpret_cast<const char *>(&token_count.first),  sizeof(llama_token));
+                file_out.write(reinterpret_cast<const char *>(&token_count.second), sizeof(int32_t));
+            }
+        }
+    }
+    check_equal(llama_ngram_cache_load(filename), ref);
+
+    // empty caches
+    llama_ngram_cache empty;
+    llama_ngram_cache_save(empty, filename);
+    assert(llama_ngram_cache_load(filename).empty());
+
+    // pruning keeps the n-grams seen most often, with their full distributions
+    {
+        llama_ngram_cache pruned;
+        llama_ngram_cache_merge(pruned, cache);
+        llama_ngram_cache_prune(pruned, ref.size());
+        check_equal(pruned, ref);
+
+        const size_t n_max = ref.size() / 3;
+        llama_ngram_cache_prune(pruned, n_max);
+        assert(pruned.size() == n_max);
+
+        int64_t min_kept = INT64_MAX;
+        pruned.for_each([&](const llama_ngram & ngram, const llama_ngram_cache_part & part) {
+            const auto & item = ref.at(to_vector(ngram));
+            assert(part.size() == item.size());
+            int64_t total = 0;
+            for (const auto & token_count : item) {
+                assert(part.count(token_count.first) == token_count.second);
+                total += token_count.second;
+            }
+            min_kept = std::min(min_kept, total);
+        });
+        for (const auto & item : ref) {
+            if (pruned.find(llama_ngram(item.first.data(), item.first.size())).empty()) {
+                int64_t total = 0;
+                for (const auto & token_count : item.second) {
+                    total += token_count.second;
+                }
+                assert(total <= min_kept);
+            }
+        }
+
+        llama_ngram_cache_prune(pruned, 0);
+        assert(pruned.empty());
+    }
+
+    cache.clear();
+    assert(cache.empty());
+    assert(cache.find(llama_ngram(inp.data(), 2)).empty());
+
+    std::remove(filename.c_str());
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,284 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "../ggml/src/ggml-rpc.cpp" // the codec and the batch parser are internal
+
+#include <cassert>
+#include <random>
+
+// compresses and decompresses the data, the bytes after the output must not be written
+static std::vector<uint8_t> round_trip(const std::vector<uint8_t> & data) {
+    std::vector<uint8_t> compressed;
+    rpc_compress(data.data(), data.size(), compressed);
+    std::vector<uint8_t> out(data.size() + 16, 0xcd);
+    assert(rpc_decompress(compressed.data(), compressed.size(), out.data(), data.size()));
+    for (size_t i = data.size(); i < out.size(); i++) {
+        assert(out[i] == 0xcd);
+    }
+    out.resize(data.size());
+    assert(out == data);
+    return compressed;
+}
+
+static bool decompress(const std::vector<uint8_t> & compressed, size_t size) {
+    std::vector<uint8_t> out(size + 16, 0xcd);
+    const bool ok = rpc_decompress(compressed.data(), compressed.size(), out.data(), size);
+    for (size_t i = size; i < out.size(); i++) {
+        assert(out[i] == 0xcd);
+    }
+    return ok;
+}
+
+static std::vector<uint8_t> random_data(std::mt19937 & rng, size_t size) {
+    std::vector<uint8_t> data(size);
+    for (auto & b : data) {
+        b = rng() & 0xff;
+    }
+    return data;
+}
+
+static void test_round_trip() {
+    std::mt19937 rng(42);
+
+    // shorter than a match
+    for (size_t size = 0; size < 8; size++) {
+        round_trip(random_data(rng, size));
+    }
+
+    // a single byte repeated: matches that overlap their output
+    std::vector<uint8_t> zeros(100000, 0);
+    assert(round_trip(zeros).size() < zeros.size()/100);
+
+    // a pattern repeated with a period that is not a power of 2, long match lengths
+    std::vector<uint8_t> pattern(100000);
+    for (size_t i = 0; i < pattern.size(); i++) {
+        pattern[i] = (uint8_t) (i % 251);
+    }
+    assert(round_trip(pattern).size() < pattern.size()/100);
+
+    // no matches, long literal lengths
+    std::vector<uint8_t> noise = random_data(rng, 100000);
+    round_trip(noise);
+
+    // runs of literals and matches, like quantized weights with repeated blocks
+    std::vector<uint8_t> mixed;
+    for (int i = 0; i < 200; i++) {
+        std::vector<uint8_t> part = random_data(rng, rng() % 600);
+        mixed.insert(mixed.end(), part.begin(), part.end());
+        const size_t n_rep = rng() % 300;
+        const size_t offs  = mixed.size() > 0 ? rng() % mixed.size() : 0;
+        for (size_t j = 0; j < n_rep && !mixed.empty(); j++) {
+            mixed.push_back(mixed[offs + j]);
+        }
+    }
+    round_trip(mixed);
+}
+
+static void test_bad_input() {
+    std::vector<uint8_t> data(10000);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = (uint8_t) ((i / 7) % 13);
+    }
+    std::vector<uint8_t> compressed;
+    rpc_compress(data.data(), data.size(), compressed);
+    assert(decompress(compressed, data.size()));
+
+    // truncated input, the output is short
+    for (size_t n = 0; n + 1 < compressed.size(); n++) {
+        assert(!decompress(std::vector<uint8_t>(compressed.begin(), compressed.begin() + n), data.size()));
+    }
+
+    // declared size smaller or larger than the data
+    assert(!decompress(compressed, data.size() - 1));
+    assert(!decompress(compressed, data.size() + 1));
+    assert(!decompress(compressed, 0));
+
+    // literal length beyond the input and beyond the output
+    assert(!decompress({ 0xf0, 255, 255, 1, 2, 3 }, 1000));
+    assert(!decompress({ 0x40, 1, 2, 3, 4 }, 3));
+    // unterminated length
+    assert(!decompress({ 0xf0, 255, 255 }, 100000));
+
+    // match offset 0, offset before the start of the output
+    assert(!decompress({ 0x40, 1, 2, 3, 4, 0, 0, 0x00 }, 8));
+    assert(!decompress({ 0x40, 1, 2, 3, 4, 5, 0, 0x00 }, 8));
+    // match length beyond the output
+    assert(!decompress({ 0x4f, 1, 2, 3, 4, 4, 0, 255, 255, 0x00 }, 100));
+    // missing offset
+    assert(!decompress({ 0x40, 1, 2, 3, 4, 4 }, 8));
+
+    // the same sequences with valid values
+    assert(decompress({ 0x40, 1, 2, 3, 4, 4, 0, 0x00 }, 8));
+    assert(decompress({ 0x40, 1, 2, 3, 4, 1, 0, 0x10, 9 }, 9));
+}
+
+static void append_cmd(std::vector<uint8_t> & batch, enum rpc_cmd cmd, const std::vector<uint8_t> & data) {
+    append_cmd_header(batch, cmd, data.size());
+    append_data(batch, data.data(), data.size());
+}
+
+static std::vector<uint8_t> set_tensor_cmd(const rpc_tensor & tensor, uint64_t offset, const std::vector<uint8_t> & data) {
+    std::vector<uint8_t> cmd;
+    append_data(cmd, &tensor, sizeof(tensor));
+    append_data(cmd, &offset, sizeof(offset));
+    append_data(cmd, data.data(), data.size());
+    return cmd;
+}
+
+static std::vector<uint8_t> set_tensor_compressed_cmd(const rpc_tensor & tensor, uint64_t offset, uint64_t size, const std::vector<uint8_t> & compressed) {
+    std::vector<uint8_t> cmd;
+    append_data(cmd, &tensor, sizeof(tensor));
+    append_data(cmd, &offset, sizeof(offset));
+    append_data(cmd, &size, sizeof(size));
+    append_data(cmd, compressed.data(), compressed.size());
+    return cmd;
+}
+
+static std::vector<uint8_t> batch_of(uint64_t first_id) {
+    std::vector<uint8_t> batch;
+    append_data(batch, &first_id, sizeof(first_id));
+    return batch;
+}
+
+static void test_serve_batch(ggml_backend_t backend) {
+    const size_t n = 4096;
+
+    rpc_server_shared shared;
+    shared.backend   = backend;
+    shared.free_mem  = 1 << 20;
+    shared.total_mem = 1 << 20;
+
+    rpc_server server(&shared);
+    std::vector<uint8_t> input(sizeof(uint64_t));
+    std::vector<uint8_t> output;
+    const uint64_t size = n;
+    memcpy(input.data(), &size, sizeof(size));
+    assert(server.alloc_buffer(input, output));
+    assert(output.size() == 2*sizeof(uint64_t));
+    uint64_t remote_ptr;
+    memcpy(&remote_ptr, output.data(), sizeof(remote_ptr));
+    assert(remote_ptr != 0);
+    uint64_t remote_size;
+    memcpy(&remote_size, output.data() + sizeof(uint64_t), sizeof(remote_size));
+    assert(remote_size >= n);
+    ggml_backend_buffer_t buffer = reinterpret_cast<ggml_backend_buffer_t>(remote_ptr);
+    uint8_t * base = (uint8_t *) ggml_backend_buffer_get_base(buffer);
+
+    // a tensor of n bytes that fills the buffer
+    rpc_tensor tensor;
+    memset(&tensor, 0, sizeof(tensor));
+    tensor.id     = 1;
+    tensor.type   = GGML_TYPE_I8;
+    tensor.buffer = remote_ptr;
+    tensor.ne[0]  = n;
+    tensor.ne[1]  = tensor.ne[2] = tensor.ne[3] = 1;
+    tensor.nb[0]  = 1;
+    tensor.nb[1]  = tensor.nb[2] = tensor.nb[3] = n;
+    tensor.op     = GGML_OP_NONE;
+    tensor.data   = (uint64_t) base;
+
+    std::vector<uint8_t> plain(n/2);
+    std::vector<uint8_t> packed(n/2);
+    for (size_t i = 0; i < n/2; i++) {
+        plain[i]  = (uint8_t) (i * 7);
+        packed[i] = (uint8_t) (i % 5);
+    }
+    std::vector<uint8_t> compressed;
+    rpc_compress(packed.data(), packed.size(), compressed);
+
+    // a valid batch: the ids of its commands follow the ids of the previous requests
+    uint64_t next_id = 3;
+    std::vector<uint8_t> batch = batch_of(3);
+    append_cmd(batch, SET_TENSOR, set_tensor_cmd(tensor, 0, plain));
+    append_cmd(batch, SET_TENSOR_COMPRESSED, set_tensor_compressed_cmd(tensor, n/2, packed.size(), compressed));
+    assert(rpc_serve_batch(server, batch, next_id));
+    assert(next_id == 5);
+    assert(memcmp(base, plain.data(), plain.size()) == 0);
+    assert(memcmp(base + n/2, packed.data(), packed.size()) == 0);
+
+    const std::vector<uint8_t> expected(base, base + n);
+    auto rejected = [&](const std::vector<uint8_t> & batch) {
+        uint64_t id = next_id;
+        const bool ok = rpc_serve_batch(server, batch, id);
+        // the data is not modified by the invalid commands
+        assert(memcmp(base, expected.data(), n) == 0);
+        return !ok;
+    };
+    std::vector<uint8_t> zeros(n/2, 0);
+    std::vector<uint8_t> zeros_compressed;
+    rpc_compress(zeros.data(), zeros.size(), zeros_compressed);
+
+    // wrong first id, truncated ids and headers
+    batch = batch_of(next_id + 1);
+    append_cmd(batch, SET_TENSOR, set_tensor_cmd(tensor, 0, zeros));
+    assert(rejected(batch));
+    assert(rejected({ 0, 0, 0 }));
+    batch = batch_of(next_id);
+    batch.push_back(SET_TENSOR);
+    batch.push_back(0);
+    assert(rejected(batch));
+
+    // command size beyond the batch
+    batch = batch_of(next_id);
+    append_cmd(batch, SET_TENSOR, set_tensor_cmd(tensor, 0, zeros));
+    batch.resize(batch.size() - 1);
+    assert(rejected(batch));
+
+    // commands that are not allowed in a batch
+    batch = batch_of(next_id);
+    append_cmd(batch, GRAPH_COMPUTE, {});
+    assert(rejected(batch));
+    batch = batch_of(next_id);
+    append_cmd(batch, (enum rpc_cmd) 255, {});
+    assert(rejected(batch));
+
+    // offset and size outside the tensor
+    batch = batch_of(next_id);
+    append_cmd(batch, SET_TENSOR, set_tensor_cmd(tensor, n/2 + 1, zeros));
+    assert(rejected(batch));
+    batch = batch_of(next_id);
+    append_cmd(batch, SET_TENSOR, set_tensor_cmd(tensor, UINT64_MAX, zeros));
+    assert(rejected(batch));
+
+    // tensor data outside its buffer
+    rpc_tensor outside = tensor;
+    outside.data += remote_size - n + 1;
+    batch = batch_of(next_id);
+    append_cmd(batch, SET_TENSOR, set_tensor_cmd(outside, 0, {}));
+    assert(rejected(batch));
+
+    // compressed data: declared size larger than a chunk, larger or smaller than the data, truncated
+    batch = batch_of(next_id);
+    append_cmd(batch, SET_TENSOR_COMPRESSED, set_tensor_compressed_cmd(tensor, 0, (uint64_t) RPC_CHUNK_SIZE + 1, zeros_compressed));
+    assert(rejected(batch));
+    batch = batch_of(next_id);
+    append_cmd(batch, SET_TENSOR_COMPRESSED, set_tensor_compressed_cmd(tensor, 0, zeros.size() + 1, zeros_compressed));
+    assert(rejected(batch));
+    batch = batch_of(next_id);
+    append_cmd(batch, SET_TENSOR_COMPRESSED, set_tensor_compressed_cmd(tensor, 0, zeros.size() - 1, zeros_compressed));
+    assert(rejected(batch));
+    batch = batch_of(next_id);
+    append_cmd(batch, SET_TENSOR_COMPRESSED, set_tensor_compressed_cmd(tensor, 0, zeros.size(),
+        std::vector<uint8_t>(zeros_compressed.begin(), zeros_compressed.end() - 2)));
+    assert(rejected(batch));
+
+    // the same commands with valid values are accepted
+    batch = batch_of(next_id);
+    append_cmd(batch, SET_TENSOR_COMPRESSED, set_tensor_compressed_cmd(tensor, 0, zeros.size(), zeros_compressed));
+    assert(rpc_serve_batch(server, batch, next_id));
+    assert(memcmp(base, zeros.data(), zeros.size()) == 0);
+}
+
+int main(void) {
+    test_round_trip();
+    test_bad_input();
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+    test_serve_batch(backend);
+    ggml_backend_free(backend);
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include "ggml.h"
 #include "llama.h"
+#include "sampling.h"
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -7,6 +8,8 @@
 
 #include <algorithm>
 #include <cmath>
+#include <map>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -146,6 +149,110 @@ static void test_repetition_penalties(
     for (size_t i = 0; i < candidates_p.size; i++) {
         GGML_ASSERT(fabs(candidates_p.data[i].p - expected_probs[i]) < 1e-3);
     }
+
+    // same penalties from pre-counted tokens, with the candidates still indexed by token id
+    std::vector<llama_token> tokens;
+    std::vector<int32_t>     counts;
+    for (const llama_token id : last_tokens) {
+        const auto it = std::find(tokens.begin(), tokens.end(), id);
+        if (it == tokens.end()) {
+            tokens.push_back(id);
+            counts.push_back(1);
+        } else {
+            counts[it - tokens.begin()]++;
+        }
+    }
+
+    candidates.clear();
+    for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+        const float logit = logf(probs[token_id]);
+        candidates.emplace_back(llama_token_data{token_id, logit, 0.0f});
+    }
+
+    candidates_p = { candidates.data(), candidates.size(), false };
+    llama_sample_repetition_penalties_counts(nullptr, &candidates_p, tokens.data(), counts.data(), tokens.size(), repeat_penalty, alpha_frequency, alpha_presence);
+    llama_sample_softmax(nullptr, &candidates_p);
+    DUMP(&candidates_p);
+
+    GGML_ASSERT(candidates_p.size == expected_probs.size());
+    for (size_t i = 0; i < candidates_p.size; i++) {
+        GGML_ASSERT(fabs(candidates_p.data[i].p - expected_probs[i]) < 1e-3);
+    }
+}
+
+// the window counts of the ring must match the last n_window tokens
+static void check_token_ring(const llama_token_ring & ring, const std::vector<llama_token> & expected, size_t n_window) {
+    GGML_ASSERT(ring.size() == expected.size());
+    GGML_ASSERT(ring.n_window == n_window);
+    GGML_ASSERT(ring.to_vector() == expected);
+
+    std::map<llama_token, int32_t> counts;
+    for (size_t i = expected.size() - n_window; i < expected.size(); ++i) {
+        counts[expected[i]]++;
+    }
+
+    GGML_ASSERT(ring.window_size() == counts.size());
+    for (size_t i = 0; i < ring.window_size(); ++i) {
+        const auto it = counts.find(ring.window_tokens()[i]);
+        GGML_ASSERT(it != counts.end());
+        GGML_ASSERT(it->second == ring.window_counts()[i]);
+    }
+}
+
+static void test_token_ring() {
+    // starts filled with token 0
+    llama_token_ring ring;
+    ring.init(5, 3);
+    std::vector<llama_token> expected(5, 0);
+    check_token_ring(ring, expected, 3);
+
+    // evictions and wrap-around, with repeated tokens entering and leaving the window
+    std::mt19937 rng(42);
+    for (int i = 0; i < 1000; ++i) {
+        const llama_token id = rng() % 7;
+        ring.push_back(id);
+        expected.erase(expected.begin());
+        expected.push_back(id);
+        check_token_ring(ring, expected, 3);
+    }
+
+    // a window as large as the buffer
+    ring.init(4, 10);
+    expected.assign(4, 0);
+    check_token_ring(ring, expected, 4);
+    for (const llama_token id : {3, 3, 1, 3, 2, 2, 3}) {
+        ring.push_back(id);
+        expected.erase(expected.begin());
+        expected.push_back(id);
+        check_token_ring(ring, expected, 4);
+    }
+
+    // changing the window keeps the tokens
+    ring.resize(4, 2);
+    check_token_ring(ring, expected, 2);
+
+    // a larger buffer keeps the tokens at the end
+    ring.resize(6, 6);
+    expected.insert(expected.begin(), 2, 0);
+    check_token_ring(ring, expected, 6);
+
+    // a smaller buffer keeps the most recent tokens
+    ring.resize(3, 3);
+    expected.erase(expected.begin(), expected.end() - 3);
+    check_token_ring(ring, expected, 3);
+
+    ring.push_back(5);
+    expected.erase(expected.begin());
+    expected.push_back(5);
+    check_token_ring(ring, expected, 3);
+
+    // no window
+    ring.init(3, 0);
+    ring.push_back(1);
+    GGML_ASSERT(ring.window_size() == 0);
+
+    ring.reset();
+    GGML_ASSERT(ring.to_vector() == std::vector<llama_token>(3, 0));
 }
 
 static void test_sampler_queue(
@@ -267,6 +374,8 @@ int main(void) {
     test_repetition_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2},       {0.499966f, 0.499966f, 0.000023f, 0.000023f, 0.000023f}, 1.0f, 5.0f, 5.0f);
     test_repetition_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2, 0, 0}, {0.499977f, 0.499977f, 0.000023f, 0.000023f, 0.000000f}, 1.0f, 5.0f, 5.0f);
 
+    test_token_ring();
+
     test_sampler_queue(10000, "k", 10000, 1.0f, 1.0f);
     test_sampler_queue(10000, "k",     1, 1.0f, 1.0f);
     test_sampler_queue(10000, "p", 10000, 1.0f, 1.0f);